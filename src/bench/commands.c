@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <regex.h>
+
+#include "../headers/jobcommands.h"
+
+#define USAGE "Usage:\n\tcommands [-t milliseconds]\n" \
+              "\tmilliseconds is how long each parser runs per command " \
+              "(default 200)\n"
+#define COMMANDS_HEAD "%-24s %14s %14s %8s\n"
+#define COMMANDS_ROW "%-24s %14.0f %14.0f %7.0fx\n"
+
+/* The commands the server used to validate with a regex each */
+#define REGEX_CMDS 7
+
+/* Commands parsed between two looks at the clock */
+#define COMMANDS_BATCH 256
+
+/*
+ * The patterns the server matched every command against, in order, before it
+ * parsed commands in one pass.
+ */
+static const char *regex_cmds[REGEX_CMDS] =
+{
+    "^commands$",
+    "^jobs$",
+    "^run (.+)( [0-9]*)*$",
+    "^kill ([0-9]+)$",
+    "^watch ([0-9]+)$",
+    "^exit$",
+    "^joblist$"
+};
+
+/* What clients send, each is measured on its own and all of them mixed */
+static const char *lines[] =
+{
+    "jobs",
+    "joblist",
+    "watch 4242",
+    "kill 4242",
+    "run randprint 10",
+    "run print_ptree 1 2 3 4",
+    "commands",
+    "frobnicate 1 2"
+};
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Validate a command the way the server did: compile and match every pattern
+ * until one matches. Unlike the server, the patterns are always freed, so the
+ * leak of the old code does not skew the measurement.
+ *
+ * @return
+ *        -1:       the command was not a match
+ *        i:        the index of the pattern that matched
+ */
+static int validate_command(const char *buf)
+{
+    regex_t regex;
+    for (int i = 0; i < REGEX_CMDS; i++)
+    {
+        if (regcomp(&regex, regex_cmds[i], REG_EXTENDED|REG_NOSUB) != 0)
+        {
+            return -1;
+        }
+        int match = regexec(&regex, buf, 0, NULL, 0);
+        regfree(&regex);
+        if (match == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Handle a command the way the server did: validate it, then parse it again,
+ * the pid of kill and watch with strtol() and the words of run with strtok()
+ * into copies on the stack.
+ *
+ * @return
+ *        a value that depends on the parse, so it is not optimized out
+ */
+static long handle_regex(const char *line)
+{
+    char buf[BUFSIZE + 1];
+    strncpy(buf, line, BUFSIZE);
+    buf[BUFSIZE] = '\0';
+
+    int match = validate_command(buf);
+    if (match == 3 || match == 4) /* kill, watch */
+    {
+        return strtol(strchr(buf, ' ') + 1, NULL, 10);
+    }
+    if (match == 2) /* run */
+    {
+        int size = 0;
+        for (const char *p = buf; *p; size += (*p++ == ' '));
+
+        char args[size][BUFSIZE + 1];
+        char *arg = strtok(buf, " ");
+        int i = 0;
+        for (arg = strtok(NULL, " "); arg && i < size; arg = strtok(NULL, " "))
+        {
+            strcpy(args[i++], arg);
+        }
+        return i + args[0][0];
+    }
+    return match;
+}
+
+/*
+ * Handle a command the way the server does now, with one pass of
+ * parse_command().
+ */
+static long handle_parse(const char *line)
+{
+    command_t cmd;
+    parse_command(line, strlen(line), &cmd);
+    return cmd.type + cmd.pid + cmd.argc;
+}
+
+/*
+ * Handle the given commands in turn for about the given time.
+ *
+ * @return
+ *        the commands handled per second
+ */
+static double run_handler(long (*handler)(const char *), const char **cmds,
+                          int ncmds, long long duration)
+{
+    volatile long sink = 0;
+    unsigned long handled = 0;
+    long long start = now_ns();
+    long long elapsed;
+
+    do
+    {
+        for (int i = 0; i < COMMANDS_BATCH; i++)
+        {
+            sink += handler(cmds[(handled + i) % ncmds]);
+        }
+        handled += COMMANDS_BATCH;
+        elapsed = now_ns() - start;
+    } while (elapsed < duration);
+
+    (void) sink;
+    return handled * 1e9 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    long long duration = 200;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': /* Time each parser runs per command */
+                duration = strtoll(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+    if (duration <= 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    duration *= 1000000;
+
+    int nlines = sizeof(lines) / sizeof(lines[0]);
+    printf(COMMANDS_HEAD, "command", "regex cmds/s", "parse cmds/s",
+           "speedup");
+    for (int i = 0; i <= nlines; i++)
+    {
+        const char **cmds = i < nlines ? &lines[i] : lines;
+        int ncmds = i < nlines ? 1 : nlines;
+
+        double before = run_handler(handle_regex, cmds, ncmds, duration);
+        double after = run_handler(handle_parse, cmds, ncmds, duration);
+        printf(COMMANDS_ROW, i < nlines ? lines[i] : "(all mixed)", before,
+               after, after / before);
+    }
+    return 0;
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../headers/iobackend.h"
+
+#define USAGE "Usage:\n\tfanout [-w writes] [watchers]...\n" \
+              "\twrites is the total writes per run (default 2000000)\n"
+#define FANOUT_HEAD "%-8s %8s %8s %12s %14s\n"
+#define FANOUT_ROW "%-8s %8d %8lu %12.0f %14.3f\n"
+
+/* A line of job output as the server sends it to a text watcher */
+#define LINE "[JOB 4242] the quick brown fox jumps over the lazy dog 0123456789\r\n"
+
+/* Watcher counts measured when none are given */
+static const int default_watchers[] = { 1, 10, 100, 500 };
+
+/*
+ * The read ends of the watchers, drained by their own thread so a blocking
+ * write of the benchmark never waits on a full socket for long.
+ *
+ * @data fds
+ *        the read end of each watcher
+ * @data count
+ *        the amount of watchers
+ * @data expected
+ *        the bytes all watchers receive in total
+ */
+typedef struct drain
+{
+    int *fds;
+    int count;
+    size_t expected;
+
+} drain_t;
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Read from every watcher until they received all the bytes they were sent.
+ */
+static void *drain_watchers(void *arg)
+{
+    drain_t *drain = arg;
+    struct epoll_event events[64];
+    char buf[64 * 1024];
+    size_t received = 0;
+
+    int epollfd = epoll_create1(0);
+    for (int i = 0; i < drain->count; i++)
+    {
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = drain->fds[i] };
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, drain->fds[i], &event);
+    }
+
+    while (received < drain->expected)
+    {
+        int ready = epoll_wait(epollfd, events, 64, -1);
+        for (int i = 0; i < ready; i++)
+        {
+            ssize_t nbytes = read(events[i].data.fd, buf, sizeof(buf));
+            if (nbytes > 0)
+            {
+                received += nbytes;
+            }
+        }
+    }
+    close(epollfd);
+    return NULL;
+}
+
+/*
+ * Send lines to the watchers the way write_to_watchers() does: every line is
+ * written to all watchers in batches of IO_BATCH writes through the backend.
+ * Runs in its own process so the backend and its counters are fresh.
+ *
+ * @return
+ *        -1:       the backend or the watchers could not be set up
+ *        0:        the run was measured and reported
+ */
+static int run_fanout(iobackend_t backend, int watchers, unsigned long lines)
+{
+    int *writefds = malloc(watchers * sizeof(int));
+    int *readfds = malloc(watchers * sizeof(int));
+    iowrite_t writes[IO_BATCH];
+    unsigned long nwrites, nsyscalls;
+    char stats[256];
+    size_t len = strlen(LINE);
+
+    if (io_backend_init(backend) != backend)
+    {
+        printf("%-8s %8d unavailable\n", backend == IO_URING ? "io_uring" : "write",
+               watchers);
+        return -1;
+    }
+    for (int i = 0; i < watchers; i++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        {
+            perror("socketpair");
+            return -1;
+        }
+        writefds[i] = pair[0];
+        readfds[i] = pair[1];
+    }
+
+    drain_t drain = { readfds, watchers, len * watchers * lines };
+    pthread_t reader;
+    pthread_create(&reader, NULL, drain_watchers, &drain);
+
+    long long start = now_ns();
+    for (unsigned long line = 0; line < lines; line++)
+    {
+        for (int i = 0; i < watchers; i += IO_BATCH)
+        {
+            int count = watchers - i < IO_BATCH ? watchers - i : IO_BATCH;
+            for (int j = 0; j < count; j++)
+            {
+                writes[j] = (iowrite_t) { writefds[i + j], LINE, len, 0 };
+            }
+            io_write_batch(writes, count);
+
+            /* The server queues what is left, here it is sent in full */
+            for (int j = 0; j < count; j++)
+            {
+                ssize_t sent = writes[j].result > 0 ? writes[j].result : 0;
+                if (sent < (ssize_t) len
+                    && write(writes[j].fd, LINE + sent, len - sent) < 0)
+                {
+                    perror("write");
+                    return -1;
+                }
+            }
+        }
+    }
+    pthread_join(reader, NULL);
+    long long elapsed = now_ns() - start;
+
+    io_report_stats(stats, sizeof(stats));
+    char *counts = strchr(stats, ':');
+    if (counts == NULL
+        || sscanf(counts, ": %lu writes in %lu syscalls", &nwrites,
+                  &nsyscalls) != 2)
+    {
+        return -1;
+    }
+    printf(FANOUT_ROW, io_backend_name(), watchers, lines,
+           lines * 1e9 / elapsed, (double) nsyscalls / lines);
+    io_thread_exit();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long budget = 2000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w': /* Writes per run, spread over the lines */
+                budget = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+
+    int nwatchers = argc - optind;
+    int *watchers = malloc(sizeof(default_watchers) + nwatchers * sizeof(int));
+    if (nwatchers == 0)
+    {
+        nwatchers = sizeof(default_watchers) / sizeof(default_watchers[0]);
+        memcpy(watchers, default_watchers, sizeof(default_watchers));
+    }
+    for (int i = 0; optind + i < argc; i++)
+    {
+        watchers[i] = strtol(argv[optind + i], NULL, 10);
+        if (watchers[i] <= 0)
+        {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+
+    /* Two sockets per watcher */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    printf(FANOUT_HEAD, "backend", "watchers", "lines", "lines/sec",
+           "syscalls/line");
+    iobackend_t backends[] = { IO_SYNC, IO_URING };
+    for (int b = 0; b < 2; b++)
+    {
+        for (int i = 0; i < nwatchers; i++)
+        {
+            unsigned long lines = budget / watchers[i];
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                exit(run_fanout(backends[b], watchers[i],
+                                lines > 0 ? lines : 1) < 0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+    }
+    free(watchers);
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../headers/linebuf.h"
+
+#define USAGE "Usage:\n\tframing [-m megabytes] [-c chunk] [bufsize]...\n" \
+              "\tmegabytes is the job output framed per run (default 64), " \
+              "chunk the most\n\tbytes a read() returns (default 4096)\n"
+#define FRAMING_HEAD "%-8s %8s %10s %10s %14s\n"
+#define FRAMING_ROW "%-8s %8zu %10lu %10.0f %14.0f\n"
+
+/* Buffer sizes measured when none are given, the first is the old BUFSIZE */
+static const size_t default_sizes[] = { 256, 4096, 65536 };
+
+/* Times each framer runs over the output, the fastest run is reported */
+#define FRAMING_RUNS 3
+
+/*
+ * What a framer found, compared between the framers so both frame the same
+ * lines.
+ *
+ * @data lines
+ *        the amount of lines
+ * @data bytes
+ *        the bytes of all lines, without their network newlines
+ */
+typedef struct framed
+{
+    unsigned long lines;
+    unsigned long bytes;
+
+} framed_t;
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Build job output that looks like what jobs write: mostly short status and
+ * log lines, some longer ones, each ending in a network newline. No line is
+ * longer than the old BUFSIZE allowed.
+ */
+static char *make_output(size_t total)
+{
+    char *output = malloc(total);
+    size_t len = 0;
+
+    srandom(0);
+    while (len < total)
+    {
+        int kind = random() % 10;
+        size_t line = kind < 5 ? 10 + random() % 30         /* Status lines */
+                    : kind < 9 ? 40 + random() % 80         /* Log lines */
+                    : 120 + random() % 120;                 /* Long lines */
+        if (len + line + 2 > total)
+        {
+            break;
+        }
+        for (size_t i = 0; i < line; i++)
+        {
+            output[len + i] = ' ' + random() % 95;
+        }
+        memcpy(output + len + line, "\r\n", 2);
+        len += line + 2;
+    }
+    memset(output + len, ' ', total - len);
+    return output;
+}
+
+/*
+ * The network newline search the server used before the line buffers: the
+ * whole buffer is scanned from its start on every call.
+ */
+static int find_network_newline(char *buf, int inbuf)
+{
+    for (int i = 0; i < inbuf - 1; i++)
+    {
+        if (*(buf+i) == '\r' && *(buf+i+1) == '\n')
+        {
+            return i + 2;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Frame the output the way the server did before the line buffers: bytes are
+ * read after what is left of the last line, the buffer is rescanned from its
+ * start for every line, and the rest is moved to the front after each line.
+ */
+static framed_t frame_rescan(const char *output, size_t total, char *buf,
+                             size_t size, size_t chunk)
+{
+    framed_t framed = { 0, 0 };
+    size_t pos = 0;
+    int inbuf = 0;
+
+    while (pos < total)
+    {
+        size_t nbytes = size - inbuf;
+        nbytes = nbytes < chunk ? nbytes : chunk;
+        nbytes = nbytes < total - pos ? nbytes : total - pos;
+        memcpy(buf + inbuf, output + pos, nbytes); /* The read() */
+        pos += nbytes;
+        inbuf += nbytes;
+
+        int nwl;
+        while ((nwl = find_network_newline(buf, inbuf)) > 0)
+        {
+            buf[nwl - 2] = '\0';
+            framed.lines++;
+            framed.bytes += nwl - 2;
+            inbuf -= nwl;
+            memmove(buf, buf + nwl, inbuf);
+        }
+    }
+    return framed;
+}
+
+/*
+ * Frame the output with a line buffer, as the server and its job managers do.
+ */
+static framed_t frame_linebuf(const char *output, size_t total, char *buf,
+                              size_t size, size_t chunk)
+{
+    framed_t framed = { 0, 0 };
+    linebuf_t lines;
+    size_t pos = 0;
+
+    linebuf_init(&lines, buf, size);
+    while (pos < total)
+    {
+        size_t nbytes;
+        char *space = linebuf_space(&lines, &nbytes);
+        nbytes = nbytes < chunk ? nbytes : chunk;
+        nbytes = nbytes < total - pos ? nbytes : total - pos;
+        memcpy(space, output + pos, nbytes); /* The read() */
+        linebuf_fill(&lines, nbytes);
+        pos += nbytes;
+
+        char *line;
+        size_t len;
+        while ((line = linebuf_next(&lines, &len)) != NULL)
+        {
+            framed.lines++;
+            framed.bytes += len;
+        }
+    }
+    return framed;
+}
+
+/*
+ * Run a framer over the output a few times and report its fastest run.
+ *
+ * @return
+ *        what the framer found
+ */
+static framed_t run_framer(const char *name,
+                           framed_t (*framer)(const char *, size_t, char *,
+                                              size_t, size_t),
+                           const char *output, size_t total, size_t size,
+                           size_t chunk)
+{
+    char *buf = malloc(size);
+    long long best = 0;
+    framed_t framed = { 0, 0 };
+
+    for (int run = 0; run < FRAMING_RUNS; run++)
+    {
+        long long start = now_ns();
+        framed = framer(output, total, buf, size, chunk);
+        long long elapsed = now_ns() - start;
+        if (run == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    printf(FRAMING_ROW, name, size, framed.lines,
+           total / (double) (1 << 20) * 1e9 / best, framed.lines * 1e9 / best);
+    free(buf);
+    return framed;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = 64;
+    size_t chunk = 4096;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': /* Job output framed per run */
+                total = strtoul(optarg, NULL, 10);
+                break;
+            case 'c': /* Most bytes a read() returns */
+                chunk = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+
+    int nsizes = argc - optind;
+    size_t *sizes = malloc(sizeof(default_sizes) + nsizes * sizeof(size_t));
+    if (nsizes == 0)
+    {
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+    for (int i = 0; optind + i < argc; i++)
+    {
+        sizes[i] = strtoul(argv[optind + i], NULL, 10);
+        if (sizes[i] < 256) /* The longest line has to fit */
+        {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (total == 0 || chunk == 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    total <<= 20;
+    char *output = make_output(total);
+    printf(FRAMING_HEAD, "framer", "bufsize", "lines", "MB/s", "lines/sec");
+    for (int i = 0; i < nsizes; i++)
+    {
+        framed_t old = run_framer("rescan", frame_rescan, output, total,
+                                  sizes[i], chunk);
+        framed_t new = run_framer("linebuf", frame_linebuf, output, total,
+                                  sizes[i], chunk);
+        if (old.lines != new.lines || old.bytes != new.bytes)
+        {
+            fprintf(stderr, "[FRAMING] The framers found different lines\n");
+            exit(1);
+        }
+    }
+    free(sizes);
+    free(output);
+    return 0;
+}
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "../headers/hashindex.h"
+#include "../headers/objpool.h"
+
+#define USAGE "Usage:\n\tindex [-t milliseconds] [-j jobs]... [-w watchers]...\n" \
+              "\tmilliseconds is how long each operation runs (default 100)\n"
+#define INDEX_HEAD "%-6s %6s %8s %14s %14s %14s\n"
+#define INDEX_ROW "%-6s %6zu %8zu %14.0f %14.0f %14.0f\n"
+
+/* Most watchers of all jobs together, larger runs are skipped */
+#define INDEX_MAX_WATCHERS (1024 * 1024)
+
+/* Operations run between two looks at the clock */
+#define INDEX_BATCH 64
+
+/* Counts measured when none are given */
+static const size_t default_jobs[] = { 100, 1000, 10000 };
+static const size_t default_watchers[] = { 10, 100, 1000 };
+
+/*
+ * A watcher of a benchmark job, in the job's watchlist and, once indexed, in
+ * the job's index of its watchers by client.
+ */
+typedef struct bwatcher
+{
+    uintptr_t client;
+    hashnode_t byclient;
+    struct bwatcher *next;
+    struct bwatcher *prev;
+
+} bwatcher_t;
+
+/*
+ * A benchmark job, in the joblist and, once indexed, in the index of the
+ * jobs by pid.
+ */
+typedef struct bjob
+{
+    pid_t pid;
+    hashnode_t bypid;
+    struct bjob *next;
+    struct bjob *prev;
+    bwatcher_t *head;
+    bwatcher_t *end;
+    hashindex_t byclient;
+
+} bjob_t;
+
+/*
+ * The jobs of a run, found and watched either by walking their lists, as the
+ * server did, or through the indexes, as it does now.
+ *
+ * @data indexed
+ *        whether the indexes are kept and used, and the structs are allocated
+ *        from pools rather than with malloc()
+ */
+typedef struct bjoblist
+{
+    int indexed;
+    bjob_t *head;
+    bjob_t *end;
+    hashindex_t bypid;
+
+} bjoblist_t;
+
+static objpool_t job_pool = OBJPOOL_INIT("job", bjob_t);
+static objpool_t watcher_pool = OBJPOOL_INIT("watcher", bwatcher_t);
+
+/* The state of the random numbers, the same for both ways of finding */
+static uint64_t seed;
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * A random number below max, cheap enough not to weigh on the measurement.
+ */
+static size_t next_random(size_t max)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed % max;
+}
+
+/*
+ * The client key of the given watcher, spaced like pool allocated clients.
+ */
+static uintptr_t client_key(size_t i)
+{
+    return 0x100000 + i * POOL_ALIGN * 64;
+}
+
+/*
+ * Find a job by pid.
+ */
+static bjob_t *find_job(bjoblist_t *jobs, pid_t pid)
+{
+    if (jobs->indexed)
+    {
+        return hashindex_find(&jobs->bypid, pid);
+    }
+    for (bjob_t *job = jobs->head; job; job = job->next)
+    {
+        if (job->pid == pid)
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a job to the end of the joblist.
+ */
+static void add_job(bjoblist_t *jobs, bjob_t *job)
+{
+    job->next = NULL;
+    job->prev = jobs->end;
+    if (jobs->end != NULL)
+    {
+        jobs->end->next = job;
+    }
+    else
+    {
+        jobs->head = job;
+    }
+    jobs->end = job;
+    if (jobs->indexed)
+    {
+        hashindex_insert(&jobs->bypid, &job->bypid, job->pid, job);
+    }
+}
+
+/*
+ * Take a job out of the joblist, without freeing it.
+ */
+static void unlink_job(bjoblist_t *jobs, bjob_t *job)
+{
+    *(job->prev ? &job->prev->next : &jobs->head) = job->next;
+    *(job->next ? &job->next->prev : &jobs->end) = job->prev;
+    if (jobs->indexed)
+    {
+        hashindex_remove(&jobs->bypid, &job->bypid);
+    }
+}
+
+/*
+ * Start or stop a client watching a job, as the watch command does.
+ *
+ * @return
+ *        0:        the client stopped watching the job
+ *        1:        the client started watching the job
+ */
+static int toggle_watcher(bjoblist_t *jobs, bjob_t *job, uintptr_t client)
+{
+    bwatcher_t *watcher = NULL;
+    if (jobs->indexed)
+    {
+        watcher = hashindex_find(&job->byclient, client);
+    }
+    else
+    {
+        for (watcher = job->head; watcher; watcher = watcher->next)
+        {
+            if (watcher->client == client)
+            {
+                break;
+            }
+        }
+    }
+
+    if (watcher != NULL)
+    {
+        *(watcher->prev ? &watcher->prev->next : &job->head) = watcher->next;
+        *(watcher->next ? &watcher->next->prev : &job->end) = watcher->prev;
+        if (jobs->indexed)
+        {
+            hashindex_remove(&job->byclient, &watcher->byclient);
+            pool_free(&watcher_pool, watcher);
+        }
+        else
+        {
+            free(watcher);
+        }
+        return 0;
+    }
+
+    watcher = jobs->indexed ? pool_alloc(&watcher_pool)
+                            : malloc(sizeof(bwatcher_t));
+    watcher->client = client;
+    watcher->next = NULL;
+    watcher->prev = job->end;
+    *(job->end ? &job->end->next : &job->head) = watcher;
+    job->end = watcher;
+    if (jobs->indexed)
+    {
+        hashindex_insert(&job->byclient, &watcher->byclient, client, watcher);
+    }
+    return 1;
+}
+
+/*
+ * Create the given amount of jobs, each watched by the given amount of
+ * clients.
+ */
+static void build_jobs(bjoblist_t *jobs, int indexed, size_t njobs,
+                       size_t nwatchers)
+{
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->indexed = indexed;
+    hashindex_init(&jobs->bypid);
+
+    for (size_t i = 0; i < njobs; i++)
+    {
+        bjob_t *job = indexed ? pool_alloc(&job_pool) : malloc(sizeof(bjob_t));
+        memset(job, 0, sizeof(*job));
+        job->pid = 1000 + i;
+        hashindex_init(&job->byclient);
+        add_job(jobs, job);
+        for (size_t w = 0; w < nwatchers; w++)
+        {
+            toggle_watcher(jobs, job, client_key(w));
+        }
+    }
+}
+
+/*
+ * Free the jobs and their watchers.
+ */
+static void free_jobs(bjoblist_t *jobs)
+{
+    bjob_t *job = jobs->head;
+    while (job)
+    {
+        bjob_t *next = job->next;
+        while (job->head != NULL)
+        {
+            toggle_watcher(jobs, job, job->head->client);
+        }
+        hashindex_free(&job->byclient);
+        if (jobs->indexed)
+        {
+            pool_free(&job_pool, job);
+        }
+        else
+        {
+            free(job);
+        }
+        job = next;
+    }
+    hashindex_free(&jobs->bypid);
+    pool_destroy(&job_pool);
+    pool_destroy(&watcher_pool);
+}
+
+/*
+ * Find a random job, as watch, kill and the exit of a job do.
+ */
+static void op_find(bjoblist_t *jobs, size_t njobs, size_t nwatchers)
+{
+    if (find_job(jobs, 1000 + next_random(njobs)) == NULL)
+    {
+        exit(1);
+    }
+}
+
+/*
+ * Stop a random client watching a random job and start it again.
+ */
+static void op_toggle(bjoblist_t *jobs, size_t njobs, size_t nwatchers)
+{
+    bjob_t *job = find_job(jobs, 1000 + next_random(njobs));
+    uintptr_t client = client_key(next_random(nwatchers));
+    if (toggle_watcher(jobs, job, client) != 0
+        || toggle_watcher(jobs, job, client) != 1)
+    {
+        exit(1);
+    }
+}
+
+/*
+ * Remove a random job and add it back, as a job exiting and another starting.
+ */
+static void op_remove(bjoblist_t *jobs, size_t njobs, size_t nwatchers)
+{
+    bjob_t *job = find_job(jobs, 1000 + next_random(njobs));
+    unlink_job(jobs, job);
+    add_job(jobs, job);
+}
+
+/*
+ * Run an operation for about the given time.
+ *
+ * @return
+ *        the operations run per second
+ */
+static double run_op(void (*op)(bjoblist_t *, size_t, size_t),
+                     bjoblist_t *jobs, size_t njobs, size_t nwatchers,
+                     long long duration)
+{
+    unsigned long ops = 0;
+    long long start = now_ns();
+    long long elapsed;
+
+    seed = 88172645463325252ULL;
+    do
+    {
+        for (int i = 0; i < INDEX_BATCH; i++)
+        {
+            op(jobs, njobs, nwatchers);
+        }
+        ops += INDEX_BATCH;
+        elapsed = now_ns() - start;
+    } while (elapsed < duration);
+
+    return ops * 1e9 / elapsed;
+}
+
+/*
+ * Parse a count given on the command line into the next free slot.
+ */
+static void add_count(size_t *counts, int *ncounts, const char *arg)
+{
+    counts[*ncounts] = strtoul(arg, NULL, 10);
+    if (counts[(*ncounts)++] == 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t jobcounts[argc + 3], watchercounts[argc + 3];
+    int njobcounts = 0, nwatchercounts = 0;
+    long long duration = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:j:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': /* Time each operation runs */
+                duration = strtoll(optarg, NULL, 10);
+                break;
+            case 'j': /* Amount of jobs */
+                add_count(jobcounts, &njobcounts, optarg);
+                break;
+            case 'w': /* Amount of watchers of each job */
+                add_count(watchercounts, &nwatchercounts, optarg);
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+    if (duration <= 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    duration *= 1000000;
+    if (njobcounts == 0)
+    {
+        njobcounts = sizeof(default_jobs) / sizeof(default_jobs[0]);
+        memcpy(jobcounts, default_jobs, sizeof(default_jobs));
+    }
+    if (nwatchercounts == 0)
+    {
+        nwatchercounts = sizeof(default_watchers) / sizeof(default_watchers[0]);
+        memcpy(watchercounts, default_watchers, sizeof(default_watchers));
+    }
+
+    printf(INDEX_HEAD, "lookup", "jobs", "watchers", "finds/sec",
+           "toggles/sec", "removes/sec");
+    for (int j = 0; j < njobcounts; j++)
+    {
+        for (int w = 0; w < nwatchercounts; w++)
+        {
+            size_t njobs = jobcounts[j], nwatchers = watchercounts[w];
+            if (njobs * nwatchers > INDEX_MAX_WATCHERS)
+            {
+                continue;
+            }
+            for (int indexed = 0; indexed < 2; indexed++)
+            {
+                bjoblist_t jobs;
+                build_jobs(&jobs, indexed, njobs, nwatchers);
+                double finds = run_op(op_find, &jobs, njobs, nwatchers,
+                                      duration);
+                double toggles = run_op(op_toggle, &jobs, njobs, nwatchers,
+                                        duration);
+                double removes = run_op(op_remove, &jobs, njobs, nwatchers,
+                                        duration);
+                printf(INDEX_ROW, indexed ? "hash" : "list", njobs, nwatchers,
+                       finds, toggles, removes);
+                fflush(stdout);
+                free_jobs(&jobs);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE /* tee(), splice(), F_SETPIPE_SZ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../headers/serverdata.h"
+#include "../headers/serverlog.h"
+
+#define USAGE "Usage:\n\tsplice [-m megabytes] [watchers]...\n" \
+              "\tmegabytes is the total output the watchers receive per run " \
+              "(default 4096)\n"
+#define SPLICE_HEAD "%-6s %8s %10s %10s %12s\n"
+#define SPLICE_ROW "%-6s %8d %10zu %10.0f %12.0f\n"
+
+/* Watcher counts measured when none are given */
+static const int default_watchers[] = { 1, 10, 100 };
+
+/* How job output reaches the raw watchers */
+typedef enum fanmode
+{
+    FAN_COPY,
+    FAN_SPLICE
+
+} fanmode_t;
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Microseconds of CPU the calling process has used, user and system.
+ */
+static long long cpu_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/*
+ * Write all of a buffer to a blocking descriptor.
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t nbytes = write(fd, buf, len);
+        if (nbytes <= 0)
+        {
+            exit(1);
+        }
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+/*
+ * Play the job: write the given amount of output to its pipe in pieces of
+ * RAWBUF_SIZE, then close it.
+ */
+static void produce(int fd, size_t total)
+{
+    char *buf = malloc(RAWBUF_SIZE);
+    memset(buf, 'x', RAWBUF_SIZE);
+
+    while (total > 0)
+    {
+        size_t len = total < RAWBUF_SIZE ? total : RAWBUF_SIZE;
+        write_all(fd, buf, len);
+        total -= len;
+    }
+    exit(0);
+}
+
+/*
+ * Play the watchers: read every socket until all of them are closed.
+ */
+static void consume(int *fds, int count)
+{
+    struct epoll_event events[64];
+    char buf[64 * 1024];
+    int open = count;
+
+    int epollfd = epoll_create1(0);
+    for (int i = 0; i < count; i++)
+    {
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = fds[i] };
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, fds[i], &event);
+    }
+    while (open > 0)
+    {
+        int ready = epoll_wait(epollfd, events, 64, -1);
+        for (int i = 0; i < ready; i++)
+        {
+            if (read(events[i].data.fd, buf, sizeof(buf)) <= 0)
+            {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+                open--;
+            }
+        }
+    }
+    exit(0);
+}
+
+/*
+ * Copy a chunk of the job pipe to every watcher: read it into the server and
+ * write it to each socket.
+ *
+ * @return
+ *        the bytes taken from the job pipe, 0 once it is closed
+ */
+static ssize_t fan_copy(int jobfd, int *socks, int count, char *buf)
+{
+    ssize_t len = read(jobfd, buf, RAWBUF_SIZE);
+    for (int i = 0; i < count && len > 0; i++)
+    {
+        write_all(socks[i], buf, len);
+    }
+    return len;
+}
+
+/*
+ * Hand a chunk of the job pipe to every watcher the way feed_watchers() does:
+ * tee() it into the pipe of every feed but the last, splice() it into the
+ * last (which consumes it), then splice() each feed pipe into its socket.
+ *
+ * @return
+ *        the bytes taken from the job pipe, 0 once it is closed
+ */
+static ssize_t fan_splice(int jobfd, int *socks, int (*feeds)[2], int count)
+{
+    struct pollfd pfd = { jobfd, POLLIN, 0 };
+    int len = 0;
+
+    poll(&pfd, 1, -1);
+    if (ioctl(jobfd, FIONREAD, &len) < 0 || len == 0)
+    {
+        return 0;
+    }
+    if (len > RAWBUF_SIZE)
+    {
+        len = RAWBUF_SIZE;
+    }
+
+    /* The feed pipes are empty and as large as the chunk, tee() takes it all */
+    for (int i = 0; i < count - 1; i++)
+    {
+        if (tee(jobfd, feeds[i][1], len, 0) != len)
+        {
+            exit(1);
+        }
+    }
+    for (ssize_t moved = 0; moved < len; )
+    {
+        ssize_t nbytes = splice(jobfd, NULL, feeds[count - 1][1], NULL,
+                                len - moved, SPLICE_F_MOVE);
+        if (nbytes <= 0)
+        {
+            exit(1);
+        }
+        moved += nbytes;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        for (ssize_t moved = 0; moved < len; )
+        {
+            ssize_t nbytes = splice(feeds[i][0], NULL, socks[i], NULL,
+                                    len - moved, SPLICE_F_MOVE);
+            if (nbytes <= 0)
+            {
+                exit(1);
+            }
+            moved += nbytes;
+        }
+    }
+    return len;
+}
+
+/*
+ * Fan the output of a job out to the given amount of watchers, with the job
+ * and the watchers in processes of their own so only the fan-out is measured.
+ *
+ * @return
+ *        -1:       the pipes or sockets could not be set up
+ *        0:        the run was measured and reported
+ */
+static int run_fanout(fanmode_t mode, int watchers, size_t total)
+{
+    int jobpipe[2];
+    int *socks = malloc(watchers * sizeof(int));
+    int *peers = malloc(watchers * sizeof(int));
+    int (*feeds)[2] = malloc(watchers * sizeof(*feeds));
+    char *buf = malloc(RAWBUF_SIZE);
+
+    if (pipe(jobpipe) < 0)
+    {
+        perror("pipe");
+        return -1;
+    }
+    for (int i = 0; i < watchers; i++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || pipe(feeds[i]) < 0)
+        {
+            perror("socketpair");
+            return -1;
+        }
+        fcntl(feeds[i][1], F_SETPIPE_SZ, RAWPIPE_SIZE);
+        socks[i] = pair[0];
+        peers[i] = pair[1];
+    }
+
+    size_t joboutput = total / watchers;
+    pid_t job = fork();
+    if (job == 0)
+    {
+        close(jobpipe[0]);
+        produce(jobpipe[1], joboutput);
+    }
+    close(jobpipe[1]);
+    pid_t reader = fork();
+    if (reader == 0)
+    {
+        for (int i = 0; i < watchers; i++)
+        {
+            close(socks[i]);
+        }
+        consume(peers, watchers);
+    }
+    for (int i = 0; i < watchers; i++)
+    {
+        close(peers[i]);
+    }
+
+    long long start = now_ns();
+    long long cpu = cpu_us();
+    size_t fanned = 0;
+    ssize_t len;
+    while ((len = mode == FAN_COPY ? fan_copy(jobpipe[0], socks, watchers, buf)
+                                   : fan_splice(jobpipe[0], socks, feeds,
+                                                watchers)) > 0)
+    {
+        fanned += len;
+    }
+    cpu = cpu_us() - cpu;
+    for (int i = 0; i < watchers; i++)
+    {
+        close(socks[i]);
+    }
+    waitpid(job, NULL, 0);
+    waitpid(reader, NULL, 0);
+    long long elapsed = now_ns() - start;
+
+    double delivered = (double) fanned * watchers;
+    printf(SPLICE_ROW, mode == FAN_COPY ? "copy" : "splice", watchers,
+           fanned >> 20, delivered / (1 << 20) * 1e9 / elapsed,
+           cpu / 1000.0 / (delivered / (1 << 30)));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = 4096;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': /* Output delivered per run, spread over the watchers */
+                total = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+
+    int nwatchers = argc - optind;
+    int *watchers = malloc(sizeof(default_watchers) + nwatchers * sizeof(int));
+    if (nwatchers == 0)
+    {
+        nwatchers = sizeof(default_watchers) / sizeof(default_watchers[0]);
+        memcpy(watchers, default_watchers, sizeof(default_watchers));
+    }
+    for (int i = 0; optind + i < argc; i++)
+    {
+        watchers[i] = strtol(argv[optind + i], NULL, 10);
+        if (watchers[i] <= 0)
+        {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+
+    /* Two sockets and a pipe per watcher */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    printf(SPLICE_HEAD, "mode", "watchers", "job MB", "MB/s", "cpu ms/GB");
+    fanmode_t modes[] = { FAN_COPY, FAN_SPLICE };
+    for (int m = 0; m < 2; m++)
+    {
+        for (int i = 0; i < nwatchers; i++)
+        {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                exit(run_fanout(modes[m], watchers[i], total << 20) < 0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+    }
+    free(watchers);
+    return 0;
+}
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "headers/cgroup.h"
+
+/* The delegated cgroup the jobs are placed under, "" until one is given */
+static char root[CGROUP_PATH];
+
+/*******************************************************************************
+ *                              Cgroup Helpers                                 *
+ ******************************************************************************/
+
+/*
+ * Write a value to one of the files of a cgroup.
+ *
+ * @return
+ *        -1:       the file could not be written, errno is set
+ *        0:        the value was written
+ */
+static int write_value(const char *cgroup, const char *file, const char *value)
+{
+    char path[CGROUP_PATH + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t nbytes = write(fd, value, strlen(value));
+    int error = errno;
+    close(fd);
+    errno = error;
+    return nbytes == (ssize_t) strlen(value) ? 0 : -1;
+}
+
+/*
+ * Read one of the files of a cgroup into buf, '\0' terminated.
+ *
+ * @return
+ *        -1:       the file could not be read
+ *        0:        the file was read, cut short at size - 1 bytes
+ */
+static int read_value(const char *cgroup, const char *file, char *buf,
+                      size_t size)
+{
+    char path[CGROUP_PATH + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t nbytes = read(fd, buf, size - 1);
+    close(fd);
+    if (nbytes < 0)
+    {
+        return -1;
+    }
+    buf[nbytes] = '\0';
+    return 0;
+}
+
+/*******************************************************************************
+ *                                 Cgroups                                     *
+ ******************************************************************************/
+
+/*
+ * Place every job the server runs in a cgroup of its own, under a cgroup v2
+ * directory the server may write to, such as one delegated to the user who
+ * runs it: no root is needed. The cpu, memory and pids controllers are
+ * enabled for the cgroups of the jobs, as far as the directory allows. The
+ * server must not be in the directory itself, since a cgroup with processes
+ * can not pass its controllers on. The cgroups a previous run of the server
+ * left are removed, since they are named by pids that may be reused. Called
+ * before the launcher is started, so it and the job managers know the
+ * directory.
+ *
+ * @param dir
+ *        the cgroup directory
+ *
+ * @return
+ *        -1:       the directory is not in a cgroup v2 hierarchy, errno is set
+ *        0:        the jobs are placed under the directory
+ */
+int cgroup_start(const char *dir)
+{
+    struct statfs fs;
+    if (statfs(dir, &fs) < 0)
+    {
+        return -1;
+    }
+    if (fs.f_type != CGROUP2_SUPER_MAGIC)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    const char *controllers[] = CGROUP_CONTROLLERS;
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(*controllers); i++)
+    {
+        if (write_value(dir, "cgroup.subtree_control", controllers[i]) < 0)
+        {
+            fprintf(stderr, "[SERVER] cgroup: %s controller unavailable "
+                    "(%s)\n", controllers[i] + 1, strerror(errno));
+        }
+    }
+
+    DIR *cgroups = opendir(dir);
+    struct dirent *entry;
+    if (cgroups == NULL)
+    {
+        return -1;
+    }
+    while ((entry = readdir(cgroups)) != NULL)
+    {
+        pid_t pid;
+        char path[CGROUP_PATH];
+        if (sscanf(entry->d_name, CGROUP_JOB, &pid) == 1
+            && snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name)
+               < (int) sizeof(path))
+        {
+            cgroup_remove(path);
+        }
+    }
+    closedir(cgroups);
+
+    snprintf(root, sizeof(root), "%s", dir);
+    return 0;
+}
+
+/*
+ * Tell if the jobs are placed in cgroups (see cgroup_start()).
+ */
+int cgroup_enabled(void)
+{
+    return root[0] != '\0';
+}
+
+/*
+ * Parse limits given as a list of key=value pairs seperated by commas, such as
+ * "cpu=50,mem=64M,pids=32": cpu in percent of one CPU, mem in bytes or with a
+ * K, M or G suffix, and pids in processes. The limits not given are left as
+ * they are.
+ *
+ * @param text len
+ *        the limits, not null terminated, and their length
+ * @param limits
+ *        filled with the limits given
+ *
+ * @return
+ *        -1:       the limits are not valid
+ *        0:        the limits were parsed
+ */
+int cgroup_parse_limits(const char *text, size_t len, joblimits_t *limits)
+{
+    char buf[CGROUP_PATH];
+    if (len == 0 || len >= sizeof(buf))
+    {
+        return -1;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+
+    char *save;
+    for (char *pair = strtok_r(buf, ",", &save); pair;
+         pair = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(pair, '=');
+        char *end;
+        if (value == NULL || value[1] < '0' || value[1] > '9')
+        {
+            return -1;
+        }
+        *value++ = '\0';
+
+        errno = 0;
+        unsigned long long number = strtoull(value, &end, 10);
+        if (errno == ERANGE)
+        {
+            return -1;
+        }
+        if (strcmp(pair, "mem") == 0)
+        {
+            const char *units = "KMG";
+            const char *unit = *end != '\0' ? strchr(units, *end) : NULL;
+            if (unit != NULL)
+            {
+                int shift = 10 * (unit - units + 1);
+                if (number > (UINT64_MAX >> shift)) /* Would wrap around */
+                {
+                    return -1;
+                }
+                number <<= shift;
+                end++;
+            }
+            limits->memory = number;
+        }
+        else if (strcmp(pair, "cpu") == 0)
+        {
+            limits->cpu = number;
+        }
+        else if (strcmp(pair, "pids") == 0)
+        {
+            limits->pids = number;
+        }
+        else
+        {
+            return -1;
+        }
+        if (*end != '\0' || number == 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Tell if any limit is set.
+ */
+int cgroup_has_limits(const joblimits_t *limits)
+{
+    return limits->cpu > 0 || limits->memory > 0 || limits->pids > 0;
+}
+
+/*
+ * Fill the limits a run did not set with the limits the server sets for
+ * every job.
+ */
+void cgroup_merge_limits(joblimits_t *limits, const joblimits_t *defaults)
+{
+    limits->cpu = limits->cpu ? limits->cpu : defaults->cpu;
+    limits->memory = limits->memory ? limits->memory : defaults->memory;
+    limits->pids = limits->pids ? limits->pids : defaults->pids;
+}
+
+/*******************************************************************************
+ *                              Job Cgroups                                    *
+ ******************************************************************************/
+
+/*
+ * Create the cgroup of a job and set its limits.
+ *
+ * @param path size
+ *        filled with the path of the cgroup, and the size of path
+ * @param id
+ *        the pid the cgroup is named by, that of the job manager
+ * @param limits
+ *        the limits of the job
+ *
+ * @return
+ *        -1:       the cgroup could not be created or a limit could not be
+ *                  set (its controller may not be enabled), errno is set
+ *        0:        the cgroup is ready to be entered
+ */
+int cgroup_create(char *path, size_t size, pid_t id,
+                  const joblimits_t *limits)
+{
+    char value[64];
+
+    /*
+     * A cgroup by the same name is left from an earlier job whose manager had
+     * the pid, and holds its limits and usage: it is removed, never reused
+     */
+    snprintf(path, size, "%s/" CGROUP_JOB, root, id);
+    if (mkdir(path, 0755) < 0
+        && (errno != EEXIST || cgroup_remove(path) < 0 || mkdir(path, 0755) < 0))
+    {
+        return -1;
+    }
+
+    int set = 0;
+    if (limits->cpu > 0)
+    {
+        snprintf(value, sizeof(value), "%lu %d",
+                 limits->cpu * CGROUP_PERIOD / 100, CGROUP_PERIOD);
+        set = set < 0 ? set : write_value(path, "cpu.max", value);
+    }
+    if (limits->memory > 0)
+    {
+        snprintf(value, sizeof(value), "%llu",
+                 (unsigned long long) limits->memory);
+        set = set < 0 ? set : write_value(path, "memory.max", value);
+    }
+    if (limits->pids > 0)
+    {
+        snprintf(value, sizeof(value), "%lu", limits->pids);
+        set = set < 0 ? set : write_value(path, "pids.max", value);
+    }
+
+    if (set < 0)
+    {
+        int error = errno;
+        rmdir(path);
+        errno = error;
+    }
+    return set;
+}
+
+/*
+ * Open the cgroup.procs file of the cgroup of a job. The job writes "0" to
+ * it between its fork and its exec (see spawn_job()), so only the job is ever
+ * placed in the cgroup, never the process that spawns it.
+ *
+ * @param path
+ *        the cgroup of the job
+ *
+ * @return
+ *        -1:       the file could not be opened, errno is set
+ *        fd:       the file, close on exec
+ */
+int cgroup_procs(const char *path)
+{
+    char file[CGROUP_PATH + 32];
+    snprintf(file, sizeof(file), "%s/cgroup.procs", path);
+    return open(file, O_WRONLY | O_CLOEXEC);
+}
+
+/*
+ * Read the CPU time and the peak memory a job used from its cgroup. What can
+ * not be read (memory.peak needs the memory controller, and Linux 5.19) is
+ * left 0.
+ *
+ * @param path
+ *        the cgroup of the job
+ * @param usage
+ *        filled with what the job used
+ */
+void cgroup_usage(const char *path, jobusage_t *usage)
+{
+    char buf[1024];
+    unsigned long long value;
+
+    memset(usage, 0, sizeof(*usage));
+    if (read_value(path, "cpu.stat", buf, sizeof(buf)) == 0
+        && sscanf(buf, "usage_usec %llu", &value) == 1)
+    {
+        usage->cpu_usec = value;
+    }
+    if (read_value(path, "memory.peak", buf, sizeof(buf)) == 0
+        && sscanf(buf, "%llu", &value) == 1)
+    {
+        usage->peak = value;
+    }
+}
+
+/*
+ * Wait for every process in a cgroup to exit, which cgroup.events tells by
+ * "populated 0". The file is polled for POLLPRI, raised each time it changes,
+ * for up to CGROUP_DRAIN_MS.
+ *
+ * @return
+ *        -1:       processes are still in the cgroup
+ *        0:        the cgroup is empty
+ */
+static int wait_empty(const char *cgroup)
+{
+    char path[CGROUP_PATH + 32];
+    char buf[256];
+    snprintf(path, sizeof(path), "%s/cgroup.events", cgroup);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int empty = 0;
+    for (;;)
+    {
+        ssize_t nbytes = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (nbytes < 0)
+        {
+            break;
+        }
+        buf[nbytes] = '\0';
+        if (strstr(buf, "populated 0") != NULL)
+        {
+            empty = 1;
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - start.tv_sec) * 1000
+                      + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited >= CGROUP_DRAIN_MS)
+        {
+            break;
+        }
+
+        struct pollfd changed = { .fd = fd, .events = POLLPRI };
+        poll(&changed, 1, CGROUP_DRAIN_MS - waited);
+    }
+    close(fd);
+    return empty ? 0 : -1;
+}
+
+/*
+ * Remove the cgroup of a job that exited. Processes the job left behind are
+ * killed, so they do not outlive the job outside its limits, and the cgroup is
+ * removed once they are gone.
+ *
+ * @param path
+ *        the cgroup of the job
+ *
+ * @return
+ *        -1:       the cgroup could not be removed, errno is set
+ *        0:        the cgroup is gone
+ */
+int cgroup_remove(const char *path)
+{
+    if (rmdir(path) == 0 || errno == ENOENT)
+    {
+        return 0;
+    }
+    if (errno != EBUSY)
+    {
+        return -1;
+    }
+
+    if (write_value(path, "cgroup.kill", "1") < 0 || wait_empty(path) < 0)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    return rmdir(path);
+}
@@ -0,0 +1,63 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "headers/frame.h"
+
+/*
+ * Write a frame header to buf. The payload is expected to follow it.
+ *
+ * @param buf
+ *        where the header is written, at least FRAME_HEADER bytes
+ * @param type
+ *        what the frame carries
+ * @param stream
+ *        the stream job output came from, FRAME_NOSTREAM otherwise
+ * @param pid
+ *        the job the frame is about, 0 for messages of the server
+ * @param len
+ *        the length of the payload
+ *
+ * @return
+ *        the size of the header (FRAME_HEADER)
+ */
+size_t frame_pack(char *buf, frametype_t type, framestream_t stream, pid_t pid,
+                  size_t len)
+{
+    frame_t frame;
+    frame.type = type;
+    frame.stream = stream;
+    frame.flags = 0;
+    frame.pid = htonl(pid);
+    frame.len = htonl(len);
+
+    memcpy(buf, &frame, FRAME_HEADER);
+    return FRAME_HEADER;
+}
+
+/*
+ * Read the frame header at the start of buf, if all of it has arrived.
+ *
+ * @param buf
+ *        the bytes received
+ * @param inbuf
+ *        the amount of bytes in buf
+ * @param frame
+ *        filled with the header, in host byte order
+ *
+ * @return
+ *        -1:       the header is incomplete
+ *        n:        the size of the whole frame, header and payload
+ */
+ssize_t frame_unpack(const char *buf, size_t inbuf, frame_t *frame)
+{
+    if (inbuf < FRAME_HEADER)
+    {
+        return -1;
+    }
+
+    memcpy(frame, buf, FRAME_HEADER);
+    frame->flags = ntohs(frame->flags);
+    frame->pid = ntohl(frame->pid);
+    frame->len = ntohl(frame->len);
+    return FRAME_HEADER + (ssize_t) frame->len;
+}
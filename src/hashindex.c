@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "headers/hashindex.h"
+
+/*******************************************************************************
+ *                              Index Helpers                                  *
+ ******************************************************************************/
+
+/*
+ * Spread a key over the buckets. Pids are sequential and pointers are aligned,
+ * so the key is multiplied by the 64-bit golden ratio and its high bits kept.
+ */
+static size_t bucket_of(uintptr_t key, size_t nbuckets)
+{
+    uint64_t hash = (uint64_t) key * 0x9E3779B97F4A7C15ULL;
+    return (hash >> 32) & (nbuckets - 1);
+}
+
+/*
+ * Move every entry to a new array of buckets.
+ *
+ * @param index
+ *        the index to resize
+ * @param nbuckets
+ *        the new amount of buckets, a power of two
+ *
+ * @return
+ *        -1:       the buckets could not be allocated, the index is unchanged
+ *        0:        the index was resized
+ */
+static int resize(hashindex_t *index, size_t nbuckets)
+{
+    hashnode_t **buckets = calloc(nbuckets, sizeof(hashnode_t *));
+    if (buckets == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < index->nbuckets; i++)
+    {
+        hashnode_t *node = index->buckets[i];
+        while (node)
+        {
+            hashnode_t *next = node->next;
+            size_t bucket = bucket_of(node->key, nbuckets);
+            node->next = buckets[bucket];
+            buckets[bucket] = node;
+            node = next;
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->nbuckets = nbuckets;
+    return 0;
+}
+
+/*******************************************************************************
+ *                              Hash Index                                     *
+ ******************************************************************************/
+
+/*
+ * Initialize an empty index. No buckets are allocated until the first insert,
+ * so an index that is never used costs nothing.
+ *
+ * @param index
+ *        the index to initialize
+ */
+void hashindex_init(hashindex_t *index)
+{
+    index->buckets = NULL;
+    index->nbuckets = 0;
+    index->size = 0;
+}
+
+/*
+ * Insert an entry. The key must not be in the index already.
+ *
+ * @param index
+ *        the index to insert into
+ * @param node
+ *        the entry, embedded in owner
+ * @param key
+ *        the key to find the entry by
+ * @param owner
+ *        the struct returned when the key is found
+ *
+ * @return
+ *        -1:       the first buckets could not be allocated
+ *        0:        the entry was inserted
+ */
+int hashindex_insert(hashindex_t *index, hashnode_t *node, uintptr_t key,
+                     void *owner)
+{
+    if (index->nbuckets == 0 && resize(index, HASHINDEX_MIN) < 0)
+    {
+        return -1;
+    }
+    if (index->size >= index->nbuckets) /* Growing may fail, chains just grow */
+    {
+        resize(index, index->nbuckets * 2);
+    }
+
+    size_t bucket = bucket_of(key, index->nbuckets);
+    node->key = key;
+    node->owner = owner;
+    node->next = index->buckets[bucket];
+    index->buckets[bucket] = node;
+    index->size++;
+    return 0;
+}
+
+/*
+ * Find the struct indexed by key.
+ *
+ * @param index
+ *        the index to search
+ * @param key
+ *        the key to find
+ *
+ * @return
+ *        NULL:     no entry has the key
+ *        owner:    the struct the entry with the key is embedded in
+ */
+void *hashindex_find(const hashindex_t *index, uintptr_t key)
+{
+    if (index->size == 0)
+    {
+        return NULL;
+    }
+
+    hashnode_t *node = index->buckets[bucket_of(key, index->nbuckets)];
+    while (node && node->key != key)
+    {
+        node = node->next;
+    }
+    return node ? node->owner : NULL;
+}
+
+/*
+ * Remove an entry that is in the index.
+ *
+ * @param index
+ *        the index to remove from
+ * @param node
+ *        the entry to remove
+ */
+void hashindex_remove(hashindex_t *index, hashnode_t *node)
+{
+    hashnode_t **link = &index->buckets[bucket_of(node->key, index->nbuckets)];
+    while (*link != node)
+    {
+        link = &(*link)->next;
+    }
+    *link = node->next;
+    node->next = NULL;
+    index->size--;
+}
+
+/*
+ * Free the buckets of an index. The entries belong to their owners and are
+ * left alone.
+ *
+ * @param index
+ *        the index to free
+ */
+void hashindex_free(hashindex_t *index)
+{
+    free(index->buckets);
+    hashindex_init(index);
+}
@@ -0,0 +1,76 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Name of the cgroup of a job, by the pid of its job manager */
+#define CGROUP_JOB "job-%d"
+
+/* The controllers enabled for the cgroups of the jobs */
+#define CGROUP_CONTROLLERS { "+cpu", "+memory", "+pids" }
+
+/* The period cpu.max is written with, a CPU limit is a percent of it */
+#define CGROUP_PERIOD 100000
+
+/* How long a cgroup is waited on to empty once its processes are killed */
+#define CGROUP_DRAIN_MS 1000
+
+/* Longest path of a cgroup */
+#define CGROUP_PATH 512
+
+/*
+ * The resources a job may use, set with "run -l" or by the server for every
+ * job (see cgroup_parse_limits()).
+ *
+ * @data cpu
+ *        the percent of one CPU the job may use (cpu.max), 0 for no limit
+ * @data memory
+ *        the bytes of memory the job may use (memory.max), 0 for no limit
+ * @data pids
+ *        the processes the job may run at once (pids.max), 0 for no limit
+ */
+typedef struct joblimits
+{
+    unsigned long cpu;
+    uint64_t memory;
+    unsigned long pids;
+
+} joblimits_t;
+
+/*
+ * The resources a job used, read from its cgroup once it exited.
+ *
+ * @data cpu_usec
+ *        the CPU time the job used, in microseconds (cpu.stat)
+ * @data peak
+ *        the most memory the job used at once, in bytes (memory.peak), 0 if
+ *        the memory of the job was not accounted
+ */
+typedef struct jobusage
+{
+    uint64_t cpu_usec;
+    uint64_t peak;
+
+} jobusage_t;
+
+/*******************************************************************************
+ *                                 Cgroups                                     *
+ ******************************************************************************/
+int cgroup_start(const char *dir);
+int cgroup_enabled(void);
+int cgroup_parse_limits(const char *text, size_t len, joblimits_t *limits);
+int cgroup_has_limits(const joblimits_t *limits);
+void cgroup_merge_limits(joblimits_t *limits, const joblimits_t *defaults);
+
+/*******************************************************************************
+ *                              Job Cgroups                                    *
+ ******************************************************************************/
+int cgroup_create(char *path, size_t size, pid_t id,
+                  const joblimits_t *limits);
+int cgroup_procs(const char *path);
+void cgroup_usage(const char *path, jobusage_t *usage);
+int cgroup_remove(const char *path);
+
+#endif /* CGROUP_H */
@@ -0,0 +1,91 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Sent (as text) in reply to the "binary" command. Everything the server sends
+ * after it is framed.
+ */
+#define BINARY_ON "[SERVER] Binary framing enabled"
+
+/* The size of a frame header on the wire */
+#define FRAME_HEADER 12
+
+/*
+ * The size of what a job used, at the end of the payload of its exit: the
+ * CPU time in microseconds and the peak memory in bytes (0 if it was not
+ * accounted), 8 bytes each
+ */
+#define FRAME_USAGE 16
+
+/*
+ * What a frame carries:
+ *
+ * FRAME_SERVER:     a message of the server, as text without its newline
+ * FRAME_OUTPUT:     a line of the jobs output, without its newline
+ * FRAME_EXIT:       the job exited, the payload is its exit status (4 bytes),
+ *                   followed by what the job used if it ran in a cgroup
+ * FRAME_SIGNAL:     the job was terminated by a signal, the payload is what
+ *                   the job used if it ran in a cgroup, else empty
+ * FRAME_RAW:        a piece of the jobs stdout as the job wrote it, sent to a
+ *                   raw or chunked watcher
+ * FRAME_GAP:        output was dropped, the payload is the amount (8 bytes):
+ *                   lines if the pid is 0, or bytes of the raw output of pid
+ */
+typedef enum frametype
+{
+    FRAME_SERVER = 1,
+    FRAME_OUTPUT,
+    FRAME_EXIT,
+    FRAME_SIGNAL,
+    FRAME_RAW,
+    FRAME_GAP
+
+} frametype_t;
+
+/*
+ * The stream a frame of job output came from, numbered like the fds.
+ */
+typedef enum framestream
+{
+    FRAME_NOSTREAM,
+    FRAME_STDOUT,
+    FRAME_STDERR
+
+} framestream_t;
+
+/*
+ * A frame header. On the wire every field is in network byte order and the
+ * header is followed by len bytes of payload.
+ *
+ * @data type
+ *        what the frame carries (see frametype_t)
+ * @data stream
+ *        the stream job output came from (see framestream_t)
+ * @data flags
+ *        reserved, always 0
+ * @data pid
+ *        the job the frame is about, 0 for messages of the server
+ * @data len
+ *        the length of the payload
+ */
+typedef struct frame
+{
+    uint8_t type;
+    uint8_t stream;
+    uint16_t flags;
+    uint32_t pid;
+    uint32_t len;
+
+} frame_t;
+
+/*******************************************************************************
+ *                               Framing                                       *
+ ******************************************************************************/
+size_t frame_pack(char *buf, frametype_t type, framestream_t stream, pid_t pid,
+                  size_t len);
+ssize_t frame_unpack(const char *buf, size_t inbuf, frame_t *frame);
+
+#endif /* FRAME_H */
@@ -0,0 +1,60 @@
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Buckets an index starts with once its first entry is inserted */
+#define HASHINDEX_MIN 8
+
+/*
+ * An entry of a hash index, embedded in the struct it indexes so inserting
+ * one allocates nothing.
+ *
+ * @data key
+ *        the key the entry is found by
+ * @data owner
+ *        the struct the entry is embedded in
+ * @data next
+ *        the next entry in the same bucket
+ */
+typedef struct hashnode
+{
+    uintptr_t key;
+    void *owner;
+    struct hashnode *next;
+
+} hashnode_t;
+
+/*
+ * Index structs by an integer or pointer key, with a chain of entries per
+ * bucket. The buckets are doubled once there are more entries than buckets,
+ * so a chain stays short on average and a lookup, insert or remove takes
+ * constant time.
+ *
+ * @data buckets
+ *        the chain of each bucket, NULL until the first entry is inserted
+ * @data nbuckets
+ *        the amount of buckets, a power of two
+ * @data size
+ *        the amount of entries
+ */
+typedef struct hashindex
+{
+    hashnode_t **buckets;
+    size_t nbuckets;
+    size_t size;
+
+} hashindex_t;
+
+/*******************************************************************************
+ *                              Hash Index                                     *
+ ******************************************************************************/
+void hashindex_init(hashindex_t *index);
+int hashindex_insert(hashindex_t *index, hashnode_t *node, uintptr_t key,
+                     void *owner);
+void *hashindex_find(const hashindex_t *index, uintptr_t key);
+void hashindex_remove(hashindex_t *index, hashnode_t *node);
+void hashindex_free(hashindex_t *index);
+
+#endif /* HASHINDEX_H */
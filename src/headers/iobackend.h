@@ -0,0 +1,93 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+#include <sys/types.h>
+
+/* Amount of reads or writes submitted to the kernel at once */
+#define IO_BATCH 64
+
+/*
+ * The I/O backends the server can use for its batched reads and writes. 
+ * IO_SYNC issues one read() or write() per entry, IO_URING submits a whole
+ * batch with one io_uring_enter.
+ */
+typedef enum iobackend
+{
+    IO_SYNC,
+    IO_URING
+
+} iobackend_t;
+
+/*
+ * A single write in a batch.
+ *
+ * @data fd
+ *        the file descriptor to write to
+ * @data buf
+ *        the bytes to write, which must stay valid until the batch completes
+ * @data len
+ *        the amount of bytes to write
+ * @data result
+ *        set once the batch completes: the bytes written, or -errno
+ */
+typedef struct iowrite
+{
+    int fd;
+    const void *buf;
+    size_t len;
+    ssize_t result;
+
+} iowrite_t;
+
+/*
+ * A single read in a batch.
+ *
+ * @data fd
+ *        the file descriptor to read from
+ * @data buf
+ *        where the bytes are read to, which must stay valid until the batch
+ *        completes
+ * @data len
+ *        the most bytes to read
+ * @data result
+ *        set once the batch completes: the bytes read, or -errno
+ */
+typedef struct ioread
+{
+    int fd;
+    void *buf;
+    size_t len;
+    ssize_t result;
+
+} ioread_t;
+
+/*
+ * The result of a read issued ahead of time in a batch, kept with whatever
+ * the fd belongs to until it is taken in place of its next read (see
+ * io_read()).
+ *
+ * @data ready
+ *        set while the result has not been taken
+ * @data result
+ *        the bytes read, into the buffer the next read would have used, or
+ *        -errno
+ */
+typedef struct ioahead
+{
+    int ready;
+    ssize_t result;
+
+} ioahead_t;
+
+/*******************************************************************************
+ *                               I/O Backend                                   *
+ ******************************************************************************/
+iobackend_t io_backend_init(iobackend_t requested);
+const char *io_backend_name(void);
+void io_write_batch(iowrite_t *writes, int count);
+void io_read_batch(ioread_t *reads, int count);
+ssize_t io_read(int fd, void *buf, size_t len, ioahead_t *ahead);
+void io_thread_exit(void);
+void io_report_stats(char *buf, size_t size);
+
+#endif /* IOBACKEND_H */
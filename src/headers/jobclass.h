@@ -0,0 +1,62 @@
+#ifndef JOBCLASS_H
+#define JOBCLASS_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * The priority class a job is run in, chosen with "run -p class". The class
+ * weighs the share of the job slots the runs of a client get while runs wait
+ * in the admission queue (see dequeue_run()), and sets the nice value and I/O
+ * priority the job runs with (see jobclass_apply()).
+ */
+typedef enum jobclass
+{
+    CLASS_INVALID = -1,
+    CLASS_NORMAL,
+    CLASS_INTERACTIVE,
+    CLASS_BATCH,
+    JOB_CLASSES
+
+} jobclass_t;
+
+/* The virtual time a run of weight 1 costs the client who ran it */
+#define SHARE_STRIDE (1UL << 20)
+
+/*
+ * What a priority class stands for.
+ *
+ * @data name
+ *        how the class is named in the run command
+ * @data weight
+ *        the share of the job slots a run of the class is worth, relative to
+ *        the other classes
+ * @data nice
+ *        the nice value the job runs with
+ * @data ioclass iolevel
+ *        the I/O scheduling class and level the job runs with, as taken by
+ *        ioprio_set(), or 0 to leave the I/O priority of the job as it is
+ */
+typedef struct classinfo
+{
+    const char *name;
+    unsigned long weight;
+    int nice;
+    int ioclass;
+    int iolevel;
+
+} classinfo_t;
+
+/*******************************************************************************
+ *                             Priority Classes                                *
+ ******************************************************************************/
+const classinfo_t *jobclass_info(jobclass_t jobclass);
+jobclass_t jobclass_parse(const char *name, size_t len);
+int jobclass_apply(jobclass_t jobclass);
+int jobclass_sets_priority(jobclass_t jobclass);
+void jobclass_record_wait(jobclass_t jobclass, const struct timespec *since);
+void jobclass_record_run(jobclass_t jobclass, const struct timespec *started);
+void jobclass_report_stats(jobclass_t jobclass, char *buf, size_t size);
+
+#endif /* JOBCLASS_H */
@@ -1,24 +1,93 @@
 #ifndef JOBCOMMANDS_H
 #define JOBCOMMANDS_H
 
+#include <sys/types.h>
+
+#include "jobclass.h"
+#include "cgroup.h"
+
 #ifndef PORT
   #define PORT 50000
 #endif
 
-#ifndef CLIENT_CMDS_S
-	#define CLIENT_CMDS_S 7
-#endif
-
 /* No lines or paths may exceed the BUFSIZE below */
 #define BUFSIZE 256
 
-/* List of valid commands the client can send */
-extern const char *client_cmds[CLIENT_CMDS_S];
+/*
+ * The commands a client can send.
+ */
+typedef enum cmdtype
+{
+    CMD_INVALID = -1,
+    CMD_COMMANDS,
+    CMD_JOBS,
+    CMD_RUN,
+    CMD_KILL,
+    CMD_WATCH,
+    CMD_EXIT,
+    CMD_JOBLIST,
+    CMD_BINARY,
+    CMD_RANGE,
+    CMD_LAST
+
+} cmdtype_t;
+
+/*
+ * The option a watch command ends with, or a run command starts with, if any.
+ */
+typedef enum cmdopt
+{
+    CMD_OPT_NONE,
+    CMD_OPT_RAW,
+    CMD_OPT_CHUNKED,
+    CMD_OPT_NOLOG
+
+} cmdopt_t;
+
+/*
+ * A command parsed out of the line a client sent. Nothing is copied: args
+ * points into the line, which must outlive the command.
+ *
+ * @data type
+ *        the command, CMD_INVALID if the line is not a valid command
+ * @data pid
+ *        the pid a kill or watch command names
+ * @data opt
+ *        how a watch command asks to watch the job, or CMD_OPT_NOLOG for a
+ *        run command that asks for the output of the job not to be logged
+ * @data jobclass
+ *        the priority class a run command asks for, CLASS_NORMAL if none
+ * @data limits
+ *        the resource limits a run command asks for, 0 for those it does not
+ * @data count
+ *        the lines of output a watch command asks to be sent first, of those
+ *        the job already wrote, or the last lines a last command asks for
+ * @data first last
+ *        the lines of output a range command asks for, counted from 1
+ * @data args
+ *        the jobname of a run command followed by its arguments, seperated by
+ *        spaces
+ * @data argc
+ *        the amount of words in args
+ */
+typedef struct command
+{
+    cmdtype_t type;
+    pid_t pid;
+    cmdopt_t opt;
+    jobclass_t jobclass;
+    joblimits_t limits;
+    unsigned long count;
+    unsigned long first;
+    unsigned long last;
+    const char *args;
+    int argc;
+
+} command_t;
 
 /*******************************************************************************
  *                         Message Transmission Helpers                        *
  ******************************************************************************/
-int validate_command(char *buf);
-int find_network_newline(char *buf, int inbuf);
+cmdtype_t parse_command(const char *buf, size_t len, command_t *cmd);
 
 #endif /* JOBCOMMANDS_H */
@@ -1,29 +1,54 @@
 #ifndef JOBPROTOCOL_H
 #define JOBPROTOCOL_H
 
+#include <time.h>
+
 #include "serverdata.h"
 #include "serverlog.h"
+#include "jobcommands.h"
+#include "ring.h"
+
+/*
+ * How the "run" command launches a job:
+ *
+ * LAUNCH_MANAGER:   a job manager process is forked per job, which forwards
+ *                   the jobs output and exit status through a shared ring
+ * LAUNCH_DIRECT:    the server reads the jobs stdout and stderr pipes itself,
+ *                   and the launcher reports the jobs exit status
+ */
+typedef enum launchmode
+{
+    LAUNCH_MANAGER,
+    LAUNCH_DIRECT
+
+} launchmode_t;
 
 /*******************************************************************************
  *                             Job Helpers                                     *
  ******************************************************************************/
+void set_launch_mode(launchmode_t mode);
+void set_job_limits(const joblimits_t *limits);
 
 /* Determine what command was sent */
-int execute_command(char *buf, int validate, client_t *client, 
-                    joblist_t *joblist);
-int run_job(char *buf, client_t *client, joblist_t *joblist);
+int execute_command(command_t *cmd, client_t *client, joblist_t *joblist);
+int run_job(command_t *cmd, client_t *client, joblist_t *joblist);
+void admit_jobs(joblist_t *joblist);
 
-int job(int clientfd, joblist_t *joblist);
-int job_exists(char *buf, int clientfd, joblist_t *joblist);
-int kill_job(char *buf, int clientfd, joblist_t *joblist);
-int watch_job(char *buf, client_t *client, joblist_t *joblist);
+int job(client_t *client, joblist_t *joblist);
+int job_exists(pid_t jpid, client_t *client, joblist_t *joblist);
+int kill_job(command_t *cmd, client_t *client, joblist_t *joblist);
+int watch_job(command_t *cmd, client_t *client, joblist_t *joblist);
+int send_output(command_t *cmd, client_t *client, joblist_t *joblist);
+int binary_mode(client_t *client);
 
 /* Building and running the job (used by "run" command) */
-int arg_count(char *buf);
-int build_job(int readfd, pid_t mpid, client_t *client, joblist_t *joblist);
-int forward_job_output(int stdoutfd, int stderrfd, int writefd, int jpid);
-int fill_argv(char *buf, char ***, int size);
-void generate_job_and_manager(int writefd, char *argv[]);
-void execute(int stdoutfd, int stderrfd, char *argv[]);
+int forward_job_output(int stdoutfd, int stderrfd, ring_t *ring, int writefd,
+                       pid_t jpid, const char *cgroup);
+void generate_job_and_manager(int writefd, int ringfds[RING_FDS], char *argv[],
+                              jobclass_t jobclass, const joblimits_t *limits);
+int spawn_job(char *argv[], jobclass_t jobclass, int procsfd, int stdoutfd,
+              int stderrfd, pid_t *jpid);
+void record_spawn(struct timespec *start, pid_t pid, joblist_t *joblist);
+void spawn_report_stats(char *buf, size_t size);
 
 #endif /* JOBPROTOCOLG_H */
@@ -0,0 +1,156 @@
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "serverdata.h"
+#include "serverlog.h"
+#include "jobprotocol.h"
+#include "ring.h"
+
+/* Most fds sent with a reply: the jobpipe of a managed job and its ring */
+#define LAUNCH_FDS (1 + RING_FDS)
+
+/* Processes the launcher first has room to track, doubled as needed */
+#define LAUNCH_TRACKED 32
+
+/*
+ * The messages exchanged between a worker and the launcher:
+ *
+ * LAUNCH_SPAWN:     a worker asks for a job to be launched, and the launcher
+ *                   replies with the pid of the job (-1 if it could not be
+ *                   launched) and its fds
+ * LAUNCH_EXITED:    the launcher reaped a directly launched job, or the
+ *                   manager of a job
+ */
+typedef enum launchop
+{
+    LAUNCH_SPAWN,
+    LAUNCH_EXITED
+
+} launchop_t;
+
+/*
+ * Why the launcher could not launch a job, sent as the status of its reply:
+ *
+ * LAUNCH_FAILED:    the job could not be spawned
+ * LAUNCH_NOCLASS:   the job could not be given the priorities of its class
+ *                   (see jobclass_apply())
+ */
+typedef enum launchfail
+{
+    LAUNCH_FAILED,
+    LAUNCH_NOCLASS
+
+} launchfail_t;
+
+/*
+ * A message on the socket between a worker and the launcher. The fds of a
+ * launched job travel alongside the reply as SCM_RIGHTS: the jobpipe of a
+ * managed job followed by the fds of its ring, or the stdout and stderr pipes
+ * of a direct job.
+ *
+ * @data op
+ *        what the message is
+ * @data id
+ *        the slot of the request in the workers pending table, echoed back
+ * @data mode
+ *        how the job is launched
+ * @data jobclass
+ *        the priority class the job is run in (see jobclass_apply())
+ * @data limits
+ *        the resource limits of a managed job (see cgroup_create())
+ * @data pid
+ *        the pid of the job, -1 if it could not be launched
+ * @data mpid
+ *        the pid of the job manager, 0 for a direct job (or for an exit, if
+ *        the job itself exited)
+ * @data status
+ *        the status of an exited job, as reported by waitpid(), or why a job
+ *        could not be launched (a launchfail_t)
+ * @data args
+ *        the jobname and its arguments, seperated by spaces
+ */
+typedef struct launchmsg
+{
+    launchop_t op;
+    int id;
+    launchmode_t mode;
+    jobclass_t jobclass;
+    joblimits_t limits;
+    pid_t pid;
+    pid_t mpid;
+    int status;
+    char args[BUFSIZE + 1];
+
+} launchmsg_t;
+
+/*
+ * A request a worker sent to the launcher and has not had a reply to yet.
+ *
+ * @data busy
+ *        set while the reply is outstanding
+ * @data flags
+ *        the JOB_* flags of the job asked for
+ * @data jobclass
+ *        the priority class of the job asked for
+ * @data client
+ *        the client who ran the job, NULL if it disconnected since
+ * @data start
+ *        when the request was sent
+ */
+typedef struct pending
+{
+    int busy;
+    int flags;
+    jobclass_t jobclass;
+    client_t *client;
+    struct timespec start;
+
+} pending_t;
+
+/*
+ * Store the channel between a worker and the launcher. Each worker has its own
+ * socket to the launcher, so the replies to its requests and the exits of the
+ * jobs it polls are handled by that worker alone.
+ *
+ * @data type
+ *        always CONN_LAUNCHER, used to identify the launcher from an epoll event
+ * @data fd
+ *        the workers end of the socket
+ * @data fdset
+ *        the epoll instance of the worker
+ * @data slots
+ *        the most requests that can wait for a reply, the limit of jobs run
+ *        at once, since a job counts against it as soon as it is asked for
+ * @data pending
+ *        the requests waiting for a reply, indexed by their id. Any worker
+ *        may send a request for a client of this worker (see admit_jobs()),
+ *        so they are only touched under the joblist lock
+ */
+typedef struct launcher
+{
+    conntype_t type;
+    int fd;
+    connections_t *fdset;
+    int slots;
+    pending_t pending[];
+
+} launcher_t;
+
+/*******************************************************************************
+ *                               Launcher                                      *
+ ******************************************************************************/
+pid_t launcher_start(int nworkers, int fds[]);
+void launcher_stop(pid_t pid, int nworkers, int fds[]);
+launcher_t *launcher_init(int fd, connections_t *fdset, int slots);
+
+int launcher_request(launcher_t *launcher, launchmode_t mode,
+                     const char *args, int flags, jobclass_t jobclass,
+                     const joblimits_t *limits, client_t *client);
+int launcher_recv(launcher_t *launcher, launchmsg_t *msg, int fds[LAUNCH_FDS],
+                  pending_t *request);
+void launcher_forget(launcher_t *launcher, client_t *client);
+
+#endif /* LAUNCHER_H */
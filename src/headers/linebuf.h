@@ -0,0 +1,47 @@
+#ifndef LINEBUF_H
+#define LINEBUF_H
+
+#include <sys/types.h>
+
+/*
+ * Frame network lines (ending in "\r\n") out of a buffer as bytes arrive.
+ * Lines are consumed in place: each is handed out as a pointer into the
+ * buffer, and the bytes of an incomplete line are only moved to the front once
+ * the buffer has no room left at its end. The buffer remembers how far it was
+ * scanned, so the bytes of an incomplete line are never scanned twice.
+ *
+ * @data buf
+ *        the storage, one byte of which is kept to '\0' terminate a line
+ * @data size
+ *        the size of the storage
+ * @data start
+ *        the first byte not yet consumed
+ * @data end
+ *        the end of the bytes received
+ * @data scan
+ *        where the search for the next line resumes, the bytes from start up
+ *        to it hold no network newline
+ */
+typedef struct linebuf
+{
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    size_t scan;
+
+} linebuf_t;
+
+/*******************************************************************************
+ *                              Line Framing                                   *
+ ******************************************************************************/
+void linebuf_init(linebuf_t *lines, char *buf, size_t size);
+char *linebuf_space(linebuf_t *lines, size_t *room);
+void linebuf_fill(linebuf_t *lines, size_t nbytes);
+char *linebuf_next(linebuf_t *lines, size_t *len);
+char *linebuf_rest(linebuf_t *lines, size_t *len);
+size_t linebuf_pending(const linebuf_t *lines);
+
+ssize_t find_crlf(const char *buf, size_t len);
+
+#endif /* LINEBUF_H */
@@ -0,0 +1,85 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "logsegment.h"
+
+/* Directory of the log segments, unless the server is given another */
+#define LOG_DIR "../logs"
+
+/* Sealed segments kept in the log directory, unless the server is told */
+#ifndef LOG_KEEP
+    #define LOG_KEEP 16
+#endif
+
+/* Records the log ring holds, a power of two */
+#ifndef LOG_SLOTS
+    #define LOG_SLOTS 4096
+#endif
+
+/* Slots of the ring lines of job output are never given, kept for the rest */
+#define LOG_RESERVED (LOG_SLOTS / 8)
+
+/* Bytes of payload a record holds, a longer payload is truncated */
+#define LOG_PAYLOAD 480
+
+/* Milliseconds the logger waits for records before it writes what it has */
+#ifndef LOG_FLUSH_MS
+    #define LOG_FLUSH_MS 50
+#endif
+
+/* Milliseconds between two fsyncs of the log, while it is written to */
+#ifndef LOG_FSYNC_MS
+    #define LOG_FSYNC_MS 1000
+#endif
+
+/* Bytes of text the logger formats before it writes them to stdout */
+#define LOG_BATCH_SIZE (64 * 1024)
+
+/*
+ * A slot of the log ring. A producer claims the slot by advancing the tail,
+ * fills it and then publishes it by setting seq. The logger reads the slot
+ * once seq says it is published, and hands it back for the next lap.
+ *
+ * @data seq
+ *        the position the slot is free for, or that position + 1 once the
+ *        record in it is published
+ * @data type
+ *        what the record holds
+ * @data clientfd
+ *        the client a command came from
+ * @data pid
+ *        the job the record is about
+ * @data time
+ *        when the record was pushed, in nanoseconds since the epoch
+ * @data len
+ *        the length of the payload
+ * @data data
+ *        the payload
+ */
+typedef struct logslot
+{
+    size_t seq;
+    logtype_t type;
+    int clientfd;
+    pid_t pid;
+    int64_t time;
+    uint32_t len;
+    char data[LOG_PAYLOAD];
+
+} logslot_t;
+
+/*******************************************************************************
+ *                             Asynchronous Log                                *
+ ******************************************************************************/
+int logger_start(const char *dir);
+void logger_stop(void);
+void logger_close(void);
+void logger_set_rotation(size_t size, unsigned long age, size_t count);
+void logger_push(logtype_t type, int clientfd, pid_t pid, const void *data,
+                 size_t len);
+void logger_report_stats(char *buf, size_t size);
+
+#endif /* LOGGER_H */
@@ -0,0 +1,205 @@
+#ifndef LOGSEGMENT_H
+#define LOGSEGMENT_H
+
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/types.h>
+
+/* Identifies a log segment, and the version of its layout */
+#define SEG_MAGIC "JSLOGSEG"
+#define SEG_VERSION 2
+
+/* Most bytes of a segment file, preallocated when the segment is created */
+#ifndef SEG_SIZE
+    #define SEG_SIZE (16 * 1024 * 1024)
+#endif
+
+/* Bytes of records covered by an entry of the sparse index */
+#define SEG_BLOCK (64 * 1024)
+
+/* Entries of the sparse index, one per block of the segment */
+#define SEG_BLOCKS (SEG_SIZE / SEG_BLOCK)
+
+/* Records are aligned to this, so their headers can be read in place */
+#define SEG_ALIGN 8
+
+/* Name of the segment files in the log directory, by their sequence number */
+#define SEG_NAME "segment-%08lu.log"
+
+/* Suffix of a segment once it is compressed, and name it is compressed to */
+#define SEG_GZ ".gz"
+#define SEG_TMP ".segment-%08lu.tmp"
+
+/*
+ * What a log record holds, which decides how it is formatted:
+ *
+ * LOG_TEXT:         a message of the server, logged as is
+ * LOG_COMMAND:      a command a client sent (CLIENT_CMD)
+ * LOG_STDOUT:       a line of a jobs stdout (JOB_STDOUT)
+ * LOG_STDERR:       a line of a jobs stderr (JOB_STDERR)
+ * LOG_EXIT:         the exit status of a job, the payload is an int (JOB_EXIT)
+ * LOG_SIGNAL:       a job was terminated by a signal (JOB_SIGNAL)
+ */
+typedef enum logtype
+{
+    LOG_TEXT,
+    LOG_COMMAND,
+    LOG_STDOUT,
+    LOG_STDERR,
+    LOG_EXIT,
+    LOG_SIGNAL,
+    LOG_TYPES
+
+} logtype_t;
+
+/*
+ * A record of a segment, followed by its payload and padded to SEG_ALIGN.
+ *
+ * @data size
+ *        the bytes of the record with its payload and padding, 0 past the
+ *        last record
+ * @data type
+ *        what the record holds (see logtype_t)
+ * @data len
+ *        the length of the payload
+ * @data clientfd
+ *        the client a command came from, -1 if none
+ * @data pid
+ *        the job the record is about, 0 if none
+ * @data time
+ *        when the record was logged, in nanoseconds since the epoch
+ */
+typedef struct segrecord
+{
+    uint32_t size;
+    uint16_t type;
+    uint16_t len;
+    int32_t clientfd;
+    int32_t pid;
+    int64_t time;
+    char data[];
+
+} segrecord_t;
+
+/*
+ * An entry of the sparse index, summing up the records that start in a block
+ * of the segment, so a query can skip the blocks it has no use for.
+ *
+ * @data offset
+ *        the offset of the first record of the block, 0 if the block has none
+ * @data count
+ *        the amount of records of the block
+ * @data types
+ *        a bit for each type of record in the block
+ * @data first last
+ *        the time of the first and the last record of the block
+ * @data pids clients
+ *        bloom filters of the jobs and the clients of the records in the block
+ */
+typedef struct segblock
+{
+    uint32_t offset;
+    uint32_t count;
+    uint32_t types;
+    uint32_t unused;
+    int64_t first;
+    int64_t last;
+    uint64_t pids;
+    uint64_t clients;
+
+} segblock_t;
+
+/*
+ * The header of a segment, taking its first pages. The records follow from
+ * SEG_DATA up to used.
+ *
+ * @data magic version
+ *        SEG_MAGIC and SEG_VERSION
+ * @data sealed
+ *        set once the segment is full or the server shut down, the segment is
+ *        not written to anymore
+ * @data seqno
+ *        the sequence number of the segment
+ * @data size
+ *        the bytes of the segment file, at most SEG_SIZE
+ * @data created
+ *        when the segment was created, in nanoseconds since the epoch
+ * @data used
+ *        the offset past the last record written
+ * @data summary
+ *        the sum of every entry of the index
+ * @data blocks
+ *        the sparse index
+ */
+typedef struct segheader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sealed;
+    uint64_t seqno;
+    uint64_t size;
+    int64_t created;
+    uint64_t used;
+    segblock_t summary;
+    segblock_t blocks[SEG_BLOCKS];
+
+} segheader_t;
+
+/* Offset of the first record of a segment, past its header */
+#define SEG_DATA ((sizeof(segheader_t) + 4095) & ~(size_t) 4095)
+
+/*
+ * A segment mapped in memory, written by the logger or read by logquery. A
+ * compressed segment is read into memory instead, its header first and the
+ * rest once it is needed (see segment_load()).
+ *
+ * @data fd
+ *        the segment file, -1 for a compressed segment
+ * @data header
+ *        the mapping of the segment, starting with its header
+ * @data size
+ *        the bytes mapped, or read of a compressed segment
+ * @data seqno
+ *        the sequence number of the segment
+ * @data gz
+ *        the compressed segment being read, NULL once it is read whole
+ */
+typedef struct logsegment
+{
+    int fd;
+    segheader_t *header;
+    size_t size;
+    unsigned long seqno;
+    void *gz;
+
+} logsegment_t;
+
+/*******************************************************************************
+ *                              Log Segments                                   *
+ ******************************************************************************/
+unsigned long segment_last(const char *dir);
+int segment_filter(const struct dirent *entry);
+int segment_create(logsegment_t *seg, const char *dir, unsigned long seqno,
+                   size_t size, int64_t time);
+int segment_append(logsegment_t *seg, logtype_t type, int clientfd, pid_t pid,
+                   int64_t time, const void *data, size_t len);
+void segment_sync(logsegment_t *seg);
+void segment_close(logsegment_t *seg);
+int segment_open(logsegment_t *seg, const char *path);
+int segment_load(logsegment_t *seg);
+void segment_release(logsegment_t *seg);
+
+/*******************************************************************************
+ *                              Log Retention                                  *
+ ******************************************************************************/
+int segment_compress(const char *dir, unsigned long seqno);
+int segment_prune(const char *dir, unsigned long current, size_t keep);
+
+/*******************************************************************************
+ *                            Record Formatting                                *
+ ******************************************************************************/
+uint64_t segment_bloom(int32_t key);
+size_t format_record(logtype_t type, int clientfd, pid_t pid, const char *data,
+                     char *buf, size_t size);
+
+#endif /* LOGSEGMENT_H */
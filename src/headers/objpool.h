@@ -0,0 +1,83 @@
+#ifndef OBJPOOL_H
+#define OBJPOOL_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+/* Alignment of every slab and object, the size of a cache line */
+#define POOL_ALIGN 64
+
+/* Bytes of each slab, objects larger than a slab get a slab of their own */
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/*
+ * A slab of objects. The header takes the first cache line of the slab and the
+ * objects follow it back to back.
+ *
+ * @data next
+ *        the next slab of the pool
+ */
+typedef struct slab
+{
+    struct slab *next;
+
+} slab_t;
+
+/*
+ * Allocate objects of one type out of cache-line aligned slabs. A freed object
+ * goes on the freelist (its first bytes hold the link) and is handed out again
+ * before a new slab is allocated, so the objects of a type stay packed
+ * together. Slabs are only released all at once, by pool_destroy(). The pool
+ * is shared by every worker thread, so its lock is held for each allocation.
+ *
+ * @data name
+ *        the name the pool is reported by
+ * @data objsize
+ *        the size of an object, rounded up to a whole amount of cache lines
+ * @data slabs
+ *        the slabs of the pool
+ * @data freelist
+ *        the objects freed and not yet handed out again
+ * @data nslabs
+ *        the amount of slabs
+ * @data live
+ *        the amount of objects handed out and not yet freed
+ * @data highwater
+ *        the most objects that were live at once
+ * @data lock
+ *        serializes the workers allocations
+ */
+typedef struct objpool
+{
+    const char *name;
+    size_t objsize;
+    slab_t *slabs;
+    void *freelist;
+    size_t nslabs;
+    size_t live;
+    size_t highwater;
+    pthread_mutex_t lock;
+
+} objpool_t;
+
+/* The size of an object of the given type, rounded up to whole cache lines */
+#define POOL_OBJSIZE(type) \
+    ((sizeof(type) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1))
+
+/* Initializer of a pool of objects of the given type */
+#define OBJPOOL_INIT(poolname, type)            \
+    {                                           \
+        .name = (poolname),                     \
+        .objsize = POOL_OBJSIZE(type),          \
+        .lock = PTHREAD_MUTEX_INITIALIZER       \
+    }
+
+/*******************************************************************************
+ *                              Object Pool                                    *
+ ******************************************************************************/
+void *pool_alloc(objpool_t *pool);
+void pool_free(objpool_t *pool, void *obj);
+void pool_destroy(objpool_t *pool);
+void pool_report_stats(objpool_t *pool, char *buf, size_t size);
+
+#endif /* OBJPOOL_H */
@@ -0,0 +1,134 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bytes of records a ring holds, a multiple of the page size */
+#define RING_SIZE (256 * 1024)
+
+/* Longest record payload, longer output is split over several records */
+#define RING_MAX_RECORD (RING_SIZE / 4)
+
+/*
+ * What a record carries:
+ *
+ * REC_STDOUT:       a line the job wrote to its stdout
+ * REC_STDERR:       a line the job wrote to its stderr
+ * REC_EXIT:         the job exited, the payload is its exit status (an int)
+ * REC_SIGNAL:       the job was terminated by a signal, no payload
+ * REC_USAGE:        what the job used, read from its cgroup, the payload is
+ *                   a jobusage_t (see cgroup_usage()), passed just before
+ *                   the exit of a job that ran in a cgroup
+ */
+typedef enum rectype
+{
+    REC_STDOUT,
+    REC_STDERR,
+    REC_EXIT,
+    REC_SIGNAL,
+    REC_USAGE
+
+} rectype_t;
+
+/*
+ * The fds of a ring, in the order they are passed between processes.
+ *
+ * RING_MEMFD:       the shared memory holding the ring
+ * RING_DATAFD:      an eventfd the producer signals when the ring stops being
+ *                   empty, polled by the consumer
+ * RING_SPACEFD:     an eventfd the consumer signals when it made room for a
+ *                   producer waiting on a full ring
+ */
+typedef enum ringfd
+{
+    RING_MEMFD,
+    RING_DATAFD,
+    RING_SPACEFD,
+    RING_FDS
+
+} ringfd_t;
+
+/*
+ * A record in a ring. The payload is followed by a '\0' (so a line can be used
+ * as a string), and each record is padded to 8 bytes.
+ *
+ * @data len
+ *        the length of the payload, without the '\0'
+ * @data type
+ *        what the record carries
+ * @data data
+ *        the payload
+ */
+typedef struct record
+{
+    uint32_t len;
+    uint32_t type;
+    char data[];
+
+} record_t;
+
+/*
+ * The positions of a ring, shared by both sides at the start of the memfd. The
+ * positions only ever grow, each is written by one side only and kept on a
+ * cache line of its own.
+ *
+ * @data tail
+ *        the end of the last record, advanced by the producer
+ * @data head
+ *        the start of the first record not yet consumed, advanced by the
+ *        consumer
+ * @data waiting
+ *        set while the producer waits for room
+ */
+typedef struct ringctl
+{
+    uint64_t tail;
+    char pad1[56];
+    uint64_t head;
+    char pad2[56];
+    uint32_t waiting;
+
+} ringctl_t;
+
+/*
+ * A single-producer, single-consumer ring of records in shared memory, used to
+ * pass the output of a job from its manager to the server. The records are
+ * mapped twice in a row, so a record that wraps around the end of the ring is
+ * still contiguous.
+ *
+ * @data fds
+ *        the memfd and the eventfds of the ring (see ringfd_t)
+ * @data ctl
+ *        the positions of the ring
+ * @data data
+ *        the records, RING_SIZE bytes mapped twice
+ * @data map
+ *        the whole mapping
+ * @data maplen
+ *        the length of the mapping
+ */
+typedef struct ring
+{
+    int fds[RING_FDS];
+    ringctl_t *ctl;
+    char *data;
+    void *map;
+    size_t maplen;
+
+} ring_t;
+
+/*******************************************************************************
+ *                              Shared Ring                                    *
+ ******************************************************************************/
+int ring_open(int fds[RING_FDS]);
+ring_t *ring_attach(int fds[RING_FDS]);
+void ring_free(ring_t *ring);
+
+int ring_push(ring_t *ring, rectype_t type, const void *data, size_t len,
+              int peerfd);
+record_t *ring_peek(ring_t *ring);
+void ring_pop(ring_t *ring, record_t *record);
+void ring_wake(ring_t *ring);
+
+#endif /* RING_H */
@@ -0,0 +1,65 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <sys/types.h>
+
+#include "frame.h"
+
+/* Most bytes of recent output kept per job, unless the server is told */
+#ifndef SCROLLBACK_SIZE
+    #define SCROLLBACK_SIZE (64 * 1024)
+#endif
+
+/* Most bytes of recent output kept across every job */
+#ifndef SCROLLBACK_TOTAL
+    #define SCROLLBACK_TOTAL (16 * 1024 * 1024)
+#endif
+
+/* Bytes a scrollback first takes, doubled each time it fills up */
+#define SCROLLBACK_MIN 4096
+
+/*
+ * The most recent lines of output of a job, so a client that starts watching
+ * the job late can be sent them first. Each line is kept as the FRAME_OUTPUT
+ * frame a binary watcher is sent, back to back in a ring of bytes, and the
+ * oldest lines are dropped to make room for new ones. The ring starts small
+ * and grows up to the size set by scrollback_set_limits(), as long as the
+ * scrollback of every job together stays within its cap.
+ *
+ * @data buf
+ *        the ring, NULL until the job writes a line
+ * @data size
+ *        the bytes of the ring
+ * @data start
+ *        the offset of the oldest line, counted from the first byte ever
+ *        written, so an offset is found in the ring at offset % size
+ * @data end
+ *        the offset past the newest line
+ * @data lines
+ *        the amount of lines held
+ */
+typedef struct scrollback
+{
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t end;
+    size_t lines;
+
+} scrollback_t;
+
+/*******************************************************************************
+ *                               Scrollback                                    *
+ ******************************************************************************/
+void scrollback_set_limits(size_t size, size_t cap);
+void scrollback_init(scrollback_t *sb);
+void scrollback_append(scrollback_t *sb, framestream_t stream, pid_t pid,
+                       const char *line, size_t len);
+size_t scrollback_find(const scrollback_t *sb, size_t count, size_t *found);
+void scrollback_read(const scrollback_t *sb, size_t offset, char *buf,
+                     size_t len);
+void scrollback_free(scrollback_t *sb);
+void scrollback_count_replay(size_t lines);
+void scrollback_report_stats(char *buf, size_t size);
+
+#endif /* SCROLLBACK_H */
@@ -1,17 +1,72 @@
 #ifndef SERVERDATA_H
 #define SERVERDATA_H
 
-#ifndef MAX_JOBS
-    #define MAX_JOBS 32
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "ring.h"
+#include "linebuf.h"
+#include "hashindex.h"
+#include "scrollback.h"
+#include "spool.h"
+#include "jobclass.h"
+#include "cgroup.h"
+#include "iobackend.h"
+
+#include <time.h>
+
+/* Jobs run at once for each online core, unless the server is told */
+#ifndef JOBS_PER_CORE
+    #define JOBS_PER_CORE 1
+#endif
+
+/* Runs that may wait in the admission queue, unless the server is told */
+#ifndef ADMIT_QUEUE
+    #define ADMIT_QUEUE 256
 #endif
 
 /*******************************************************************************
  *                          Communincation Structure                           *
  ******************************************************************************/
+
+/*
+ * The kind of object an epoll event refers to. Every struct registered with
+ * the servers epoll instance begins with a conntype_t, so the data.ptr of a
+ * ready event can be inspected and then cast straight to its owner.
+ */
+typedef enum conntype
+{
+    CONN_LISTENER,
+    CONN_SHUTDOWN,
+    CONN_CLIENT,
+    CONN_JOB,
+    CONN_JOBSTREAM,
+    CONN_LAUNCHER,
+    CONN_DEAD
+
+} conntype_t;
+
+/*
+ * Store the epoll instance that every client socket and job pipe is
+ * registered with.
+ *
+ * @data epollfd
+ *        the epoll instance the server waits on
+ * @data nfds
+ *        the total count of file descriptors currently registered
+ * @data launcher
+ *        the channel to the launcher process used by the worker that owns the
+ *        epoll instance (see launcher.h)
+ * @data dead
+ *        the jobs removed while the worker handles a batch of events, freed
+ *        once the batch is done (see free_dead_jobs())
+ */
 typedef struct connections
 {
-    fd_set *all_fds;
-    int maxfd;
+    int epollfd;
+    size_t nfds;
+    struct launcher *launcher;
+    struct job *dead;
 
 } connections_t;
 
@@ -19,11 +74,167 @@ typedef struct connections
  *                            Client Structures                                   *
  ******************************************************************************/
 
+/* Size of each buffer in a clients outbound chain */
+#define OUTBUF_SIZE 4096
+
+/*
+ * A buffer in the chain of output waiting to be written to a client. Messages
+ * are packed into the tail buffer until it is full. A range of a file queued
+ * for a client (see send_file()) takes a buffer of its own, its data unused.
+ *
+ * @data next
+ *        the buffer to write after this one
+ * @data fd
+ *        the file the range is sent from with sendfile(), -1 for bytes
+ * @data start
+ *        the offset of the first byte not yet written
+ * @data end
+ *        the offset after the last byte queued
+ * @data data
+ *        the queued bytes
+ */
+typedef struct outbuf
+{
+    struct outbuf *next;
+    int fd;
+    size_t start;
+    size_t end;
+    char data[OUTBUF_SIZE];
+
+} outbuf_t;
+
+/* Size asked for the pipe that holds a raw watchers undelivered output */
+#define RAWPIPE_SIZE (256 * 1024)
+
+/*
+ * How a client watches a job:
+ *
+ * WATCH_LINES:      each line of output is formatted as "[JOB pid] line"
+ * WATCH_RAW:        the jobs output is passed through unchanged
+ * WATCH_CHUNKED:    the jobs output is passed through unchanged, in chunks that
+ *                   each begin with a "[JOB pid] length" header
+ */
+typedef enum watchmode
+{
+    WATCH_LINES,
+    WATCH_RAW,
+    WATCH_CHUNKED
+
+} watchmode_t;
+
+/*
+ * The output of a job on its way to a client that watches it raw or chunked.
+ * Output is tee()d from the jobs pipe into the feeds pipe and splice()d from
+ * there into the clients socket, so it is never copied into the server. Only
+ * when the pipe could not take all of a read is the rest copied into the spill
+ * chain, after which output keeps going to the spill chain until it drains.
+ *
+ * @data pipe
+ *        the feeds pipe, non-blocking
+ * @data pid
+ *        the job being watched
+ * @data mode
+ *        WATCH_RAW or WATCH_CHUNKED
+ * @data attached
+ *        cleared once the client stops watching the job, the feed is freed
+ *        once its output has been delivered
+ * @data queued
+ *        the bytes waiting in the pipe
+ * @data spillhead spilltail
+ *        the chain of output that did not fit in the pipe
+ * @data spillbytes
+ *        the bytes waiting in the spill chain
+ * @data dropped
+ *        the bytes dropped since the client fell behind, reported with a gap
+ *        marker before the output resumes
+ * @data fed
+ *        the bytes of the current read that went into the pipe, -1 if the read
+ *        is dropped for this feed (see feed_watchers())
+ * @data next
+ *        the clients next feed
+ */
+typedef struct rawfeed
+{
+    int pipe[2];
+    pid_t pid;
+    watchmode_t mode;
+    int attached;
+    size_t queued;
+    outbuf_t *spillhead;
+    outbuf_t *spilltail;
+    size_t spillbytes;
+    size_t dropped;
+    ssize_t fed;
+    struct rawfeed *next;
+
+} rawfeed_t;
+
+/* Bytes of received commands a client may have waiting to be executed */
+#define CLIENTBUF_SIZE 4096
+
 /*
  * Store a client that has connected to the server.
  *
+ * @data type
+ *        always CONN_CLIENT, used to identify the client from an epoll event
  * @data clientfd
  *        the clients file descriptor to communicate through
+ * @data fdset
+ *        the epoll instance of the worker that owns the client
+ * @data outhead outtail
+ *        the chain of output waiting for the socket to become writable
+ * @data outbytes
+ *        the total count of bytes waiting in the chains buffers, ranges of
+ *        files queued with send_file() are not counted
+ * @data feeds
+ *        the jobs the client watches raw or chunked
+ * @data sending
+ *        the feed being written to the socket, which is written up to the end
+ *        of a chunk before anything else is sent to the client
+ * @data sendleft
+ *        the bytes of the sending feed still to write
+ * @data rawbytes
+ *        the total count of bytes waiting in the clients feeds
+ * @data dropped
+ *        job output lines dropped since the client fell behind, reported with
+ *        a gap marker once the client catches up
+ * @data stalling
+ *        set when the client stalled a job under the block policy
+ * @data closing
+ *        set when the client was disconnected for falling behind, or its 
+ *        socket failed while it was sent job output, the owning worker closes
+ *        it once its socket reports the shutdown
+ * @data binary
+ *        set once the client asked for binary framing, everything it is sent
+ *        from then on is framed (see frame.h)
+ * @data corked
+ *        set while the owning worker handles the commands the client sent,
+ *        output is only queued until the worker sends it all at once, after
+ *        it has let go of the joblist lock (see uncork_client())
+ * @data inflight
+ *        set while a line of job output is written to the socket in a batch
+ *        with those of other watchers, without the output lock (see
+ *        write_to_watchers()), output is only queued until it completes
+ * @data outlock
+ *        guards the output of the client, from the chain to inflight, as the
+ *        jobs it watches may be polled by any worker. It is held while the 
+ *        output is queued and while it is written to the socket, and no other
+ *        lock is taken while it is held
+ * @data input
+ *        frames the commands read into inbuf
+ * @data inbuf
+ *        the commands received and not yet executed, so a command split over
+ *        several reads (or a batch of pipelined ones) is kept whole
+ * @data ahead
+ *        the read of the socket issued in a batch with the other fds of the
+ *        worker that were ready, until it is taken (see read_client())
+ * @data watching
+ *        the clients watcher in each job it watches, so a client that 
+ *        disconnects is removed from exactly those watchlists
+ * @data share
+ *        the virtual time the runs of the client were admitted up to, each
+ *        run advancing it by SHARE_STRIDE over the weight of its class (see
+ *        dequeue_run())
  * @data next
  *        point the next client connected to the server
  * @data prev
@@ -31,7 +242,28 @@ typedef struct connections
  */
 typedef struct client
 {
+    conntype_t type;
     int clientfd;
+    connections_t *fdset;
+    outbuf_t *outhead;
+    outbuf_t *outtail;
+    size_t outbytes;
+    rawfeed_t *feeds;
+    rawfeed_t *sending;
+    size_t sendleft;
+    size_t rawbytes;
+    size_t dropped;
+    int stalling;
+    int closing;
+    int binary;
+    int corked;
+    int inflight;
+    pthread_mutex_t outlock;
+    linebuf_t input;
+    char inbuf[CLIENTBUF_SIZE];
+    ioahead_t ahead;
+    struct watcher *watching;
+    unsigned long share;
     struct client *next;
     struct client *prev;
 
@@ -39,9 +271,10 @@ typedef struct client
 
 /*
  * Store a list of clients that are currently connect to the server. This list
- * is not bounded (other than by the fd_set size of per OS). Clients that are no
+ * is not bounded (other than by the open file limit of the OS). Clients that are no
  * longer active should be removed from the clientlist as soon as the 
- * disconnection happens.
+ * disconnection happens. Each worker thread owns its own clientlist, so a 
+ * clientlist is only ever touched by the thread that accepted its clients.
  *
  * @data head
  *        the first client connected to the server
@@ -50,8 +283,8 @@ typedef struct client
  * @data size
  *        the total count of actively connected clients
  * @data fdset
- *        the fd_set that holds all concurrent connections to the server (which 
- *        holds every connected clients clientfd).
+ *        the epoll instance that holds all concurrent connections to the server
+ *        (which holds every connected clients clientfd).
  */
 typedef struct clientlist
 {
@@ -66,11 +299,40 @@ typedef struct clientlist
 /*******************************************************************************
  *                            Job Watcher Structures                               *
  ******************************************************************************/
+/*
+ * A client watching a job.
+ *
+ * @data client
+ *        the watching client
+ * @data feed
+ *        the clients feed of the jobs output, NULL when watching lines
+ * @data byclient
+ *        the watchers entry in the watchlists index, keyed by client
+ * @data job
+ *        the job being watched
+ * @data lagging
+ *        set while the client is behind and holds the job stalled under the
+ *        block policy (see stall_job())
+ * @data next
+ *        the next watcher of the job
+ * @data prev
+ *        the previous watcher of the job
+ * @data cnext
+ *        the watcher of the next job the client watches
+ * @data cprev
+ *        the watcher of the previous job the client watches
+ */
 typedef struct watcher
 {
     client_t *client;
+    rawfeed_t *feed;
+    hashnode_t byclient;
+    struct job *job;
+    int lagging;
     struct watcher *next;
     struct watcher *prev;
+    struct watcher *cnext;
+    struct watcher *cprev;
     
 } watcher_t;
 
@@ -85,12 +347,19 @@ typedef struct watcher
  *        the last active client watching the job (can be the same as head)
  * @data size
  *        the total count of active clients watching the job
+ * @data nraw
+ *        the amount of those clients watching raw or chunked
+ * @data byclient
+ *        the watchers indexed by their client, so a client is found without
+ *        walking the list
  */
 typedef struct watchlist
 {
     watcher_t *head;
     watcher_t *end;
     size_t size;
+    size_t nraw;
+    hashindex_t byclient;
 
 } watchlist_t;
 
@@ -98,19 +367,126 @@ typedef struct watchlist
  *                                Job Structures                                   *
  ******************************************************************************/
 
+/* Bytes of a partial output line a job stream may hold */
+#define STREAMBUF_SIZE 256
+
+/*
+ * The fds the server polls for a job it launched directly (without a job
+ * manager): the read ends of the jobs stdout and stderr pipes.
+ */
+typedef enum streamtype
+{
+    STREAM_STDOUT,
+    STREAM_STDERR,
+    JOB_STREAMS
+
+} streamtype_t;
+
+/*
+ * Store one of the fds of a directly launched job. Output is read in whatever
+ * pieces the job writes it, so an incomplete line is kept until the rest of 
+ * it arrives.
+ *
+ * @data type
+ *        always CONN_JOBSTREAM, used to identify the stream from an epoll event,
+ *        CONN_DEAD once its job is removed
+ * @data fd
+ *        the read end of the pipe, -1 once closed
+ * @data stream
+ *        which of the jobs fds this is
+ * @data job
+ *        the job the stream belongs to
+ * @data lines
+ *        frames the lines read into buf
+ * @data buf
+ *        the lines read, and the incomplete line
+ * @data ahead
+ *        the read of the pipe issued in a batch with the other fds of the
+ *        worker that were ready, until it is taken (see read_job_stream())
+ */
+typedef struct jobstream
+{
+    conntype_t type;
+    int fd;
+    streamtype_t stream;
+    struct job *job;
+    linebuf_t lines;
+    char buf[STREAMBUF_SIZE];
+    ioahead_t ahead;
+
+} jobstream_t;
+
+/* The output of the job is not logged, set with "run -q" */
+#define JOB_NOLOG 0x1
+
+/* The job waited in the admission queue before it was launched */
+#define JOB_QUEUED 0x2
+
 /*
  * Store a job that the server initialized. Communication between the server and
  * the job will be done through the corresponding job struct. Non-active jobs
  * will have their job struct removed.
  *
+ * @data type
+ *        always CONN_JOB, used to identify the job from an epoll event,
+ *        CONN_DEAD once it is removed
  * @data pid
  *        the process id of the running job
  * @data mpid
- *        the process id of the job manager
+ *        the process id of the job manager, 0 if the job was launched directly
  * @data jobpipe
- *        the pipe that communication between the server and job manager happens
+ *        the read end of the pipe the job manager reported the pid of the job
+ *        through, held (not polled) so the manager can tell the server is
+ *        still around, -1 if the job was launched directly
+ * @data ring
+ *        the ring the job manager passes the jobs output through, its data
+ *        eventfd is polled, NULL if the job was launched directly
+ * @data ahead
+ *        the read of the data eventfd of the ring issued in a batch with the
+ *        other fds of the worker that were ready (see read_job_ring())
+ * @data ended
+ *        set once the launcher reported the exit of the job manager, so the
+ *        job is removed as soon as the ring is drained
+ * @data streams
+ *        the fds of a job launched directly, unused (-1) for a managed job
+ * @data fdset
+ *        the epoll instance of the worker that polls the job, which is the
+ *        worker that owned the client who ran the job
+ * @data lock
+ *        guards the watchlist of the job and the state of its output, from 
+ *        stalled to the spool, so the worker that polls the job fans its output
+ *        out under this lock alone (see joblist_t)
+ * @data stalled
+ *        set while the job is not polled because a watcher fell behind under
+ *        the block policy
+ * @data lagging
+ *        the amount of watchers holding the job stalled, it is polled again
+ *        once none is left (see resume_jobs())
+ * @data flags
+ *        the JOB_* flags the job was run with
+ * @data jobclass
+ *        the priority class the job was run in
+ * @data started
+ *        when the job was added, to count how long jobs of its class run
+ * @data accounted
+ *        set once the job manager passed on what the job used, read from the
+ *        cgroup of the job (see cgroup_usage())
+ * @data usage
+ *        what the job used, reported with its exit if accounted
+ * @data lines
+ *        the lines of output the job wrote
+ * @data logged
+ *        the lines of output that were logged (see set_log_policy())
+ * @data scrollback
+ *        the last lines of output, replayed to a client that starts watching
+ *        the job late (see replay_scrollback())
+ * @data spool
+ *        where all of the output is written, to be read back by lines after
+ *        the job is removed too (see send_output())
  * @data watcherslist
  *        the list of clients watching the job
+ * @data bypid
+ *        the jobs entry in the joblists index, keyed by pid
  * @data next
  *        the next job running on the server
  * @data prev
@@ -118,19 +494,91 @@ typedef struct watchlist
  */
 typedef struct job
 {
+    conntype_t type;
     pid_t pid;
     pid_t mpid;
     int jobpipe;
+    ring_t *ring;
+    ioahead_t ahead;
+    int ended;
+    jobstream_t streams[JOB_STREAMS];
+    connections_t *fdset;
+    pthread_mutex_t lock;
+    int stalled;
+    size_t lagging;
+    int flags;
+    jobclass_t jobclass;
+    struct timespec started;
+    int accounted;
+    jobusage_t usage;
+    unsigned long lines;
+    unsigned long logged;
+    scrollback_t scrollback;
+    spool_t spool;
     watchlist_t *watchlist;
+    hashnode_t bypid;
     struct job *next;
     struct job *prev;
 
 } job_t;
 
 /*
- * Store a list of jobs that the server has initialized. The list is bounded
- * by MAX_JOBS, thus attempting to run a job that exceeds the MAX_JOB bound
- * will be ignored and reported.
+ * A run that waits in the admission queue for a running job to finish.
+ *
+ * @data args
+ *        the jobname and its arguments, as given to the run command
+ * @data flags
+ *        the JOB_* flags the job is run with
+ * @data jobclass
+ *        the priority class the job is run in
+ * @data limits
+ *        the resource limits the job is run with
+ * @data client
+ *        the client who ran the job, the run is dropped if it disconnects
+ * @data since
+ *        when the run was queued
+ * @data next
+ *        the run queued after it
+ */
+typedef struct queued
+{
+    char *args;
+    int flags;
+    jobclass_t jobclass;
+    joblimits_t limits;
+    client_t *client;
+    struct timespec since;
+    struct queued *next;
+
+} queued_t;
+
+/*
+ * Store a list of jobs that the server has initialized. At most limit jobs
+ * run at once, counting the jobs still being launched: a run past the limit
+ * waits in a bounded admission queue, and is launched as soon as a job
+ * finishes (see admit_jobs()), the clients sharing the slots by the weight
+ * of the classes of their runs (see dequeue_run()). A run past the queue is
+ * declined.
+ *
+ * The joblist is shared by every worker thread. A job is only polled and 
+ * removed by the worker whose epoll instance holds its fds, but any worker
+ * may run, kill or watch it. The lock guards the joblist, the jobs each
+ * client watches and the lifetime of the clients and jobs: a worker holds it
+ * while it runs, kills or watches a job, and while it closes one of its own
+ * clients. It guards the admission queue and the requests every worker has
+ * sent the launcher too, since a job finishing on one worker may launch a run
+ * queued on another.
+ *
+ * Job output is fanned out without it. The worker that polls a job holds only
+ * the lock of the job while it hands the output to the watchers, which may
+ * belong to other workers, and the output lock of each client while it queues
+ * or writes to it. A watchlist only changes under both the joblist lock and
+ * the lock of its job, so a client can not be freed while the output of a job
+ * it watches is fanned out. The locks are taken in that order: the joblist
+ * lock, then the lock of a job, then the output lock of a client. A client
+ * that fails while it is sent job output is shut down, and its owning worker
+ * removes its watchers when it closes it. A client is sent the replies to its
+ * commands once its worker has let go of the joblist lock (see corked).
  *
  * @data head
  *        the first job running on the server
@@ -138,16 +586,39 @@ typedef struct job
  *        the last job running the server (can be the same as head)
  * @data size
  *        the total count of actively running jobs
- * @data fdset
- *        the fd_set that holds all concurrent connections to the server (which 
- *        holds every running jobs pipe).
+ * @data bypid
+ *        the jobs indexed by their pid, so a job is found without walking the
+ *        list
+ * @data limit
+ *        the most jobs run at once
+ * @data launching
+ *        the jobs the launcher was asked for and has not replied to yet
+ * @data queuehead queueend
+ *        the first and last runs waiting in the admission queue
+ * @data queued
+ *        the amount of runs waiting
+ * @data queuemax
+ *        the most runs that may wait, 0 to decline every run past the limit
+ * @data vtime
+ *        the virtual time the last run was admitted at, which the share of a
+ *        client that had no runs waiting is brought up to
+ * @data lock
+ *        serializes access to the shared job state across worker threads
  */
 typedef struct joblist
 {
     job_t *head;
     job_t *end;
     size_t size;
-    connections_t *fdset;
+    hashindex_t bypid;
+    size_t limit;
+    size_t launching;
+    queued_t *queuehead;
+    queued_t *queueend;
+    size_t queued;
+    size_t queuemax;
+    unsigned long vtime;
+    pthread_mutex_t lock;
 
 } joblist_t;
 
@@ -156,7 +627,9 @@ typedef struct joblist
 /*******************************************************************************
  *                          Communincation Helpers                             *
  ******************************************************************************/
-void add_fd(int fd, connections_t *connections);
+int add_fd(int fd, void *owner, connections_t *connections);
+int modify_fd(int fd, void *owner, unsigned int events,
+              connections_t *connections);
 void close_fd(int fd, connections_t *connections);
 
 /*******************************************************************************
@@ -172,22 +645,50 @@ void clear_clients(clientlist_t *clientlist);
  *                              Job Helpers                                     *
  ******************************************************************************/
 
-int add_job(pid_t pid, pid_t mpid, int jobpipe, client_t *client, 
-            joblist_t *joblist);
+int add_job(pid_t pid, pid_t mpid, int jobpipe, ring_t *ring,
+            connections_t *fdset, client_t *client, joblist_t *joblist);
+int add_direct_job(pid_t pid, int fds[JOB_STREAMS], connections_t *fdset,
+                   client_t *client, joblist_t *joblist);
+void close_stream(jobstream_t *stream);
 int remove_job(pid_t pid, joblist_t *joblist);
 job_t *find_job(pid_t pid, joblist_t *joblist);
 int jobcmp(job_t *job1, job_t *job2);
 void free_job(job_t *job);
+void free_dead_jobs(connections_t *fdset);
 void clear_jobs(joblist_t *joblist);
+void stall_job(watcher_t *watcher);
+void resume_jobs(client_t *client);
+
+/*******************************************************************************
+ *                           Admission Queue Helpers                           *
+ ******************************************************************************/
+
+size_t queue_run(const char *args, int flags, jobclass_t jobclass,
+                 const joblimits_t *limits, client_t *client,
+                 joblist_t *joblist);
+void charge_share(client_t *client, jobclass_t jobclass, joblist_t *joblist);
+queued_t *dequeue_run(joblist_t *joblist);
+void free_queued(queued_t *run);
+void dequeue_client(client_t *client, joblist_t *joblist);
 
 /*******************************************************************************
  *                         Job Watcher Helpers                                 *
  ******************************************************************************/
 
-int add_watcher(pid_t pid, client_t *client, joblist_t *joblist);
+int add_watcher(pid_t pid, client_t *client, watchmode_t mode,
+                joblist_t *joblist);
 void remove_watcher(watcher_t *watcher, watchlist_t *watchlist);
 watcher_t *find_watcher(client_t *client, watchlist_t *watchlist);
 int watchercmp(watcher_t *watcher1, watcher_t *watcher2);
+void unwatch_all(client_t *client);
+void free_feed(rawfeed_t *feed, client_t *client);
+
+/*******************************************************************************
+ *                              Object Pools                                   *
+ ******************************************************************************/
+
+void report_pools(void);
+void release_pools(void);
 
 
 #endif /* SERVERDATA_H */
@@ -1,6 +1,9 @@
 #ifndef SERVERLOG_H
 #define SERVERLOG_H
 
+#include "frame.h"
+#include "cgroup.h"
+
 /* No lines or paths may exceed the BUFSIZE below */
 #define BUFSIZE 256
 
@@ -8,7 +11,13 @@
  *
  */
 #define JOB_EMPTY "[SERVER] No currently running jobs\r\n"
-#define JOB_OVERLOAD "[SERVER] MAXJOBS exceeded\r\n"
+#define JOB_OVERLOAD "[SERVER] Job queue is full\r\n"
+#define QUEUE_POSITION "[SERVER] Job queued at position %zu\r\n"
+#define JOB_STARTED "[SERVER] Queued job started as job %d\r\n"
+#define JOB_WAITING "[SERVER] %zu jobs queued\r\n"
+#define JOB_FAILED "[SERVER] Job could not be started\r\n"
+#define JOB_NOCLASS "[SERVER] Job could not be given the priorities of its class\r\n"
+#define JOB_NOLIMITS "[SERVER] Resource limits need jobs run in cgroups\r\n"
 #define SERVER_SHUTDOWN "[SERVER] Shutting down\r\n"
 #define CLIENT_CLOSED "[CLIENT %d] Connection closed\r\n"
 #define CLIENT_ERROR "[SERVER] Could not accept client\n"
@@ -17,22 +26,116 @@
 #define WATCHING_JOB "[SERVER] Watching job %d\r\n"
 #define END_WATCHING_JOB "[SERVER] No longer watching job %d\r\n"
 #define CREATE_JOB "[SERVER] Job %d created\r\n"
-#define JOB_EXIT "[JOB %d] Exited with status %d\r\n"
-#define JOB_SIGNAL "[JOB %d] Exited due to signal\r\n"
+#define JOB_EXIT "[JOB %d] Exited with status %d%s\r\n"
+#define JOB_SIGNAL "[JOB %d] Exited due to signal%s\r\n"
+#define JOB_USAGE " (cpu %llums, peak memory %lluKB)"
+#define JOB_USAGE_CPU " (cpu %llums)"
 #define JOB_STDOUT "[JOB %d] %s\r\n"
 #define JOB_STDERR "*(JOB %d)* %s\r\n"
 #define JOB_NOT_FOUND "[SERVER] Job %d not found\r\n"
 #define INVALID_COMMAND "[SERVER] Invalid command: %s\r\n"
 #define CLIENT_CMD "[CLIENT %d] %s\r\n"
+#define OUTPUT_GAP "[SERVER] %lu lines dropped\r\n"
+#define RAW_GAP "[SERVER] %lu bytes dropped\r\n"
+#define RAW_CHUNK "[JOB %d] %zu\r\n"
 #define JOB_LIST "[SERVER]%s\r\n" 
+#define SPOOL_LINES "[SERVER] Lines %lu to %lu of the %lu lines of job %d\r\n"
+#define SPOOL_EMPTY "[SERVER] No such lines, job %d wrote %lu lines\r\n"
 
+#define SPAWN_TIME "[SERVER] Spawned %d in %luus (%zu jobs running)\n"
+#define SPAWN_STATS "[SERVER] Spawned %lu processes, %luus average, %luus max\n"
 #define SERVER_ACT "[SERVER] Activated: %s\n"
 #define SERVER_DEACT "[SERVER] De-activated: %s\n"
 #define CON_CLOSED "[CLIENT] Connection closed\r\n"
+#define JOB_LOGGED "[SERVER] Logged %lu of the %lu lines of job %d\n"
+#define LOG_DROPPED "[SERVER] %lu log records dropped\n"
+#define LOG_STATS "[SERVER] Logged %lu records to %lu segments, %lu syncs " \
+                  "(%lu dropped, %lu truncated), %lu segments compressed " \
+                  "and %lu deleted\n"
 
-#define VALID_CMDS_S 7
+#define VALID_CMDS_S 10
 #define JOB_TOTAL 4
 
+/* Bytes of output a client may have waiting before it is considered behind */
+#define DEFAULT_HIGHWATER (256 * 1024)
+
+/* Most bytes of job output fed to raw watchers at once */
+#define RAWBUF_SIZE (64 * 1024)
+
+/* Most bytes of a file sent to a client that uses binary framing per frame */
+#define FILE_FRAME (1024 * 1024 * 1024)
+
+/*
+ * What happens to job output for a watcher that has fallen behind (has more
+ * than the high-water mark of output waiting to be written):
+ *
+ * SLOW_BLOCK:       the output is queued and the job is no longer read until
+ *                   the watcher catches up, so the job blocks on its pipe
+ * SLOW_DROP:        the output is dropped, and a gap marker with the amount of
+ *                   dropped lines is sent once the watcher catches up
+ * SLOW_DISCONNECT:  the watcher is disconnected
+ */
+typedef enum slowpolicy
+{
+    SLOW_BLOCK,
+    SLOW_DROP,
+    SLOW_DISCONNECT
+
+} slowpolicy_t;
+
+/*
+ * How much the server logs:
+ *
+ * LEVEL_INFO:       the messages of the server, the commands of the clients and
+ *                   the start and end of every job
+ * LEVEL_OUTPUT:     the output of the jobs as well, every line of stderr and a
+ *                   sample of the lines of stdout (see set_log_policy())
+ * LEVEL_DEBUG:      debug messages as well, in a server built with DEBUG_LOG
+ */
+typedef enum loglevel
+{
+    LEVEL_INFO,
+    LEVEL_OUTPUT,
+    LEVEL_DEBUG
+
+} loglevel_t;
+
+/* Debug messages are compiled out, unless the server is built with DEBUG_LOG */
+#ifdef DEBUG_LOG
+    #define log_debug(...) log_debugf(__VA_ARGS__)
+#else
+    #define log_debug(...) ((void) 0)
+#endif
+
+/*
+ * A message for the watchers of a job, sent to each watcher as text or as a
+ * frame (see write_to_watchers()).
+ *
+ * @data type
+ *        FRAME_OUTPUT, FRAME_EXIT or FRAME_SIGNAL
+ * @data stream
+ *        the stream a line of output came from
+ * @data line
+ *        the line of output, '\0' terminated and without its newline
+ * @data len
+ *        the length of the line
+ * @data status
+ *        the exit status of the job, for FRAME_EXIT
+ * @data usage
+ *        what the job used, for FRAME_EXIT or FRAME_SIGNAL, NULL if the job
+ *        did not run in a cgroup
+ */
+typedef struct jobmsg
+{
+    frametype_t type;
+    framestream_t stream;
+    const char *line;
+    size_t len;
+    int status;
+    const jobusage_t *usage;
+
+} jobmsg_t;
+
 /* List of valid commands */
 extern char *cmdheads[VALID_CMDS_S];
 extern char *cmdmsg[VALID_CMDS_S];
@@ -42,17 +145,31 @@ extern int indent[VALID_CMDS_S];
  ******************************************************************************/
 void log_message(char *buf);
 void log_client_command(char *buf, int clientfd);
+void set_log_policy(loglevel_t level, unsigned long sample);
+#ifdef DEBUG_LOG
+void log_debugf(const char *format, ...);
+#endif
 
-void log_startup();
+void log_startup(const char *logdir);
 void log_shutdown();
 
 /*******************************************************************************
  *                      Server to Client Communication                         *
  ******************************************************************************/
-int write_client(char *format, char *buf, int clientfd);
-int write_job(char *format, pid_t jobpid, pid_t exit_status, 
-                char *buf, int writefd);
-int write_to_watchers(char *buf, watchlist_t *watchlist);
-int write_setmsg(int clientfd, int type);
+void set_slow_policy(slowpolicy_t policy, size_t highwater);
+int client_behind(client_t *client);
+int send_client(client_t *client, const char *msg, size_t len);
+int send_file(client_t *client, int fd, off_t offset, size_t len, pid_t pid);
+int send_message(client_t *client, const char *msg, size_t len);
+int flush_client(client_t *client);
+void cork_client(client_t *client);
+int uncork_client(client_t *client);
+int start_binary(client_t *client);
+int write_client(char *format, char *buf, client_t *client);
+int write_to_watchers(const jobmsg_t *msg, job_t *job);
+int replay_scrollback(job_t *job, client_t *client, size_t count);
+ssize_t feed_watchers(job_t *job, int fd, char *buf, size_t room);
+void write_to_feeds(const char *msg, size_t len, job_t *job);
+int write_setmsg(client_t *client, int type);
 void notify_clients_shutdown(clientlist_t* clientlist);
 #endif /* SERVERLOG_H */
@@ -0,0 +1,124 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Directory of the spooled output of the jobs, unless the server is told */
+#define SPOOL_DIR "../spool"
+
+/* Names of the output of a job and of its index, by the pid of the job */
+#define SPOOL_OUT "job-%d.out"
+#define SPOOL_IDX "job-%d.idx"
+
+/* Identifies the index of a spool */
+#define SPOOL_MAGIC "JSSPOOL1"
+
+/* Lines of output between two entries of the index */
+#define SPOOL_STRIDE 64
+
+/* Bytes of output buffered before they are written to the spool */
+#define SPOOL_BUFSIZE (16 * 1024)
+
+/* Entries of the index buffered before they are written */
+#define SPOOL_ENTRIES (SPOOL_BUFSIZE / SPOOL_STRIDE / sizeof(uint64_t))
+
+/*
+ * The header of the index of a spool, followed by the entries of the index:
+ * the offset in the output of every SPOOL_STRIDE'th line, starting with the
+ * first. The header is rewritten after the output and the entries it counts,
+ * so a reader never finds it ahead of them.
+ *
+ * @data magic
+ *        SPOOL_MAGIC
+ * @data stride
+ *        SPOOL_STRIDE
+ * @data lines
+ *        the lines of output written
+ * @data bytes
+ *        the bytes of output written
+ * @data done
+ *        set once the job is removed, nothing more is written
+ */
+typedef struct spoolheader
+{
+    char magic[8];
+    uint64_t stride;
+    uint64_t lines;
+    uint64_t bytes;
+    uint64_t done;
+
+} spoolheader_t;
+
+/*
+ * The spool a running job writes its output to: the output as the watchers
+ * are sent it as text, appended to a file of its own, and a sparse index of
+ * where its lines start. Output is buffered and written a buffer at a time,
+ * and whenever it is read (see spool_flush()).
+ *
+ * @data outfd idxfd
+ *        the output and the index, -1 if the job is not spooled
+ * @data lines
+ *        the lines appended
+ * @data bytes
+ *        the bytes appended, buffered or not
+ * @data inbuf
+ *        the bytes buffered
+ * @data buf
+ *        the output buffered, allocated once the job writes a line
+ * @data entries
+ *        the entries of the index, written or buffered
+ * @data inentries
+ *        the amount of entries buffered
+ * @data entrybuf
+ *        the entries buffered
+ */
+typedef struct spool
+{
+    int outfd;
+    int idxfd;
+    uint64_t lines;
+    uint64_t bytes;
+    size_t inbuf;
+    char *buf;
+    uint64_t entries;
+    size_t inentries;
+    uint64_t entrybuf[SPOOL_ENTRIES];
+
+} spool_t;
+
+/*
+ * The spool of a job (running or not) opened to be read, its index mapped.
+ *
+ * @data outfd
+ *        the output
+ * @data header
+ *        the mapping of the index, starting with its header
+ * @data size
+ *        the bytes mapped
+ */
+typedef struct spoolview
+{
+    int outfd;
+    const spoolheader_t *header;
+    size_t size;
+
+} spoolview_t;
+
+/*******************************************************************************
+ *                                Spooling                                     *
+ ******************************************************************************/
+int spool_start(const char *dir);
+void spool_create(spool_t *spool, pid_t pid);
+void spool_append(spool_t *spool, const char *text, size_t len);
+void spool_flush(spool_t *spool);
+void spool_close(spool_t *spool);
+
+/*******************************************************************************
+ *                             Spool Lookups                                   *
+ ******************************************************************************/
+int spool_open(spoolview_t *view, pid_t pid);
+uint64_t spool_offset(const spoolview_t *view, uint64_t line);
+void spool_release(spoolview_t *view);
+
+#endif /* SPOOL_H */
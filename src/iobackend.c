@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "headers/iobackend.h"
+
+/*
+ * A read or write in a batch, as the backends issue it.
+ *
+ * @data fd
+ *        the file descriptor to read from or write to
+ * @data addr
+ *        the bytes to write, or where the bytes are read to
+ * @data len
+ *        the amount of bytes
+ * @data result
+ *        the bytes read or written, or -errno
+ */
+typedef struct ioreq
+{
+    int fd;
+    unsigned long addr;
+    size_t len;
+    ssize_t result;
+
+} ioreq_t;
+
+/*
+ * Store the io_uring instance of a single worker thread. The rings are mapped
+ * straight from the kernel, there is no liburing dependency.
+ *
+ * @data fd
+ *        the io_uring instance, -1 if the ring could not be set up
+ * @data entries
+ *        the size of the submission queue
+ * @data seq
+ *        the number of the current batch, kept in the user data of its
+ *        submissions so completions left over from an earlier one are skipped
+ * @data sq_head sq_tail sq_mask sq_array
+ *        the submission queue ring shared with the kernel
+ * @data cq_head cq_tail cq_mask cqes
+ *        the completion queue ring shared with the kernel
+ * @data sqes
+ *        the submission queue entries
+ * @data sq_ring cq_ring
+ *        the mappings of both rings (the same if the kernel maps them once)
+ */
+typedef struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned seq;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+} uring_t;
+
+/* The backend chosen at startup, shared by all workers */
+static iobackend_t backend = IO_SYNC;
+
+/* Each worker submits through its own ring */
+static __thread uring_t *ring;
+
+/* Counters for the writes and reads issued and the syscalls they took */
+static unsigned long io_writes;
+static unsigned long io_syscalls;
+static unsigned long io_reads;
+static unsigned long io_readcalls;
+
+/*******************************************************************************
+ *                             io_uring Helpers                                *
+ ******************************************************************************/
+
+/*
+ * Tear down a ring created by uring_setup().
+ *
+ * @param uring
+ *        the ring to unmap and close
+ */
+static void uring_free(uring_t *uring)
+{
+    if (uring->sqes != NULL)
+    {
+        munmap(uring->sqes, uring->sqes_len);
+    }
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring)
+    {
+        munmap(uring->cq_ring, uring->cq_ring_len);
+    }
+    if (uring->sq_ring != NULL)
+    {
+        munmap(uring->sq_ring, uring->sq_ring_len);
+    }
+    if (uring->fd >= 0)
+    {
+        close(uring->fd);
+    }
+    free(uring);
+}
+
+/*
+ * Create an io_uring instance with room for IO_BATCH submissions and map its
+ * rings.
+ *
+ * @return
+ *        NULL:         io_uring is unavailable (old kernel, seccomp, limits)
+ *        uring:        the ring, ready for submissions
+ */
+static uring_t *uring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring_t *uring = calloc(1, sizeof(struct uring));
+    if (uring == NULL)
+    {
+        return NULL;
+    }
+
+    uring->fd = syscall(__NR_io_uring_setup, IO_BATCH, &params);
+    if (uring->fd < 0)
+    {
+        uring_free(uring);
+        return NULL;
+    }
+
+    uring->entries = params.sq_entries;
+    uring->sq_ring_len = params.sq_off.array
+                        + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_len = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (uring->cq_ring_len > uring->sq_ring_len)
+        {
+            uring->sq_ring_len = uring->cq_ring_len;
+        }
+        uring->cq_ring_len = uring->sq_ring_len;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED)
+    {
+        uring->sq_ring = NULL;
+        uring_free(uring);
+        return NULL;
+    }
+
+    uring->cq_ring = uring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED)
+        {
+            uring->cq_ring = NULL;
+            uring_free(uring);
+            return NULL;
+        }
+    }
+
+    uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED)
+    {
+        uring->sqes = NULL;
+        uring_free(uring);
+        return NULL;
+    }
+
+    char *sq = uring->sq_ring;
+    char *cq = uring->cq_ring;
+    uring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return uring;
+}
+
+/*
+ * Reap the completions that are ready. Each fills the result of its request,
+ * unless it was left over from an earlier batch.
+ *
+ * @return
+ *        the completions of this batch that were reaped
+ */
+static int uring_reap(uring_t *uring, ioreq_t *reqs)
+{
+    unsigned head = *uring->cq_head;
+    int reaped = 0;
+
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        if ((cqe->user_data >> 32) == uring->seq)
+        {
+            reqs[cqe->user_data & 0xffffffff].result = cqe->res;
+            reaped++;
+        }
+        head++;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/*
+ * Submit up to uring->entries requests with a single io_uring_enter and wait
+ * for all of them to complete. Requests on the same fd are placed next to each
+ * other and linked, so the kernel runs them in the order of the batch, and
+ * once one of them falls short the rest are cancelled rather than landing out
+ * of order. If the kernel takes only part of the batch, the submissions it
+ * did take are still waited for, and the rest are taken back out of the ring
+ * for the caller to issue.
+ *
+ * @param uring
+ *        the ring of the calling thread
+ * @param opcode
+ *        IORING_OP_READ or IORING_OP_WRITE
+ * @param reqs
+ *        the requests to submit
+ * @param count
+ *        the amount of requests, no more than uring->entries
+ * @param order
+ *        filled with the index of each request in the order they were placed
+ *        in the ring
+ * @param calls
+ *        the counter of the syscalls made
+ *
+ * @return
+ *        n:        the first n requests of order were submitted and have
+ *                  their results, the rest were never submitted
+ */
+static int uring_submit(uring_t *uring, int opcode, ioreq_t *reqs, int count,
+                        int *order, unsigned long *calls)
+{
+    unsigned tail = *uring->sq_tail;
+    unsigned mask = *uring->sq_mask;
+    char placed[IO_BATCH] = { 0 };
+    int n = 0;
+
+    uring->seq++;
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = i; j < count && !placed[i]; j++)
+        {
+            if (placed[j] || reqs[j].fd != reqs[i].fd)
+            {
+                continue;
+            }
+            placed[j] = 1;
+            order[n++] = j;
+        }
+    }
+
+    for (int i = 0; i < count; i++, tail++)
+    {
+        unsigned index = tail & mask;
+        struct io_uring_sqe *sqe = &uring->sqes[index];
+        ioreq_t *req = &reqs[order[i]];
+
+        req->result = -EIO; /* Unless its completion comes */
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = req->fd;
+        sqe->addr = req->addr;
+        sqe->len = req->len;
+        sqe->off = (__u64) -1; /* Sockets and pipes have no offset */
+        sqe->rw_flags = RWF_NOWAIT; /* O_NONBLOCK alone waits for the fd */
+        sqe->user_data = ((__u64) uring->seq << 32) | order[i];
+        if (i + 1 < count && reqs[order[i + 1]].fd == req->fd)
+        {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        uring->sq_array[index] = index;
+    }
+    __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* A partial submission returns without waiting for the completions */
+    int submitted = 0;
+    int completed = 0;
+    int failed = 0;
+    while (completed < submitted || (!failed && submitted < count))
+    {
+        int tosubmit = failed ? 0 : count - submitted;
+        int ret = syscall(__NR_io_uring_enter, uring->fd, tosubmit,
+                          (failed ? submitted : count) - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        (*calls)++;
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0 && tosubmit == 0) /* The completions are lost */
+        {
+            break;
+        }
+        if (ret < tosubmit)
+        {
+            submitted += ret > 0 ? ret : 0;
+            failed = 1;
+
+            /* Take what the kernel did not back out of the ring */
+            __atomic_store_n(uring->sq_tail,
+                             __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+        }
+        else
+        {
+            submitted += tosubmit;
+        }
+        completed += uring_reap(uring, reqs);
+    }
+
+    for (int i = 0; i < submitted; i++)
+    {
+        if (reqs[order[i]].result == -ECANCELED) /* One ahead fell short */
+        {
+            reqs[order[i]].result = 0;
+        }
+    }
+    return submitted;
+}
+
+/*******************************************************************************
+ *                               I/O Backend                                   *
+ ******************************************************************************/
+
+/*
+ * Choose the backend used for batched writes. If io_uring is requested but
+ * can not be set up, the server falls back to plain write() calls.
+ *
+ * @param requested
+ *        the backend asked for on the command line
+ *
+ * @return
+ *        the backend that will be used
+ */
+iobackend_t io_backend_init(iobackend_t requested)
+{
+    backend = IO_SYNC;
+    if (requested == IO_URING)
+    {
+        uring_t *probe = uring_setup();
+        if (probe != NULL)
+        {
+            backend = IO_URING;
+            uring_free(probe);
+        }
+        else
+        {
+            perror("[SERVER] io_uring unavailable, using write()");
+        }
+    }
+    return backend;
+}
+
+/*
+ * Return the name of the backend in use.
+ */
+const char *io_backend_name(void)
+{
+    return backend == IO_URING ? "io_uring" : "write";
+}
+
+/*
+ * Determine if a request on the fd fell short earlier in the batch, in which
+ * case no more are issued on it, as their bytes would land out of order.
+ */
+static int fell_short(int *shortfds, int nshort, int fd)
+{
+    for (int i = 0; i < nshort; i++)
+    {
+        if (shortfds[i] == fd)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Perform every request in the batch and record each result. With io_uring
+ * the batch costs one syscall per IO_BATCH requests, and a request the kernel
+ * did not take is issued on its own. Each request is issued once, a short read
+ * or write is reported rather than retried, and the requests after it on the
+ * same fd are not issued (their result is 0).
+ *
+ * @param opcode
+ *        IORING_OP_READ or IORING_OP_WRITE
+ * @param reqs
+ *        the requests to perform
+ * @param count
+ *        the amount of requests in the batch
+ * @param calls
+ *        the counter of the syscalls made
+ */
+static void io_batch(int opcode, ioreq_t *reqs, int count,
+                     unsigned long *calls)
+{
+    if (backend == IO_URING && ring == NULL)
+    {
+        ring = uring_setup();
+    }
+
+    for (int done = 0; done < count; )
+    {
+        int batch = count - done;
+        int order[IO_BATCH];
+        int submitted = 0;
+
+        if (batch > IO_BATCH)
+        {
+            batch = IO_BATCH;
+        }
+        if (backend == IO_URING && ring != NULL)
+        {
+            if (batch > ring->entries)
+            {
+                batch = ring->entries;
+            }
+            unsigned long uring_calls = 0;
+            submitted = uring_submit(ring, opcode, reqs + done, batch, order,
+                                     &uring_calls);
+            __atomic_fetch_add(calls, uring_calls, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            for (int i = 0; i < batch; i++)
+            {
+                order[i] = i;
+            }
+        }
+
+        /* Whatever the ring did not take, in the order it was placed */
+        int shortfds[IO_BATCH];
+        int nshort = 0;
+        for (int i = 0; i < batch; i++)
+        {
+            ioreq_t *req = &reqs[done + order[i]];
+            if (i < submitted) /* Only noted if it fell short */
+            {
+                if (req->result != (ssize_t) req->len)
+                {
+                    shortfds[nshort++] = req->fd;
+                }
+                continue;
+            }
+            if (fell_short(shortfds, nshort, req->fd))
+            {
+                req->result = 0;
+                continue;
+            }
+
+            req->result = opcode == IORING_OP_WRITE
+                          ? write(req->fd, (void *) req->addr, req->len)
+                          : read(req->fd, (void *) req->addr, req->len);
+            if (req->result < 0)
+            {
+                req->result = -errno;
+            }
+            if (req->result != (ssize_t) req->len)
+            {
+                shortfds[nshort++] = req->fd;
+            }
+            __atomic_fetch_add(calls, 1, __ATOMIC_RELAXED);
+        }
+        done += batch;
+    }
+}
+
+/*
+ * Perform every write in the batch and record each result (see io_batch()).
+ *
+ * @param writes
+ *        the writes to perform
+ * @param count
+ *        the amount of writes in the batch
+ */
+void io_write_batch(iowrite_t *writes, int count)
+{
+    ioreq_t reqs[count];
+
+    __atomic_fetch_add(&io_writes, count, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++)
+    {
+        reqs[i] = (ioreq_t) { writes[i].fd, (unsigned long) writes[i].buf,
+                              writes[i].len, 0 };
+    }
+    io_batch(IORING_OP_WRITE, reqs, count, &io_syscalls);
+    for (int i = 0; i < count; i++)
+    {
+        writes[i].result = reqs[i].result;
+    }
+}
+
+/*
+ * Perform every read in the batch and record each result (see io_batch()).
+ * The reads of every fd that is ready are issued together, so with io_uring
+ * they cost a single syscall.
+ *
+ * @param reads
+ *        the reads to perform
+ * @param count
+ *        the amount of reads in the batch
+ */
+void io_read_batch(ioread_t *reads, int count)
+{
+    ioreq_t reqs[count];
+
+    __atomic_fetch_add(&io_reads, count, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++)
+    {
+        reqs[i] = (ioreq_t) { reads[i].fd, (unsigned long) reads[i].buf,
+                              reads[i].len, 0 };
+    }
+    io_batch(IORING_OP_READ, reqs, count, &io_readcalls);
+    for (int i = 0; i < count; i++)
+    {
+        reads[i].result = reqs[i].result;
+    }
+}
+
+/*
+ * Read from the fd as read() does, unless a read was already issued for it in
+ * a batch, whose result is taken instead. The bytes of that read are already
+ * in buf, which must be where the read was issued to.
+ *
+ * @param fd buf len
+ *        as read()
+ * @param ahead
+ *        the result of the read issued ahead for the fd
+ *
+ * @return
+ *        as read(), with errno set on -1
+ */
+ssize_t io_read(int fd, void *buf, size_t len, ioahead_t *ahead)
+{
+    if (!ahead->ready)
+    {
+        return read(fd, buf, len);
+    }
+
+    ahead->ready = 0;
+    if (ahead->result < 0)
+    {
+        errno = -ahead->result;
+        return -1;
+    }
+    return ahead->result;
+}
+
+/*
+ * Release the ring of the calling thread. Workers call this before exiting.
+ */
+void io_thread_exit(void)
+{
+    if (ring != NULL)
+    {
+        uring_free(ring);
+        ring = NULL;
+    }
+}
+
+/*
+ * Format the amount of writes and reads issued and the syscalls they cost,
+ * used to compare the backends.
+ *
+ * @param buf
+ *        the buffer to format the statistics into
+ * @param size
+ *        the size of buf
+ */
+void io_report_stats(char *buf, size_t size)
+{
+    snprintf(buf, size, "[SERVER] I/O backend %s: %lu writes in %lu syscalls, "
+             "%lu reads in %lu syscalls\n", io_backend_name(), io_writes,
+             io_syscalls, io_reads, io_readcalls);
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "headers/jobclass.h"
+
+/* ioprio_set() has no glibc wrapper, nor its constants a header of glibc */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+/*
+ * The classes a job can be run in. A normal job runs as jobs always did, an
+ * interactive job is admitted ahead of them and gets more of the CPU and the
+ * most of the disk, and a batch job is admitted last and only runs and reads
+ * when nothing else wants to.
+ */
+static const classinfo_t classes[JOB_CLASSES] =
+{
+    [CLASS_NORMAL]      = { "normal",      4, 0,  0,                 0 },
+    [CLASS_INTERACTIVE] = { "interactive", 8, -5, IOPRIO_CLASS_BE,   0 },
+    [CLASS_BATCH]       = { "batch",       1, 10, IOPRIO_CLASS_IDLE, 0 }
+};
+
+/*
+ * How long the runs of a class waited to be admitted and how long their jobs
+ * ran, reported on shutdown.
+ */
+typedef struct classstats
+{
+    unsigned long waits;
+    unsigned long wait_nsec;
+    unsigned long wait_max_nsec;
+    unsigned long runs;
+    unsigned long run_nsec;
+    unsigned long run_max_nsec;
+
+} classstats_t;
+
+static classstats_t stats[JOB_CLASSES];
+
+/*******************************************************************************
+ *                           Priority Class Helpers                            *
+ ******************************************************************************/
+
+/*
+ * The nanoseconds since a point in time, as told by CLOCK_MONOTONIC.
+ */
+static unsigned long elapsed_nsec(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000000UL
+           + now.tv_nsec - since->tv_nsec;
+}
+
+/*
+ * Add a sample to a sum and count, and raise the max it is kept with.
+ */
+static void record(unsigned long *count, unsigned long *sum,
+                   unsigned long *max, unsigned long nsec)
+{
+    __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(sum, nsec, __ATOMIC_RELAXED);
+
+    unsigned long most = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (nsec > most && !__atomic_compare_exchange_n(max, &most, nsec, 1,
+                                                       __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED))
+    {
+        ;
+    }
+}
+
+/*******************************************************************************
+ *                             Priority Classes                                *
+ ******************************************************************************/
+
+/*
+ * Look up what a priority class stands for.
+ *
+ * @param jobclass
+ *        a valid class
+ *
+ * @return
+ *        the name, weight and priorities of the class
+ */
+const classinfo_t *jobclass_info(jobclass_t jobclass)
+{
+    return &classes[jobclass];
+}
+
+/*
+ * Find the priority class a run command names.
+ *
+ * @param name len
+ *        the name of the class, not null terminated, and its length
+ *
+ * @return
+ *        CLASS_INVALID:    no class has the name
+ *        jobclass:         the class named
+ */
+jobclass_t jobclass_parse(const char *name, size_t len)
+{
+    for (int i = 0; i < JOB_CLASSES; i++)
+    {
+        if (strlen(classes[i].name) == len
+            && memcmp(classes[i].name, name, len) == 0)
+        {
+            return i;
+        }
+    }
+    return CLASS_INVALID;
+}
+
+/*
+ * Give the calling process the nice value and I/O priority of a class. It is
+ * called by a job between its fork and its exec (see spawn_job()), so the
+ * job runs with them from its first instruction and everything it forks
+ * inherits them. The negative nice value of an interactive job needs
+ * CAP_SYS_NICE (or a RLIMIT_NICE that allows it), without which the job is
+ * not started and its client is told so (JOB_NOCLASS). The other priorities
+ * only lower the priority of the job or keep it within what an unprivileged
+ * process may ask for.
+ *
+ * @param jobclass
+ *        the class of the job
+ *
+ * @return
+ *        -1:       a priority could not be set, errno is set
+ *        0:        the process runs with the priorities of its class
+ */
+int jobclass_apply(jobclass_t jobclass)
+{
+    const classinfo_t *info = &classes[jobclass];
+
+    if (info->nice != 0 && setpriority(PRIO_PROCESS, 0, info->nice) < 0)
+    {
+        return -1;
+    }
+    if (info->ioclass != 0
+        && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                   info->ioclass << IOPRIO_CLASS_SHIFT | info->iolevel) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Tell if a class sets any priority, so its jobs have to apply it themselves
+ * before they exec (see jobclass_apply()).
+ */
+int jobclass_sets_priority(jobclass_t jobclass)
+{
+    return classes[jobclass].nice != 0 || classes[jobclass].ioclass != 0;
+}
+
+/*
+ * Count a run that was admitted, along with how long it waited.
+ *
+ * @param jobclass
+ *        the class of the run
+ * @param since
+ *        when the run was queued, NULL for a run admitted right away
+ */
+void jobclass_record_wait(jobclass_t jobclass, const struct timespec *since)
+{
+    classstats_t *class = &stats[jobclass];
+    record(&class->waits, &class->wait_nsec, &class->wait_max_nsec,
+           since != NULL ? elapsed_nsec(since) : 0);
+}
+
+/*
+ * Count a job that finished, along with how long it ran.
+ *
+ * @param jobclass
+ *        the class of the job
+ * @param started
+ *        when the job was added to the joblist
+ */
+void jobclass_record_run(jobclass_t jobclass, const struct timespec *started)
+{
+    classstats_t *class = &stats[jobclass];
+    record(&class->runs, &class->run_nsec, &class->run_max_nsec,
+           elapsed_nsec(started));
+}
+
+/*
+ * Format how long the runs of a class waited and how long their jobs ran,
+ * reported on shutdown.
+ */
+void jobclass_report_stats(jobclass_t jobclass, char *buf, size_t size)
+{
+    classstats_t *class = &stats[jobclass];
+    unsigned long waits = __atomic_load_n(&class->waits, __ATOMIC_RELAXED);
+    unsigned long runs = __atomic_load_n(&class->runs, __ATOMIC_RELAXED);
+
+    snprintf(buf, size, "[SERVER] Class %s: %lu runs waited %luus average, "
+             "%luus max, %lu jobs ran %lums average, %lums max\n",
+             classes[jobclass].name, waits,
+             waits ? class->wait_nsec / waits / 1000 : 0,
+             class->wait_max_nsec / 1000, runs,
+             runs ? class->run_nsec / runs / 1000000 : 0,
+             class->run_max_nsec / 1000000);
+}
@@ -6,18 +6,177 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include "headers/socket.h"
 #include "headers/jobcommands.h"
+#include "headers/frame.h"
+#include "headers/linebuf.h"
 
 #define COMMAND "%s\r\n"
 #define CONNECTION_CLOSED "[CLIENT] Connection closed\n"
 #define SERVER_SHUTDOWN "[SERVER] Shutting down"
 #define CON_CLOSED "[CLIENT] Connection closed\r\n"
+#define BINARY_COMMAND "binary\r\n"
+
+/* How framed messages are displayed, the same as their text form */
+#define SHOW_STDOUT "[JOB %d] %.*s\n"
+#define SHOW_STDERR "*(JOB %d)* %.*s\n"
+#define SHOW_EXIT "[JOB %d] Exited with status %d%s\n"
+#define SHOW_SIGNAL "[JOB %d] Exited due to signal%s\n"
+#define SHOW_USAGE " (cpu %llums, peak memory %lluKB)"
+#define SHOW_USAGE_CPU " (cpu %llums)"
+#define SHOW_LINES_GAP "[SERVER] %lu lines dropped\n"
+#define SHOW_BYTES_GAP "[SERVER] %lu bytes dropped\n"
+
+/* Set with -b, the server is asked for binary framing */
+static int binary = 0;
+
+/* Set once the server acknowledged binary framing */
+static int framed = 0;
+
+/* What the server sent that is not yet displayed, grown to fit a frame */
+static char *inbuf_data = NULL;
+static size_t inbuf_size = 0;
+static size_t inbuf = 0;
+
+/*
+ * Display a line of text the server sent, and switch to frames once the
+ * server acknowledged binary framing.
+ *
+ * @param buf
+ *          the text received
+ * @param len
+ *          the amount of bytes in buf
+ *
+ * @return:
+ *      -1:         the server is shutting down
+ *      0:          no complete line has arrived
+ *      n:          a line of n bytes (with its network newline) was displayed
+ */
+static int show_line(char *buf, size_t len)
+{
+    ssize_t nwl = find_crlf(buf, len);
+    if (nwl < 0)
+    {
+        return 0;
+    }
+
+    buf[nwl - 2] = '\0';
+    printf("%s\n", buf);
+
+    if (strcmp(buf, SERVER_SHUTDOWN) == 0)
+    {
+        return -1;
+    }
+    if (binary && strcmp(buf, BINARY_ON) == 0)
+    {
+        framed = 1;
+    }
+    return nwl;
+}
+
+/*
+ * Format what a job used, at the end of the payload of its exit (see
+ * FRAME_USAGE), the same as the server does in its text. Nothing is
+ * formatted if the job did not run in a cgroup.
+ *
+ * @param payload len
+ *          what the job used, and its length, less than FRAME_USAGE if none
+ * @param buf size
+ *          filled with the text, and its size
+ */
+static void show_usage(const char *payload, int len, char *buf, size_t size)
+{
+    uint64_t usage[2];
+
+    buf[0] = '\0';
+    if (len < FRAME_USAGE)
+    {
+        return;
+    }
+    memcpy(usage, payload, sizeof(usage));
+    if (be64toh(usage[1]) > 0)
+    {
+        snprintf(buf, size, SHOW_USAGE,
+                 (unsigned long long) be64toh(usage[0]) / 1000,
+                 (unsigned long long) be64toh(usage[1]) / 1024);
+    }
+    else
+    {
+        snprintf(buf, size, SHOW_USAGE_CPU,
+                 (unsigned long long) be64toh(usage[0]) / 1000);
+    }
+}
 
 /*
- * Read the output from the server, stripping network newlines prior to 
- * displaying it. 
+ * Display a frame the server sent, in the same form as its text.
+ *
+ * @param buf
+ *          the frames received
+ * @param len
+ *          the amount of bytes in buf
+ *
+ * @return:
+ *      -1:         the server is shutting down
+ *      0:          no complete frame has arrived
+ *      n:          a frame of n bytes was displayed
+ */
+static ssize_t show_frame(char *buf, size_t len)
+{
+    frame_t frame;
+    ssize_t size = frame_unpack(buf, len, &frame);
+    if (size < 0 || size > len)
+    {
+        return 0;
+    }
+
+    char *payload = buf + FRAME_HEADER;
+    int paylen = frame.len;
+    uint32_t status;
+    uint64_t amount;
+    char usage[64];
+
+    switch (frame.type)
+    {
+        case FRAME_SERVER:
+            printf("%.*s\n", paylen, payload);
+            if (paylen == strlen(SERVER_SHUTDOWN)
+                && memcmp(payload, SERVER_SHUTDOWN, paylen) == 0)
+            {
+                return -1;
+            }
+            break;
+        case FRAME_OUTPUT:
+            printf(frame.stream == FRAME_STDERR ? SHOW_STDERR : SHOW_STDOUT,
+                   frame.pid, paylen, payload);
+            break;
+        case FRAME_EXIT:
+            memcpy(&status, payload, sizeof(status));
+            show_usage(payload + sizeof(status),
+                       paylen - (int) sizeof(status), usage, sizeof(usage));
+            printf(SHOW_EXIT, frame.pid, (int) ntohl(status), usage);
+            break;
+        case FRAME_SIGNAL:
+            show_usage(payload, paylen, usage, sizeof(usage));
+            printf(SHOW_SIGNAL, frame.pid, usage);
+            break;
+        case FRAME_RAW:
+            fwrite(payload, 1, paylen, stdout);
+            break;
+        case FRAME_GAP:
+            memcpy(&amount, payload, sizeof(amount));
+            printf(frame.pid == 0 ? SHOW_LINES_GAP : SHOW_BYTES_GAP,
+                   (unsigned long) be64toh(amount));
+            break;
+    }
+    return size;
+}
+
+/*
+ * Read the output from the server and display it, stripping network newlines
+ * from text, or turning frames back into text once the server switched to
+ * binary framing.
  *
  * @param readfd
  *          the socket to read the output from
@@ -28,32 +187,45 @@
  */
 int read_server(int readfd)
 {
-    char buf[BUFSIZE + 1];
-    char *after = buf;
-    int inbuf = 0;
-    int room = BUFSIZE;
-    int nbytes;
+    ssize_t nbytes;
 
-    while ((nbytes = read(readfd, after, room)) > 0)
+    while (1)
     {
-        inbuf += nbytes;
-
-        int nwl;
-        while ((nwl = find_network_newline(buf, inbuf)) > 0)
+        if (inbuf == inbuf_size) /* Make room for a frame of any length */
         {
-            buf[nwl - 2] = '\0';
-            printf("%s\n", buf);
-
-            if (strcmp(buf, SERVER_SHUTDOWN) == 0)
+            size_t size = inbuf_size > 0 ? inbuf_size * 2 : BUFSIZE + 1;
+            char *grown = realloc(inbuf_data, size);
+            if (grown == NULL)
             {
+                perror("[CLIENT] realloc");
                 return 1;
             }
-            inbuf -= nwl;
-            memmove(buf, buf + nwl, inbuf);
+            inbuf_data = grown;
+            inbuf_size = size;
         }
-        after = buf + inbuf;
-        room = BUFSIZE - inbuf;
+
+        nbytes = read(readfd, inbuf_data + inbuf, inbuf_size - inbuf);
+        if (nbytes <= 0)
+        {
+            break;
+        }
+        inbuf += nbytes;
+
+        size_t used = 0;
+        ssize_t shown;
+        while ((shown = framed ? show_frame(inbuf_data + used, inbuf - used)
+                               : show_line(inbuf_data + used, inbuf - used)) > 0)
+        {
+            used += shown;
+        }
+        if (shown < 0)
+        {
+            return 1;
+        }
+        inbuf -= used;
+        memmove(inbuf_data, inbuf_data + used, inbuf);
     }
+    fflush(stdout);
 
     if (nbytes < 0 && errno != EAGAIN)
     {
@@ -91,9 +263,8 @@ int read_command(int writefd)
 
     buf[num_read - 1] = '\0';
 
-    int validate = validate_command(buf);
-
-    if (validate == 5) //Exit
+    command_t cmd;
+    if (parse_command(buf, strlen(buf), &cmd) == CMD_EXIT) //Exit
         return 1;
 
     char msg[BUFSIZE + 4];
@@ -115,9 +286,15 @@ int read_command(int writefd)
 int main(int argc, char *argv[])
 {
     char addr[BUFSIZE+1];
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) /* Ask for binary framing */
+    {
+        binary = 1;
+        argc--;
+        argv++;
+    }
     if (argc > 2)
     {
-        fprintf(stderr, "Usage:\n\tjobclient hostname\n");
+        fprintf(stderr, "Usage:\n\tjobclient [-b] hostname\n");
         exit(1);
     }
     
@@ -140,6 +317,12 @@ int main(int argc, char *argv[])
 
     // Set-up socket
     int soc = connect_to_server(PORT, addr);
+    if (binary && write(soc, BINARY_COMMAND, strlen(BINARY_COMMAND)) < 0)
+    {
+        perror("[CLIENT] write");
+        close(soc);
+        exit(1);
+    }
 
     int closed = 0;
 
@@ -1,121 +1,289 @@
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
-#include <regex.h>
 
 #include "headers/jobcommands.h"
 
 /*
- * All possible commands that are valid.
+ * Hash a command name by its first letter and its length. Every command hashes
+ * to a slot of its own, so a name is looked up with a single comparison.
  */
-const char *client_cmds[] =
+#define CMD_HASH(first, len) (((unsigned char) (first) + (len)) & 15)
+#define CMD_SLOTS 16
+
+/*
+ * A command name in the lookup table.
+ */
+typedef struct cmdname
 {
-    "^commands$",
-    "^jobs$",
-    "^run (.+)( [0-9]*)*$",
-    "^kill ([0-9]+)$",
-    "^watch ([0-9]+)$",
-    "^exit$",
-    "^joblist$"
+    const char *name;
+    size_t len;
+    cmdtype_t type;
+
+} cmdname_t;
+
+/*
+ * All possible commands that are valid, placed by their hash. Empty slots have
+ * a length of 0, which no name matches.
+ */
+static const cmdname_t cmd_table[CMD_SLOTS] =
+{
+    [CMD_HASH('c', 8)] = { "commands", 8, CMD_COMMANDS },
+    [CMD_HASH('j', 4)] = { "jobs", 4, CMD_JOBS },
+    [CMD_HASH('r', 3)] = { "run", 3, CMD_RUN },
+    [CMD_HASH('k', 4)] = { "kill", 4, CMD_KILL },
+    [CMD_HASH('w', 5)] = { "watch", 5, CMD_WATCH },
+    [CMD_HASH('e', 4)] = { "exit", 4, CMD_EXIT },
+    [CMD_HASH('j', 7)] = { "joblist", 7, CMD_JOBLIST },
+    [CMD_HASH('b', 6)] = { "binary", 6, CMD_BINARY },
+    [CMD_HASH('r', 5)] = { "range", 5, CMD_RANGE },
+    [CMD_HASH('l', 4)] = { "last", 4, CMD_LAST }
 };
 
 /*
- * Validate that the command the client received or sent to the server is one
- * of the accepted commands, in the correct format.
+ * Parse the number at the start of buf, which must be a run of digits followed
+ * by the end of the line or a space.
  *
  * @param buf
- *      the command the client or server received
+ *      the text after the space that ends the command name or an argument
+ * @param len
+ *      the length of buf
+ * @param max
+ *      the largest number accepted
+ * @param number
+ *      set to the number
  *
  * @return
- *      -2:     error occurred and thus the validity of the command is
- *              unknown
- *      -1:      the command was not a match
- *      i:      return the index of the regex in client_cmds that matched the
- *              command
+ *      -1:     buf does not start with a number up to max
+ *      n:      the number was n characters long
  */
-int validate_command(char *buf)
+static ssize_t parse_number(const char *buf, size_t len, unsigned long max,
+                            unsigned long *number)
 {
-    int match;
-    regex_t regex;
-    for (int i = 0; i < CLIENT_CMDS_S; i++)
-    {
-        match = regcomp(&regex, client_cmds[i], REG_EXTENDED|REG_NOSUB);
-
-        if (match != 0)
-        {
-            fprintf(stderr, "[SERVER] Regex could not be compiled\n");
-            return -2;
-        }
-        
-        match = regexec(&regex, buf, 0, NULL, 0);
+    size_t i = 0;
+    unsigned long value = 0;
 
-        if (!match)
-        {
-            return i;
-        }
-        else if (match != REG_NOMATCH)
+    for (; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+    {
+        if (value > (max - (buf[i] - '0')) / 10)
         {
-            regerror(match, &regex, buf, sizeof(buf));
-            fprintf(stderr, "[SERVER] Regex match failed for %s\n", buf);
-            return -2;
+            return -1;
         }
-        regfree(&regex);
+        value = value * 10 + (buf[i] - '0');
+    }
+    if (i == 0 || (i < len && buf[i] != ' '))
+    {
+        return -1;
     }
-    return -1;
+    *number = value;
+    return i;
 }
 
 /*
- * Locate the network newline (\r\n) in the given string up to
- * and including the first 'inbuf' characters. String parameters
- * may or may not be null terminated.
- * 
- * @param buf
- *      the string to locate the \r\n within
- * @param inbuf
- *      the amount of chars in buf
- * 
+ * Parse the pid at the start of buf (see parse_number()).
+ */
+static ssize_t parse_pid(const char *buf, size_t len, pid_t *pid)
+{
+    unsigned long value;
+    ssize_t used = parse_number(buf, len, INT_MAX, &value);
+    *pid = value;
+    return used;
+}
+
+/*
+ * Parse the space and the number that must come next in buf, and move buf
+ * past them.
+ *
  * @return
- *      -1:     no network newline was found 
- *      i+2:    the index of the char directly after the
- *              network newline
+ *      -1:     buf does not go on with a number
+ *      0:      the number was parsed
  */
-int find_network_newline(char *buf, int inbuf)
+static int next_number(const char **buf, size_t *len, unsigned long *number)
 {
-    for (int i = 0; i < inbuf - 1; i++)
+    ssize_t used;
+    if (*len < 2 || **buf != ' '
+        || (used = parse_number(*buf + 1, *len - 1, ULONG_MAX, number)) < 0)
     {
-        if (*(buf+i) == '\r' && *(buf+i+1) == '\n')
-        {
-            return i + 2;
-        }
+        return -1;
     }
-    return -1;
+    *buf += used + 1;
+    *len -= used + 1;
+    return 0;
 }
 
+/*
+ * Validate that the command the client received or sent to the server is one
+ * of the accepted commands, in the correct format, and parse it in a single
+ * pass. Nothing is allocated: the command only points into buf.
+ *
+ * Commands and their arguments are seperated by a single space:
+ *      run [-q] [-p class] [-l limits] jobname [args]
+ *                              the arguments are kept as they are in args,
+ *                              -q asks for the output not to be logged, -p
+ *                              for the priority class of the job and -l for
+ *                              its resource limits (cpu=50,mem=64M,pids=32)
+ *      kill pid
+ *      watch pid [raw|chunked|count]
+ *      range pid first last    lines first to last, counted from 1
+ *      last pid count
+ *      commands, jobs, joblist, exit, binary
+ *
+ * @param buf
+ *      the command the client or server received, without its newline
+ * @param len
+ *      the length of the command
+ * @param cmd
+ *      filled with the parsed command
+ *
+ * @return
+ *      CMD_INVALID:    the command was not a match
+ *      type:           the command that matched
+ */
+cmdtype_t parse_command(const char *buf, size_t len, command_t *cmd)
+{
+    size_t word = 0;
+    while (word < len && buf[word] != ' ')
+    {
+        word++;
+    }
 
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = CMD_INVALID;
+    if (word == 0)
+    {
+        return CMD_INVALID;
+    }
 
+    const cmdname_t *name = &cmd_table[CMD_HASH(buf[0], word)];
+    if (name->len != word || memcmp(name->name, buf, word) != 0)
+    {
+        return CMD_INVALID;
+    }
 
+    /* Skip the space after the name, if there are arguments */
+    const char *rest = buf + word + (word < len);
+    size_t left = len - word - (word < len);
+    int args = word < len;
+    ssize_t used;
 
+    switch (name->type)
+    {
+        case CMD_RUN: /* A jobname is needed */
+            if (!args)
+            {
+                return CMD_INVALID;
+            }
+            if (left >= 3 && memcmp(rest, "-q ", 3) == 0) /* Output unlogged */
+            {
+                cmd->opt = CMD_OPT_NOLOG;
+                rest += 3;
+                left -= 3;
+            }
+            if (left >= 3 && memcmp(rest, "-p ", 3) == 0) /* Priority class */
+            {
+                size_t len = 3;
+                while (len < left && rest[len] != ' ')
+                {
+                    len++;
+                }
+                cmd->jobclass = jobclass_parse(rest + 3, len - 3);
+                if (cmd->jobclass == CLASS_INVALID || len == left)
+                {
+                    return CMD_INVALID;
+                }
+                rest += len + 1;
+                left -= len + 1;
+            }
+            if (left >= 3 && memcmp(rest, "-l ", 3) == 0) /* Resource limits */
+            {
+                size_t len = 3;
+                while (len < left && rest[len] != ' ')
+                {
+                    len++;
+                }
+                if (len == left
+                    || cgroup_parse_limits(rest + 3, len - 3, &cmd->limits) < 0)
+                {
+                    return CMD_INVALID;
+                }
+                rest += len + 1;
+                left -= len + 1;
+            }
+            for (size_t i = 0; i < left; i++)
+            {
+                cmd->argc += rest[i] != ' ' && (i == 0 || rest[i - 1] == ' ');
+            }
+            if (cmd->argc == 0)
+            {
+                return CMD_INVALID;
+            }
+            cmd->args = rest;
+            break;
+
+        case CMD_KILL:
+        case CMD_WATCH:
+            if (!args || (used = parse_pid(rest, left, &cmd->pid)) < 0)
+            {
+                return CMD_INVALID;
+            }
+            rest += used;
+            left -= used;
+
+            if (left == 0)
+            {
+                break;
+            }
+            if (name->type == CMD_WATCH && left == 4
+                && memcmp(rest, " raw", 4) == 0)
+            {
+                cmd->opt = CMD_OPT_RAW;
+                break;
+            }
+            if (name->type == CMD_WATCH && left == 8
+                && memcmp(rest, " chunked", 8) == 0)
+            {
+                cmd->opt = CMD_OPT_CHUNKED;
+                break;
+            }
+            if (name->type == CMD_WATCH
+                && next_number(&rest, &left, &cmd->count) == 0 && left == 0)
+            {
+                break;
+            }
+            return CMD_INVALID;
+
+        case CMD_RANGE:
+        case CMD_LAST:
+            if (!args || (used = parse_pid(rest, left, &cmd->pid)) < 0)
+            {
+                return CMD_INVALID;
+            }
+            rest += used;
+            left -= used;
+
+            if (name->type == CMD_LAST
+                && next_number(&rest, &left, &cmd->count) == 0 && left == 0)
+            {
+                break;
+            }
+            if (name->type == CMD_RANGE
+                && next_number(&rest, &left, &cmd->first) == 0
+                && next_number(&rest, &left, &cmd->last) == 0 && left == 0
+                && cmd->first > 0 && cmd->first <= cmd->last)
+            {
+                break;
+            }
+            return CMD_INVALID;
+
+        default: /* No arguments */
+            if (args)
+            {
+                return CMD_INVALID;
+            }
+            break;
+    }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+    cmd->type = name->type;
+    return cmd->type;
+}
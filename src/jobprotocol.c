@@ -1,29 +1,78 @@
+#define _GNU_SOURCE /* pipe2() */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
-#include <regex.h>
+#include <spawn.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "headers/serverdata.h"
 #include "headers/serverlog.h"
 #include "headers/jobcommands.h"
 #include "headers/jobprotocol.h"
+#include "headers/launcher.h"
+#include "headers/ring.h"
+#include "headers/linebuf.h"
 
 #ifndef JOBS_DIR
     #define JOBS_DIR "jobs/"
 #endif
 
+extern char **environ;
+
+/* How jobs are launched, chosen at startup */
+static launchmode_t launchmode = LAUNCH_MANAGER;
+
+/* Resource limits of every job, where a run sets none, chosen at startup */
+static joblimits_t job_limits;
+
+/* Counters for the processes the server spawned and the time it took */
+static unsigned long spawn_count;
+static unsigned long spawn_nsec;
+static unsigned long spawn_max_nsec;
+
 /*
- * Determine which of the commands ther server recieved and direct the flow to
- * execute the given command. Invalid commands are also filtered out.
+ * Choose how the "run" command launches jobs.
  *
- * @param buf
- *        the command the server recieved and is attemting to execute
- * @param validate
- *        the int value of the command (the index if appears at in the cmds list)
+ * @param mode
+ *        LAUNCH_MANAGER to fork a job manager per job, LAUNCH_DIRECT for the
+ *        server to own the jobs output pipes itself (see read_job_stream())
+ */
+void set_launch_mode(launchmode_t mode)
+{
+    launchmode = mode;
+}
+
+/*
+ * Choose the resource limits every job is run with, where its run command
+ * does not set them. Only jobs placed in cgroups are limited (see
+ * cgroup_start()).
+ *
+ * @param limits
+ *        the limits, 0 for those left unset
+ */
+void set_job_limits(const joblimits_t *limits)
+{
+    job_limits = *limits;
+}
+
+/*
+ * Direct the flow to execute the command the server recieved. Invalid commands
+ * are also filtered out. The joblist lock is taken for the commands that list,
+ * run, kill or watch jobs, and the others go without it. The caller corks the
+ * client, so the replies are written once the lock is let go of (see
+ * read_client()).
+ *
+ * @param cmd
+ *        the command the server recieved and is attemting to execute, as parsed
+ *        by parse_command()
  * @param client
  *        the client who invoked the command
  * @param joblist
@@ -36,32 +85,57 @@
  *         1:         an error occured (lib or syscall function) and the command
  *                    was not executed
  */
-int execute_command(char *buf, int validate, client_t *client, 
-                    joblist_t *joblist)
+int execute_command(command_t *cmd, client_t *client, joblist_t *joblist)
 {
-    switch(validate)
+    int result = -1;
+
+    switch(cmd->type)
     {
-        case 1: /* display jobs */
-            return job(client->clientfd, joblist);
-        case 2: /* run job */
-            return run_job(buf, client, joblist);
-        case 3: /* kill */
-            return kill_job(buf, client->clientfd, joblist);
-        case 4: /* watch */
-            return watch_job(buf, client, joblist);
+        case CMD_BINARY: /* binary framing */
+            return binary_mode(client);
+        case CMD_RANGE: /* lines of output */
+        case CMD_LAST:
+            return send_output(cmd, client, joblist);
+        default:
+            break;
     }
-    return -1;
+
+    pthread_mutex_lock(&joblist->lock);
+    switch(cmd->type)
+    {
+        case CMD_JOBS: /* display jobs */
+            result = job(client, joblist);
+            break;
+        case CMD_RUN: /* run job, or queue it */
+            result = run_job(cmd, client, joblist);
+            if (result < 0)
+            {
+                write_client(NULL, JOB_FAILED, client);
+            }
+            break;
+        case CMD_KILL: /* kill */
+            result = kill_job(cmd, client, joblist);
+            break;
+        case CMD_WATCH: /* watch */
+            result = watch_job(cmd, client, joblist);
+            break;
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&joblist->lock);
+    return result;
 }
 /*******************************************************************************
 *                                Jobs Command                                  *
 *******************************************************************************/
 /*
  * Prepare a list of the active jobs running on the server and write it to the
- * client who requested it. If there are no jobs currently running, write the
- * appropiate message.
+ * client who requested it. The pids are appended in place and sent as 
+ * several lines if they do not all fit in one. If there are no jobs currently
+ * running, write the appropiate message.
  *
- * @param clientfd
- *        the fd of the client who invoked the command
+ * @param client
+ *        the client who invoked the command
  * @param joblist
  *        the list of currently running jobs to parse
  *
@@ -72,24 +146,41 @@ int execute_command(char *buf, int validate, client_t *client,
  *        0:            the messages were written to the client successfully
  *        1:            an error occured and the message could not be sent
  */
-int job(int clientfd, joblist_t *joblist)
+int job(client_t *client, joblist_t *joblist)
 {
+    char queued[BUFSIZE + 1];
+    snprintf(queued, sizeof(queued), JOB_WAITING, joblist->queued);
+    if (joblist->queued > 0 && write_client(NULL, queued, client) < 0)
+    {
+        return -1;
+    }
     if (joblist->size == 0)
     {
-        return write_client(NULL, JOB_EMPTY, clientfd);
+        return write_client(NULL, JOB_EMPTY, client);
     }
     
-    char buf[BUFSIZE + 1];
-    job_t *job = joblist->head;
+    /* Leave room for the JOB_LIST around the pids */
+    char buf[BUFSIZE - sizeof(JOB_LIST) + 1];
+    size_t len = 0;
     
-    while (job)
+    for (job_t *job = joblist->head; job; job = job->next)
     {
-        sprintf(buf, "%s %d", buf, job->pid); /* error checking omitted since
-                                                the error can be skipped */
-        job = job->next;
+        char pid[16];
+        int plen = snprintf(pid, sizeof(pid), " %d", job->pid);
+
+        if (len + plen >= sizeof(buf)) /* Line is full */
+        {
+            if (write_client(JOB_LIST, buf, client) < 0)
+            {
+                return -1;
+            }
+            len = 0;
+        }
+        memcpy(buf + len, pid, plen + 1);
+        len += plen;
     }
     
-    return write_client(JOB_LIST, buf, clientfd);
+    return write_client(JOB_LIST, buf, client);
 }
 
 /*******************************************************************************
@@ -100,10 +191,10 @@ int job(int clientfd, joblist_t *joblist)
  * Locate the job that the client wants to kill and kill it, then notify the
  * client. If the job doesn't exist, the appropiate message is written instead.
  *
- * @param buf
- *      the char representation of the job's pid to kill
- * @param clientfd
- *      the fd of the client who requested the kill
+ * @param cmd
+ *      the kill command, naming the job's pid
+ * @param client
+ *      the client who requested the kill
  * @param joblist
  *      the list of jobs to find the specific job within
  *
@@ -112,10 +203,10 @@ int job(int clientfd, joblist_t *joblist)
  *      0:          the job was killed successfully
  *
  */
-int kill_job(char *buf, int clientfd, joblist_t *joblist)
+int kill_job(command_t *cmd, client_t *client, joblist_t *joblist)
 {
     pid_t jpid;
-    if ((jpid = job_exists(buf, clientfd, joblist)) > 1)
+    if ((jpid = job_exists(cmd->pid, client, joblist)) > 1)
     {
         kill(jpid, SIGINT);
         return 0;
@@ -129,10 +220,16 @@ int kill_job(char *buf, int clientfd, joblist_t *joblist)
 /*
  * Locate the job the client wants to watch and add the client to the list of
  * watchers. If the client was already watching the job, it will no longer be
- * watching.
+ * watching. A trailing "raw" or "chunked" watches the jobs output unformatted
+ * (see rawfeed_t). A client that uses binary framing is sent raw output in 
+ * FRAME_RAW frames, so it always watches chunked. A trailing count of lines
+ * has the client sent that many of the last lines the job wrote first (see
+ * replay_scrollback()). The lock of the job is held throughout, so the lines
+ * replayed and the output that follows them meet without a gap.
  *
- * @param buf
- *      the pid of the job
+ * @param cmd
+ *      the watch command, naming the pid of the job and optionally how to
+ *      watch it or how many lines to replay
  * @param client
  *      the client who invoked the command and will be appended as a watcher
  *      or removed
@@ -143,12 +240,39 @@ int kill_job(char *buf, int clientfd, joblist_t *joblist)
  *      -1:         no job was found with the given pid
  *      0:          the job was killed successfully
  */
-int watch_job(char *buf, client_t *client, joblist_t *joblist)
+int watch_job(command_t *cmd, client_t *client, joblist_t *joblist)
 {
     pid_t jpid;
-    if ((jpid = job_exists(buf, client->clientfd, joblist)) > 1) /* Job exists*/
+    if ((jpid = job_exists(cmd->pid, client, joblist)) > 1) /* Job exists*/
     {
-        printf("%d\n", add_watcher(jpid, client, joblist)); /* Errors => job not watched */
+        watchmode_t mode = WATCH_LINES;
+        if (cmd->opt == CMD_OPT_RAW)
+        {
+            mode = WATCH_RAW;
+        }
+        else if (cmd->opt == CMD_OPT_CHUNKED)
+        {
+            mode = WATCH_CHUNKED;
+        }
+        if (mode == WATCH_RAW && client->binary) /* Keep the frames intact */
+        {
+            mode = WATCH_CHUNKED;
+        }
+        job_t *job = find_job(jpid, joblist);
+        pthread_mutex_lock(&job->lock);
+        int replay = cmd->count > 0
+                     && find_watcher(client, job->watchlist) == NULL;
+
+        if (add_watcher(jpid, client, mode, joblist) < 0) /* Not watched */
+        {
+            log_debug("[SERVER] Client %d could not watch job %d\n",
+                      client->clientfd, jpid);
+        }
+        else if (replay)
+        {
+            replay_scrollback(job, client, cmd->count);
+        }
+        pthread_mutex_unlock(&job->lock);
         return 0;
     }
     return -1;
@@ -159,352 +283,696 @@ int watch_job(char *buf, client_t *client, joblist_t *joblist)
  * Determine if the job exists and is running on the server. If not, write
  * the appropiate message to teh client.
  *
- * @param buf
- *      the command contatining the pid of the job
- * @param clientfd
- *      the fd of the client who invoked the command
+ * @param jpid
+ *      the pid of the job the command named
+ * @param client
+ *      the client who invoked the command
  * @param joblist
  *      the list of the jobs to scan through
  *
  * @return
- *      Note the return value is determined by write_job in serverlog.c
+ *      Note the return value is determined by write_client in serverlog.c
  *
  *        -1:           the write failed
  *        0:            the messages were written to the client successfully
  *        1:            an error occured and the message could not be sent
  *      jpid:           the pid of the job the client requested access too
  */
-int job_exists(char *buf, int clientfd, joblist_t *joblist)
+int job_exists(pid_t jpid, client_t *client, joblist_t *joblist)
 {
-    char *ptr = strchr(buf, ' ');
-    if (!ptr)
-        return write_job(JOB_NOT_FOUND, 0, -1, NULL, clientfd);
-    
-    pid_t jpid = strtol(++ptr, NULL, 10);
+    char msg[BUFSIZE + 1];
 
     if (jpid == 0 || find_job(jpid, joblist) == NULL)
-        return write_job(JOB_NOT_FOUND, jpid, -1, NULL, clientfd);
+    {
+        sprintf(msg, JOB_NOT_FOUND, jpid);
+        return write_client(NULL, msg, client);
+    }
     return jpid;
 }
+/*******************************************************************************
+*                           Range and Last Commands                            *
+*******************************************************************************/
+
+/*
+ * Send the client lines of the output of a job, running or not, out of the
+ * spool of the job (see spool.h). The lines are found through the index of
+ * the spool and sent with sendfile(), after a SPOOL_LINES message, so finding
+ * and sending them costs the same however much output the job wrote. The
+ * joblist lock is only held to find a job that is still running, whose spool
+ * is flushed under the lock of the job alone.
+ *
+ * @param cmd
+ *      the range command, naming the job and the first and last line, or the
+ *      last command, naming the job and how many of its last lines
+ * @param client
+ *      the client who invoked the command
+ * @param joblist
+ *      the list of jobs, to flush the spool of a job that is still running
+ *
+ * @return
+ *      -1:         the job has no spool, or the clients socket has closed
+ *      0:          the lines were sent, or the job did not write them
+ */
+int send_output(command_t *cmd, client_t *client, joblist_t *joblist)
+{
+    spoolview_t view;
+    char msg[BUFSIZE + 1];
+
+    pthread_mutex_lock(&joblist->lock);
+    job_t *job = find_job(cmd->pid, joblist);
+    if (job != NULL) /* Kept until its lock is let go of (see free_job()) */
+    {
+        pthread_mutex_lock(&job->lock);
+    }
+    pthread_mutex_unlock(&joblist->lock);
+
+    if (job != NULL) /* Some of its output may still be buffered */
+    {
+        spool_flush(&job->spool);
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (cmd->pid == 0 || spool_open(&view, cmd->pid) < 0)
+    {
+        sprintf(msg, JOB_NOT_FOUND, cmd->pid);
+        write_client(NULL, msg, client);
+        return -1;
+    }
+
+    unsigned long lines = view.header->lines;
+    unsigned long first = cmd->first;
+    unsigned long last = cmd->last < lines ? cmd->last : lines;
+    if (cmd->type == CMD_LAST)
+    {
+        first = cmd->count < lines ? lines - cmd->count + 1 : 1;
+        last = lines;
+    }
+    if (first > last)
+    {
+        spool_release(&view);
+        snprintf(msg, sizeof(msg), SPOOL_EMPTY, cmd->pid, lines);
+        return write_client(NULL, msg, client) < 0 ? -1 : 0;
+    }
+
+    uint64_t start = spool_offset(&view, first - 1);
+    uint64_t end = spool_offset(&view, last);
+    int outfd = view.outfd;
+    view.outfd = -1;
+    spool_release(&view);
+
+    snprintf(msg, sizeof(msg), SPOOL_LINES, first, last, lines, cmd->pid);
+    if (write_client(NULL, msg, client) < 0)
+    {
+        close(outfd);
+        return -1;
+    }
+    return send_file(client, outfd, start, end - start, cmd->pid);
+}
+
+/*******************************************************************************
+*                              Binary Command                                  *
+*******************************************************************************/
+
+/*
+ * Switch the client to binary framing. The switch is acknowledged with 
+ * BINARY_ON, the last text the client is sent: every message that follows is
+ * a frame (see frame.h), and lines of job output are framed as the job wrote
+ * them. The commands the client sends stay text (see start_binary()).
+ *
+ * @param client
+ *      the client who invoked the command
+ *
+ * @return
+ *      -1:         the clients socket has closed
+ *      0:          the client now uses binary framing
+ */
+int binary_mode(client_t *client)
+{
+    return start_binary(client);
+}
+
 /*******************************************************************************
 *                              Run Command                                     *
 *******************************************************************************/
 
 /*
- * Parse the jobname and args, set-up job manager and pipe and prepare to launch
- * the job. Validity of the command is checked here.s
+ * Ask the launcher to launch the job the run command names (see launcher.c).
+ * The jobname and args are split into an argument list by the launcher. The worker
+ * does not wait for the job: once the launcher replies, the job is added to
+ * the joblist with the client as its first watcher (see read_launcher()).
  *
- * @param buf 
- *      the command the user requested, to be parsed
+ * Once the limit of jobs run at once is reached, the run waits in the
+ * admission queue instead and the client is told where it stands in the
+ * order runs are admitted in (see queue_position()). It is launched once a
+ * job finishes (see admit_jobs()).
+ *
+ * The limits the run sets are filled in with those of the server. A run
+ * that sets limits is declined unless jobs are placed in cgroups.
+ *
+ * @param cmd
+ *      the run command the user requested
  * @param client
  *      the client who invoked the command and will be set as the first watcher
  * @param joblist 
  *      the list to append the new job too, given it succeeds
  *
  * @return
- *      -1:         an error occurred and the job could not be created
- *      0:          the job was successfully created and appended
+ *      -1:         an error occurred and the job could not be launched
+ *      0:          the job is being launched, or waits in the queue
+ *      1:          the queue is full, or the run set limits that can not
+ *                  be enforced, and the run was declined
  *
  */
-int run_job(char *buf, client_t *client, joblist_t *joblist)
+int run_job(command_t *cmd, client_t *client, joblist_t *joblist)
 {
-    int size;
-    if ((size = arg_count(buf)) == 1 || joblist->size >= MAX_JOBS) 
+    int flags = cmd->opt == CMD_OPT_NOLOG ? JOB_NOLOG : 0;
+    jobclass_t jobclass = cmd->jobclass;
+    joblimits_t limits = cmd->limits;
+    if (cmd->argc == 0) 
     {
         return -1;
     }
+    if (cgroup_has_limits(&limits) && !cgroup_enabled())
+    {
+        write_client(NULL, JOB_NOLIMITS, client);
+        return 1;
+    }
+    cgroup_merge_limits(&limits, &job_limits);
 
-    char *arg;
-    char args[size][BUFSIZE + 1];
-    char *argv[size];
-    int i = 0;
-
-    arg = strtok(buf, " ");
-    arg = strtok(NULL, " ");
-    while (arg && i < size) /* Parse the buf to get jobname + args */
+    /* A run waits behind any queued one, to be admitted by its share */
+    if (joblist->size + joblist->launching >= joblist->limit
+        || joblist->queuehead != NULL)
     {
-        if (strcpy(args[i], arg) < 0)
+        size_t position = queue_run(cmd->args, flags, jobclass, &limits,
+                                    client, joblist);
+        if (position == 0)
         {
-            return -1;
+            write_client(NULL, JOB_OVERLOAD, client);
+            return 1;
         }
-        argv[i] = args[i];
-        arg = strtok(NULL, " ");
-        i++;
+        char msg[BUFSIZE + 1];
+        snprintf(msg, sizeof(msg), QUEUE_POSITION, position);
+        write_client(NULL, msg, client);
+        return 0;
     }
-    argv[i] = NULL; /* Null terminate for execvp */
-    
-    int fd[2];
-    pid_t mpid;
-    
-    if (pipe(fd) < 0 || (mpid = fork()) < 0)
+
+    if (launcher_request(client->fdset->launcher, launchmode, cmd->args,
+                         flags, jobclass, &limits, client) < 0)
     {
         return -1;
     }
+    joblist->launching++;
+    charge_share(client, jobclass, joblist);
+    jobclass_record_wait(jobclass, NULL);
+    return 0;
+}
 
-    if (mpid == 0)
-    {
-        close(fd[0]);
-        generate_job_and_manager(fd[1], argv);
-    }
-    
-    if (mpid > 0)
+/*
+ * Launch the runs waiting in the admission queue, by weighted fair share
+ * across the clients who ran them (see dequeue_run()), while there are fewer
+ * jobs than the limit. Called whenever a job finishes or a launch
+ * ends, by any worker: each run is sent to the launcher through the worker of
+ * the client who ran it, which polls the job once it is launched. The caller
+ * must hold the joblist lock.
+ *
+ * @param joblist
+ *        the list of currently running jobs, holding the queue
+ */
+void admit_jobs(joblist_t *joblist)
+{
+    queued_t *run;
+    while (joblist->size + joblist->launching < joblist->limit
+           && (run = dequeue_run(joblist)) != NULL)
     {
-        close(fd[1]);
-        /* Job couldnt be created */
-        if (build_job(fd[0], mpid, client, joblist) < 0) 
+        if (launcher_request(run->client->fdset->launcher, launchmode,
+                             run->args, run->flags, run->jobclass,
+                             &run->limits, run->client) < 0)
+        {
+            write_client(NULL, JOB_FAILED, run->client);
+        }
+        else
         {
-            kill(SIGINT, mpid); /* Avoid stray processes */
-            wait(NULL);
-            return -1;
+            joblist->launching++;
+            jobclass_record_wait(run->jobclass, &run->since);
         }
+        free_queued(run);
     }
-    return 0;
 }
 
 /*
- * Read from the pipe connecting the server (this) and the job manager to 
- * retrieve the job's pid (ususally the managers pid + 1). Once the pid is
- * retrieved, add the new job to the joblist and set the client as its first
- * watcher. If the read times out, then kill both the job manager and the job.
- *
- * @param readfd
- *        the read fd of the pipe connecting the job manager and the server
- * @param mpid
- *          the pid of the job manager's process
- * @param client
- *        the client who requested the job creation and thus the first watcher
- *         of the jobs output
- * @param joblist
- *        the list of currently running job to append th enew job too
+ * Spawn the job in a cgroup of its own, named by the pid of the job manager
+ * and holding its limits (see cgroup_create()). The job enters the cgroup
+ * itself before it execs (see spawn_job()), so the manager is never counted
+ * against the limits or billed for the job, and the job is accounted from its
+ * first instruction. If jobs are not placed in cgroups, the job is spawned as
+ * it is.
+ *
+ * @param argv jobclass stdoutfd stderrfd jpid
+ *        as taken by spawn_job()
+ * @param limits
+ *        the resource limits the job is run with
+ * @param cgroup
+ *        set to the path of the cgroup of the job, left "" if it has none
  *
  * @return
- *        -1:         an error occured, the job was either not appended, the client
- *                    was not appended to the jobs watch list or a syscall failed.
- *                    No job will be created as such.
- *        0:          the job was created, appended, and watched successfully
+ *        -1:         the cgroup could not be set up, or the job could not be
+ *                    spawned
+ *        0:          the job is running
+ *        1:          the job could not be given the priorities of its class
  */
-int build_job(int readfd, pid_t mpid, client_t *client, joblist_t *joblist)
-{    
-    pid_t jpid;
-    
-    /* Avoid stray/zombie process */
-    if (read(readfd, &jpid, sizeof(int)) != sizeof(int)
-        || add_job(jpid, mpid, readfd, client, joblist) < 0)
+static int spawn_in_cgroup(char *argv[], jobclass_t jobclass,
+                           const joblimits_t *limits, int stdoutfd,
+                           int stderrfd, char cgroup[CGROUP_PATH], pid_t *jpid)
+{
+    if (!cgroup_enabled())
     {
-        kill(mpid, SIGINT);
-        waitpid(mpid, NULL, 0);
+        return spawn_job(argv, jobclass, -1, stdoutfd, stderrfd, jpid);
+    }
+    if (cgroup_create(cgroup, CGROUP_PATH, getpid(), limits) < 0)
+    {
+        perror("[SERVER] cgroup");
         return -1;
     }
-    return 0;
+
+    int procsfd = cgroup_procs(cgroup);
+    if (procsfd < 0)
+    {
+        perror("[SERVER] cgroup");
+        cgroup_remove(cgroup);
+        return -1;
+    }
+
+    int spawned = spawn_job(argv, jobclass, procsfd, stdoutfd, stderrfd, jpid);
+
+    close(procsfd);
+    if (spawned != 0)
+    {
+        cgroup_remove(cgroup);
+    }
+    return spawned;
 }
 
 /*
  * Setup both the jov manager and the job in seperate processes. The job manager
  * will first write the job processes pid to the server, then begin reading all
- * output generated by the job, redirecting it to the server in a valid format. 
- * The job process will prepare to send the jobs stdout and stderr to the job 
- * manager and finally execute the job executable.
+ * output generated by the job, passing it to the server through the jobs ring.
+ * The job is spawned with its stdout and stderr sent to the job manager (see
+ * spawn_job()), in a cgroup of its own if jobs are placed in cgroups (see
+ * spawn_in_cgroup()).
+ *
+ * The manager is forked from the launcher, so it leaves through _exit(): 
+ * flushing the stdio buffers it inherited would duplicate their output.
  *
  * @param writefd
- *        the file descriptor that the job manager uses to communicate to the 
- *        server
+ *        the pipe the job manager reports the jobs pid through, or -1 if the
+ *        job could not be given the priorities of its class, which it then
+ *        keeps open so it can tell if the server has gone away
+ * @param ringfds
+ *        the fds of the ring the output is passed through (see ring_open())
  * @param argv
  *        the argument list to run the job, as required by execvp()
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param limits
+ *        the resource limits the job is run with
  *
  * @exit
  *        -1:         an error occured at any stage and the job and/or job 
  *                    manager could not be created
  */
-void generate_job_and_manager(int writefd, char *argv[])
+void generate_job_and_manager(int writefd, int ringfds[RING_FDS], char *argv[],
+                              jobclass_t jobclass, const joblimits_t *limits)
 {
     int stdoutfd[2];
     int stderrfd[2];
+    char cgroup[CGROUP_PATH] = "";
     pid_t jpid;
+    int spawned = -1;
 
-    if (pipe(stdoutfd) < 0 || pipe(stderrfd) < 0 || (jpid = fork()) < 0)
+    ring_t *ring = ring_attach(ringfds);
+    if (ring != NULL && pipe2(stdoutfd, O_CLOEXEC) == 0
+        && pipe2(stderrfd, O_CLOEXEC) == 0)
     {
-        exit(-1);
+        spawned = spawn_in_cgroup(argv, jobclass, limits, stdoutfd[1],
+                                  stderrfd[1], cgroup, &jpid);
     }
-
-    if (jpid == 0) /* Job to be process */
+    if (spawned != 0)
     {
-        close(stdoutfd[0]);
-        close(stderrfd[0]);
-        close(writefd);
-        execute(stdoutfd[1], stderrfd[1], argv);
-    }
-    
-    if (jpid > 0) /* Job manager */
-    {
-        close(stdoutfd[1]);
-        close(stderrfd[1]);
-
-        if (write(writefd, &jpid, sizeof(int)) < 0) /*Inform server of jobs pid*/
+        if (spawned > 0) /* Tell the launcher the class is why */
         {
-            kill(jpid, SIGINT);
-            exit(-1);
-        }    
-        forward_job_output(stdoutfd[0], stderrfd[0], writefd, jpid);
+            jpid = -1;
+            write(writefd, &jpid, sizeof(int));
+        }
+        _exit(-1);
     }
-    exit(-1);    
+
+    close(stdoutfd[1]);
+    close(stderrfd[1]);
+
+    if (write(writefd, &jpid, sizeof(int)) < 0) /*Inform server of jobs pid*/
+    {
+        kill(jpid, SIGINT);
+        _exit(-1);
+    }    
+    forward_job_output(stdoutfd[0], stderrfd[0], ring, writefd, jpid,
+                       cgroup[0] != '\0' ? cgroup : NULL);
+    _exit(-1);    
 }
 
 /*
- * Read the jobs output, determine the correct prepend (JOB_STDOUT or JOB_STDERR)
- * and forward it through the jobs pipe to the server. If the job exits by from
- * a signal, notify the server. If the job exits normally, report the exit status
- * to the server. All messages read from the server are logged in both stdout
- * and the server.log. Once the job is finished, exit with status code 0.
+ * Read the jobs output and pass each line to the server as a record in the
+ * jobs ring, tagged with the stream it came from. Lines are not bounded by
+ * BUFSIZE: a line only has to fit a record (RING_MAX_RECORD), a longer one is
+ * passed in pieces. Once both of the jobs pipes have closed, the job is reaped
+ * and its exit status (or the signal that ended it) is passed as the last
+ * record, after what the job used if it ran in a cgroup, whose cgroup is then
+ * removed. If the server has gone away, the job is interrupted.
  *
  * @param stdoutfd
  *        the read pipe connected to the jobs stdout
  * @param stderrfd
  *        the read pipe connected to the jobs stderr
+ * @param ring
+ *        the ring shared with the server
  * @param writefd
- *        the write pipe connected to the server via the job struct
+ *        the pipe to the server, used to tell if the server has gone away
  * @param jpid
  *        the pid of the job that output is being forwarded from
+ * @param cgroup
+ *        the cgroup of the job, NULL if it has none
  *
  * @exit
- *        1:              an error occured and the job must be killed to avoid
- *                        stray processes
+ *        1:              the lines could not be buffered
  *        0:              the jobs output and exit status has been reported
- *                        successfully
  */
-int forward_job_output(int stdoutfd, int stderrfd, int writefd, int jpid)
+int forward_job_output(int stdoutfd, int stderrfd, ring_t *ring, int writefd,
+                       pid_t jpid, const char *cgroup)
 {
-    char buf[BUFSIZE+1];
-    char *after = buf;
-    char *prepend;
-    int inbuf, nbytes, status;
-    int room = BUFSIZE;
-    int fd[] = { stdoutfd, stderrfd };
-    int maxfd = stdoutfd > stderrfd ? stdoutfd : stderrfd;    
-    int done;
-
-    /* Prepare to read both stdout and stderr */
-    fd_set all_fds, listen_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(fd[0], &all_fds);
-    FD_SET(fd[1], &all_fds);
+    struct pollfd fds[] = {
+        { .fd = stdoutfd, .events = POLLIN },
+        { .fd = stderrfd, .events = POLLIN }
+    };
+    rectype_t types[] = { REC_STDOUT, REC_STDERR };
+    char *buf[] = { malloc(RING_MAX_RECORD + 1), malloc(RING_MAX_RECORD + 1) };
+    linebuf_t lines[2];
+    int open = 2;
+    int lost = 0;
+    int status;
 
-    /* Loop until the job has exited */
-    while ((done = waitpid(jpid, &status, WNOHANG)) == 0)
+    if (buf[0] == NULL || buf[1] == NULL)
     {
-        listen_fds = all_fds;
-
-        int nready = select(maxfd, &listen_fds, NULL, NULL, NULL);
+        kill(jpid, SIGINT);
+        _exit(1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        linebuf_init(&lines[i], buf[i], RING_MAX_RECORD + 1);
+    }
 
-        if (nready < 0)
+    while (open > 0)
+    {
+        if (poll(fds, 2, -1) < 0)
         {
-            perror("select");
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
         }
+
         for (int i = 0; i < 2; i++) /* Check for both stdout and stderr */
         {
-            memset(buf, 0, sizeof(buf));
-            inbuf = 0;
-            after = buf;
-            nbytes = 0;
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+            {
+                continue;
+            }
+
+            size_t room;
+            char *after = linebuf_space(&lines[i], &room);
+            ssize_t nbytes = read(fds[i].fd, after, room);
+            if (nbytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nbytes > 0)
+            {
+                linebuf_fill(&lines[i], nbytes);
+            }
 
-            prepend = i == 0? JOB_STDOUT : JOB_STDERR;
+            char *line;
+            size_t len;
+            while ((line = linebuf_next(&lines[i], &len)) != NULL)
+            {
+                lost = lost || ring_push(ring, types[i], line, len,
+                                         writefd) < 0;
+            }
+
+            /* A line too long for a record, or the last line of the stream */
+            size_t pending = linebuf_pending(&lines[i]);
+            if (pending == RING_MAX_RECORD || (nbytes <= 0 && pending > 0))
+            {
+                line = linebuf_rest(&lines[i], &len);
+                lost = lost || ring_push(ring, types[i], line, len,
+                                         writefd) < 0;
+            }
+
+            if (nbytes <= 0) /* The job closed the stream */
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open--;
+            }
+        }
 
-            if (fd[i] > -1 && FD_ISSET(fd[i], &listen_fds))
+        if (lost) /* Cant forward job */
+        {
+            kill(jpid, SIGINT);
+            for (int i = 0; i < 2; i++)
             {
-                while ((nbytes = read(fd[i], after, room)) > 0)
+                if (fds[i].fd >= 0)
                 {
-                    inbuf += nbytes;
-                    int nwl;
-    
-                    /* Only accept full commands */
-                    while ((nwl = find_network_newline(buf, inbuf)) > 0) 
-                    {
-                        buf[nwl - 2] = '\0';
-                        /* Sent output formatted to server */
-                        if (write_job(prepend, jpid, -1, buf, writefd) < 0)
-                        {
-                            kill(jpid, SIGINT); /* Cant forward job */
-                        }
-                        inbuf -= nwl;
-                        memmove(buf, buf+nwl, inbuf);
-                    }
-                    after = buf + inbuf;
-                    room = BUFSIZE- - inbuf;
+                    close(fds[i].fd);
                 }
             }
+            break;
         }
     }
 
+    while (waitpid(jpid, &status, 0) < 0 && errno == EINTR);
+
+    if (cgroup != NULL)
+    {
+        jobusage_t usage;
+        cgroup_usage(cgroup, &usage);
+        ring_push(ring, REC_USAGE, &usage, sizeof(usage), writefd);
+        cgroup_remove(cgroup);
+    }
+
     if (WIFEXITED(status)) /* Job exited indepenendly */
     {
         int exit_status = WEXITSTATUS(status);
-        write_job(JOB_EXIT, jpid, exit_status, NULL, writefd);
+        ring_push(ring, REC_EXIT, &exit_status, sizeof(int), writefd);
     }
     else /* Kill command was executed */
     {
-        write_job(JOB_SIGNAL, jpid, -1, NULL, writefd);
+        ring_push(ring, REC_SIGNAL, NULL, 0, writefd);
     }
-    close(writefd);
-    close(fd[0]);
-    close(fd[1]);
-    exit(0);
+    _exit(0);
 }
 
 /*
- * Replace the stdoutfd and stderrfd pipes with the jobs stdout and stderr and
- * execute the job. If the job was invalid, or any error occured, this will
- * notify the job manager to handle the case.
+ * Spawn the job with vfork(), and have it take the priorities of its class
+ * (see jobclass_apply()) and enter its cgroup, by writing itself to the
+ * cgroup.procs of the cgroup, before it execs. posix_spawn() can not do
+ * anything in the job before the exec, while vfork() still shares the memory
+ * of the caller instead of copying it. Every signal is blocked around the
+ * vfork(), so no handler runs in the job on the stack of the caller, and the
+ * job reports why it failed through the memory it shares.
  *
+ * @param job_exe argv
+ *        the executable of the job and its arguments
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param procsfd
+ *        the cgroup.procs file of the cgroup of the job (see cgroup_procs()),
+ *        -1 if it is not placed in one
  * @param stdoutfd stderrfd
- *        the two pipes connected to the job manager used to send the jobs stdout
- *        and stderr too
- *
- * @param argv
- *        an array of arguments for execvp(), with argv[0] set as the jobs name,
- *        and argv[length - 1] as NULL, as required by execvp().
+ *        the write ends of the pipes to send the jobs stdout and stderr to
+ * @param jpid
+ *        set to the pid of the job
  *
- * @exit
- *        -1:         the final stages of the job creation encountered an error,
- *                    a syscall or library function failed, or the job does not
- *                    exist
+ * @return
+ *        -1:         the job could not enter its cgroup or be executed,
+ *                    errno is set
+ *        0:          the job is running
+ *        1:          the job could not be given the priorities of its class,
+ *                    and was not run
  */
-void execute(int stdoutfd, int stderrfd, char *argv[])
+static int vfork_job(const char *job_exe, char *argv[], jobclass_t jobclass,
+                     int procsfd, int stdoutfd, int stderrfd, pid_t *jpid)
 {
-    if (dup2(stdoutfd, fileno(stdout)) == -1
-        || dup2(stderrfd, fileno(stderr)) == -1)
+    volatile int error = 0;
+    volatile int noclass = 0;
+    sigset_t all;
+    sigset_t old;
+
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+
+    pid_t pid = vfork();
+    if (pid == 0)
     {
-        exit(-1);
+        sigset_t none;
+        sigemptyset(&none);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+
+        if (jobclass_apply(jobclass) < 0)
+        {
+            noclass = 1;
+            error = errno;
+        }
+        else if ((procsfd >= 0 && write(procsfd, "0", 1) != 1)
+                 || dup2(stdoutfd, STDOUT_FILENO) < 0
+                 || dup2(stderrfd, STDERR_FILENO) < 0
+                 || sigprocmask(SIG_SETMASK, &none, NULL) < 0
+                 || execve(job_exe, argv, environ) < 0)
+        {
+            error = errno;
+        }
+        _exit(127);
     }
 
-    close(stdoutfd);
-    close(stderrfd);
+    int forked = errno;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0)
+    {
+        errno = forked;
+        return -1;
+    }
+    if (error != 0)
+    {
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+        errno = error;
+        return noclass ? 1 : -1;
+    }
+    *jpid = pid;
+    return 0;
+}
 
+/*
+ * Spawn the job with the stdoutfd and stderrfd pipes as its stdout and stderr.
+ * posix_spawn() creates the process without copying the callers page tables
+ * (glibc uses clone(CLONE_VM | CLONE_VFORK)), so the cost of launching a job
+ * does not grow with the memory of the process launching it. A job with
+ * priorities to take or a cgroup to enter has to do so before it execs, which
+ * posix_spawn() can not do, so it is spawned by vfork_job() instead. The job
+ * starts with no signals blocked and SIGINT and SIGPIPE handled by default,
+ * since the launcher ignores both.
+ *
+ * @param argv
+ *        an array of arguments for the job, with argv[0] set as the jobs name,
+ *        and argv[length - 1] as NULL
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param procsfd
+ *        the cgroup.procs file of the cgroup the job is placed in, -1 if it
+ *        is not placed in one
+ * @param stdoutfd stderrfd
+ *        the write ends of the pipes to send the jobs stdout and stderr to
+ * @param jpid
+ *        set to the pid of the job
+ *
+ * @return
+ *        -1:         the job could not be spawned, a syscall failed or the job
+ *                    does not exist
+ *        0:          the job is running
+ *        1:          the job could not be given the priorities of its class,
+ *                    and was not run
+ */
+int spawn_job(char *argv[], jobclass_t jobclass, int procsfd, int stdoutfd,
+              int stderrfd, pid_t *jpid)
+{
     char job_exe[BUFSIZE + 1];
-    if (sprintf(job_exe, "%s%s", JOBS_DIR, argv[0]) < 0)
+    if (snprintf(job_exe, sizeof(job_exe), "%s%s", JOBS_DIR, argv[0]) < 0)
     {
-        exit(-1);
+        return -1;
+    }
+
+    if (procsfd >= 0 || jobclass_sets_priority(jobclass))
+    {
+        return vfork_job(job_exe, argv, jobclass, procsfd, stdoutfd, stderrfd,
+                         jpid);
     }
-    execvp(job_exe, argv);
-    exit(-1);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    sigset_t deflt;
+
+    sigemptyset(&none);
+    sigemptyset(&deflt);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_adddup2(&actions, stdoutfd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stderrfd, STDERR_FILENO);
+    sigaddset(&deflt, SIGINT);
+    sigaddset(&deflt, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &deflt);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK
+                                    | POSIX_SPAWN_SETSIGDEF);
+
+    int error = posix_spawn(jpid, job_exe, &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return error == 0 ? 0 : -1;
 }
 
 /*
- * Find and return the total number of words in the given buf, each seperated
- * by a space. This is used to build an argv set for execvp().
+ * Record how long it took to launch a job, from the request to the launchers
+ * reply, and log it along with the amount of jobs running so the latency can
+ * be followed as the server grows.
  *
- * Example: "run randprint 1" return 3, "run randprint" returns 2
+ * @param start
+ *        when the request was sent
+ * @param pid
+ *        the pid of the job
+ * @param joblist
+ *        the list of currently running jobs
+ */
+void record_spawn(struct timespec *start, pid_t pid, joblist_t *joblist)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long nsec = (end.tv_sec - start->tv_sec) * 1000000000UL
+                         + end.tv_nsec - start->tv_nsec;
+    __atomic_fetch_add(&spawn_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spawn_nsec, nsec, __ATOMIC_RELAXED);
+
+    unsigned long max = __atomic_load_n(&spawn_max_nsec, __ATOMIC_RELAXED);
+    while (nsec > max && !__atomic_compare_exchange_n(&spawn_max_nsec, &max,
+                        nsec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    char msg[BUFSIZE + 1];
+    snprintf(msg, sizeof(msg), SPAWN_TIME, pid, nsec / 1000, joblist->size);
+    log_message(msg);
+}
+
+/*
+ * Format the amount of jobs launched and the average and worst time it took,
+ * reported on shutdown.
  *
  * @param buf
- *        the string to count args within
- *
- * @return
- *        1:            there were no words found
- *        count:        the total number of words found +1.    
- */    
-int arg_count(char *buf)
+ *        the buffer to format the statistics into
+ * @param size
+ *        the size of buf
+ */
+void spawn_report_stats(char *buf, size_t size)
 {
-    int count = 0;
-    char ch = ' ';
-    for (; *buf; count += (*buf++ == ch));
-    return count++;
+    unsigned long count = spawn_count > 0 ? spawn_count : 1;
+    snprintf(buf, size, SPAWN_STATS, spawn_count, spawn_nsec / count / 1000,
+             spawn_max_nsec / 1000);
 }
-
@@ -9,6 +9,11 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 
 #include "headers/socket.h"
@@ -16,14 +21,48 @@
 #include "headers/jobcommands.h"
 #include "headers/serverdata.h"
 #include "headers/serverlog.h"
+#include "headers/iobackend.h"
+#include "headers/launcher.h"
+#include "headers/ring.h"
+#include "headers/logger.h"
 
 #define QUEUE_LENGTH 5
+#define MAX_EVENTS 64
 
-static int active = 1;
+/*
+ * Store a worker thread of the server. Every worker runs its own event loop 
+ * (see run_worker()) on its own listener, and owns the clients it accepts. The
+ * joblist is shared between all workers.
+ *
+ * @data thread
+ *        the thread running the worker (unused for worker 0, the main thread)
+ * @data listenfd
+ *        the listener the worker accepts clients on
+ * @data shutdownfd
+ *        the eventfd shared by all workers, signalled on teardown
+ * @data fdset
+ *        the epoll instance of the worker
+ * @data clientlist
+ *        the clients the worker has accepted
+ * @data joblist
+ *        the jobs running on the server
+ */
+typedef struct worker
+{
+    pthread_t thread;
+    int listenfd;
+    int shutdownfd;
+    connections_t *fdset;
+    clientlist_t *clientlist;
+    joblist_t *joblist;
+
+} worker_t;
+
+static volatile sig_atomic_t active = 1;
 
 /*
  * When the server receives the kill signal, begin tear down phase
- * by breaking the 'server loop' in main().
+ * by breaking the 'server loop' in run_worker().
  * 
  * @param sig
  *        Supported signals are only SIGINT (ctrl-c)
@@ -51,21 +90,162 @@ void setup_client(int listenfd, clientlist_t *clientlist)
     if (clientfd < 0 || add_client(clientfd, clientlist) < 0)
     {
         fprintf(stderr, CLIENT_ERROR);
+        if (clientfd >= 0)
+        {
+            close(clientfd);
+        }
         return; /* Server continues */
     }
 
-    if (write_client(NULL, CLIENT_ACCPT, clientfd) < 0
-        || write_client(NULL, CLIENT_WELCOME, clientfd) < 0)
+    client_t *client = clientlist->end; /* Newest client */
+    if (write_client(NULL, CLIENT_ACCPT, client) < 0
+        || write_client(NULL, CLIENT_WELCOME, client) < 0)
+    {
+        return;
+    }
+}
+
+/*
+ * Read the output of a job like read(), handing it to the jobs raw and chunked
+ * watchers on the way (see feed_watchers()). If the job has no line watchers 
+ * the output is never read into buf, so the pipe is fed from until it is
+ * empty, or until a watcher stalls the job.
+ *
+ * @param job
+ *        the job to read output from
+ * @param fd
+ *        the pipe to read, the jobs stdout
+ * @param buf room
+ *        where the output is read to, and its size
+ * @param joblist
+ *        the list of active jobs on the server
+ * @param drain
+ *        keep feeding even if the job is stalled
+ *
+ * @return
+ *        -1:               the pipe could not be read (errno is set)
+ *        0:                the pipe has closed
+ *        n:                n bytes were read into buf
+ */
+static ssize_t read_output(job_t *job, int fd, char *buf, size_t room,
+                            joblist_t *joblist, int drain)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&job->lock);
+        watchlist_t *watchlist = job->watchlist;
+        int raw = watchlist->nraw > 0;
+        int lines = watchlist->size > watchlist->nraw;
+        ssize_t nbytes = raw ? feed_watchers(job, fd, buf, room) : 0;
+        int stalled = job->stalled;
+        pthread_mutex_unlock(&job->lock);
+
+        if (!raw)
+        {
+            return read(fd, buf, room);
+        }
+        if (nbytes < 0 || (nbytes > 0 && lines))
+        {
+            return nbytes;
+        }
+        if (nbytes > 0)
+        {
+            if (stalled && !drain)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+
+        /* Nothing was waiting, tell an empty pipe from a closed one */
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+        {
+            continue;
+        }
+        if (pfd.revents & (POLLHUP | POLLERR))
+        {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+}
+
+/*
+ * Redirect a line the job manager passed on to all of the jobs watchers, as
+ * is. The caller must hold the lock of the job.
+ *
+ * @param job
+ *        the job the line came from
+ * @param record
+ *        the record holding the line
+ */
+static void write_record_line(job_t *job, record_t *record)
+{
+    jobmsg_t msg = {
+        .type = FRAME_OUTPUT,
+        .stream = record->type == REC_STDOUT ? FRAME_STDOUT : FRAME_STDERR,
+        .line = record->data,
+        .len = record->len
+    };
+    write_to_watchers(&msg, job);
+}
+
+/*
+ * Add a line of stdout the job manager passed on to the output batched for
+ * the watchers that watch the job raw or chunked, so a run of lines is fed to
+ * them at once (see write_to_feeds()). The batch is fed first if the line does
+ * not fit, and a line longer than the whole batch is fed on its own. The 
+ * caller must hold the lock of the job.
+ *
+ * @param job
+ *        the job the line came from
+ * @param record
+ *        the record holding the line
+ * @param raw inraw
+ *        the batch, RAWBUF_SIZE bytes, and the amount of bytes in it
+ */
+static void batch_record_line(job_t *job, record_t *record, char *raw,
+                              size_t *inraw)
+{
+    size_t len = record->len + 2;
+    if (*inraw + len > RAWBUF_SIZE)
+    {
+        write_to_feeds(raw, *inraw, job);
+        *inraw = 0;
+    }
+
+    if (len > RAWBUF_SIZE)
     {
+        char *line = malloc(len);
+        if (line != NULL)
+        {
+            memcpy(line, record->data, record->len);
+            memcpy(line + record->len, "\r\n", 2);
+            write_to_feeds(line, len, job);
+            free(line);
+        }
         return;
     }
+    memcpy(raw + *inraw, record->data, record->len);
+    memcpy(raw + *inraw + record->len, "\r\n", 2);
+    *inraw += len;
 }
 
 /*
- * Read the output of the job forwarded by its manager and redirect it to all
- * of the jobs watchers. If the job exits, remove it from the joblist and notify
- * its watchers. If the client closes during the middle of watching a job,
- * remove it from the jobs watcherlist and notify the server to close its socket.
+ * Read the output of the job from the ring its manager passes it through, and
+ * redirect it to all of the jobs watchers. The records are read in place, out
+ * of the shared memory, and the ring is drained until it is empty, or until a
+ * watcher stalls the job (see queue_job_output()), in which case the rest is
+ * left in the ring and the manager waits once it fills up. If the client
+ * closes during the middle of watching a job, remove it from the jobs 
+ * watcherlist and notify the server to close its socket.
+ *
+ * The lock of the job is held while the records are fanned out, as the
+ * watchers may belong to other workers, while the joblist is left free for
+ * them. Only this worker polls the ring, so it is its only consumer.
  *
  * @param job
  *        the job to read output from
@@ -73,56 +253,436 @@ void setup_client(int listenfd, clientlist_t *clientlist)
  *        the list of active jobs on the server
  *
  * @return
- *        -1:               jobs pipe has closed, thus job is finished
+ *        -1:               the job has finished, its exit was forwarded (or
+ *                          its manager exited without one)
  *        0:                job output was read and forwarded successfully
  */
-int read_write_job(job_t *job, joblist_t *joblist)
+int read_job_ring(job_t *job, joblist_t *joblist)
 {
-    char buf[BUFSIZE+1];
-    char *after = buf;
-    int room = BUFSIZE;
-    int inbuf = 0;
+    uint64_t count;
+    if (io_read(job->ring->fds[RING_DATAFD], &count, sizeof(count),
+                &job->ahead) < 0 && errno != EAGAIN)
+    {
+        perror("[SERVER] eventfd");
+    }
+
+    char raw[RAWBUF_SIZE];
+    size_t inraw = 0;
+    int finished = 0;
+    record_t *record;
+
+    pthread_mutex_lock(&job->lock);
+    while (!finished && (record = ring_peek(job->ring)) != NULL)
+    {
+        if (record->type == REC_STDOUT || record->type == REC_STDERR)
+        {
+            write_record_line(job, record);
+            if (record->type == REC_STDOUT && job->watchlist->nraw > 0)
+            {
+                batch_record_line(job, record, raw, &inraw);
+            }
+        }
+        else if (record->type == REC_USAGE) /* Reported with the exit */
+        {
+            memcpy(&job->usage, record->data, sizeof(jobusage_t));
+            job->accounted = 1;
+        }
+        else /* The job has exited, feed what is batched before the exit */
+        {
+            if (inraw > 0)
+            {
+                write_to_feeds(raw, inraw, job);
+                inraw = 0;
+            }
+
+            jobmsg_t msg = { .type = FRAME_SIGNAL };
+            msg.usage = job->accounted ? &job->usage : NULL;
+            if (record->type == REC_EXIT)
+            {
+                msg.type = FRAME_EXIT;
+                memcpy(&msg.status, record->data, sizeof(int));
+            }
+            write_to_watchers(&msg, job);
+            finished = 1;
+        }
+        ring_pop(job->ring, record);
+
+        if (job->stalled) /* A watcher fell behind, leave the rest */
+        {
+            break;
+        }
+    }
+    if (inraw > 0)
+    {
+        write_to_feeds(raw, inraw, job);
+    }
+
+    /* The manager is gone and left nothing behind */
+    if (job->ended && ring_peek(job->ring) == NULL)
+    {
+        finished = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return finished ? -1 : 0;
+}
+
+/*
+ * Fan a single line of a directly launched jobs output out to its watchers,
+ * the same as a line passed on by a job manager (see write_record_line()). 
+ * The caller must hold the lock of the job.
+ *
+ * @param stream
+ *        the stream the line was read from
+ * @param line
+ *        the line, without its network newline
+ * @param len
+ *        the length of the line
+ */
+static void write_stream_line(jobstream_t *stream, char *line, size_t len)
+{
+    jobmsg_t msg = {
+        .type = FRAME_OUTPUT,
+        .stream = stream->stream == STREAM_STDOUT ? FRAME_STDOUT : FRAME_STDERR,
+        .line = line,
+        .len = len
+    };
+    write_to_watchers(&msg, stream->job);
+}
+
+/*
+ * Read the stdout or stderr pipe of a directly launched job and redirect each
+ * complete line to all of the jobs watchers. An incomplete line stays in the
+ * stream until the rest of it arrives, and a line that fills the whole buffer
+ * is sent as is. The pipe is read without a lock, since only this worker
+ * polls it, and the lock of the job is held while each chunk of output is
+ * fanned out. Reading stops once a watcher stalls the job, unless the job has
+ * exited and its pipes are being drained, and after a read that did not fill
+ * the buffer, as the pipe is polled again if it still holds output. The first
+ * read may have been issued in a batch already (see read_ahead()).
+ *
+ * @param stream
+ *        the stream to read output from
+ * @param joblist
+ *        the list of active jobs on the server
+ * @param drain
+ *        read until the pipe is empty even if the job is stalled
+ *
+ * @return
+ *        -1:               the pipe has closed
+ *        0:                job output was read and forwarded successfully
+ */
+int read_job_stream(jobstream_t *stream, joblist_t *joblist, int drain)
+{
+    job_t *job = stream->job;
     int nbytes = 0;
-    int stat;
 
-    while (waitpid(job->mpid, &stat, WNOHANG) <= 0 &&
-            (nbytes = read(job->jobpipe, after, room)) > 0)
+    while (1)
     {
-        inbuf += nbytes;
-        int nwl;
-    
-        /* Only accept full commands */
-        while ((nwl = find_network_newline(buf, inbuf)) > 0) 
+        size_t room;
+        char *after = linebuf_space(&stream->lines, &room);
+
+        /* Only stdout is fed to raw and chunked watchers */
+        if (stream->ahead.ready) /* Read in a batch (see read_ahead()) */
+        {
+            nbytes = io_read(stream->fd, after, room, &stream->ahead);
+        }
+        else if (stream->stream == STREAM_STDOUT)
+        {
+            nbytes = read_output(job, stream->fd, after, room, joblist, drain);
+        }
+        else
         {
-            buf[nwl-2] = '\0'; /* Remove \r\n */
-            write_to_watchers(buf, job->watchlist);
-            inbuf -= nwl;
-            memmove(buf, buf+nwl, inbuf);
+            nbytes = read(stream->fd, after, room);
+        }
+        if (nbytes <= 0)
+        {
+            break;
+        }
+
+        linebuf_fill(&stream->lines, nbytes);
+        char *line;
+        size_t len;
+
+        pthread_mutex_lock(&job->lock);
+        while ((line = linebuf_next(&stream->lines, &len)) != NULL)
+        {
+            write_stream_line(stream, line, len);
+        }
+        if (linebuf_pending(&stream->lines) == STREAMBUF_SIZE - 1)
+        {
+            /* No newline in sight */
+            line = linebuf_rest(&stream->lines, &len);
+            write_stream_line(stream, line, len);
+        }
+        int stalled = job->stalled;
+        pthread_mutex_unlock(&job->lock);
+
+        /* A watcher fell behind, leave the rest in the pipe */
+        if (stalled && !drain)
+        {
+            return 0;
+        }
+
+        /* Most likely empty, epoll reports it again if it is not */
+        if ((size_t) nbytes < room && !drain)
+        {
+            return 0;
         }
-        after = buf + inbuf;
-        room = BUFSIZE - inbuf;
     }
 
-    /* The jobs pipe has closed -- prompting their removal */
     if ((nbytes < 0 && errno != EAGAIN) || nbytes == 0)
     {
         return -1;
     }
     return 0;
 }
+
+/*
+ * Finish a directly launched job once the launcher reports that it exited. 
+ * Output still in its pipes is forwarded first (along with any incomplete last
+ * line), then the watchers are sent the jobs exit status under the lock of the
+ * job, and the job is removed under the joblist lock.
+ *
+ * @param job
+ *        the job that exited
+ * @param status
+ *        the status the launcher reaped the job with
+ * @param joblist
+ *        the list of active jobs on the server
+ */
+void reap_job(job_t *job, int status, joblist_t *joblist)
+{
+    jobmsg_t msg = { .type = FRAME_SIGNAL }; /* Kill command was executed */
+    if (WIFEXITED(status)) /* Job exited indepenendly */
+    {
+        msg.type = FRAME_EXIT;
+        msg.status = WEXITSTATUS(status);
+    }
+
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        jobstream_t *stream = &job->streams[i];
+        if (stream->fd >= 0)
+        {
+            read_job_stream(stream, joblist, 1);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        jobstream_t *stream = &job->streams[i];
+        if (linebuf_pending(&stream->lines) > 0)
+        {
+            size_t len;
+            char *line = linebuf_rest(&stream->lines, &len);
+            write_stream_line(stream, line, len);
+        }
+    }
+    write_to_watchers(&msg, job);
+    pthread_mutex_unlock(&job->lock);
+
+    pthread_mutex_lock(&joblist->lock);
+    remove_job(job->pid, joblist);
+    admit_jobs(joblist);
+    pthread_mutex_unlock(&joblist->lock);
+}
+
+/*
+ * Handle the messages the launcher sent to the worker: the replies to the
+ * jobs its clients ran, which are added to the joblist with the client as 
+ * their first watcher (or without a watcher if the client has since left),
+ * and the exits of the direct jobs the worker polls (see reap_job()) and of
+ * the managers of the jobs it polls (see read_job_ring()). A launch that ends
+ * frees its slot for the runs waiting in the admission queue, whether the
+ * job was added or not. The requests are read under the joblist lock, since
+ * another worker may be sending one for a client of this worker. The replies
+ * to the clients are written once the lock is let go of, as the clients
+ * belong to this worker and can not be closed in between.
+ *
+ * @param launcher
+ *        the channel of the worker to the launcher
+ * @param joblist
+ *        the list of active jobs on the server
+ *
+ * @return
+ *        -1:               the launcher has exited
+ *        0:                the messages were handled
+ */
+int read_launcher(launcher_t *launcher, joblist_t *joblist)
+{
+    launchmsg_t msg;
+    pending_t request;
+    int fds[LAUNCH_FDS];
+    int nread;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&joblist->lock);
+        if ((nread = launcher_recv(launcher, &msg, fds, &request)) <= 0)
+        {
+            pthread_mutex_unlock(&joblist->lock);
+            break;
+        }
+
+        if (msg.op == LAUNCH_EXITED)
+        {
+            log_debug("[SERVER] Launcher reaped %d (manager %d), status %d\n",
+                      msg.pid, msg.mpid, msg.status);
+            job_t *job = find_job(msg.pid, joblist);
+            pthread_mutex_unlock(&joblist->lock);
+
+            if (job == NULL || job->fdset != launcher->fdset)
+            {
+                continue;
+            }
+            if (job->mpid == 0)
+            {
+                reap_job(job, msg.status, joblist);
+            }
+            else if (msg.mpid == job->mpid) /* Drain what it left first */
+            {
+                job->ended = 1;
+                ring_wake(job->ring);
+            }
+            continue;
+        }
+
+        log_debug("[SERVER] Launcher replied to request %d with job %d\n",
+                  msg.id, msg.pid);
+        char started[BUFSIZE + 1];
+        char *reply = NULL;
+        joblist->launching--;
+        int added = -1;
+        ring_t *ring = NULL;
+        if (msg.pid > 0 && msg.mode == LAUNCH_DIRECT)
+        {
+            record_spawn(&request.start, msg.pid, joblist);
+            added = add_direct_job(msg.pid, fds, launcher->fdset,
+                                   request.client, joblist);
+        }
+        else if (msg.pid > 0 && (ring = ring_attach(fds + 1)) != NULL)
+        {
+            record_spawn(&request.start, msg.pid, joblist);
+            added = add_job(msg.pid, msg.mpid, fds[0], ring, launcher->fdset,
+                            request.client, joblist);
+        }
+
+        if (added == 0)
+        {
+            /* Gone already if its first watcher could not be added */
+            job_t *job = find_job(msg.pid, joblist);
+            if (job != NULL)
+            {
+                job->flags = request.flags;
+                job->jobclass = request.jobclass;
+            }
+            if (job != NULL && (request.flags & JOB_QUEUED)
+                && request.client != NULL)
+            {
+                snprintf(started, sizeof(started), JOB_STARTED, msg.pid);
+                reply = started;
+            }
+        }
+        else
+        {
+            if (msg.pid > 0) /* Avoid stray processes */
+            {
+                kill(msg.pid, SIGINT);
+            }
+            if (ring != NULL) /* Closes the fds of the ring */
+            {
+                ring_free(ring);
+                for (int i = 1; i < LAUNCH_FDS; i++)
+                {
+                    fds[i] = -1;
+                }
+            }
+            for (int i = 0; i < LAUNCH_FDS; i++)
+            {
+                if (fds[i] >= 0)
+                {
+                    close(fds[i]);
+                }
+            }
+            reply = msg.pid <= 0 && msg.status == LAUNCH_NOCLASS
+                    ? JOB_NOCLASS : JOB_FAILED;
+        }
+        admit_jobs(joblist);
+        pthread_mutex_unlock(&joblist->lock);
+
+        if (reply != NULL && request.client != NULL)
+        {
+            write_client(NULL, reply, request.client);
+        }
+    }
+    return nread;
+}
+
+/*
+ * Validate and execute a single command sent by the client. If the command is
+ * invalid, the client is notified of the illegal action. The joblist lock is
+ * only taken by the commands that need it (see execute_command()).
+ *
+ * @param buf
+ *        the command the client sent, stripped of its network newline
+ * @param len
+ *        the length of the command
+ * @param client
+ *        the client who sent the command
+ * @param joblist
+ *        the list of currently running jobs
+ *
+ * @return
+ *        -1:            clients socket has closed, prompt for clients removal
+ *         0:            command was handled
+ */
+int handle_command(char *buf, size_t len, client_t *client, joblist_t *joblist)
+{
+    command_t cmd;
+    cmdtype_t type = parse_command(buf, len, &cmd);
+
+    if (type == CMD_INVALID || type == CMD_EXIT) /* Invalid command */
+    {
+        if (write_client(INVALID_COMMAND, buf, client) < 0
+            || write_client(NULL, CLIENT_WELCOME, client) < 0)
+        {
+            return -1;
+        }
+    }
+    else if (type == CMD_COMMANDS || type == CMD_JOBLIST) /* Command list */
+    {
+        if (write_setmsg(client, type == CMD_JOBLIST) < 0)
+        {
+            return -1;
+        }    
+    }
+    else
+    {
+        execute_command(&cmd, client, joblist);
+    }
+    return 0;
+}
+
 /*
  * Buffer and read a clients command and execute the given instructions. Cases
  * where client send invalid messages or one that lacks a network newline are
- * handled.If the command is invalid, the client is notified of the illegal 
- * action. If the command lacks a network newline, the command is considered
- * void and the client will have to resend the command. Valid commands are 
- * executed from here. This is will also notify if a clients connection goes
- * dark.
+ * handled. A command that lacks a network newline is kept in the clients
+ * input buffer until the rest of it arrives, so commands may be split over
+ * several reads or pipelined in batches. A command longer than BUFSIZE is
+ * considered void. Valid commands are executed from here (see 
+ * handle_command()). This is will also notify if a clients connection goes
+ * dark. The socket is read until a read does not fill the buffer, as it is
+ * polled again if more arrived meanwhile, and the first read may have been
+ * issued in a batch already (see read_ahead()). The client is corked while
+ * its commands are handled, so the replies
+ * are queued under the locks and written once all of them are let go of
+ * (see uncork_client()).
  *
  * @param client
  *        the client who sent the command
- * @param clientlist
- *        the list of currently active clients
+ * @param joblist
+ *        the list of currently running jobs
  *
  * @return
  *        -1:            clients socket has closed, prompt for clients removal
@@ -130,66 +690,467 @@ int read_write_job(job_t *job, joblist_t *joblist)
  */
 int read_client(client_t *client, joblist_t *joblist)
 {
-    char buf[BUFSIZE+1];
-    char *after = buf;
-    int room = BUFSIZE;
-    int inbuf = 0;
+    linebuf_t *input = &client->input;
+    size_t room;
+    char *after = linebuf_space(input, &room);
     int nbytes = 0;
-    
-    while ((nbytes = read(client->clientfd, after, room)) > 0)
+    int closed = 0;
+
+    cork_client(client);
+    while (!closed && (nbytes = io_read(client->clientfd, after, room,
+                                        &client->ahead)) > 0)
     {
-        inbuf += nbytes;
-        int nwl;
+        int drained = (size_t) nbytes < room;
+        linebuf_fill(input, nbytes);
+        char *line;
+        size_t len;
     
         /* Only accept full commands */
-        while ((nwl = find_network_newline(buf, inbuf)) > 0) 
+        while ((line = linebuf_next(input, &len)) != NULL) 
+        {
+            if (len > BUFSIZE) /* Too long to be a command */
+            {
+                continue;
+            }
+            log_client_command(line, client->clientfd);
+            if (handle_command(line, len, client, joblist) < 0)
+            {
+                closed = 1;
+                break;
+            }
+        }
+
+        /* Nothing but an overlong command, which is void */
+        if (linebuf_pending(input) == CLIENTBUF_SIZE - 1)
+        {
+            linebuf_rest(input, &len);
+        }
+        after = linebuf_space(input, &room);
+
+        if (drained) /* Polled again if more arrives */
         {
-            buf[nwl -2] = '\0'; /* Remove \r\n */
+            break;
+        }
+    }
+
+    int flushed = uncork_client(client);
+    if (flushed > 0) /* Jobs it stalled may go on */
+    {
+        pthread_mutex_lock(&joblist->lock);
+        resume_jobs(client);
+        pthread_mutex_unlock(&joblist->lock);
+    }
+
+    /* The clients socket has closed -- prompting their removal */
+    if (closed || flushed < 0 || (nbytes < 0 && errno != EAGAIN)
+        || nbytes == 0)
+    {
+        return -1;
+    }
+    return 0;
+}
 
-            log_client_command(buf, client->clientfd);
+/*
+ * Issue the first read of every client and job pipe that is ready in a single
+ * batch (see io_read_batch()), so with io_uring the reads of a whole batch of
+ * events cost one syscall. Each result is kept with its client, stream or job
+ * until its handler takes it in place of its first read (see io_read()). The
+ * stdout of a job watched raw or chunked is left to read_output(), which moves
+ * it to the feeds without reading it, and a lone read is left to its handler.
+ *
+ * @param events
+ *        the events epoll returned
+ * @param nready
+ *        the amount of events
+ */
+static void read_ahead(struct epoll_event *events, int nready)
+{
+    ioread_t reads[MAX_EVENTS];
+    ioahead_t *aheads[MAX_EVENTS];
+    uint64_t counts[MAX_EVENTS];
+    int count = 0;
 
-            int validate = validate_command(buf);
+    for (int i = 0; i < nready; i++)
+    {
+        conntype_t *owner = events[i].data.ptr;
+        ioread_t *next = &reads[count];
+        size_t room;
 
-            if (validate == -2) /* Error occurred */
+        if (*owner == CONN_CLIENT && (events[i].events & ~EPOLLOUT))
+        {
+            client_t *client = (client_t *) owner;
+            next->fd = client->clientfd;
+            next->buf = linebuf_space(&client->input, &room);
+            next->len = room;
+            aheads[count++] = &client->ahead;
+        }
+        else if (*owner == CONN_JOB) /* Only the count of the eventfd */
+        {
+            job_t *job = (job_t *) owner;
+            next->fd = job->ring->fds[RING_DATAFD];
+            next->buf = &counts[i];
+            next->len = sizeof(uint64_t);
+            aheads[count++] = &job->ahead;
+        }
+        else if (*owner == CONN_JOBSTREAM)
+        {
+            jobstream_t *stream = (jobstream_t *) owner;
+            pthread_mutex_lock(&stream->job->lock);
+            int raw = stream->stream == STREAM_STDOUT
+                      && stream->job->watchlist->nraw > 0;
+            pthread_mutex_unlock(&stream->job->lock);
+            if (raw)
             {
-                return 0;
+                continue;
             }
-            else if (validate == -1 || validate == 5) /* Invalid command */
+            next->fd = stream->fd;
+            next->buf = linebuf_space(&stream->lines, &room);
+            next->len = room;
+            aheads[count++] = &stream->ahead;
+        }
+    }
+    if (count < 2)
+    {
+        return;
+    }
+
+    io_read_batch(reads, count);
+    for (int i = 0; i < count; i++)
+    {
+        aheads[i]->ready = 1;
+        aheads[i]->result = reads[i].result;
+    }
+}
+
+/*
+ * Run the event loop of a single worker until the server is told to shut down.
+ * Each worker accepts on its own listener, owns the clients it accepted and 
+ * polls the pipes of the jobs those clients ran. Only ready fds are visited: 
+ * each event carries its owner, so a client that closes its connection is 
+ * removed from the clientlist and epoll, and a job whose pipe closes (or, if
+ * it was launched directly, whose pidfd reports its exit) is removed from the
+ * joblist, and freed once the rest of the batch is handled. Clients with
+ * output waiting are also polled for EPOLLOUT, which drains their outbound
+ * chain.
+ *
+ * @param arg
+ *        the worker_t to run
+ */
+void *run_worker(void *arg)
+{
+    worker_t *worker = arg;
+    clientlist_t *clientlist = worker->clientlist;
+    joblist_t *joblist = worker->joblist;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (active) /* SIGINT not received */
+    {
+        int nready = epoll_wait(worker->fdset->epollfd, events, MAX_EVENTS, -1);
+
+        /*
+         * SIGINT clears active through the handler, any other interruption
+         * (such as io_uring task work) is simply retried.
+         */
+        if (nready < 0 && errno != EINTR)
+        {
+            perror("[SERVER] epoll_wait");
+            active = 0;
+        }
+        if (active && nready > 0)
+        {
+            read_ahead(events, nready);
+        }
+
+        for (int i = 0; active && i < nready; i++)
+        {
+            conntype_t *owner = events[i].data.ptr;
+
+            switch (*owner)
             {
-                if (write_client(INVALID_COMMAND, buf, client->clientfd) < 0
-                    || write_client(NULL, CLIENT_WELCOME, client->clientfd) < 0)
+                case CONN_LISTENER: /* Potiental client attempting to connect */
+                    setup_client(worker->listenfd, clientlist);
+                    break;
+
+                case CONN_SHUTDOWN: /* Another worker is tearing down */
+                    break;
+
+                case CONN_CLIENT:
                 {
-                    return -1;
+                    client_t *client = (client_t *) owner;
+                    int closed = 0;
+
+                    /* Drain the output waiting for the client */
+                    if (events[i].events & EPOLLOUT)
+                    {
+                        int flushed = flush_client(client);
+                        if (flushed > 0)
+                        {
+                            pthread_mutex_lock(&joblist->lock);
+                            resume_jobs(client);
+                            pthread_mutex_unlock(&joblist->lock);
+                        }
+                        closed = flushed < 0;
+                    }
+
+                    if (!closed && (events[i].events & ~EPOLLOUT))
+                    {
+                        closed = read_client(client, joblist) < 0;
+                    }
+
+                    if (closed)
+                    {
+                        pthread_mutex_lock(&joblist->lock);
+                        launcher_forget(worker->fdset->launcher, client);
+                        dequeue_client(client, joblist);
+                        close_client(client, clientlist);
+                        pthread_mutex_unlock(&joblist->lock);
+                    }
+                    break;
                 }
-            }
-            else if (validate == 0 || validate == 6) /* Client requested command list */
-            {
-                if (write_setmsg(client->clientfd, validate) < 0)
+
+                case CONN_JOB:
                 {
-                    return -1;
-                }    
-            }
-            else
-            {
-                execute_command(buf, validate, client, joblist);
+                    job_t *job = (job_t *) owner;
+                    if (read_job_ring(job, joblist) < 0)
+                    {
+                        pthread_mutex_lock(&joblist->lock);
+                        remove_job(job->pid, joblist);
+                        admit_jobs(joblist);
+                        pthread_mutex_unlock(&joblist->lock);
+                    }
+                    break;
+                }
+
+                case CONN_JOBSTREAM: /* Output of a direct job */
+                {
+                    jobstream_t *stream = (jobstream_t *) owner;
+                    if (read_job_stream(stream, joblist, 0) < 0)
+                    {
+                        pthread_mutex_lock(&stream->job->lock);
+                        close_stream(stream);
+                        pthread_mutex_unlock(&stream->job->lock);
+                    }
+                    break;
+                }
+
+                case CONN_LAUNCHER: /* Launched jobs and exits */
+                    if (read_launcher(worker->fdset->launcher, joblist) < 0)
+                    {
+                        fprintf(stderr, "[SERVER] Launcher exited\n");
+                        close_fd(worker->fdset->launcher->fd, worker->fdset);
+                    }
+                    break;
+
+                case CONN_DEAD: /* Removed earlier in this batch */
+                    break;
             }
-            inbuf -= nwl;
-            memmove(buf, buf+nwl, inbuf);
         }
-        after = buf + inbuf;
-        room = BUFSIZE- - inbuf;
+
+        /* No event of this batch refers to the removed jobs any longer */
+        if (worker->fdset->dead != NULL)
+        {
+            pthread_mutex_lock(&joblist->lock);
+            free_dead_jobs(worker->fdset);
+            pthread_mutex_unlock(&joblist->lock);
+        }
     }
 
-    /* The clients socket has closed -- prompting their removal */
-    if ((nbytes < 0 && errno != EAGAIN) || nbytes == 0)
+    /* Wake the other workers (the eventfd is never read, so it stays ready) */
+    uint64_t wake = 1;
+    write(worker->shutdownfd, &wake, sizeof(wake));
+    io_thread_exit();
+    return NULL;
+}
+
+/*
+ * Set up the epoll instance, listener and clientlist of a worker. Every worker
+ * also watches the shared shutdown eventfd and its own socket to the launcher.
+ *
+ * @param worker
+ *        the worker to initialize
+ * @param listenfd
+ *        the listener the worker accepts clients on
+ * @param launchfd
+ *        the workers end of the socket to the launcher
+ *
+ * @return
+ *        -1:       the worker could not be initialized
+ *        0:        the worker is ready to run
+ */
+int init_worker(worker_t *worker, int listenfd, int launchfd)
+{
+    static conntype_t listener = CONN_LISTENER;
+    static conntype_t shutdown = CONN_SHUTDOWN;
+
+    worker->listenfd = listenfd;
+    worker->fdset = malloc(sizeof(struct connections));
+    worker->clientlist = malloc(sizeof(struct clientlist));
+
+    if (worker->fdset == NULL || worker->clientlist == NULL)
     {
         return -1;
     }
+
+    worker->fdset->nfds = 0;
+    worker->fdset->dead = NULL;
+    worker->fdset->launcher = launcher_init(launchfd, worker->fdset,
+                                            worker->joblist->limit);
+    if (worker->fdset->launcher == NULL
+        || (worker->fdset->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || add_fd(listenfd, &listener, worker->fdset) < 0
+        || add_fd(worker->shutdownfd, &shutdown, worker->fdset) < 0
+        || add_fd(launchfd, worker->fdset->launcher, worker->fdset) < 0)
+    {
+        return -1;
+    }
+
+    worker->clientlist->head = worker->clientlist->end = NULL;
+    worker->clientlist->size = 0;
+    worker->clientlist->fdset = worker->fdset;
     return 0;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    int nworkers = 1;
+    iobackend_t iobackend = IO_SYNC;
+    slowpolicy_t slowpolicy = SLOW_DROP;
+    size_t highwater = DEFAULT_HIGHWATER;
+    launchmode_t launchmode = LAUNCH_MANAGER;
+    const char *logdir = LOG_DIR;
+    loglevel_t loglevel = LEVEL_OUTPUT;
+    unsigned long logsample = 1;
+    size_t logsize = SEG_SIZE;
+    unsigned long logage = 0;
+    size_t logkeep = LOG_KEEP;
+    size_t scrollsize = SCROLLBACK_SIZE;
+    size_t scrolltotal = SCROLLBACK_TOTAL;
+    const char *spooldir = SPOOL_DIR;
+    long joblimit = 0;
+    size_t queuemax = ADMIT_QUEUE;
+    const char *cgroupdir = NULL;
+    joblimits_t limits = { 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv,
+                         "t:i:w:p:l:L:v:s:r:a:k:b:m:o:j:q:g:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': /* Worker threads, 0 for one per core */
+                nworkers = strtol(optarg, NULL, 10);
+                if (nworkers <= 0)
+                {
+                    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'i': /* I/O backend for batched writes */
+                iobackend = strcmp(optarg, "uring") == 0 ? IO_URING : IO_SYNC;
+                break;
+            case 'w': /* Output a watcher may have waiting */
+                highwater = strtoul(optarg, NULL, 10);
+                break;
+            case 'p': /* What happens to watchers that fall behind */
+                if (strcmp(optarg, "block") == 0)
+                    slowpolicy = SLOW_BLOCK;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    slowpolicy = SLOW_DISCONNECT;
+                else
+                    slowpolicy = SLOW_DROP;
+                break;
+            case 'l': /* How jobs are launched */
+                launchmode = strcmp(optarg, "direct") == 0 ? LAUNCH_DIRECT
+                                                           : LAUNCH_MANAGER;
+                break;
+            case 'L': /* Directory of the log segments */
+                logdir = optarg;
+                break;
+            case 'v': /* How much is logged */
+                if (strcmp(optarg, "info") == 0)
+                    loglevel = LEVEL_INFO;
+                else if (strcmp(optarg, "debug") == 0)
+                    loglevel = LEVEL_DEBUG;
+                else
+                    loglevel = LEVEL_OUTPUT;
+                break;
+            case 's': /* One in how many lines of stdout are logged */
+                logsample = strtoul(optarg, NULL, 10);
+                break;
+            case 'r': /* Bytes of a log segment */
+                logsize = strtoul(optarg, NULL, 10);
+                break;
+            case 'a': /* Seconds a log segment is written to */
+                logage = strtoul(optarg, NULL, 10);
+                break;
+            case 'k': /* Sealed log segments kept */
+                logkeep = strtoul(optarg, NULL, 10);
+                break;
+            case 'b': /* Bytes of recent output kept per job */
+                scrollsize = strtoul(optarg, NULL, 10);
+                break;
+            case 'm': /* Bytes of recent output kept across every job */
+                scrolltotal = strtoul(optarg, NULL, 10);
+                break;
+            case 'o': /* Directory the output of the jobs is spooled to */
+                spooldir = optarg;
+                break;
+            case 'j': /* Jobs run at once, 0 for the default per core */
+                joblimit = strtol(optarg, NULL, 10);
+                break;
+            case 'q': /* Runs that may wait for a job to finish */
+                queuemax = strtoul(optarg, NULL, 10);
+                break;
+            case 'g': /* Cgroup v2 directory the jobs are placed under */
+                cgroupdir = optarg;
+                break;
+            case 'c': /* Resource limits of every job, in cgroups */
+                if (cgroup_parse_limits(optarg, strlen(optarg), &limits) == 0)
+                {
+                    break;
+                }
+                fprintf(stderr, "[SERVER] Invalid limits: %s\n", optarg);
+                /* Fall through */
+            default:
+                fprintf(stderr, "Usage:\n\tjobserver [-t workers] "
+                                "[-i write|uring] [-w highwater] "
+                                "[-p block|drop|disconnect] "
+                                "[-l manager|direct] [-L logdir] "
+                                "[-v info|output|debug] [-s sample] "
+                                "[-r size] [-a age] [-k keep] "
+                                "[-b scrollback] [-m scrollmax] "
+                                "[-o spooldir] [-j jobs] [-q queue] "
+                                "[-g cgroupdir] [-c limits]\n");
+                exit(1);
+        }
+    }
+
+    /* Only a job manager places its job in a cgroup */
+    if ((cgroupdir != NULL && launchmode == LAUNCH_DIRECT)
+        || (cgroupdir == NULL && cgroup_has_limits(&limits)))
+    {
+        fprintf(stderr, "[SERVER] Resource limits need -g and -l manager\n");
+        exit(1);
+    }
+
+    /* Known to the launcher and so to every job manager it forks */
+    if (cgroupdir != NULL && cgroup_start(cgroupdir) < 0)
+    {
+        perror("[SERVER] cgroup");
+        exit(1);
+    }
+
+    /* A client resetting its connection is seen as EPIPE, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The launcher is forked while the server is still small */
+    int *launchfds = malloc(nworkers * sizeof(int));
+    pid_t launcher;
+    if (launchfds == NULL || (launcher = launcher_start(nworkers, launchfds)) < 0)
+    {
+        perror("[SERVER] launcher");
+        exit(1);
+    }
+
     /* Prepare for teardown signal */
     struct sigaction sig_handler;
     sigemptyset(&sig_handler.sa_mask);
@@ -197,122 +1158,114 @@ int main(void)
     sig_handler.sa_flags = 0;
     sigaction(SIGINT, &sig_handler, NULL);
 
-    /* Set up server and sockets */
+    /* Set up server and structures to run server commands */
     struct sockaddr_in *self = init_server_addr(PORT);
-    int listenfd = setup_server_socket(self, QUEUE_LENGTH);
-
-    /* Set up structures to run server commands and connect clients */
-    clientlist_t *clientlist = malloc(sizeof(struct clientlist));
     joblist_t *joblist = malloc(sizeof(struct joblist));
-    connections_t *fdset = malloc(sizeof(struct connections));
-    fdset->all_fds = malloc(sizeof(fd_set));
+    worker_t *workers = calloc(nworkers, sizeof(struct worker));
+    int shutdownfd = eventfd(0, EFD_CLOEXEC);
 
-    if (fdset == NULL || fdset->all_fds == NULL || joblist == NULL 
-        || clientlist == NULL)
+    if (joblist == NULL || workers == NULL || shutdownfd < 0)
     {
         perror("[SERVER] malloc");
         exit(1);
     }
 
-    log_startup();
+    logger_set_rotation(logsize, logage, logkeep);
+    log_startup(logdir);
+    set_log_policy(loglevel, logsample);
+    io_backend_init(iobackend);
+    set_slow_policy(slowpolicy, highwater);
+    set_launch_mode(launchmode);
+    set_job_limits(&limits);
+    scrollback_set_limits(scrollsize, scrolltotal);
+    if (spool_start(spooldir) < 0)
+    {
+        perror("[SERVER] spool");
+        exit(1);
+    }
 
-    /* Initialize structures and prepare the fdset for select() */
-    fd_set listen_fds;
-    FD_ZERO(fdset->all_fds);
-    FD_SET(listenfd, fdset->all_fds);
-    fdset->maxfd = listenfd;
+    if (joblimit <= 0)
+    {
+        joblimit = sysconf(_SC_NPROCESSORS_ONLN) * JOBS_PER_CORE;
+    }
 
-    clientlist->head = clientlist->end = NULL;
-    clientlist->size = 0;
     joblist->size = 0;
     joblist->head = joblist->end = NULL;
-    clientlist->fdset = joblist->fdset = fdset;
+    joblist->limit = joblimit > 0 ? joblimit : 1;
+    joblist->launching = 0;
+    joblist->queuehead = joblist->queueend = NULL;
+    joblist->queued = 0;
+    joblist->queuemax = queuemax;
+    joblist->vtime = 0;
+    hashindex_init(&joblist->bypid);
+    pthread_mutex_init(&joblist->lock, NULL);
 
-    while (active) /* SIGINT not received */
+    /* One listener per worker, sharing the port when there are several */
+    for (int i = 0; i < nworkers; i++)
     {
-        listen_fds = *fdset->all_fds;
-        int nready = select(fdset->maxfd + 1, &listen_fds, NULL, NULL, NULL);
+        int listenfd = setup_server_socket(self, QUEUE_LENGTH, nworkers > 1);
 
-        if (nready < 0)
-        {
-            if (errno != EINTR) /* kill signal wasn't recieved */
-            {
-                perror("[SERVER] select");
-            }
-            active = 0;
-        }
-        
-        /* Potiental client is attempting to connect */
-        if (active && FD_ISSET(listenfd, &listen_fds))
+        workers[i].joblist = joblist;
+        workers[i].shutdownfd = shutdownfd;
+        if (init_worker(&workers[i], listenfd, launchfds[i]) < 0)
         {
-            setup_client(listenfd, clientlist);
+            perror("[SERVER] worker");
+            exit(1);
         }
-        
-        client_t *client = clientlist->head;
-        
-        /*
-         * Iterate through the connected clients and read their command if one
-         * was sent. If the client closes their connection, remove them from
-         * the fd_set.
-           */
-        while (client)
-        {
-            int client_closed = 0;
+    }
 
-            /* Read from the client only if there is something to read */
-            if (FD_ISSET(client->clientfd, &listen_fds))
-            {
-                /* Read from the client and determine if the connection closed*/
-                if ((client_closed = read_client(client, joblist)) < 0)
-                {
-                    client_t *closed_client = client;
-                    client = client->next;
-                    close_client(closed_client, clientlist);
-                }
-            }
-            if (client_closed == 0)
-            {
-                client = client->next;
-            }
-        }
-    
-        job_t *job = joblist->head;
-    
-        /*
-         * Iterate through the running jobs and re-direct their output to all of
-         * the jobs watchers. If a watcher closes connection, remove them from
-         * the clientlist and fd_set. 
-           */
-        while (job)
-        {
-            int job_closed = abs(waitpid(job->mpid, NULL, WNOHANG));
-            
-            /* Read from the job only if there is something to read */
-            if (FD_ISSET(job->jobpipe, &listen_fds))
-            {
-                /* Read from the client and determine if the connection closed*/
-                if ((job_closed = read_write_job(job, joblist)) < 0)
-                {
-                    job_t *job_ended = job;
-                    job = job->next;
-                    int stat;
-                    wait(&stat);
-                    remove_job(job_ended->pid, joblist);
-                }
-            }
-            if (job_closed >= 0)
-            {
-                job = job->next;
-            }
+    /* Only the main thread (worker 0) handles SIGINT */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    for (int i = 1; i < nworkers; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]))
+        {
+            perror("[SERVER] pthread_create");
+            exit(1);
         }
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    run_worker(&workers[0]);
 
     /* Begin tearing down the server */
-    free(self);
-    close(listenfd);
-    clear_clients(clientlist);
+    for (int i = 1; i < nworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < nworkers; i++)
+    {
+        close(workers[i].listenfd);
+        clear_clients(workers[i].clientlist);
+        close(workers[i].fdset->epollfd);
+        free(workers[i].fdset->launcher);
+        free(workers[i].fdset);
+    }
     clear_jobs(joblist);
-    wait(NULL); // Wait for job's to clear up
+    launcher_stop(launcher, nworkers, launchfds);
+    free(launchfds);
+    close(shutdownfd);
+    free(workers);
+    free(self);
+
+    char stats[BUFSIZE + 1];
+    io_report_stats(stats, sizeof(stats));
+    log_message(stats);
+    spawn_report_stats(stats, sizeof(stats));
+    log_message(stats);
+    scrollback_report_stats(stats, sizeof(stats));
+    log_message(stats);
+    for (int i = 0; i < JOB_CLASSES; i++)
+    {
+        jobclass_report_stats(i, stats, sizeof(stats));
+        log_message(stats);
+    }
+    report_pools();
+    release_pools();
     log_shutdown();
     return 0;
 }
@@ -0,0 +1,874 @@
+#define _GNU_SOURCE /* pipe2() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+#include "headers/serverdata.h"
+#include "headers/serverlog.h"
+#include "headers/jobprotocol.h"
+#include "headers/launcher.h"
+#include "headers/ring.h"
+
+/*
+ * A process whose exit the launcher reports: a directly launched job, or the
+ * manager of a job.
+ *
+ * @data pid
+ *        the pid of the process
+ * @data job
+ *        the pid of the job (the same as pid for a direct job)
+ * @data sock
+ *        the socket of the worker that polls the job
+ */
+typedef struct tracked
+{
+    pid_t pid;
+    pid_t job;
+    int sock;
+
+} tracked_t;
+
+/*
+ * A managed job whose manager has not reported the pid of the job yet. The
+ * pipe the manager reports through is polled along with the sockets of the
+ * workers, so the launcher serves other requests meanwhile.
+ *
+ * @data msg
+ *        the request, turned into the reply once the manager reports
+ * @data sock
+ *        the socket the request came from
+ * @data fds
+ *        the read end of the pipe from the manager, followed by the fds of
+ *        the ring
+ * @data exited
+ *        set if the manager was reaped before its report was read
+ * @data status
+ *        the status the manager was reaped with
+ */
+typedef struct starting
+{
+    launchmsg_t msg;
+    int sock;
+    int fds[LAUNCH_FDS];
+    int exited;
+    int status;
+
+} starting_t;
+
+/*******************************************************************************
+ *                           Launcher Process                                  *
+ ******************************************************************************/
+
+/*
+ * Send a message, and the fds that go with it, over a launcher socket.
+ *
+ * @param sock
+ *        the socket to send on
+ * @param msg
+ *        the message to send
+ * @param fds
+ *        the fds to pass along, may be NULL if nfds is 0
+ * @param nfds
+ *        the amount of fds, at most LAUNCH_FDS
+ *
+ * @return
+ *        -1:       the message could not be sent
+ *        0:        the message was sent
+ */
+static int send_launchmsg(int sock, launchmsg_t *msg, int *fds, int nfds)
+{
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int) * LAUNCH_FDS)];
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL) == sizeof(*msg) ? 0 : -1;
+}
+
+/*
+ * Close each of the fds.
+ */
+static void close_fds(int *fds, int nfds)
+{
+    for (int i = 0; i < nfds; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+/*
+ * Fork a job manager for the job (see generate_job_and_manager()), without
+ * waiting for it to report the pid of the job (see finish_managed()). The ring
+ * the manager passes the jobs output through is created here, so its fds can
+ * be sent to the server. The manager leaves the launchers signal setup behind,
+ * and closes the launchers sockets and the fds of the other launches in
+ * flight, so only the launcher holds them and each manager can tell when the
+ * server is gone.
+ *
+ * @param argv
+ *        the argument list to run the job
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param limits
+ *        the resource limits the job is run with
+ * @param fds
+ *        set to the read end of the pipe between the server and the manager,
+ *        followed by the fds of the ring
+ * @param mpid
+ *        set to the pid of the job manager
+ * @param socks
+ *        the sockets of the launcher
+ * @param nsocks
+ *        the amount of sockets
+ * @param starting
+ *        the other managed launches in flight
+ * @param nstarting
+ *        the amount of launches in flight
+ *
+ * @return
+ *        -1:       the manager could not be forked
+ *        0:        the manager was forked
+ */
+static int start_managed(char *argv[], jobclass_t jobclass,
+                         const joblimits_t *limits, int fds[LAUNCH_FDS],
+                         pid_t *mpid, struct pollfd *socks, int nsocks,
+                         starting_t *starting, size_t nstarting)
+{
+    int fd[2];
+    int *ringfds = fds + 1;
+
+    if (ring_open(ringfds) < 0)
+    {
+        return -1;
+    }
+    if (pipe2(fd, O_CLOEXEC) < 0)
+    {
+        close_fds(ringfds, RING_FDS);
+        return -1;
+    }
+
+    if ((*mpid = fork()) < 0)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        close_fds(ringfds, RING_FDS);
+        return -1;
+    }
+
+    if (*mpid == 0)
+    {
+        sigset_t none;
+        sigemptyset(&none);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        for (int i = 0; i < nsocks; i++)
+        {
+            close(socks[i].fd);
+        }
+        for (size_t i = 0; i < nstarting; i++)
+        {
+            close_fds(starting[i].fds, LAUNCH_FDS);
+        }
+        close(fd[0]);
+        generate_job_and_manager(fd[1], ringfds, argv, jobclass, limits);
+    }
+
+    close(fd[1]);
+    fds[0] = fd[0];
+    return 0;
+}
+
+/*
+ * Spawn the job without a job manager (see spawn_job()), keeping the read ends
+ * of its stdout and stderr pipes for the server.
+ *
+ * @param argv
+ *        the argument list to run the job
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param fds
+ *        set to the read ends of the jobs stdout and stderr pipes
+ * @param failure
+ *        set to why the job could not be launched
+ *
+ * @return
+ *        -1:       the job could not be launched
+ *        jpid:     the pid of the job
+ */
+static pid_t launch_direct(char *argv[], jobclass_t jobclass,
+                           int fds[JOB_STREAMS], launchfail_t *failure)
+{
+    int stdoutfd[2];
+    int stderrfd[2];
+    pid_t jpid;
+
+    if (pipe2(stdoutfd, O_CLOEXEC) < 0)
+    {
+        return -1;
+    }
+    if (pipe2(stderrfd, O_CLOEXEC) < 0)
+    {
+        close(stdoutfd[0]);
+        close(stdoutfd[1]);
+        return -1;
+    }
+
+    int spawned = spawn_job(argv, jobclass, -1, stdoutfd[1], stderrfd[1],
+                            &jpid);
+
+    close(stdoutfd[1]);
+    close(stderrfd[1]);
+    if (spawned != 0)
+    {
+        *failure = spawned > 0 ? LAUNCH_NOCLASS : LAUNCH_FAILED;
+        close(stdoutfd[0]);
+        close(stderrfd[0]);
+        return -1;
+    }
+
+    fds[STREAM_STDOUT] = stdoutfd[0];
+    fds[STREAM_STDERR] = stderrfd[0];
+    return jpid;
+}
+
+/*
+ * Reply to a worker with the pid and fds of the job it requested. Once the fds
+ * are sent the launcher closes its copies, so the server holds the only read
+ * ends. A job no worker will ever see is interrupted.
+ *
+ * @param msg
+ *        the reply
+ * @param sock
+ *        the socket the request came from
+ * @param fds
+ *        the fds of the job
+ * @param nfds
+ *        the amount of fds, 0 if the job could not be launched
+ *
+ * @return
+ *        -1:       the job could not be launched, or the reply not sent
+ *        0:        the job was launched and the reply sent
+ */
+static int reply_launch(launchmsg_t *msg, int sock, int *fds, int nfds)
+{
+    int sent = send_launchmsg(sock, msg, fds, nfds);
+    close_fds(fds, nfds);
+
+    if (msg->pid > 0 && sent < 0) /* No one will ever see the job */
+    {
+        kill(msg->pid, SIGINT);
+    }
+    return msg->pid > 0 && sent == 0 ? 0 : -1;
+}
+
+/*
+ * Read the pid of the job its manager reported, once the pipe from the
+ * manager is ready (or the launcher is on its way out), and reply to the
+ * worker that requested the job.
+ *
+ * @param start
+ *        the launch in flight
+ *
+ * @return
+ *        as reply_launch()
+ */
+static int finish_managed(starting_t *start)
+{
+    launchmsg_t *msg = &start->msg;
+    pid_t jpid = 0;
+
+    if (read(start->fds[0], &jpid, sizeof(int)) != sizeof(int) || jpid < 0)
+    {
+        /* The manager failed, or told its job could not take its class */
+        msg->pid = -1;
+        msg->mpid = 0;
+        msg->status = jpid < 0 ? LAUNCH_NOCLASS : LAUNCH_FAILED;
+        close_fds(start->fds, LAUNCH_FDS);
+        return reply_launch(msg, start->sock, NULL, 0);
+    }
+
+    msg->pid = jpid;
+    msg->status = 0;
+    return reply_launch(msg, start->sock, start->fds, LAUNCH_FDS);
+}
+
+/*
+ * Launch the job a worker requested. A direct job is spawned and replied to
+ * straight away, while for a managed job only its manager is forked: the reply
+ * is sent once the manager reports the pid of the job (see finish_managed()).
+ *
+ * @param msg
+ *        the request, which is turned into the reply
+ * @param sock
+ *        the socket the request came from
+ * @param starting
+ *        the managed launches in flight, the launch of a managed job is
+ *        filled in after the last of them
+ * @param nstarting
+ *        the amount of launches in flight
+ * @param socks
+ *        the sockets of the launcher
+ * @param nsocks
+ *        the amount of sockets
+ *
+ * @return
+ *        -1:       the job could not be launched
+ *        0:        the job was launched and the reply sent
+ *        1:        the manager of the job was forked, the reply is pending
+ */
+static int launch(launchmsg_t *msg, int sock, starting_t *starting,
+                  size_t nstarting, struct pollfd *socks, int nsocks)
+{
+    starting_t *start = &starting[nstarting];
+    char *argv[BUFSIZE / 2 + 2];
+    int fds[LAUNCH_FDS];
+    int nfds = 0;
+    int argc = 0;
+
+    msg->args[BUFSIZE] = '\0';
+    for (char *arg = strtok(msg->args, " "); arg; arg = strtok(NULL, " "))
+    {
+        argv[argc++] = arg;
+    }
+    argv[argc] = NULL; /* Null terminate for posix_spawn */
+
+    launchfail_t failure = LAUNCH_FAILED;
+    msg->pid = -1;
+    msg->mpid = 0;
+    if (argc > 0 && msg->mode == LAUNCH_DIRECT)
+    {
+        if ((msg->pid = launch_direct(argv, msg->jobclass, fds,
+                                      &failure)) > 0)
+        {
+            nfds = JOB_STREAMS;
+        }
+    }
+    else if (argc > 0
+             && start_managed(argv, msg->jobclass, &msg->limits, start->fds,
+                              &msg->mpid, socks, nsocks, starting,
+                              nstarting) == 0)
+    {
+        start->msg = *msg;
+        start->sock = sock;
+        start->exited = 0;
+        return 1;
+    }
+    msg->status = msg->pid > 0 ? 0 : failure;
+    return reply_launch(msg, sock, fds, nfds);
+}
+
+/*
+ * Report the exit of a process the launcher tracked to the worker that polls
+ * its job.
+ *
+ * @param sock
+ *        the socket of the worker
+ * @param pid
+ *        the pid of the process
+ * @param job
+ *        the pid of its job
+ * @param status
+ *        the status it was reaped with
+ */
+static void report_exit(int sock, pid_t pid, pid_t job, int status)
+{
+    launchmsg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = LAUNCH_EXITED;
+    msg.pid = job;
+    msg.mpid = pid == job ? 0 : pid;
+    msg.status = status;
+    send_launchmsg(sock, &msg, NULL, 0);
+}
+
+/*
+ * Track a launched job, or its manager, until it is reaped.
+ *
+ * @param tracked ntracked cap
+ *        the processes tracked, their amount and the room for them, grown as
+ *        needed
+ * @param pid
+ *        the pid of the process
+ * @param job
+ *        the pid of its job
+ * @param sock
+ *        the socket of the worker that polls the job
+ */
+static void track(tracked_t **tracked, size_t *ntracked, size_t *cap,
+                  pid_t pid, pid_t job, int sock)
+{
+    if (*ntracked == *cap)
+    {
+        *cap = *cap ? *cap * 2 : LAUNCH_TRACKED;
+        *tracked = realloc(*tracked, *cap * sizeof(tracked_t));
+        if (*tracked == NULL)
+        {
+            _exit(1);
+        }
+    }
+    (*tracked)[*ntracked].pid = pid;
+    (*tracked)[*ntracked].job = job;
+    (*tracked)[*ntracked].sock = sock;
+    (*ntracked)++;
+}
+
+/*
+ * Reap every child that exited and report it to the worker that polls the job.
+ * A job manager reports the exit of its job through the jobs ring, so the exit
+ * of the manager itself only matters if it never got to. A manager reaped 
+ * before its report was read is reported once it is (see run_launcher()).
+ *
+ * @param tracked
+ *        the direct jobs still running
+ * @param ntracked
+ *        the amount of direct jobs, updated as they are reaped
+ * @param starting
+ *        the managed launches in flight
+ * @param nstarting
+ *        the amount of launches in flight
+ */
+static void reap_children(tracked_t *tracked, size_t *ntracked,
+                          starting_t *starting, size_t nstarting)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (size_t i = 0; i < *ntracked; i++)
+        {
+            if (tracked[i].pid == pid)
+            {
+                report_exit(tracked[i].sock, pid, tracked[i].job, status);
+                tracked[i] = tracked[--(*ntracked)];
+                break;
+            }
+        }
+        for (size_t i = 0; i < nstarting; i++)
+        {
+            if (starting[i].msg.mpid == pid)
+            {
+                starting[i].exited = 1;
+                starting[i].status = status;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Run the launcher until every worker has closed its socket. The launcher
+ * serves the requests of every worker as they come: a direct job is replied
+ * to as soon as it is spawned, and a managed job once its manager reports the
+ * pid of the job, so several managers may be starting at once. The pipes the
+ * managers report through are polled after the sockets of the workers and the
+ * signalfd, through which the launcher reaps the jobs it launched as SIGCHLD
+ * arrives. SIGINT from the terminal is ignored (as is SIGPIPE, inherited from
+ * the server): the launcher outlives the teardown of the server so it can reap
+ * the jobs being interrupted, which it waits for before it exits.
+ *
+ * @param socks
+ *        the launchers end of the socket of each worker, followed by a slot
+ *        for the signalfd, grown to hold the pipes of the managers
+ * @param nsocks
+ *        the amount of worker sockets
+ */
+static void run_launcher(struct pollfd *socks, int nsocks)
+{
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    signal(SIGINT, SIG_IGN);
+
+    socks[nsocks].fd = signalfd(-1, &chld, SFD_CLOEXEC);
+    socks[nsocks].events = POLLIN;
+
+    tracked_t *tracked = NULL;
+    size_t ntracked = 0;
+    size_t cap = 0;
+    starting_t *starting = NULL;
+    size_t nstarting = 0;
+    size_t startcap = 0;
+    struct pollfd *pipes = socks + nsocks + 1;
+    int open = nsocks;
+
+    while (open > 0)
+    {
+        if (poll(socks, nsocks + 1 + nstarting, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        /* Managers that reported, the last one takes the slot of each */
+        for (size_t i = 0; i < nstarting; )
+        {
+            if (pipes[i].revents == 0)
+            {
+                i++;
+                continue;
+            }
+
+            starting_t start = starting[i];
+            starting[i] = starting[--nstarting];
+            pipes[i] = pipes[nstarting];
+            if (finish_managed(&start) < 0)
+            {
+                continue;
+            }
+
+            launchmsg_t *msg = &start.msg;
+            if (start.exited) /* Reaped before its report was read */
+            {
+                report_exit(start.sock, msg->mpid, msg->pid, start.status);
+                continue;
+            }
+            track(&tracked, &ntracked, &cap, msg->mpid, msg->pid, start.sock);
+        }
+
+        if (socks[nsocks].revents & POLLIN) /* Children exited */
+        {
+            struct signalfd_siginfo info;
+            read(socks[nsocks].fd, &info, sizeof(info));
+            reap_children(tracked, &ntracked, starting, nstarting);
+        }
+
+        for (int i = 0; i < nsocks; i++)
+        {
+            if (socks[i].fd < 0 || socks[i].revents == 0)
+            {
+                continue;
+            }
+
+            launchmsg_t msg;
+            if (recv(socks[i].fd, &msg, sizeof(msg), 0) != sizeof(msg))
+            {
+                close(socks[i].fd); /* The server is shutting down */
+                socks[i].fd = -1;
+                open--;
+                continue;
+            }
+
+            if (nstarting == startcap)
+            {
+                startcap = startcap ? startcap * 2 : LAUNCH_TRACKED;
+                starting = realloc(starting, startcap * sizeof(starting_t));
+                socks = realloc(socks, (nsocks + 1 + startcap)
+                                       * sizeof(struct pollfd));
+                if (starting == NULL || socks == NULL)
+                {
+                    _exit(1);
+                }
+                pipes = socks + nsocks + 1;
+            }
+
+            int launched = launch(&msg, socks[i].fd, starting, nstarting,
+                                  socks, nsocks);
+            if (launched == 1) /* Its manager reports the pid later */
+            {
+                pipes[nstarting].fd = starting[nstarting].fds[0];
+                pipes[nstarting].events = POLLIN;
+                pipes[nstarting].revents = 0;
+                nstarting++;
+            }
+            else if (launched == 0)
+            {
+                pid_t pid = msg.mpid > 0 ? msg.mpid : msg.pid;
+                track(&tracked, &ntracked, &cap, pid, msg.pid, socks[i].fd);
+            }
+        }
+    }
+
+    /* No one is left to reply to, the jobs are interrupted once they start */
+    for (size_t i = 0; i < nstarting; i++)
+    {
+        finish_managed(&starting[i]);
+    }
+
+    /* The server interrupted every job on its way out, wait for them */
+    while (wait(NULL) > 0 || errno == EINTR);
+    _exit(0);
+}
+
+/*******************************************************************************
+ *                           Server Side Channel                               *
+ ******************************************************************************/
+
+/*
+ * Fork the launcher. This must happen before the server allocates its lists
+ * and starts its workers, so the launcher is a small single-threaded process
+ * and launching a job never copies the servers memory. Each worker gets a
+ * socket of its own to the launcher.
+ *
+ * @param nworkers
+ *        the amount of workers
+ * @param fds
+ *        filled with the servers end of the socket of each worker
+ *
+ * @return
+ *        -1:       the launcher could not be started
+ *        pid:      the pid of the launcher
+ */
+pid_t launcher_start(int nworkers, int fds[])
+{
+    struct pollfd *socks = calloc(nworkers + 1, sizeof(struct pollfd));
+    if (socks == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+        {
+            free(socks);
+            return -1;
+        }
+        fds[i] = pair[0];
+        socks[i].fd = pair[1];
+        socks[i].events = POLLIN;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        for (int i = 0; i < nworkers; i++)
+        {
+            close(fds[i]);
+        }
+        run_launcher(socks, nworkers);
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        close(socks[i].fd);
+    }
+    free(socks);
+    return pid;
+}
+
+/*
+ * Close the socket of every worker, which tells the launcher to exit, and reap
+ * the launcher.
+ *
+ * @param pid
+ *        the pid of the launcher
+ * @param nworkers
+ *        the amount of workers
+ * @param fds
+ *        the servers end of the socket of each worker
+ */
+void launcher_stop(pid_t pid, int nworkers, int fds[])
+{
+    for (int i = 0; i < nworkers; i++)
+    {
+        close(fds[i]);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Set up the channel of a worker to the launcher.
+ *
+ * @param fd
+ *        the workers end of the socket to the launcher
+ * @param fdset
+ *        the epoll instance of the worker
+ * @param slots
+ *        the most requests that can wait for a reply at once
+ *
+ * @return
+ *        NULL:         the channel could not be allocated
+ *        launcher:     the channel, ready to be registered with epoll
+ */
+launcher_t *launcher_init(int fd, connections_t *fdset, int slots)
+{
+    launcher_t *launcher = calloc(1, sizeof(struct launcher)
+                                     + slots * sizeof(pending_t));
+    if (launcher == NULL)
+    {
+        return NULL;
+    }
+    launcher->type = CONN_LAUNCHER;
+    launcher->fd = fd;
+    launcher->fdset = fdset;
+    launcher->slots = slots;
+    return launcher;
+}
+
+/*
+ * Ask the launcher to launch a job. The worker does not wait for the reply: it
+ * arrives on the workers socket (see launcher_recv()), and the client who ran
+ * the job is remembered until then. The caller must hold the joblist lock.
+ *
+ * @param launcher
+ *        the channel of the clients worker
+ * @param mode
+ *        how the job is launched
+ * @param args
+ *        the jobname and its arguments
+ * @param flags
+ *        the JOB_* flags the job gets once it is added to the joblist
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param limits
+ *        the resource limits the job is run with, if it is managed
+ * @param client
+ *        the client who invoked the command
+ *
+ * @return
+ *        -1:       the request could not be sent
+ *        0:        the request was sent
+ */
+int launcher_request(launcher_t *launcher, launchmode_t mode,
+                     const char *args, int flags, jobclass_t jobclass,
+                     const joblimits_t *limits, client_t *client)
+{
+    int id = 0;
+    while (id < launcher->slots && launcher->pending[id].busy)
+    {
+        id++;
+    }
+    if (id == launcher->slots)
+    {
+        return -1;
+    }
+
+    launchmsg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = LAUNCH_SPAWN;
+    msg.id = id;
+    msg.mode = mode;
+    msg.jobclass = jobclass;
+    msg.limits = *limits;
+    strncpy(msg.args, args, BUFSIZE);
+
+    pending_t *request = &launcher->pending[id];
+    clock_gettime(CLOCK_MONOTONIC, &request->start);
+    if (send_launchmsg(launcher->fd, &msg, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    request->busy = 1;
+    request->flags = flags;
+    request->jobclass = jobclass;
+    request->client = client;
+    return 0;
+}
+
+/*
+ * Receive a message from the launcher. For the reply to a request, the fds of
+ * the job are placed in fds (-1 where none were sent) and the request it
+ * answers is copied to request and released. The caller must hold the
+ * joblist lock.
+ *
+ * @param launcher
+ *        the channel of the worker
+ * @param msg
+ *        filled with the message
+ * @param fds
+ *        filled with the fds of a launched job
+ * @param request
+ *        filled with the request a reply answers
+ *
+ * @return
+ *        -1:       the launcher has exited
+ *        0:        no message is waiting
+ *        1:        a message was received
+ */
+int launcher_recv(launcher_t *launcher, launchmsg_t *msg, int fds[LAUNCH_FDS],
+                  pending_t *request)
+{
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int) * LAUNCH_FDS)];
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t nbytes = recvmsg(launcher->fd, &hdr, MSG_CMSG_CLOEXEC);
+    if (nbytes < 0 && errno == EAGAIN)
+    {
+        return 0;
+    }
+    if (nbytes != sizeof(*msg))
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < LAUNCH_FDS; i++)
+    {
+        fds[i] = -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+    }
+
+    if (msg->op == LAUNCH_SPAWN && msg->id >= 0
+        && msg->id < launcher->slots)
+    {
+        *request = launcher->pending[msg->id];
+        launcher->pending[msg->id].busy = 0;
+        launcher->pending[msg->id].client = NULL;
+    }
+    return 1;
+}
+
+/*
+ * Forget the client in every request still waiting for a reply, used when the
+ * client disconnects. Its jobs are still launched, without a watcher. The
+ * caller must hold the joblist lock.
+ *
+ * @param launcher
+ *        the channel of the clients worker
+ * @param client
+ *        the client that is closing
+ */
+void launcher_forget(launcher_t *launcher, client_t *client)
+{
+    for (int i = 0; i < launcher->slots; i++)
+    {
+        if (launcher->pending[i].client == client)
+        {
+            launcher->pending[i].client = NULL;
+        }
+    }
+}
@@ -0,0 +1,218 @@
+#include <string.h>
+
+#ifdef __SSE2__
+    #include <immintrin.h>
+#endif
+
+#include "headers/linebuf.h"
+
+/*******************************************************************************
+ *                              Newline Search                                 *
+ ******************************************************************************/
+
+/*
+ * Find the first '\n' between p and end. The bytes are compared 32 (AVX2) or
+ * 16 (SSE2) at a time, and whatever is left, or all of it on a machine with
+ * neither, is searched with memchr().
+ *
+ * @param p
+ *        where the search starts
+ * @param end
+ *        where the search ends
+ *
+ * @return
+ *        NULL:     there is no '\n'
+ *        p:        the first '\n'
+ */
+static const char *scan_newline(const char *p, const char *end)
+{
+#ifdef __AVX2__
+    const __m256i wide = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wide));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    return p < end ? memchr(p, '\n', end - p) : NULL;
+}
+
+/*
+ * Locate the first network newline (\r\n) in the first len bytes of buf, 
+ * which may or may not be '\0' terminated.
+ *
+ * @param buf
+ *        the bytes to search
+ * @param len
+ *        the amount of bytes in buf
+ *
+ * @return
+ *        -1:       no network newline was found
+ *        i+2:      the index of the byte directly after the network newline
+ */
+ssize_t find_crlf(const char *buf, size_t len)
+{
+    const char *p = buf + 1; /* A '\n' at the start ends no line */
+    const char *end = buf + len;
+
+    while (p < end && (p = scan_newline(p, end)) != NULL)
+    {
+        if (p[-1] == '\r')
+        {
+            return p + 1 - buf;
+        }
+        p++;
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ *                              Line Framing                                   *
+ ******************************************************************************/
+
+/*
+ * Prepare an empty line buffer over the given storage.
+ *
+ * @param lines
+ *        the line buffer
+ * @param buf
+ *        the storage, which has to outlive the line buffer
+ * @param size
+ *        the size of the storage, the longest line is one byte shorter
+ */
+void linebuf_init(linebuf_t *lines, char *buf, size_t size)
+{
+    lines->buf = buf;
+    lines->size = size;
+    lines->start = lines->end = lines->scan = 0;
+}
+
+/*
+ * Return where the next bytes received go. Once the end of the storage is
+ * reached, the incomplete line (if any) is moved to the front to make room,
+ * which is the only time the bytes are moved.
+ *
+ * @param lines
+ *        the line buffer
+ * @param room
+ *        set to the amount of bytes that fit, 0 if an incomplete line fills
+ *        the whole buffer (see linebuf_rest())
+ *
+ * @return
+ *        where the bytes go
+ */
+char *linebuf_space(linebuf_t *lines, size_t *room)
+{
+    if (lines->start == lines->end)
+    {
+        lines->start = lines->end = lines->scan = 0;
+    }
+    else if (lines->end == lines->size - 1 && lines->start > 0)
+    {
+        memmove(lines->buf, lines->buf + lines->start,
+                lines->end - lines->start);
+        lines->end -= lines->start;
+        lines->scan -= lines->start;
+        lines->start = 0;
+    }
+
+    *room = lines->size - 1 - lines->end;
+    return lines->buf + lines->end;
+}
+
+/*
+ * Account for bytes received where linebuf_space() pointed.
+ *
+ * @param lines
+ *        the line buffer
+ * @param nbytes
+ *        the amount of bytes received
+ */
+void linebuf_fill(linebuf_t *lines, size_t nbytes)
+{
+    lines->end += nbytes;
+}
+
+/*
+ * Consume the next complete line. The line is left where it is, with its 
+ * network newline replaced by a '\0', and stays valid until the next call to
+ * linebuf_space(). Only the bytes received since the last search are scanned.
+ *
+ * @param lines
+ *        the line buffer
+ * @param len
+ *        set to the length of the line, without its network newline
+ *
+ * @return
+ *        NULL:     no complete line has arrived
+ *        line:     the line
+ */
+char *linebuf_next(linebuf_t *lines, size_t *len)
+{
+    char *line = lines->buf + lines->start;
+    const char *p = lines->buf + lines->scan;
+    const char *end = lines->buf + lines->end;
+
+    while (p < end && (p = scan_newline(p, end)) != NULL)
+    {
+        if (p > line && p[-1] == '\r')
+        {
+            *len = p - 1 - line;
+            line[*len] = '\0';
+            lines->start = lines->scan = p + 1 - lines->buf;
+            return line;
+        }
+        p++;
+    }
+
+    lines->scan = lines->end;
+    return NULL;
+}
+
+/*
+ * Consume whatever is left of an incomplete line, used once it fills the
+ * whole buffer or no more bytes will arrive.
+ *
+ * @param lines
+ *        the line buffer
+ * @param len
+ *        set to the length of the bytes left
+ *
+ * @return
+ *        the bytes left, '\0' terminated
+ */
+char *linebuf_rest(linebuf_t *lines, size_t *len)
+{
+    char *rest = lines->buf + lines->start;
+    *len = lines->end - lines->start;
+    rest[*len] = '\0';
+
+    lines->start = lines->scan = lines->end;
+    return rest;
+}
+
+/*
+ * Return the amount of bytes received that are not yet consumed.
+ */
+size_t linebuf_pending(const linebuf_t *lines)
+{
+    return lines->end - lines->start;
+}
@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+
+#include "headers/serverdata.h"
+#include "headers/serverlog.h"
+#include "headers/logger.h"
+
+/* Bytes a formatted record may take in a batch */
+#define LOG_RECORD_MAX (LOG_PAYLOAD + 64)
+
+/* The ring of records on their way to the logger */
+static logslot_t *slots;
+
+/* The next position a producer claims, shared by every worker */
+static size_t tail;
+
+/* The next position the logger reads, only written by the logger */
+static size_t head;
+
+/* The directory of the log, and the segment written to (if open) */
+static const char *logdir;
+static logsegment_t segment;
+static int segmented;
+
+/* How the log rotates (see logger_set_rotation()) */
+static size_t rotatesize = SEG_SIZE;
+static unsigned long rotateage;
+static size_t keep = LOG_KEEP;
+
+/* The segment written to, which the compressor leaves alone */
+static unsigned long current;
+
+/* The compressor thread, woken whenever a segment is sealed */
+static pthread_t compressor;
+static pthread_mutex_t compresslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compresswake = PTHREAD_COND_INITIALIZER;
+static int compresspending;
+static int compressstop;
+static int compressing;
+
+/* The eventfd the logger sleeps on */
+static int wakefd = -1;
+
+/* Set while the logger sleeps, cleared by the producer that wakes it */
+static int sleeping;
+
+/* Set to make the logger drain the ring and exit */
+static int stopping;
+
+static pthread_t thread;
+
+/* Counters reported as records are lost, and on shutdown */
+static unsigned long logged;
+static unsigned long dropped;
+static unsigned long truncated;
+static unsigned long segments;
+static unsigned long syncs;
+static unsigned long compressed;
+static unsigned long pruned;
+
+/*******************************************************************************
+ *                              Log Helpers                                    *
+ ******************************************************************************/
+
+/*
+ * Write all of buf to fd, retrying short writes. A failure is given up on,
+ * since nothing more can be done about the log from here.
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t nbytes = write(fd, buf, len);
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            return;
+        }
+        buf += nbytes;
+        len -= nbytes;
+    }
+}
+
+/*
+ * Nanoseconds since the epoch, the time records are logged at.
+ */
+static int64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Milliseconds of CLOCK_MONOTONIC, used to pace the syncs.
+ */
+static unsigned long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+/*
+ * Seal the segment written to, wake the compressor for it and move on to a
+ * new segment. If no segment can be created the log is given up on, and the
+ * records only go to stdout.
+ *
+ * @param time
+ *        the time the new segment is created, in nanoseconds since the epoch
+ */
+static void rotate_segment(int64_t time)
+{
+    unsigned long seqno = segment.seqno + 1;
+    segment_close(&segment);
+
+    if (segment_create(&segment, logdir, seqno, rotatesize, time) < 0)
+    {
+        perror("[SERVER] log segment");
+        segmented = 0;
+        return;
+    }
+    segments++;
+    __atomic_store_n(&current, seqno, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&compresslock);
+    compresspending = 1;
+    pthread_cond_signal(&compresswake);
+    pthread_mutex_unlock(&compresslock);
+}
+
+/*
+ * Append a record to the segment, moving on to a new segment once it is full.
+ */
+static void append_record(logtype_t type, int clientfd, pid_t pid,
+                          int64_t time, const void *data, size_t len)
+{
+    if (!segmented)
+    {
+        return;
+    }
+    if (segment_append(&segment, type, clientfd, pid, time, data, len) == 0)
+    {
+        return;
+    }
+
+    rotate_segment(time);
+    if (segmented)
+    {
+        segment_append(&segment, type, clientfd, pid, time, data, len);
+    }
+}
+
+/*
+ * Run the compressor until it is stopped. Each time a segment is sealed, every
+ * segment of the log directory besides the one written to is compressed (so
+ * segments a previous run left are too), then the oldest are deleted down to
+ * the amount kept. This is left to its own thread, so the logger never waits
+ * on zlib.
+ *
+ * @param arg
+ *        unused
+ */
+static void *run_compressor(void *arg)
+{
+    pthread_mutex_lock(&compresslock);
+    while (1)
+    {
+        while (!compresspending && !compressstop)
+        {
+            pthread_cond_wait(&compresswake, &compresslock);
+        }
+        if (compressstop)
+        {
+            break;
+        }
+        compresspending = 0;
+        pthread_mutex_unlock(&compresslock);
+
+        unsigned long writing = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+        struct dirent **entries;
+        int count = scandir(logdir, &entries, segment_filter, alphasort);
+        for (int i = 0; i < count; i++)
+        {
+            unsigned long seqno;
+            sscanf(entries[i]->d_name, "segment-%lu", &seqno);
+            if (seqno != writing && !strstr(entries[i]->d_name, SEG_GZ)
+                && segment_compress(logdir, seqno) == 0)
+            {
+                __atomic_fetch_add(&compressed, 1, __ATOMIC_RELAXED);
+            }
+            free(entries[i]);
+        }
+        if (count >= 0)
+        {
+            free(entries);
+        }
+
+        int deleted = segment_prune(logdir, writing, keep);
+        if (deleted > 0)
+        {
+            __atomic_fetch_add(&pruned, deleted, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&compresslock);
+    }
+    pthread_mutex_unlock(&compresslock);
+    return NULL;
+}
+
+/*
+ * Run the logger until it is stopped. The ring is drained into the segment,
+ * and into a batch of text for stdout which is written out once it fills up
+ * and whenever the ring runs dry. The segment is synced at most every
+ * LOG_FSYNC_MS while it is written to. Lines of output that were dropped
+ * because the ring was full are reported in the log where they went missing.
+ * The logger sleeps for up to LOG_FLUSH_MS when the ring is empty, producers
+ * only wake it early once the ring is filling up.
+ *
+ * @param arg
+ *        unused
+ */
+static void *run_logger(void *arg)
+{
+    static char batch[LOG_BATCH_SIZE];
+    size_t inbatch = 0;
+    unsigned long reported = 0;
+    unsigned long synced = now_ms();
+    int dirty = 0;
+
+    while (1)
+    {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+        while (1)
+        {
+            logslot_t *slot = &slots[head & (LOG_SLOTS - 1)];
+            size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq != head + 1) /* Empty, or the producer is still writing */
+            {
+                break;
+            }
+
+            if (inbatch + LOG_RECORD_MAX > LOG_BATCH_SIZE)
+            {
+                write_all(STDOUT_FILENO, batch, inbatch);
+                inbatch = 0;
+            }
+            inbatch += format_record(slot->type, slot->clientfd, slot->pid,
+                                     slot->data, batch + inbatch,
+                                     LOG_BATCH_SIZE - inbatch);
+            append_record(slot->type, slot->clientfd, slot->pid, slot->time,
+                          slot->data, slot->len);
+            logged++;
+            dirty = 1;
+
+            __atomic_store_n(&slot->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+            __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        unsigned long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+        if (lost != reported)
+        {
+            int len = snprintf(batch + inbatch, LOG_BATCH_SIZE - inbatch,
+                               LOG_DROPPED, lost - reported);
+            append_record(LOG_TEXT, -1, 0, now_ns(), batch + inbatch, len);
+            inbatch += len;
+            reported = lost;
+        }
+
+        write_all(STDOUT_FILENO, batch, inbatch);
+        inbatch = 0;
+
+        /* Rotate a segment that has been written to for long enough */
+        int64_t now = now_ns();
+        if (rotateage > 0 && segmented && segment.header->used > SEG_DATA
+            && now - segment.header->created >= rotateage * 1000000000LL)
+        {
+            rotate_segment(now);
+        }
+
+        if (dirty && segmented && now_ms() - synced >= LOG_FSYNC_MS)
+        {
+            segment_sync(&segment);
+            syncs++;
+            synced = now_ms();
+            dirty = 0;
+        }
+
+        if (stop)
+        {
+            break;
+        }
+
+        /* Nothing left, sleep unless a record arrived in the meantime */
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tail, __ATOMIC_SEQ_CST) == head)
+        {
+            struct pollfd pfd = { .fd = wakefd, .events = POLLIN };
+            if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+            {
+                uint64_t count;
+                read(wakefd, &count, sizeof(count));
+            }
+        }
+        __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ *                             Asynchronous Log                                *
+ ******************************************************************************/
+
+/*
+ * Create the log directory (if it doesn't exist, make one), start a segment
+ * after the last one in it and start the logger thread. Until the logger is
+ * started, and once it is stopped, records are written straight to the log.
+ *
+ * @param dir
+ *        the log directory
+ *
+ * @return
+ *        -1:       the log could not be created or the logger started
+ *        0:        the logger is running
+ */
+int logger_start(const char *dir)
+{
+    logdir = dir;
+    current = segment_last(dir) + 1;
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST)
+        || segment_create(&segment, dir, current, rotatesize, now_ns()) < 0)
+    {
+        return -1;
+    }
+    segmented = 1;
+    segments = 1;
+
+    slots = calloc(LOG_SLOTS, sizeof(logslot_t));
+    wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (slots == NULL || wakefd < 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+    {
+        slots[i].seq = i;
+    }
+
+    /* Signals are left to the workers */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int failed = pthread_create(&thread, NULL, run_logger, NULL);
+    if (!failed)
+    {
+        /* Catch up on the segments a previous run left uncompressed */
+        compresspending = 1;
+        compressing = !pthread_create(&compressor, NULL, run_compressor, NULL);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (failed)
+    {
+        free(slots);
+        slots = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set how the log rotates, before the logger is started. A segment is sealed
+ * once it is full or once it is age seconds old, and sealed segments are
+ * compressed in the background.
+ *
+ * @param size
+ *        the bytes of a segment, kept between the header and SEG_SIZE
+ * @param age
+ *        the most seconds a segment is written to, 0 for no limit
+ * @param count
+ *        the amount of sealed segments kept, 0 to keep every segment
+ */
+void logger_set_rotation(size_t size, unsigned long age, size_t count)
+{
+    if (size < SEG_DATA + SEG_BLOCK)
+    {
+        size = SEG_DATA + SEG_BLOCK;
+    }
+    rotatesize = size < SEG_SIZE ? size : SEG_SIZE;
+    rotateage = age;
+    keep = count;
+}
+
+/*
+ * Stop the logger once it has written every record in the ring. The segment
+ * stays open for the records of the shutdown itself (see logger_close()).
+ */
+void logger_stop(void)
+{
+    if (slots == NULL)
+    {
+        return;
+    }
+
+    uint64_t wake = 1;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    write(wakefd, &wake, sizeof(wake));
+    pthread_join(thread, NULL);
+
+    free(slots);
+    slots = NULL;
+    close(wakefd);
+}
+
+/*
+ * Seal the segment written to once the logger is stopped, and stop the
+ * compressor. A segment being compressed is finished, the segment sealed here
+ * is compressed by the next run of the server.
+ */
+void logger_close(void)
+{
+    if (segmented)
+    {
+        segment_close(&segment);
+        segmented = 0;
+    }
+
+    if (compressing)
+    {
+        pthread_mutex_lock(&compresslock);
+        compressstop = 1;
+        pthread_cond_signal(&compresswake);
+        pthread_mutex_unlock(&compresslock);
+        pthread_join(compressor, NULL);
+        compressing = 0;
+    }
+}
+
+/*
+ * Wake the logger if it is asleep. Only the producer that clears sleeping
+ * writes the eventfd, so a burst of records wakes it once.
+ */
+static void wake_logger(void)
+{
+    int asleep = 1;
+    if (__atomic_compare_exchange_n(&sleeping, &asleep, 0, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        uint64_t wake = 1;
+        write(wakefd, &wake, sizeof(wake));
+    }
+}
+
+/*
+ * Append a record to the log. The record is placed in the ring for the logger
+ * to format and write. A line of job output never blocks: once fewer than
+ * LOG_RESERVED slots are free it is dropped and counted (see run_logger()).
+ * The slots it leaves are kept for the audit trail, the messages of the
+ * server, the commands of the clients and the exits of the jobs, which are
+ * never dropped: if even the reserve is used up, the producer wakes the
+ * logger and waits for a slot. A payload longer than LOG_PAYLOAD is
+ * truncated, and counted.
+ *
+ * @param type
+ *        what the record holds
+ * @param clientfd
+ *        the client a command came from, -1 if none
+ * @param pid
+ *        the job the record is about, 0 if none
+ * @param data len
+ *        the payload and its length
+ */
+void logger_push(logtype_t type, int clientfd, pid_t pid, const void *data,
+                 size_t len)
+{
+    int output = type == LOG_STDOUT || type == LOG_STDERR;
+
+    if (len >= LOG_PAYLOAD)
+    {
+        len = LOG_PAYLOAD - 1;
+        __atomic_fetch_add(&truncated, 1, __ATOMIC_RELAXED);
+    }
+
+    if (slots == NULL) /* No logger running, write the record out */
+    {
+        char text[LOG_PAYLOAD];
+        char buf[LOG_RECORD_MAX];
+        memcpy(text, data, len);
+        text[len] = '\0';
+
+        size_t formatted = format_record(type, clientfd, pid, text, buf,
+                                         sizeof(buf));
+        write_all(STDOUT_FILENO, buf, formatted);
+        append_record(type, clientfd, pid, now_ns(), text, len);
+        return;
+    }
+
+    /* Claim a slot, output only outside of the reserve */
+    logslot_t *slot;
+    size_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    while (1)
+    {
+        slot = &slots[pos & (LOG_SLOTS - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos)
+        {
+            if (output && pos - __atomic_load_n(&head, __ATOMIC_ACQUIRE)
+                          >= LOG_SLOTS - LOG_RESERVED)
+            {
+                __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (seq < pos) /* Full */
+        {
+            if (output)
+            {
+                __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            wake_logger();
+            sched_yield();
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->type = type;
+    slot->clientfd = clientfd;
+    slot->pid = pid;
+    slot->time = now_ns();
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    slot->data[len] = '\0';
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* The logger is asleep and the ring is filling up */
+    if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)
+        && pos + 1 - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= LOG_SLOTS / 4)
+    {
+        wake_logger();
+    }
+}
+
+/*
+ * Format the amount of records logged, the segments they took, the records
+ * that were lost and the segments compressed and deleted, reported on
+ * shutdown.
+ *
+ * @param buf
+ *        the buffer to format the statistics into
+ * @param size
+ *        the size of buf
+ */
+void logger_report_stats(char *buf, size_t size)
+{
+    snprintf(buf, size, LOG_STATS, logged, segments, syncs, dropped,
+             truncated, __atomic_load_n(&compressed, __ATOMIC_RELAXED),
+             __atomic_load_n(&pruned, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "headers/serverdata.h"
+#include "headers/serverlog.h"
+#include "headers/logger.h"
+#include "headers/logsegment.h"
+
+#define USAGE "Usage:\n\tlogquery [-d logdir] [-j pid] [-c clientfd] "       \
+              "[-s since] [-u until] [-t type]...\n"                         \
+              "\ttimes are seconds since the epoch or "                      \
+              "\"YYYY-MM-DD HH:MM:SS\"\n"                                    \
+              "\ttypes are text, command, stdout, stderr, exit and signal\n"
+#define QUERY_STATS "%lu records matched, %lu of %lu blocks read in %lu " \
+                    "segments\n"
+
+/* The names of the record types, as -t takes them */
+static const char *typenames[LOG_TYPES] =
+{
+    "text", "command", "stdout", "stderr", "exit", "signal"
+};
+
+/*
+ * What the records are filtered by. A record is shown if it matches all of
+ * the filters that are set.
+ *
+ * @data pid
+ *        the job of the records, -1 for any
+ * @data clientfd
+ *        the client of the records, -1 for any
+ * @data since until
+ *        the time range of the records, in nanoseconds since the epoch
+ * @data types
+ *        a bit for each type of record to show
+ */
+typedef struct query
+{
+    pid_t pid;
+    int clientfd;
+    int64_t since;
+    int64_t until;
+    uint32_t types;
+
+} query_t;
+
+/* What the query cost, reported once it is done */
+static unsigned long matched, blocksread, blocks, segments;
+
+/*
+ * Parse a time given on the command line, as seconds since the epoch or as a
+ * local date and time.
+ *
+ * @return
+ *        -1:       the time could not be parsed
+ *        time:     the time in nanoseconds since the epoch
+ */
+static int64_t parse_time(const char *arg)
+{
+    struct tm tm;
+    char *end;
+    long secs = strtol(arg, &end, 10);
+
+    if (*end != '\0')
+    {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_isdst = -1;
+        end = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+        if (end == NULL || *end != '\0')
+        {
+            return -1;
+        }
+        secs = mktime(&tm);
+    }
+    return secs * 1000000000LL;
+}
+
+/*
+ * Whether an entry of the sparse index may hold a record the query matches.
+ * Blooms may match records that are not there, never the other way around.
+ */
+static int may_match(const segblock_t *block, const query_t *query)
+{
+    return block->count > 0
+        && (block->types & query->types)
+        && block->last >= query->since && block->first <= query->until
+        && (query->pid < 0
+            || (block->pids & segment_bloom(query->pid))
+               == segment_bloom(query->pid))
+        && (query->clientfd < 0
+            || (block->clients & segment_bloom(query->clientfd))
+               == segment_bloom(query->clientfd));
+}
+
+/*
+ * Show a record the query matches, prefixed by the time it was logged.
+ */
+static void show_record(const segrecord_t *record)
+{
+    char text[LOG_PAYLOAD + 64];
+    char stamp[32];
+    time_t secs = record->time / 1000000000LL;
+    struct tm *tm = localtime(&secs);
+
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", tm);
+    size_t len = format_record(record->type, record->clientfd, record->pid,
+                               record->data, text, sizeof(text));
+    printf("%s.%03lld %.*s", stamp,
+           (long long) (record->time / 1000000 % 1000), (int) len, text);
+}
+
+/*
+ * Show the records of a segment the query matches, only reading the blocks
+ * the sparse index says may hold one. A compressed segment is skipped whole
+ * if its header says it holds no match, or decompressed.
+ */
+static void query_segment(logsegment_t *seg, const query_t *query)
+{
+    uint64_t used = __atomic_load_n(&seg->header->used, __ATOMIC_ACQUIRE);
+
+    segments++;
+    blocks += (used + SEG_BLOCK - 1) / SEG_BLOCK;
+    if (!may_match(&seg->header->summary, query))
+    {
+        return;
+    }
+    if (segment_load(seg) < 0) /* Only a compressed segment is read whole */
+    {
+        fprintf(stderr, "[LOGQUERY] Segment %lu is corrupt\n", seg->seqno);
+        return;
+    }
+
+    const segheader_t *header = seg->header;
+    for (size_t i = 0; i < SEG_BLOCKS && i * SEG_BLOCK < used; i++)
+    {
+        const segblock_t *block = &header->blocks[i];
+        if (!may_match(block, query))
+        {
+            continue;
+        }
+        blocksread++;
+
+        uint64_t offset = block->offset;
+        while (offset < used && offset / SEG_BLOCK == i)
+        {
+            const segrecord_t *record =
+                (const segrecord_t *) ((const char *) header + offset);
+            if (record->size == 0) /* Torn by a crash */
+            {
+                break;
+            }
+            offset += record->size;
+
+            if ((query->types & (1u << record->type))
+                && record->time >= query->since
+                && record->time <= query->until
+                && (query->pid < 0 || record->pid == query->pid)
+                && (query->clientfd < 0
+                    || record->clientfd == query->clientfd))
+            {
+                show_record(record);
+                matched++;
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    query_t query = { -1, -1, 0, INT64_MAX, 0 };
+    const char *logdir = LOG_DIR;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:j:c:s:u:t:")) != -1)
+    {
+        int type;
+        switch (opt)
+        {
+            case 'd': /* Directory of the log segments */
+                logdir = optarg;
+                break;
+            case 'j': /* Records about a job */
+                query.pid = strtol(optarg, NULL, 10);
+                break;
+            case 'c': /* Commands of a client */
+                query.clientfd = strtol(optarg, NULL, 10);
+                break;
+            case 's': /* Records logged since */
+            case 'u': /* Records logged until */
+                if (parse_time(optarg) < 0)
+                {
+                    fprintf(stderr, USAGE);
+                    exit(1);
+                }
+                *(opt == 's' ? &query.since : &query.until) =
+                    parse_time(optarg);
+                break;
+            case 't': /* Records of a type, may be given more than once */
+                for (type = 0; type < LOG_TYPES; type++)
+                {
+                    if (strcmp(optarg, typenames[type]) == 0)
+                    {
+                        query.types |= 1u << type;
+                        break;
+                    }
+                }
+                if (type < LOG_TYPES)
+                {
+                    break;
+                }
+                /* Fall through, the type is not known */
+            default:
+                fprintf(stderr, USAGE);
+                exit(1);
+        }
+    }
+    if (query.types == 0)
+    {
+        query.types = (1u << LOG_TYPES) - 1;
+    }
+
+    struct dirent **entries;
+    int count = scandir(logdir, &entries, segment_filter, alphasort);
+    if (count < 0)
+    {
+        perror("[LOGQUERY] scandir");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        char path[BUFSIZE + sizeof(entries[i]->d_name) + 1];
+        logsegment_t seg;
+
+        snprintf(path, sizeof(path), "%s/%s", logdir, entries[i]->d_name);
+        if (segment_open(&seg, path) == 0)
+        {
+            query_segment(&seg, &query);
+            segment_release(&seg);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    fflush(stdout);
+    fprintf(stderr, QUERY_STATS, matched, blocksread, blocks, segments);
+    return 0;
+}
@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "headers/serverdata.h"
+#include "headers/serverlog.h"
+#include "headers/logsegment.h"
+
+/*******************************************************************************
+ *                             Segment Helpers                                 *
+ ******************************************************************************/
+
+/*
+ * Add a record to an entry of the index.
+ */
+static void index_record(segblock_t *block, const segrecord_t *record,
+                         uint32_t offset)
+{
+    if (block->count++ == 0)
+    {
+        block->offset = offset;
+        block->first = record->time;
+    }
+    block->last = record->time;
+    block->types |= 1u << record->type;
+    block->pids |= segment_bloom(record->pid);
+    block->clients |= segment_bloom(record->clientfd);
+}
+
+/*
+ * Reserve the whole segment on disk, so writing through the mapping never
+ * finds the disk full. File systems without fallocate get a sparse file.
+ */
+static int preallocate(int fd, size_t size)
+{
+    if (fallocate(fd, 0, 0, size) == 0)
+    {
+        return 0;
+    }
+    return errno == EOPNOTSUPP ? ftruncate(fd, size) : -1;
+}
+
+/*
+ * Whether the segment of a name is compressed.
+ */
+static int is_compressed(const char *name)
+{
+    size_t len = strlen(name);
+    return len > strlen(SEG_GZ)
+        && strcmp(name + len - strlen(SEG_GZ), SEG_GZ) == 0;
+}
+
+/*******************************************************************************
+ *                              Log Segments                                   *
+ ******************************************************************************/
+
+/*
+ * Find the last segment of a log directory, so the server carries on after it
+ * rather than writing over it.
+ *
+ * @param dir
+ *        the log directory
+ *
+ * @return
+ *        0:        the directory holds no segments
+ *        seqno:    the highest sequence number of a segment in the directory
+ */
+unsigned long segment_last(const char *dir)
+{
+    DIR *logdir = opendir(dir);
+    unsigned long last = 0;
+    struct dirent *entry;
+
+    if (logdir == NULL)
+    {
+        return 0;
+    }
+    while ((entry = readdir(logdir)) != NULL)
+    {
+        unsigned long seqno;
+        if (sscanf(entry->d_name, "segment-%lu", &seqno) == 1 && seqno > last)
+        {
+            last = seqno;
+        }
+    }
+    closedir(logdir);
+    return last;
+}
+
+/*
+ * Filter the segments, compressed or not, out of the entries of a log
+ * directory for scandir(). The sequence numbers are padded, so alphasort()
+ * sorts the segments in the order they were written.
+ */
+int segment_filter(const struct dirent *entry)
+{
+    unsigned long seqno;
+    return sscanf(entry->d_name, "segment-%lu", &seqno) == 1;
+}
+
+/*
+ * Create a segment in the log directory, preallocate it and map it to be
+ * written to.
+ *
+ * @param seg
+ *        the segment to create
+ * @param dir
+ *        the log directory
+ * @param seqno
+ *        the sequence number of the segment, which names it
+ * @param size
+ *        the bytes of the segment, at most SEG_SIZE
+ * @param time
+ *        the time the segment is created, in nanoseconds since the epoch
+ *
+ * @return
+ *        -1:       the segment could not be created, errno is set
+ *        0:        the segment is mapped and empty
+ */
+int segment_create(logsegment_t *seg, const char *dir, unsigned long seqno,
+                   size_t size, int64_t time)
+{
+    char path[BUFSIZE + 1];
+    snprintf(path, sizeof(path), "%s/" SEG_NAME, dir, seqno);
+
+    seg->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (seg->fd < 0)
+    {
+        return -1;
+    }
+
+    seg->header = MAP_FAILED;
+    if (preallocate(seg->fd, size) < 0
+        || (seg->header = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+    {
+        close(seg->fd);
+        unlink(path);
+        return -1;
+    }
+
+    memcpy(seg->header->magic, SEG_MAGIC, sizeof(seg->header->magic));
+    seg->header->version = SEG_VERSION;
+    seg->header->seqno = seqno;
+    seg->header->size = size;
+    seg->header->created = time;
+    seg->header->used = SEG_DATA;
+    seg->size = size;
+    seg->seqno = seqno;
+    seg->gz = NULL;
+    return 0;
+}
+
+/*
+ * Append a record to a segment and index it. The record is visible to a
+ * reader of the segment once used is updated past it.
+ *
+ * @param seg
+ *        the segment to append to
+ * @param type clientfd pid time
+ *        what the record holds, who it is about and when it was logged
+ * @param data len
+ *        the payload and its length, stored '\0' terminated
+ *
+ * @return
+ *        -1:       the segment is full
+ *        0:        the record was appended
+ */
+int segment_append(logsegment_t *seg, logtype_t type, int clientfd, pid_t pid,
+                   int64_t time, const void *data, size_t len)
+{
+    segheader_t *header = seg->header;
+    size_t size = (sizeof(segrecord_t) + len + 1 + SEG_ALIGN - 1)
+                  & ~(size_t) (SEG_ALIGN - 1);
+
+    if (header->used + size > header->size)
+    {
+        return -1;
+    }
+
+    segrecord_t *record = (segrecord_t *) ((char *) header + header->used);
+    record->size = size;
+    record->type = type;
+    record->len = len;
+    record->clientfd = clientfd;
+    record->pid = pid;
+    record->time = time;
+    memcpy(record->data, data, len);
+    record->data[len] = '\0';
+
+    index_record(&header->blocks[header->used / SEG_BLOCK], record,
+                 header->used);
+    index_record(&header->summary, record, header->used);
+    __atomic_store_n(&header->used, header->used + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Write the records appended to the segment so far to disk.
+ */
+void segment_sync(logsegment_t *seg)
+{
+    msync(seg->header, seg->header->used, MS_SYNC);
+}
+
+/*
+ * Seal a segment that is written to, sync it and unmap it.
+ *
+ * @param seg
+ *        the segment to close
+ */
+void segment_close(logsegment_t *seg)
+{
+    seg->header->sealed = 1;
+    segment_sync(seg);
+    munmap(seg->header, seg->size);
+    close(seg->fd);
+}
+
+/*
+ * Open an existing segment to be read. A segment is mapped, a compressed
+ * segment only has its header read until segment_load() reads the rest.
+ *
+ * @param seg
+ *        the segment to open
+ * @param path
+ *        the segment file
+ *
+ * @return
+ *        -1:       the file could not be read or is not a segment
+ *        0:        the header of the segment can be read
+ */
+int segment_open(logsegment_t *seg, const char *path)
+{
+    struct stat st;
+
+    seg->fd = -1;
+    seg->gz = NULL;
+    seg->header = NULL;
+    if (is_compressed(path))
+    {
+        seg->size = SEG_DATA;
+        if ((seg->gz = gzopen(path, "rb")) == NULL
+            || (seg->header = malloc(SEG_DATA)) == NULL
+            || gzread(seg->gz, seg->header, SEG_DATA) != (int) SEG_DATA)
+        {
+            segment_release(seg);
+            return -1;
+        }
+    }
+    else
+    {
+        if ((seg->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            return -1;
+        }
+        if (fstat(seg->fd, &st) < 0 || st.st_size < (off_t) SEG_DATA
+            || (seg->header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                                   seg->fd, 0)) == MAP_FAILED)
+        {
+            close(seg->fd);
+            return -1;
+        }
+        seg->size = st.st_size;
+    }
+
+    segheader_t *header = seg->header;
+    if (memcmp(header->magic, SEG_MAGIC, sizeof(header->magic))
+        || header->version != SEG_VERSION || header->size > SEG_SIZE
+        || header->used < SEG_DATA || header->used > header->size
+        || (seg->gz == NULL && header->size != seg->size))
+    {
+        segment_release(seg);
+        return -1;
+    }
+    seg->seqno = header->seqno;
+    return 0;
+}
+
+/*
+ * Read the records of a compressed segment, past its header. A mapped segment
+ * has nothing left to read.
+ *
+ * @param seg
+ *        the opened segment
+ *
+ * @return
+ *        -1:       the segment could not be read whole
+ *        0:        the records of the segment can be read
+ */
+int segment_load(logsegment_t *seg)
+{
+    if (seg->gz == NULL)
+    {
+        return 0;
+    }
+
+    size_t used = seg->header->used;
+    segheader_t *header = realloc(seg->header, used);
+    if (header == NULL)
+    {
+        return -1;
+    }
+    seg->header = header;
+
+    int nread = gzread(seg->gz, (char *) header + SEG_DATA, used - SEG_DATA);
+    gzclose(seg->gz);
+    seg->gz = NULL;
+    if (nread != (int) (used - SEG_DATA))
+    {
+        return -1;
+    }
+    seg->size = used;
+    return 0;
+}
+
+/*
+ * Release a segment that was read.
+ */
+void segment_release(logsegment_t *seg)
+{
+    if (seg->fd >= 0)
+    {
+        munmap(seg->header, seg->size);
+        close(seg->fd);
+        return;
+    }
+    if (seg->gz != NULL)
+    {
+        gzclose(seg->gz);
+    }
+    free(seg->header);
+}
+
+/*******************************************************************************
+ *                              Log Retention                                  *
+ ******************************************************************************/
+
+/*
+ * Compress a segment that is no longer written to. Only the records written
+ * to it are compressed, not the rest of the preallocated file. The segment is
+ * compressed to a temporary file, which replaces it once it is complete, so a
+ * query never finds half a segment.
+ *
+ * @param dir
+ *        the log directory
+ * @param seqno
+ *        the sequence number of the segment
+ *
+ * @return
+ *        -1:       the segment could not be compressed, and is left as it is
+ *        0:        the segment was replaced by its compressed form
+ */
+int segment_compress(const char *dir, unsigned long seqno)
+{
+    char path[BUFSIZE + 1], gzpath[BUFSIZE + 1], tmppath[BUFSIZE + 1];
+    snprintf(path, sizeof(path), "%s/" SEG_NAME, dir, seqno);
+    snprintf(gzpath, sizeof(gzpath), "%s/" SEG_NAME SEG_GZ, dir, seqno);
+    snprintf(tmppath, sizeof(tmppath), "%s/" SEG_TMP, dir, seqno);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *buf = malloc(SEG_BLOCK);
+    gzFile gz = NULL;
+    int failed = fd < 0 || buf == NULL
+                 || (gz = gzopen(tmppath, "wb")) == NULL;
+
+    /* The header is in the first block, it says how much of the rest to read */
+    size_t used = SEG_BLOCK;
+    for (size_t done = 0; !failed && done < used; )
+    {
+        ssize_t nread = pread(fd, buf, SEG_BLOCK, done);
+        if (nread <= 0)
+        {
+            failed = 1;
+            break;
+        }
+        if (done == 0)
+        {
+            used = ((segheader_t *) buf)->used;
+        }
+        if ((size_t) nread > used - done)
+        {
+            nread = used - done;
+        }
+        failed = gzwrite(gz, buf, nread) != nread;
+        done += nread;
+    }
+
+    if (gz != NULL && gzclose(gz) != Z_OK)
+    {
+        failed = 1;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(buf);
+
+    if (failed || rename(tmppath, gzpath) < 0)
+    {
+        unlink(tmppath);
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+/*
+ * Delete the oldest segments of a log directory, so it keeps at most keep of
+ * them besides the one written to.
+ *
+ * @param dir
+ *        the log directory
+ * @param current
+ *        the sequence number of the segment written to, which is kept
+ * @param keep
+ *        the amount of older segments to keep, 0 to keep every segment
+ *
+ * @return
+ *        -1:       the directory could not be read
+ *        n:        the amount of segments deleted
+ */
+int segment_prune(const char *dir, unsigned long current, size_t keep)
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, segment_filter, alphasort);
+    int deleted = 0;
+
+    if (count < 0)
+    {
+        return -1;
+    }
+
+    size_t older = 0;
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long seqno;
+        sscanf(entries[i]->d_name, "segment-%lu", &seqno);
+        older += seqno != current;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long seqno;
+        char path[BUFSIZE + sizeof(entries[i]->d_name) + 1];
+
+        sscanf(entries[i]->d_name, "segment-%lu", &seqno);
+        if (keep > 0 && older > keep && seqno != current)
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+            if (unlink(path) == 0)
+            {
+                deleted++;
+            }
+            older--;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return deleted;
+}
+
+/*******************************************************************************
+ *                            Record Formatting                                *
+ ******************************************************************************/
+
+/*
+ * The bits a job or client sets in the bloom filters of the sparse index.
+ */
+uint64_t segment_bloom(int32_t key)
+{
+    uint64_t hash = (uint64_t) (uint32_t) key * 0x9E3779B97F4A7C15ULL;
+    return (1ULL << (hash >> 58)) | (1ULL << ((hash >> 52) & 63));
+}
+
+/*
+ * Format a record the way it is logged, the same as it is sent to clients.
+ *
+ * @param type clientfd pid
+ *        what the record holds and who it is about
+ * @param data
+ *        the payload, '\0' terminated
+ * @param buf size
+ *        where the record is formatted to, and its size
+ *
+ * @return
+ *        the length of the formatted record, cut short at size - 1
+ */
+size_t format_record(logtype_t type, int clientfd, pid_t pid, const char *data,
+                     char *buf, size_t size)
+{
+    int status;
+    int len;
+
+    switch (type)
+    {
+        case LOG_COMMAND:
+            len = snprintf(buf, size, CLIENT_CMD, clientfd, data);
+            break;
+        case LOG_STDOUT:
+            len = snprintf(buf, size, JOB_STDOUT, pid, data);
+            break;
+        case LOG_STDERR:
+            len = snprintf(buf, size, JOB_STDERR, pid, data);
+            break;
+        case LOG_EXIT:
+            memcpy(&status, data, sizeof(int));
+            len = snprintf(buf, size, JOB_EXIT, pid, status, "");
+            break;
+        case LOG_SIGNAL:
+            len = snprintf(buf, size, JOB_SIGNAL, pid, "");
+            break;
+        default:
+            len = snprintf(buf, size, "%s", data);
+            break;
+    }
+
+    if (len < 0)
+    {
+        return 0;
+    }
+    return (size_t) len < size ? (size_t) len : size - 1;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "headers/objpool.h"
+
+/*******************************************************************************
+ *                              Pool Helpers                                   *
+ ******************************************************************************/
+
+/*
+ * Allocate a new slab and put all of its objects on the freelist. The caller
+ * must hold the pools lock.
+ *
+ * @param pool
+ *        the pool to grow
+ *
+ * @return
+ *        -1:       the slab could not be allocated
+ *        0:        the freelist holds the objects of the new slab
+ */
+static int grow(objpool_t *pool)
+{
+    size_t count = (POOL_SLAB_SIZE - POOL_ALIGN) / pool->objsize;
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    void *mem;
+    if (posix_memalign(&mem, POOL_ALIGN, POOL_ALIGN + count * pool->objsize))
+    {
+        return -1;
+    }
+    slab_t *slab = mem;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+
+    /* Chain the objects from the back, so they are handed out in order */
+    char *objs = (char *) slab + POOL_ALIGN;
+    for (size_t i = count; i > 0; i--)
+    {
+        void *obj = objs + (i - 1) * pool->objsize;
+        *(void **) obj = pool->freelist;
+        pool->freelist = obj;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ *                              Object Pool                                    *
+ ******************************************************************************/
+
+/*
+ * Hand out an object of the pools type. The object is not cleared.
+ *
+ * @param pool
+ *        the pool to allocate from
+ *
+ * @return
+ *        NULL:     no slab could be allocated for the object
+ *        obj:      the object, aligned to a cache line
+ */
+void *pool_alloc(objpool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freelist == NULL && grow(pool) < 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    void *obj = pool->freelist;
+    pool->freelist = *(void **) obj;
+    if (++pool->live > pool->highwater)
+    {
+        pool->highwater = pool->live;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+}
+
+/*
+ * Give an object back to its pool, to be handed out again.
+ *
+ * @param pool
+ *        the pool the object was allocated from
+ * @param obj
+ *        the object, may be NULL
+ */
+void pool_free(objpool_t *pool, void *obj)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *(void **) obj = pool->freelist;
+    pool->freelist = obj;
+    pool->live--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Release every slab of the pool at once, along with any object still handed
+ * out. This should only be called when the server is shutting down, once no
+ * object of the pool is used anymore.
+ *
+ * @param pool
+ *        the pool to release
+ */
+void pool_destroy(objpool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs)
+    {
+        slab_t *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->freelist = NULL;
+    pool->nslabs = 0;
+    pool->live = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Format the amount of objects the pool has handed out, the most it had out at
+ * once and the memory it holds, reported on shutdown.
+ *
+ * @param pool
+ *        the pool to report
+ * @param buf
+ *        the buffer to format the statistics into
+ * @param size
+ *        the size of buf
+ */
+void pool_report_stats(objpool_t *pool, char *buf, size_t size)
+{
+    pthread_mutex_lock(&pool->lock);
+    snprintf(buf, size, "[SERVER] Pool %s: %zu live, %zu peak, %zu slabs "
+             "(%zu bytes per object)\n", pool->name, pool->live,
+             pool->highwater, pool->nslabs, pool->objsize);
+    pthread_mutex_unlock(&pool->lock);
+}
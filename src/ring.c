@@ -0,0 +1,284 @@
+#define _GNU_SOURCE /* memfd_create() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "headers/ring.h"
+
+/* The space a record with a payload of len bytes takes in the ring */
+#define RECORD_SIZE(len) ((sizeof(record_t) + (len) + 1 + 7) & ~(size_t) 7)
+
+/*******************************************************************************
+ *                              Ring Helpers                                   *
+ ******************************************************************************/
+
+/*
+ * The bytes reserved for the positions at the start of the memfd, a whole
+ * page so the records that follow can be mapped on their own.
+ */
+static size_t ctl_size(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Signal an eventfd. A failure only means the counter is already saturated,
+ * in which case the other side is woken anyway.
+ */
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("[SERVER] eventfd");
+    }
+}
+
+/*******************************************************************************
+ *                              Shared Ring                                    *
+ ******************************************************************************/
+
+/*
+ * Create the memfd and eventfds of a new, empty ring. Neither side is mapped,
+ * the fds are handed to the producer and the consumer, which map the ring with
+ * ring_attach().
+ *
+ * @param fds
+ *        filled with the fds of the ring (see ringfd_t)
+ *
+ * @return
+ *        -1:       the ring could not be created
+ *        0:        the ring was created
+ */
+int ring_open(int fds[RING_FDS])
+{
+    fds[RING_MEMFD] = memfd_create("jobring", MFD_CLOEXEC);
+    fds[RING_DATAFD] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[RING_SPACEFD] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (fds[RING_MEMFD] < 0 || fds[RING_DATAFD] < 0 || fds[RING_SPACEFD] < 0
+        || ftruncate(fds[RING_MEMFD], ctl_size() + RING_SIZE) < 0)
+    {
+        for (int i = 0; i < RING_FDS; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Map a ring created by ring_open(). The positions are mapped first, followed
+ * by the records mapped twice, so a record that wraps around the end of the
+ * ring can be read and written in one piece. The ring takes ownership of the
+ * fds.
+ *
+ * @param fds
+ *        the fds of the ring
+ *
+ * @return
+ *        NULL:     the ring could not be mapped, the fds are left open
+ *        ring:     the mapped ring
+ */
+ring_t *ring_attach(int fds[RING_FDS])
+{
+    ring_t *ring = malloc(sizeof(struct ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    size_t ctl = ctl_size();
+    ring->maplen = ctl + 2 * RING_SIZE;
+    ring->map = mmap(NULL, ring->maplen, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    char *base = ring->map;
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED | MAP_FIXED;
+    if (mmap(base, ctl, prot, flags, fds[RING_MEMFD], 0) == MAP_FAILED
+        || mmap(base + ctl, RING_SIZE, prot, flags, fds[RING_MEMFD], ctl)
+            == MAP_FAILED
+        || mmap(base + ctl + RING_SIZE, RING_SIZE, prot, flags,
+                fds[RING_MEMFD], ctl) == MAP_FAILED)
+    {
+        munmap(ring->map, ring->maplen);
+        free(ring);
+        return NULL;
+    }
+
+    memcpy(ring->fds, fds, sizeof(ring->fds));
+    ring->ctl = (ringctl_t *) base;
+    ring->data = base + ctl;
+    return ring;
+}
+
+/*
+ * Unmap the ring and close its fds.
+ *
+ * @param ring
+ *        the ring to free
+ */
+void ring_free(ring_t *ring)
+{
+    munmap(ring->map, ring->maplen);
+    for (int i = 0; i < RING_FDS; i++)
+    {
+        close(ring->fds[i]);
+    }
+    free(ring);
+}
+
+/*
+ * Append a record to the ring, waiting for room if the ring is full. The
+ * consumer is only woken when the ring was empty, since otherwise it has yet
+ * to drain the records before this one and will find it then.
+ *
+ * The positions are published with sequentially consistent stores, and each
+ * side reads the others position after publishing its own. So either the
+ * consumer sees this record before it goes back to sleep, or the producer sees
+ * that the consumer drained everything and wakes it.
+ *
+ * @param ring
+ *        the ring to append to (from the producers side)
+ * @param type
+ *        what the record carries
+ * @param data
+ *        the payload
+ * @param len
+ *        the length of the payload, no more than RING_MAX_RECORD
+ * @param peerfd
+ *        an fd whose other end the consumer holds, such as a pipe, polled while
+ *        waiting for room so the wait ends if the consumer has gone away
+ *
+ * @return
+ *        -1:       the consumer has gone away
+ *        0:        the record was appended
+ */
+int ring_push(ring_t *ring, rectype_t type, const void *data, size_t len,
+              int peerfd)
+{
+    ringctl_t *ctl = ring->ctl;
+    size_t size = RECORD_SIZE(len);
+    uint64_t tail = ctl->tail;
+
+    while (RING_SIZE - (tail - __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE))
+            < size)
+    {
+        __atomic_store_n(&ctl->waiting, 1, __ATOMIC_SEQ_CST);
+        if (RING_SIZE - (tail - __atomic_load_n(&ctl->head, __ATOMIC_SEQ_CST))
+            >= size)
+        {
+            __atomic_store_n(&ctl->waiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+
+        struct pollfd fds[2] = {
+            { .fd = ring->fds[RING_SPACEFD], .events = POLLIN },
+            { .fd = peerfd, .events = 0 }
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        if (fds[1].revents & (POLLERR | POLLHUP))
+        {
+            return -1;
+        }
+
+        uint64_t count;
+        if (read(ring->fds[RING_SPACEFD], &count, sizeof(count)) < 0
+            && errno != EAGAIN)
+        {
+            return -1;
+        }
+    }
+
+    record_t *record = (record_t *) (ring->data + tail % RING_SIZE);
+    record->len = len;
+    record->type = type;
+    if (len > 0)
+    {
+        memcpy(record->data, data, len);
+    }
+    record->data[len] = '\0';
+
+    __atomic_store_n(&ctl->tail, tail + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctl->head, __ATOMIC_SEQ_CST) == tail)
+    {
+        signal_fd(ring->fds[RING_DATAFD]);
+    }
+    return 0;
+}
+
+/*
+ * Return the first record of the ring without consuming it.
+ *
+ * @param ring
+ *        the ring to read (from the consumers side)
+ *
+ * @return
+ *        NULL:     the ring is empty
+ *        record:   the first record, valid until ring_pop()
+ */
+record_t *ring_peek(ring_t *ring)
+{
+    ringctl_t *ctl = ring->ctl;
+    uint64_t head = ctl->head;
+
+    if (__atomic_load_n(&ctl->tail, __ATOMIC_SEQ_CST) == head)
+    {
+        return NULL;
+    }
+    return (record_t *) (ring->data + head % RING_SIZE);
+}
+
+/*
+ * Consume the first record of the ring, waking the producer if it is waiting
+ * for room.
+ *
+ * @param ring
+ *        the ring to consume from
+ * @param record
+ *        the record returned by ring_peek()
+ */
+void ring_pop(ring_t *ring, record_t *record)
+{
+    ringctl_t *ctl = ring->ctl;
+
+    __atomic_store_n(&ctl->head, ctl->head + RECORD_SIZE(record->len),
+                     __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctl->waiting, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&ctl->waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        signal_fd(ring->fds[RING_SPACEFD]);
+    }
+}
+
+/*
+ * Make the consumers eventfd ready, so the ring is looked at again even though
+ * the producer has nothing new to report (for instance once a stalled job is
+ * resumed).
+ *
+ * @param ring
+ *        the ring to wake the consumer of
+ */
+void ring_wake(ring_t *ring)
+{
+    signal_fd(ring->fds[RING_DATAFD]);
+}
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headers/scrollback.h"
+
+/* How much output is kept (see scrollback_set_limits()) */
+static size_t perjob = SCROLLBACK_SIZE;
+static size_t total = SCROLLBACK_TOTAL;
+
+/* The bytes the scrollback of every job takes together, and the most it took */
+static size_t inuse;
+static size_t peak;
+
+/* Counters reported on shutdown */
+static unsigned long kept;
+static unsigned long dropped;
+static unsigned long capped;
+static unsigned long replays;
+static unsigned long replayed;
+
+/*******************************************************************************
+ *                           Scrollback Helpers                                *
+ ******************************************************************************/
+
+/*
+ * Copy bytes into the ring at an offset, wrapping around its end.
+ */
+static void ring_write(scrollback_t *sb, size_t offset, const char *data,
+                       size_t len)
+{
+    size_t at = offset % sb->size;
+    size_t first = len < sb->size - at ? len : sb->size - at;
+
+    memcpy(sb->buf + at, data, first);
+    memcpy(sb->buf, data + first, len - first);
+}
+
+/*
+ * The bytes of the line at an offset of the ring, its frame header included.
+ */
+static size_t line_size(const scrollback_t *sb, size_t offset)
+{
+    char header[FRAME_HEADER];
+    frame_t frame;
+
+    scrollback_read(sb, offset, header, FRAME_HEADER);
+    return frame_unpack(header, FRAME_HEADER, &frame);
+}
+
+/*
+ * Grow a ring so it holds at least needed bytes, doubling it up to the size
+ * kept per job. The bytes are only taken if the scrollback of every job stays
+ * within its cap. The lines held are moved to the start of the new ring.
+ *
+ * @return
+ *        -1:       the ring could not grow
+ *        0:        the ring grew, maybe short of needed if it is at its most
+ */
+static int grow(scrollback_t *sb, size_t needed)
+{
+    size_t size = sb->size > 0 ? sb->size : SCROLLBACK_MIN;
+    while (size < needed && size < perjob)
+    {
+        size *= 2;
+    }
+    if (size > perjob)
+    {
+        size = perjob;
+    }
+    if (size <= sb->size)
+    {
+        return -1;
+    }
+
+    size_t extra = size - sb->size;
+    size_t now = __atomic_add_fetch(&inuse, extra, __ATOMIC_RELAXED);
+    if (now > total)
+    {
+        __atomic_sub_fetch(&inuse, extra, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&capped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    char *buf = malloc(size);
+    if (buf == NULL)
+    {
+        __atomic_sub_fetch(&inuse, extra, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    size_t used = sb->end - sb->start;
+    if (sb->buf != NULL)
+    {
+        scrollback_read(sb, sb->start, buf, used);
+        free(sb->buf);
+    }
+    sb->buf = buf;
+    sb->size = size;
+    sb->start = 0;
+    sb->end = used;
+
+    size_t most = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (now > most && !__atomic_compare_exchange_n(&peak, &most, now, 1,
+                                                      __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED))
+    {
+        ;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ *                               Scrollback                                    *
+ ******************************************************************************/
+
+/*
+ * Set how much output is kept, before any job is run.
+ *
+ * @param size
+ *        the most bytes kept of the output of a job, 0 to keep none
+ * @param cap
+ *        the most bytes kept of the output of every job together
+ */
+void scrollback_set_limits(size_t size, size_t cap)
+{
+    perjob = size;
+    total = cap;
+}
+
+/*
+ * Start the scrollback of a new job empty, without taking any memory yet.
+ */
+void scrollback_init(scrollback_t *sb)
+{
+    sb->buf = NULL;
+    sb->size = 0;
+    sb->start = 0;
+    sb->end = 0;
+    sb->lines = 0;
+}
+
+/*
+ * Keep a line of output of a job, as its FRAME_OUTPUT frame. The ring grows
+ * when it is full, and once it can not the oldest lines are dropped to make
+ * room. A line longer than the ring can hold is not kept. The caller must
+ * hold the lock of the job.
+ *
+ * @param sb
+ *        the scrollback of the job
+ * @param stream pid
+ *        the stream the line came from and the job that wrote it
+ * @param line len
+ *        the line, without its newline, and its length
+ */
+void scrollback_append(scrollback_t *sb, framestream_t stream, pid_t pid,
+                       const char *line, size_t len)
+{
+    size_t need = FRAME_HEADER + len;
+    if (perjob == 0)
+    {
+        return;
+    }
+    if (sb->end - sb->start + need > sb->size)
+    {
+        grow(sb, sb->end - sb->start + need);
+    }
+    if (need > sb->size)
+    {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    while (sb->end - sb->start + need > sb->size) /* Drop the oldest lines */
+    {
+        sb->start += line_size(sb, sb->start);
+        sb->lines--;
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    char header[FRAME_HEADER];
+    frame_pack(header, FRAME_OUTPUT, stream, pid, len);
+    ring_write(sb, sb->end, header, FRAME_HEADER);
+    ring_write(sb, sb->end + FRAME_HEADER, line, len);
+    sb->end += need;
+    sb->lines++;
+    __atomic_fetch_add(&kept, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find where the last lines held start.
+ *
+ * @param sb
+ *        the scrollback of the job
+ * @param count
+ *        the amount of lines wanted
+ * @param found
+ *        set to the amount of lines from the offset on, fewer than count if
+ *        the scrollback does not hold as many
+ *
+ * @return
+ *        the offset of the first of the lines, their bytes run up to sb->end
+ */
+size_t scrollback_find(const scrollback_t *sb, size_t count, size_t *found)
+{
+    size_t offset = sb->start;
+    size_t skip = count < sb->lines ? sb->lines - count : 0;
+
+    for (size_t i = 0; i < skip; i++)
+    {
+        offset += line_size(sb, offset);
+    }
+    *found = sb->lines - skip;
+    return offset;
+}
+
+/*
+ * Copy bytes out of the ring from an offset, wrapping around its end.
+ */
+void scrollback_read(const scrollback_t *sb, size_t offset, char *buf,
+                     size_t len)
+{
+    size_t at = offset % sb->size;
+    size_t first = len < sb->size - at ? len : sb->size - at;
+
+    memcpy(buf, sb->buf + at, first);
+    memcpy(buf + first, sb->buf, len - first);
+}
+
+/*
+ * Free the ring of a job that is removed, and give its bytes back to the cap.
+ */
+void scrollback_free(scrollback_t *sb)
+{
+    __atomic_sub_fetch(&inuse, sb->size, __ATOMIC_RELAXED);
+    free(sb->buf);
+    scrollback_init(sb);
+}
+
+/*
+ * Count lines that were replayed to a client that started watching a job.
+ */
+void scrollback_count_replay(size_t lines)
+{
+    __atomic_fetch_add(&replays, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&replayed, lines, __ATOMIC_RELAXED);
+}
+
+/*
+ * Format the memory the scrollback took, the lines kept and dropped and the
+ * lines replayed, reported on shutdown.
+ */
+void scrollback_report_stats(char *buf, size_t size)
+{
+    snprintf(buf, size, "[SERVER] Scrollback: %zu bytes in use, %zu peak of "
+             "%zu, %lu lines kept, %lu dropped, %lu times at the cap, %lu "
+             "lines replayed to %lu watchers\n",
+             __atomic_load_n(&inuse, __ATOMIC_RELAXED),
+             __atomic_load_n(&peak, __ATOMIC_RELAXED), total,
+             __atomic_load_n(&kept, __ATOMIC_RELAXED),
+             __atomic_load_n(&dropped, __ATOMIC_RELAXED),
+             __atomic_load_n(&capped, __ATOMIC_RELAXED),
+             __atomic_load_n(&replayed, __ATOMIC_RELAXED),
+             __atomic_load_n(&replays, __ATOMIC_RELAXED));
+}
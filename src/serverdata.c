@@ -1,53 +1,109 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
 
 #include "headers/serverdata.h"
 #include "headers/serverlog.h"
+#include "headers/objpool.h"
+
+/* The slabs the clients, jobs and watchers are allocated from */
+static objpool_t client_pool = OBJPOOL_INIT("client", client_t);
+static objpool_t job_pool = OBJPOOL_INIT("job", job_t);
+static objpool_t watchlist_pool = OBJPOOL_INIT("watchlist", watchlist_t);
+static objpool_t watcher_pool = OBJPOOL_INIT("watcher", watcher_t);
+
+static void detach_feed(watcher_t *watcher);
+static void unlink_watching(watcher_t *watcher);
 
 /*******************************************************************************
  *                    Communication Structures and Helpers                     *
  ******************************************************************************/
 
 /*
- * Add a new file descriptor to the servers current fd_set. Once a fd is added,
- * the server will begin reading and writing to it. The maxfd value is updated 
- * if applicable.
+ * Register a new file descriptor with the servers epoll instance. Once a fd is
+ * added, the server will begin reading from it. The owner is handed back as the
+ * data.ptr of every event on the fd, so it must begin with a conntype_t.
  *
  * @param fd
- *        the file descriptor to add to the fd_set
+ *        the file descriptor to register
+ * @param owner
+ *        the client, job or listener the fd belongs to
  * @param connections
  *        the connections struct holding all currently active connections on the
  *        server
+ *
+ * @return
+ *        -1:        the fd could not be registered
+ *        0:         the fd was registered successfully
  */
-void add_fd(int fd, connections_t *connections)
+int add_fd(int fd, void *owner, connections_t *connections)
 {
-    FD_SET(fd, connections->all_fds);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = owner;
+
     fcntl(fd, F_SETFL, O_NONBLOCK);
 
-    if (fd > connections->maxfd)
+    if (epoll_ctl(connections->epollfd, EPOLL_CTL_ADD, fd, &event) < 0)
     {
-        connections->maxfd = fd;
+        perror("[SERVER] epoll_ctl");
+        return -1;
     }
+    connections->nfds++;
+    return 0;
+}
+
+/*
+ * Change the events a registered file descriptor is polled for. Clients are
+ * polled for EPOLLOUT only while they have output waiting.
+ *
+ * @param fd
+ *        the registered file descriptor
+ * @param owner
+ *        the client, job or listener the fd belongs to
+ * @param events
+ *        the epoll events to poll for
+ * @param connections
+ *        the connections struct the fd is registered with
+ *
+ * @return
+ *        -1:        the events could not be changed
+ *        0:         the fd is now polled for the given events
+ */
+int modify_fd(int fd, void *owner, unsigned int events,
+              connections_t *connections)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = owner;
+
+    return epoll_ctl(connections->epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
 /*
- * Remove a file descriptor from the servers current fd_set. Once a fd is removed,
- * the server will not be able to read and write to it. This closes the clients
- * or jobs pipes once they have exited.
+ * Remove a file descriptor from the servers epoll instance. Once a fd is 
+ * removed, the server will not be able to read from it. This must be called 
+ * before the clients or jobs fd is closed, since forked jobs may still hold a
+ * copy of the fd and keep the registration alive.
  *
  * @param fd
- *        the file descriptor to remove from the fd_set
+ *        the file descriptor to deregister
  * @param connections
  *         the connections struct holding all currently active connections on the
  *        server
  */
 void close_fd(int fd, connections_t *connections)
 {
-    FD_CLR(fd, connections->all_fds);
+    if (epoll_ctl(connections->epollfd, EPOLL_CTL_DEL, fd, NULL) == 0)
+    {
+        connections->nfds--;
+    }
 }
 
 /*******************************************************************************
@@ -71,7 +127,7 @@ void close_fd(int fd, connections_t *connections)
  */
 int add_client(int clientfd, clientlist_t *clientlist)
 {
-    client_t *new_client = malloc(sizeof(struct client));
+    client_t *new_client = pool_alloc(&client_pool);
     
     if (new_client == NULL)
     {
@@ -79,9 +135,36 @@ int add_client(int clientfd, clientlist_t *clientlist)
     }
 
     /* Fill clients information */
+    new_client->type = CONN_CLIENT;
     new_client->clientfd = clientfd;
+    new_client->fdset = clientlist->fdset;
+    new_client->outhead = new_client->outtail = NULL;
+    new_client->outbytes = 0;
+    new_client->feeds = NULL;
+    new_client->sending = NULL;
+    new_client->sendleft = 0;
+    new_client->rawbytes = 0;
+    new_client->dropped = 0;
+    new_client->stalling = 0;
+    new_client->closing = 0;
+    new_client->binary = 0;
+    new_client->corked = 0;
+    new_client->inflight = 0;
+    pthread_mutex_init(&new_client->outlock, NULL);
+    linebuf_init(&new_client->input, new_client->inbuf, CLIENTBUF_SIZE);
+    new_client->ahead.ready = 0;
+    new_client->watching = NULL;
+    new_client->share = 0;
     new_client->next = NULL;
     new_client->prev = clientlist->end;
+
+    /* Allow read/write from server */
+    if (add_fd(clientfd, new_client, clientlist->fdset) < 0)
+    {
+        pthread_mutex_destroy(&new_client->outlock);
+        pool_free(&client_pool, new_client);
+        return -1;
+    }
     
     /* Append client to the clientlist */
     if (clientlist->size == 0)
@@ -94,14 +177,15 @@ int add_client(int clientfd, clientlist_t *clientlist)
         clientlist->end = new_client;
     }
 
-    add_fd(clientfd, clientlist->fdset); /* Allow read/write from server */
     clientlist->size++;
     return 0;
 }
 
 /*
  * Remove a client that has connected to the server to the curent clientlist.
- * Update the clientlist pointers and size count. All mallocs will be freed.
+ * Update the clientlist pointers and size count. The client stops watching
+ * every job it watched (see unwatch_all()), and all mallocs will be freed. 
+ * The caller must hold the joblist lock.
  *
  * @param client
  *        the client to remove from the clientlist
@@ -136,7 +220,7 @@ void close_client(client_t *client, clientlist_t *clientlist)
         }
     }
     
-    write_client("[CLIENT %d] Connection closed\r\n", NULL, client->clientfd);
+    write_client("[CLIENT %d] Connection closed\r\n", NULL, client);
 
     close_fd(client->clientfd, clientlist->fdset);
     free_client(client);
@@ -144,8 +228,11 @@ void close_client(client_t *client, clientlist_t *clientlist)
 }
 
 /*
- * Clean up the client by closing its file descriptor, removing its pointers
- * and freeing any mallocs. This should only be called by close_client().
+ * Clean up the client by closing its file descriptor, removing it from the
+ * watchlists of the jobs it watched, removing its pointers and freeing any
+ * mallocs (including output that was never written). Once it watches no job,
+ * no other worker can reach the client, so its output is freed without its
+ * lock. This should only be called by close_client() and clear_clients().
  *
  * @param client
  *        the client to close and clean
@@ -156,7 +243,24 @@ void free_client(client_t *client)
     client->clientfd = -1;
     client->next = NULL;
     client->prev = NULL;
-    free(client);
+    unwatch_all(client);
+
+    while (client->outhead) /* Discard unwritten output */
+    {
+        outbuf_t *next = client->outhead->next;
+        if (client->outhead->fd >= 0)
+        {
+            close(client->outhead->fd);
+        }
+        free(client->outhead);
+        client->outhead = next;
+    }
+    while (client->feeds)
+    {
+        free_feed(client->feeds, client);
+    }
+    pthread_mutex_destroy(&client->outlock);
+    pool_free(&client_pool, client);
 }
 
 /*
@@ -181,7 +285,7 @@ void clear_clients(clientlist_t *clientlist)
     while (temp) /* Clean up each client */
     {
         client_t *next = temp->next;
-        free(temp);
+        free_client(temp);
         temp = next;
     }
     clientlist->head = NULL;
@@ -194,60 +298,119 @@ void clear_clients(clientlist_t *clientlist)
  ******************************************************************************/
 
 /*
- * Add the job to the list of currently running jobs. Assign the client that 
- * invoked the job as the first watcher to be notified of the jobs output. 
- * Set-up a job_t struct for the new job, fill it, then append it to the end of
- * the joblist given. On error, the appropiate message is written to stderr.
+ * Allocate and fill a job_t for a newly created job, with an empty watchlist,
+ * and index it by its pid. The job polls nothing yet and is not in the list,
+ * a job that cannot be added is taken back out with discard_job().
  *
  * @param pid
  *        the pid of the newly created job
  * @param mpid
- *        the pid of the newly created job manager
- * @param jobpipe
- *        the read end FD of the newly created job
- * @param client
- *         the client who invoked the call (i.e. the first watcher)
+ *        the pid of the newly created job manager (0 if there is none)
+ * @param fdset
+ *        the epoll instance of the worker that will poll the job
  * @param joblist
- *         the list of currently running jobs to append to the new job too
+ *        the list of currently running jobs, whose index the job is added to
  *
  * @return
- *         -1:      an error occured and the job could not be created or 
- *                  appended, or no watchers could be assigned to the job
- *         0:       the job was successfully created and appended
+ *        NULL:     the job could not be allocated
+ *        job:      the new job
  */
-int add_job(pid_t pid, pid_t mpid, int jobpipe, client_t *client, 
-            joblist_t *joblist)
+static job_t *create_job(pid_t pid, pid_t mpid, connections_t *fdset,
+                         joblist_t *joblist)
 {
-    if (joblist->size == MAX_JOBS)
-    {
-        return -1;
-    }
-
     job_t *job;
-    job = malloc(sizeof(struct job));
+    job = pool_alloc(&job_pool);
     if (job == NULL)
     {
-        return -1;
+        return NULL;
     }
 
     /* Fill the job struct of the jobs information */
+    job->type = CONN_JOB;
     job->pid = pid;
     job->mpid = mpid;
-    job->jobpipe = jobpipe;
+    job->jobpipe = -1;
+    job->ring = NULL;
+    job->ahead.ready = 0;
+    job->ended = 0;
+    job->fdset = fdset;
+    pthread_mutex_init(&job->lock, NULL);
+    job->stalled = 0;
+    job->lagging = 0;
+    job->flags = 0;
+    job->jobclass = CLASS_NORMAL;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    job->accounted = 0;
+    job->lines = 0;
+    job->logged = 0;
+    scrollback_init(&job->scrollback);
+    spool_create(&job->spool, pid);
     job->next = NULL;
     job->prev = NULL;
 
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        job->streams[i].type = CONN_JOBSTREAM;
+        job->streams[i].fd = -1;
+        job->streams[i].stream = i;
+        job->streams[i].job = job;
+        linebuf_init(&job->streams[i].lines, job->streams[i].buf,
+                     STREAMBUF_SIZE);
+        job->streams[i].ahead.ready = 0;
+    }
+
     /* Prepare to assign watchers to the job */
-    job->watchlist = malloc(sizeof(struct watchlist));
+    job->watchlist = pool_alloc(&watchlist_pool);
     if (job->watchlist == NULL)
     {
-        return -1;
+        spool_close(&job->spool);
+        pthread_mutex_destroy(&job->lock);
+        pool_free(&job_pool, job);
+        return NULL;
     }
 
     job->watchlist->head = job->watchlist->end = NULL;
     job->watchlist->size = 0;
+    job->watchlist->nraw = 0;
+    hashindex_init(&job->watchlist->byclient);
+
+    if (hashindex_insert(&joblist->bypid, &job->bypid, pid, job) < 0)
+    {
+        free_job(job);
+        return NULL;
+    }
+    return job;
+}
+
+/*
+ * Take a job that could not be added back out of the joblists index and free
+ * it (see create_job()).
+ *
+ * @param job
+ *        the job to discard
+ * @param joblist
+ *        the list of currently running jobs
+ */
+static void discard_job(job_t *job, joblist_t *joblist)
+{
+    hashindex_remove(&joblist->bypid, &job->bypid);
+    free_job(job);
+}
 
-    /* Append the job to the joblist */
+/*
+ * Append a job whose fds are already polled to the joblist, and assign the
+ * client that invoked the job as its first watcher.
+ *
+ * @param job
+ *        the job to append
+ * @param client
+ *        the client who invoked the call (i.e. the first watcher), NULL if it
+ *        disconnected while the job was being launched
+ * @param joblist
+ *        the list of currently running jobs to append the job to
+ */
+static void append_job(job_t *job, client_t *client, joblist_t *joblist)
+{
     if (joblist->head == NULL)
     {
         joblist->head = job;
@@ -261,22 +424,144 @@ int add_job(pid_t pid, pid_t mpid, int jobpipe, client_t *client,
     }
 
     joblist->size++;
-    
-    add_fd(jobpipe, joblist->fdset);
 
     /* Assign client as the first watcher of the job */
-    if (add_watcher(pid, client, joblist) < 0)
+    if (client != NULL)
     {
-        remove_job(pid, joblist); /* Avoid running unwatchable jobs */
+        pthread_mutex_lock(&job->lock);
+        int added = add_watcher(job->pid, client, WATCH_LINES, joblist);
+        pthread_mutex_unlock(&job->lock);
+        if (added < 0)
+        {
+            remove_job(job->pid, joblist); /* Avoid running unwatchable jobs */
+        }
     }
+}
+
+/*
+ * Add the job to the list of currently running jobs. Assign the client that 
+ * invoked the job as the first watcher to be notified of the jobs output. 
+ * Set-up a job_t struct for the new job, fill it, then append it to the end of
+ * the joblist given. On error, the appropiate message is written to stderr.
+ *
+ * @param pid
+ *        the pid of the newly created job
+ * @param mpid
+ *        the pid of the newly created job manager
+ * @param jobpipe
+ *        the read end of the pipe the job manager reported the job through
+ * @param ring
+ *        the ring the job manager passes the jobs output through
+ * @param fdset
+ *        the epoll instance of the worker that will poll the ring
+ * @param client
+ *         the client who invoked the call (i.e. the first watcher), or NULL
+ * @param joblist
+ *         the list of currently running jobs to append to the new job too
+ *
+ * @return
+ *         -1:      an error occured and the job could not be created or 
+ *                  appended, the jobpipe and ring are left to the caller
+ *         0:       the job was successfully created and appended
+ */
+int add_job(pid_t pid, pid_t mpid, int jobpipe, ring_t *ring,
+            connections_t *fdset, client_t *client, joblist_t *joblist)
+{
+    job_t *job = create_job(pid, mpid, fdset, joblist);
+    if (job == NULL)
+    {
+        return -1;
+    }
+
+    if (add_fd(ring->fds[RING_DATAFD], job, job->fdset) < 0)
+    {
+        discard_job(job, joblist);
+        return -1;
+    }
+    job->jobpipe = jobpipe;
+    job->ring = ring;
+
+    append_job(job, client, joblist);
     return 0;    
 }
 
+/*
+ * Add a job that was launched directly (without a job manager) to the list of
+ * currently running jobs. The jobs stdout and stderr are polled by the worker
+ * of the client who ran it, and the client becomes its first watcher.
+ *
+ * @param pid
+ *        the pid of the newly created job
+ * @param fds
+ *        the read ends of the jobs stdout and stderr pipes, indexed by
+ *        streamtype_t
+ * @param fdset
+ *        the epoll instance of the worker that will poll the pipes
+ * @param client
+ *         the client who invoked the call (i.e. the first watcher), or NULL
+ * @param joblist
+ *         the list of currently running jobs to append to the new job too
+ *
+ * @return
+ *         -1:      the job could not be created, none of the fds were taken
+ *         0:       the job was successfully created and appended
+ */
+int add_direct_job(pid_t pid, int fds[JOB_STREAMS], connections_t *fdset,
+                   client_t *client, joblist_t *joblist)
+{
+    job_t *job = create_job(pid, 0, fdset, joblist);
+    if (job == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        if (add_fd(fds[i], &job->streams[i], job->fdset) < 0)
+        {
+            while (--i >= 0)
+            {
+                close_fd(fds[i], job->fdset);
+            }
+            discard_job(job, joblist);
+            return -1;
+        }
+    }
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        job->streams[i].fd = fds[i];
+    }
+
+    append_job(job, client, joblist);
+    return 0;
+}
+
+/*
+ * Stop polling and close one of the fds of a directly launched job, used once
+ * its pipe reports EOF. The job itself stays until the launcher reports its
+ * exit.
+ *
+ * @param stream
+ *        the stream to close
+ */
+void close_stream(jobstream_t *stream)
+{
+    if (stream->fd >= 0)
+    {
+        close_fd(stream->fd, stream->job->fdset);
+        close(stream->fd);
+        stream->fd = -1;
+    }
+}
+
 /*
  * Remove a currently running job from the joblist and disconnect all
  * communication between the server and the job. This should only be called
  * after the job's process has exited, as once the job is removed their will
- * be access to its process anymore.
+ * be access to its process anymore. Events for the job may still be waiting in
+ * the batch its worker is handling, so the job is only marked CONN_DEAD and
+ * freed once the batch is done (see free_dead_jobs()). Only the worker that
+ * polls the job removes it.
  *
  * @param pid
  *        the pid of the job's process that will be removed from the joblist
@@ -291,13 +576,10 @@ int add_job(pid_t pid, pid_t mpid, int jobpipe, client_t *client,
 int remove_job(pid_t pid, joblist_t *joblist)
 {
     job_t *job = find_job(pid, joblist);
-    int stat;
-    waitpid(job->mpid, &stat, 0);
     if (job == NULL)
     {
         return -1;
     }
-
     if (joblist->size == 1)
     {
         joblist->head = NULL;
@@ -322,16 +604,50 @@ int remove_job(pid_t pid, joblist_t *joblist)
         next_job->prev = prev_job;
         prev_job->next = next_job;        
     }
+    hashindex_remove(&joblist->bypid, &job->bypid);
 
-    close_fd(job->jobpipe, joblist->fdset);
-    free_job(job);
+    if (job->ring != NULL)
+    {
+        close_fd(job->ring->fds[RING_DATAFD], job->fdset);
+    }
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        close_stream(&job->streams[i]);
+    }
+    jobclass_record_run(job->jobclass, &job->started);
     joblist->size--;
+
+    job->type = CONN_DEAD;
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        job->streams[i].type = CONN_DEAD;
+    }
+    job->prev = NULL;
+    job->next = job->fdset->dead;
+    job->fdset->dead = job;
     return 0;
 }
 
+/*
+ * Free the jobs a worker removed while it handled a batch of events (see
+ * remove_job()). The caller must hold the joblist lock.
+ *
+ * @param fdset
+ *        the epoll instance of the worker
+ */
+void free_dead_jobs(connections_t *fdset)
+{
+    while (fdset->dead)
+    {
+        job_t *job = fdset->dead;
+        fdset->dead = job->next;
+        free_job(job);
+    }
+}
+
 /*
  * Find and return the job in the given joblist that is running with the pid
- * exactly that of the specified pid. 
+ * exactly that of the specified pid, through the joblists index.
  *
  * @param pid
  *        the pid of the job process desired
@@ -344,27 +660,11 @@ int remove_job(pid_t pid, joblist_t *joblist)
  */
 job_t *find_job(pid_t pid, joblist_t *joblist)
 {
-    /* No jobs running */
-    if (joblist == NULL || joblist->size == 0 || joblist->head == NULL) 
+    if (joblist == NULL) 
     {
         return NULL;
     }
-    if (joblist->size == 1) /* Only one job */
-    {
-        return joblist->head;
-    }
-
-    job_t *temp = joblist->head;
-
-    while (temp) /* Scan the list for the pid */
-    {
-        if (temp->pid == pid)
-        {
-            return temp;
-        }
-        temp = temp->next; 
-    }
-    return NULL;
+    return hashindex_find(&joblist->bypid, pid);
 }
 
 /*
@@ -387,17 +687,18 @@ int jobcmp(job_t *job1, job_t *job2)
 }
 
 /*
- * Clean up and close the given job, stop zombie process, free any mallocs, 
- * clear all watchers, close the jobpipe and dereference all pointers.
+ * Clean up and close the given job, free any mallocs, clear all watchers, 
+ * close the jobpipe and dereference all pointers. The job and its manager are
+ * reaped by the launcher (see launcher.c).
  *
  * @param job
  *        the job to clean up and close
  */
 void free_job(job_t *job)
 {
-    int stat;
-    wait(&stat);
-    WEXITSTATUS(stat);
+    /* A worker may have found the job before it was removed */
+    pthread_mutex_lock(&job->lock);
+    pthread_mutex_unlock(&job->lock);
 
     job->next = NULL;
     job->prev = NULL;
@@ -408,17 +709,38 @@ void free_job(job_t *job)
     {
         watcher_t *temp = watcher;
         watcher = watcher->next;
-        free(temp);
+        unlink_watching(temp);
+        detach_feed(temp);
+        pool_free(&watcher_pool, temp);
     }
 
-    close(job->jobpipe);
-    free(job->watchlist);
-    free(job);
+    if (job->jobpipe >= 0)
+    {
+        close(job->jobpipe);
+    }
+    if (job->ring != NULL)
+    {
+        ring_free(job->ring);
+    }
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        if (job->streams[i].fd >= 0)
+        {
+            close(job->streams[i].fd);
+        }
+    }
+    hashindex_free(&job->watchlist->byclient);
+    scrollback_free(&job->scrollback);
+    spool_close(&job->spool);
+    pthread_mutex_destroy(&job->lock);
+    pool_free(&watchlist_pool, job->watchlist);
+    pool_free(&job_pool, job);
 }
 
 /*
- * Clear all the jobs in the joblist given. Each job will be cleaned up (see
- * free_job()) and the joblist will be destroyed. This should only be called
+ * Clear all the jobs in the joblist given. Each job is interrupted (the
+ * launcher reaps it), then it will be cleaned up (see free_job()) and the joblist
+ * will be destroyed. This should only be called
  * when the server is shutting down. joblist size_t is not updated.
  *
  * @param joblist
@@ -429,36 +751,506 @@ void clear_jobs(joblist_t *joblist)
     log_message("[SERVER] Clearing all active jobs\r\n");
     job_t *temp = joblist->head;
 
+    while (joblist->queuehead) /* Never launched, their clients are gone */
+    {
+        queued_t *next = joblist->queuehead->next;
+        free_queued(joblist->queuehead);
+        joblist->queuehead = next;
+    }
+
     if (temp == NULL)
     {
+        hashindex_free(&joblist->bypid);
         free(joblist);
         return;
     }
     while (temp) /* Clean up each job */
     {
         job_t *next = temp->next;
+        kill(temp->pid, SIGINT);
         free_job(temp);
         temp = next;
     }
     joblist->head = NULL;
     joblist->end = NULL;
+    hashindex_free(&joblist->bypid);
     free(joblist);
 }
 
+/*
+ * Stop polling the ring (or the output pipes of a directly launched job)
+ * because one of the jobs watchers fell behind under the block policy. The
+ * job blocks once its manager finds the ring full, or its pipe fills up. The
+ * fd is removed from epoll (rather than
+ * polled for no events) so a closed pipe does not keep reporting EPOLLHUP 
+ * while the job is stalled. The watcher counts as lagging until its client
+ * catches up or stops watching, and the job is polled again once no watcher
+ * lags (see resume_jobs()). The caller must hold the lock of the job.
+ *
+ * @param watcher
+ *        the watcher that fell behind
+ */
+void stall_job(watcher_t *watcher)
+{
+    job_t *job = watcher->job;
+
+    if (!watcher->lagging)
+    {
+        watcher->lagging = 1;
+        job->lagging++;
+    }
+    if (!job->stalled)
+    {
+        job->stalled = 1;
+        if (job->ring != NULL)
+        {
+            close_fd(job->ring->fds[RING_DATAFD], job->fdset);
+        }
+        for (int i = 0; i < JOB_STREAMS; i++)
+        {
+            if (job->streams[i].fd >= 0)
+            {
+                close_fd(job->streams[i].fd, job->fdset);
+            }
+        }
+    }
+}
+
+/*
+ * Resume polling a stalled job once none of its watchers lags, unless the job
+ * was removed meanwhile. The caller must hold the lock of the job.
+ *
+ * @param job
+ *        the job to resume
+ */
+static void resume_job(job_t *job)
+{
+    if (!job->stalled || job->lagging > 0 || job->type != CONN_JOB)
+    {
+        return;
+    }
+
+    job->stalled = 0;
+    if (job->ring != NULL) /* Records may be left from before the stall */
+    {
+        add_fd(job->ring->fds[RING_DATAFD], job, job->fdset);
+        ring_wake(job->ring);
+    }
+    for (int i = 0; i < JOB_STREAMS; i++)
+    {
+        if (job->streams[i].fd >= 0)
+        {
+            add_fd(job->streams[i].fd, &job->streams[i], job->fdset);
+        }
+    }
+}
+
+/*
+ * Resume polling the stalled jobs of a client that caught up, once it is the
+ * last of their watchers to lag. Only the jobs the client watches are visited,
+ * through its own list of watchers, and a client that disconnects resumes its
+ * jobs as it is removed from their watchlists (see remove_watcher()). The
+ * caller must hold the joblist lock.
+ *
+ * @param client
+ *        the client that caught up
+ */
+void resume_jobs(client_t *client)
+{
+    for (watcher_t *watcher = client->watching; watcher;
+         watcher = watcher->cnext)
+    {
+        job_t *job = watcher->job;
+        pthread_mutex_lock(&job->lock);
+        if (watcher->lagging)
+        {
+            watcher->lagging = 0;
+            job->lagging--;
+            resume_job(job);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/*******************************************************************************
+ *                           Admission Queue Helpers                           *
+ ******************************************************************************/
+
+/*
+ * The virtual time a queued run would bring the share of its client to if it
+ * were admitted now (see dequeue_run()).
+ */
+static unsigned long finish_time(queued_t *run, joblist_t *joblist)
+{
+    unsigned long start = run->client->share > joblist->vtime
+                          ? run->client->share : joblist->vtime;
+    return start + SHARE_STRIDE / jobclass_info(run->jobclass)->weight;
+}
+
+/*
+ * Count where a queued run stands in the order the runs are admitted in, by
+ * taking the queue in that order (see dequeue_run()) until the run comes up.
+ * The shares of the clients are charged as the runs ahead are taken, and put
+ * back once the run is found, so the queue is left as it was. Runs queued
+ * later may still go ahead of it if their clients are owed more.
+ *
+ * @param run
+ *        the queued run
+ * @param joblist
+ *        the list of currently running jobs, holding the queue
+ *
+ * @return
+ *        the position of the run, 1 if it is admitted next
+ */
+static size_t queue_position(queued_t *run, joblist_t *joblist)
+{
+    queued_t *runs[joblist->queued];
+    unsigned long shares[joblist->queued];
+    unsigned long vtime = joblist->vtime;
+    size_t count = 0;
+    size_t position = 0;
+
+    for (queued_t *at = joblist->queuehead; at; at = at->next)
+    {
+        shares[count] = at->client->share;
+        runs[count++] = at;
+    }
+
+    for (queued_t *next = NULL; next != run; position++)
+    {
+        size_t taken = 0;
+        unsigned long first = 0;
+
+        next = NULL;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (runs[i] == NULL)
+            {
+                continue;
+            }
+            unsigned long finish = finish_time(runs[i], joblist);
+            if (next == NULL || finish < first)
+            {
+                next = runs[i];
+                taken = i;
+                first = finish;
+            }
+        }
+        charge_share(next->client, next->jobclass, joblist);
+        runs[taken] = NULL;
+    }
+
+    /* Each run kept the share its client had before any was charged */
+    count = 0;
+    for (queued_t *at = joblist->queuehead; at; at = at->next)
+    {
+        at->client->share = shares[count++];
+    }
+    joblist->vtime = vtime;
+    return position;
+}
+
+/*
+ * Queue a run that is past the limit of jobs run at once, to be launched once
+ * a job finishes. The caller must hold the joblist lock.
+ *
+ * @param args
+ *        the jobname and its arguments, copied
+ * @param flags
+ *        the JOB_* flags the job is run with
+ * @param jobclass
+ *        the priority class the job is run in
+ * @param limits
+ *        the resource limits the job is run with
+ * @param client
+ *        the client who ran the job
+ * @param joblist
+ *        the list of currently running jobs, holding the queue
+ *
+ * @return
+ *        0:           the queue is full or the run could not be allocated
+ *        position:    where the run stands in the order runs are admitted in
+ *                     (see queue_position())
+ */
+size_t queue_run(const char *args, int flags, jobclass_t jobclass,
+                 const joblimits_t *limits, client_t *client,
+                 joblist_t *joblist)
+{
+    if (joblist->queued >= joblist->queuemax)
+    {
+        return 0;
+    }
+
+    queued_t *run = malloc(sizeof(struct queued));
+    if (run == NULL || (run->args = strdup(args)) == NULL)
+    {
+        free(run);
+        return 0;
+    }
+    run->flags = flags | JOB_QUEUED;
+    run->jobclass = jobclass;
+    run->limits = *limits;
+    run->client = client;
+    run->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &run->since);
+
+    if (joblist->queueend == NULL)
+    {
+        joblist->queuehead = run;
+    }
+    else
+    {
+        joblist->queueend->next = run;
+    }
+    joblist->queueend = run;
+    joblist->queued++;
+    return queue_position(run, joblist);
+}
+
+/*
+ * Charge a client for a run that is admitted. The share of the client starts
+ * from the virtual time of the last run admitted if it is behind it, so a
+ * client that had nothing to run does not bank the slots it left to others,
+ * and moves on by SHARE_STRIDE over the weight of the class of the run. The
+ * caller must hold the joblist lock.
+ *
+ * @param client
+ *        the client who ran the job
+ * @param jobclass
+ *        the priority class of the run
+ * @param joblist
+ *        the list of currently running jobs
+ */
+void charge_share(client_t *client, jobclass_t jobclass, joblist_t *joblist)
+{
+    unsigned long start = client->share > joblist->vtime ? client->share
+                                                         : joblist->vtime;
+    client->share = start + SHARE_STRIDE / jobclass_info(jobclass)->weight;
+    joblist->vtime = start;
+}
+
+/*
+ * Take the run that is next by weighted fair share off the admission queue,
+ * and charge its client for it (see charge_share()). Each run would bring the
+ * share of its client to a virtual finish time, and the run finishing first
+ * is taken: a client is given slots in proportion to the weights of the
+ * classes of its runs, so one client with many runs does not keep another
+ * out, and an interactive run goes ahead of a batch run. Runs that would
+ * finish at the same time are taken in the order they were queued. The
+ * caller must hold the joblist lock, and free the run once it is launched.
+ *
+ * @param joblist
+ *        the list of currently running jobs, holding the queue
+ *
+ * @return
+ *        NULL:        no run is waiting
+ *        run:         the run to launch
+ */
+queued_t *dequeue_run(joblist_t *joblist)
+{
+    queued_t *run = NULL;
+    queued_t *prev = NULL;
+    unsigned long first = 0;
+
+    for (queued_t *at = joblist->queuehead, *before = NULL; at;
+         before = at, at = at->next)
+    {
+        unsigned long finish = finish_time(at, joblist);
+        if (run == NULL || finish < first)
+        {
+            run = at;
+            prev = before;
+            first = finish;
+        }
+    }
+    if (run == NULL)
+    {
+        return NULL;
+    }
+
+    if (prev == NULL)
+    {
+        joblist->queuehead = run->next;
+    }
+    else
+    {
+        prev->next = run->next;
+    }
+    if (joblist->queueend == run)
+    {
+        joblist->queueend = prev;
+    }
+    joblist->queued--;
+
+    charge_share(run->client, run->jobclass, joblist);
+    return run;
+}
+
+/*
+ * Free a run taken off the admission queue.
+ */
+void free_queued(queued_t *run)
+{
+    free(run->args);
+    free(run);
+}
+
+/*
+ * Drop the runs of a client that is closing from the admission queue, since
+ * nobody would watch them. The caller must hold the joblist lock.
+ *
+ * @param client
+ *        the client that is closing
+ * @param joblist
+ *        the list of currently running jobs, holding the queue
+ */
+void dequeue_client(client_t *client, joblist_t *joblist)
+{
+    queued_t **at = &joblist->queuehead;
+    joblist->queueend = NULL;
+
+    while (*at != NULL)
+    {
+        queued_t *run = *at;
+        if (run->client == client)
+        {
+            *at = run->next;
+            free_queued(run);
+            joblist->queued--;
+            continue;
+        }
+        joblist->queueend = run;
+        at = &run->next;
+    }
+}
+
 /*******************************************************************************
  *                    Job Watcher Structures and Helpers                       *
  ******************************************************************************/
 
+/*
+ * Create the feed a client watching a job raw or chunked is sent the jobs 
+ * output through, and attach it to the client. The pipe is enlarged so bulk
+ * output rarely has to spill (see rawfeed_t), if the system allows it. The
+ * caller must hold the output lock of the client.
+ *
+ * @param pid
+ *        the job being watched
+ * @param mode
+ *        WATCH_RAW or WATCH_CHUNKED
+ * @param client
+ *        the watching client
+ *
+ * @return
+ *        NULL:         the feed could not be created
+ *        rawfeed_t:    the feed
+ */
+static rawfeed_t *create_feed(pid_t pid, watchmode_t mode, client_t *client)
+{
+    rawfeed_t *feed = malloc(sizeof(struct rawfeed));
+    if (feed == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    if (pipe2(feed->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        perror("pipe2");
+        free(feed);
+        return NULL;
+    }
+    fcntl(feed->pipe[1], F_SETPIPE_SZ, RAWPIPE_SIZE);
+
+    feed->pid = pid;
+    feed->mode = mode;
+    feed->attached = 1;
+    feed->queued = 0;
+    feed->spillhead = feed->spilltail = NULL;
+    feed->spillbytes = 0;
+    feed->dropped = 0;
+    feed->fed = -1;
+    feed->next = client->feeds;
+    client->feeds = feed;
+    return feed;
+}
+
+/*
+ * Detach the feed of a watcher that stopped watching its job. Output already 
+ * in the feed is still delivered, the feed is freed once it is empty.
+ *
+ * @param watcher
+ *        the watcher being removed
+ */
+static void detach_feed(watcher_t *watcher)
+{
+    rawfeed_t *feed = watcher->feed;
+    if (feed == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&watcher->client->outlock);
+    feed->attached = 0;
+    watcher->feed = NULL;
+    if (feed->queued == 0 && feed->spillbytes == 0)
+    {
+        free_feed(feed, watcher->client);
+    }
+    pthread_mutex_unlock(&watcher->client->outlock);
+}
+
+/*
+ * Unlink a feed from its client, discarding any output it still holds, and
+ * free it. The caller must hold the output lock of the client, unless no
+ * other worker can reach the client any longer (see free_client()).
+ *
+ * @param feed
+ *        the feed to free
+ * @param client
+ *        the client the feed belongs to
+ */
+void free_feed(rawfeed_t *feed, client_t *client)
+{
+    rawfeed_t **link = &client->feeds;
+    while (*link != feed)
+    {
+        link = &(*link)->next;
+    }
+    *link = feed->next;
+
+    if (client->sending == feed)
+    {
+        client->sending = NULL;
+        client->sendleft = 0;
+    }
+    client->rawbytes -= feed->queued + feed->spillbytes;
+
+    while (feed->spillhead)
+    {
+        outbuf_t *next = feed->spillhead->next;
+        free(feed->spillhead);
+        feed->spillhead = next;
+    }
+    close(feed->pipe[0]);
+    close(feed->pipe[1]);
+    free(feed);
+}
+
 /*
  * Add a client to the watchlist of the job specified by pid. Clients watching
  * a job will be sent all its output as well as the jobs exit status. This is no
  * bound on the size of the watchlsit for a given job. On error, the appropiate 
- * message is written to stderr.
+ * message is written to stderr. The caller must hold the joblist lock and the
+ * lock of the job.
  *
  * @param pid
  *        the pid of the job to assign the watcher too
  * @param client
  *        the client to add to the watchlist of the specified job
+ * @param mode
+ *        how the client watches the job, a client watching raw or chunked is
+ *        given a feed of the jobs output (see rawfeed_t)
  * @param joblist
  *        the joblist that contains the job specified by pid
  *
@@ -470,7 +1262,8 @@ void clear_jobs(joblist_t *joblist)
  *                      watching the job
  *        1:            the job specified by pid is not a currently running job
  */
-int add_watcher(pid_t pid, client_t *client, joblist_t *joblist)
+int add_watcher(pid_t pid, client_t *client, watchmode_t mode,
+                joblist_t *joblist)
 {
     job_t *job = find_job(pid, joblist);
     
@@ -486,17 +1279,41 @@ int add_watcher(pid_t pid, client_t *client, joblist_t *joblist)
         return 0;
     }
     
-    watcher = malloc(sizeof(struct watcher));
+    watcher = pool_alloc(&watcher_pool);
     if (watcher == NULL)
     {
-        perror("malloc");
+        perror("[SERVER] pool_alloc");
         return -1;
     }
 
     watcher->client = client;
+    watcher->feed = NULL;
+    watcher->job = job;
+    watcher->lagging = 0;
     watcher->prev = NULL;
     watcher->next = NULL;
 
+    if (hashindex_insert(&job->watchlist->byclient, &watcher->byclient,
+                         (uintptr_t) client, watcher) < 0)
+    {
+        pool_free(&watcher_pool, watcher);
+        return -1;
+    }
+
+    if (mode != WATCH_LINES)
+    {
+        pthread_mutex_lock(&client->outlock);
+        watcher->feed = create_feed(pid, mode, client);
+        pthread_mutex_unlock(&client->outlock);
+        if (watcher->feed == NULL)
+        {
+            hashindex_remove(&job->watchlist->byclient, &watcher->byclient);
+            pool_free(&watcher_pool, watcher);
+            return -1;
+        }
+        job->watchlist->nraw++;
+    }
+
     if (job->watchlist->size == 0) /* Job was jsut created or was solo */
     {
         job->watchlist->head = job->watchlist->end = watcher;
@@ -508,6 +1325,15 @@ int add_watcher(pid_t pid, client_t *client, joblist_t *joblist)
         job->watchlist->end = watcher;
     }
     job->watchlist->size++;
+
+    /* Remember the job on the client, for when it disconnects */
+    watcher->cprev = NULL;
+    watcher->cnext = client->watching;
+    if (client->watching != NULL)
+    {
+        client->watching->cprev = watcher;
+    }
+    client->watching = watcher;
     return 0;
 }
 
@@ -515,7 +1341,8 @@ int add_watcher(pid_t pid, client_t *client, joblist_t *joblist)
  * Remove a client to the watchlist of the job specified by pid. The client that
  * was previously watching the job will no longer be sent any of its output as 
  * nor the jobs exit status. On error, the appropiate message is written to 
- * stderr.
+ * stderr. A job the watcher held stalled is resumed if no other watcher lags.
+ * The caller must hold the joblist lock and the lock of the job.
  *
  * @param wacther
  *        the watcher to remove from the watchlist of the specified job
@@ -545,15 +1372,27 @@ void remove_watcher(watcher_t *watcher, watchlist_t *watchlist)
         nwatcher->prev = pwatcher;
         pwatcher->next = nwatcher;
     }
-    
+    hashindex_remove(&watchlist->byclient, &watcher->byclient);
+    unlink_watching(watcher);
+
+    if (watcher->lagging) /* The job may go on without it */
+    {
+        watcher->job->lagging--;
+        resume_job(watcher->job);
+    }
+    if (watcher->feed != NULL)
+    {
+        watchlist->nraw--;
+    }
+    detach_feed(watcher);
     watchlist->size--;
-    free(watcher);
+    pool_free(&watcher_pool, watcher);
 }
 
 /*
  * Locate the client (watcher) in a job's watchlist and return the watcher_t
- * that contains the client. If the client is not found in the watchlist, then
- * the client was not watching the given job.
+ * that contains the client, through the watchlists index. If the client is
+ * not found in the watchlist, then the client was not watching the given job.
  *
  * @param client
  *        the client to locate in the specified job's watchlist
@@ -567,21 +1406,11 @@ void remove_watcher(watcher_t *watcher, watchlist_t *watchlist)
  */
 watcher_t *find_watcher(client_t *client, watchlist_t *watchlist)
 {
-    /* No clients currently watch the job */
-    if (watchlist == NULL || watchlist->size == 0 || watchlist->head == NULL)
+    if (watchlist == NULL)
     {
         return NULL;
     }
-    watcher_t *watcher = watchlist->head;
-    while (watcher) /* Locate client */
-    {
-        if (watcher->client == client)
-        {
-            return watcher;
-        }
-        watcher = watcher->next;
-    }
-    return NULL;
+    return hashindex_find(&watchlist->byclient, (uintptr_t) client);
 }
 
 /*
@@ -603,3 +1432,79 @@ int watchercmp(watcher_t *watcher1, watcher_t *watcher2)
     }
     return watcher1 == watcher2;
 }
+
+/*
+ * Unlink a watcher from the jobs its client watches.
+ *
+ * @param watcher
+ *        the watcher being removed
+ */
+static void unlink_watching(watcher_t *watcher)
+{
+    if (watcher->cprev != NULL)
+    {
+        watcher->cprev->cnext = watcher->cnext;
+    }
+    else
+    {
+        watcher->client->watching = watcher->cnext;
+    }
+    if (watcher->cnext != NULL)
+    {
+        watcher->cnext->cprev = watcher->cprev;
+    }
+    watcher->cnext = watcher->cprev = NULL;
+}
+
+/*
+ * Remove the client from the watchlist of every job it watches, used when the
+ * client disconnects so no job keeps writing to it. Only the jobs the client
+ * watches are visited, through its own list of watchers. The caller must hold
+ * the joblist lock.
+ *
+ * @param client
+ *        the client that is closing
+ */
+void unwatch_all(client_t *client)
+{
+    while (client->watching != NULL)
+    {
+        job_t *job = client->watching->job;
+        pthread_mutex_lock(&job->lock);
+        remove_watcher(client->watching, job->watchlist);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/*******************************************************************************
+ *                               Object Pools                                  *
+ ******************************************************************************/
+
+/*
+ * Log the statistics of the pools the clients, jobs and watchers are allocated
+ * from (see pool_report_stats()), reported on shutdown.
+ */
+void report_pools(void)
+{
+    objpool_t *pools[] = { &client_pool, &job_pool, &watchlist_pool,
+                           &watcher_pool };
+    char stats[BUFSIZE + 1];
+
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++)
+    {
+        pool_report_stats(pools[i], stats, sizeof(stats));
+        log_message(stats);
+    }
+}
+
+/*
+ * Release the slabs of every pool at once. This should only be called when the
+ * server is shutting down, after the clientlists and the joblist are cleared.
+ */
+void release_pools(void)
+{
+    pool_destroy(&client_pool);
+    pool_destroy(&job_pool);
+    pool_destroy(&watchlist_pool);
+    pool_destroy(&watcher_pool);
+}
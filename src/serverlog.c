@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
@@ -9,17 +12,37 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include "headers/serverdata.h"
 #include "headers/jobcommands.h"
 #include "headers/serverlog.h"
+#include "headers/iobackend.h"
+#include "headers/frame.h"
+#include "headers/logger.h"
 
 /* Separator for the server.log to differentiate between startups */
 char *separator = "=======================================================";
 
-/* The servers log */
-static FILE *serverlog;
+/* How job output is handled for watchers that fall behind */
+static slowpolicy_t slowpolicy = SLOW_DROP;
+static size_t highwater = DEFAULT_HIGHWATER;
+
+/* How much is logged, and one in how many lines of stdout */
+static loglevel_t loglevel = LEVEL_OUTPUT;
+static unsigned long logsample = 1;
+
+/* Job output that has to be copied for raw watchers without line watchers */
+static __thread char rawbuf[RAWBUF_SIZE];
+
+static int feed_watcher(watcher_t *watcher, const char *msg, size_t len,
+                        job_t *job, int message);
 
 /*******************************************************************************
  *                          Display Valid Commands                             *
@@ -34,9 +57,12 @@ char *cmdheads[] =
     "[SERVER] jobs:",
     "[SERVER] joblist:",
     "[SERVER] run [jobname] [args]:",
-    "[SERVER] watch [pid]:",
+    "[SERVER] watch [pid] [n]:",
+    "[SERVER] range [pid] [m] [n]:",
+    "[SERVER] last [pid] [n]:",
     "[SERVER] kill [pid]:",
-    "[SERVER] exit:"
+    "[SERVER] exit:",
+    "[SERVER] binary:"
 };
 
 /*
@@ -47,16 +73,22 @@ char *cmdmsg[] =
     "\r\n",
     "list the currently running jobs\r\n",
     "list the jobs that can be run\r\n",
-    "run a new job \"jobname\" with arguments (0+ args)\r\n",
-    "watch the job specified by pid's output\r\n",
+    "run a new job \"jobname\" with arguments (0+ args), after -q its "
+    "output is not logged\r\n",
+    "watch the job specified by pid's output, after its last n lines (or "
+    "add \"raw\" or \"chunked\" for it unformatted)\r\n",
+    "lines m to n of the output of the job specified by pid, even once it "
+    "has ended\r\n",
+    "the last n lines of the output of the job specified by pid\r\n",
     "kill the job specified by pid\r\n",
-    "close your connection with the server\r\n"
+    "close your connection with the server\r\n",
+    "switch the output sent to you to binary frames\r\n"
 };
 
 /*
  * Indent amount between the cmdhead[i] and cmdmsg[i], to ensure corect format.
  */
-int cmdindent[] = { 0, 18, 15, 2, 11, 12, 18 };
+int cmdindent[] = { 0, 18, 15, 2, 7, 3, 8, 12, 18, 16 };
 
 
 /*******************************************************************************
@@ -96,50 +128,111 @@ int jobindent[] = { 0, 9, 9, 9 };
  ******************************************************************************/
 
 /*
- * Log the message to the servers stdout as well as the active server.log.
- * Network newlines (if applicable) are not stripped before logging.
+ * Log the message to the servers stdout as well as the servers log.
+ * Network newlines (if applicable) are not stripped before logging. The
+ * message is handed to the logger thread, which writes it out (see logger.c).
  *
  * @param buf
  *        the message to log
  */
 void log_message(char *buf)
 {
-    printf("%s", buf);
-    fprintf(serverlog, "%s", buf);
+    logger_push(LOG_TEXT, -1, 0, buf, strlen(buf));
 }
 
 /*
  * Log the command the client sent to the server, regardless of if its valid
- * or not.
+ * or not. The command is formatted by the logger thread.
  *
  * @param buf
  *        the command the client requested
  * @param clientfd
- *        wwthe fd of which the command came
+ *        the fd of which the command came
  */
 void log_client_command(char *buf, int clientfd)
 {
-    char msg[BUFSIZE + 1];
-    if (sprintf(msg, CLIENT_CMD, clientfd, buf) < 0)
+    logger_push(LOG_COMMAND, clientfd, 0, buf, strlen(buf));
+}
+
+/*
+ * Set how much the server logs. The output of a job is logged at LEVEL_OUTPUT
+ * and above: every line of its stderr, and one in sample lines of its stdout.
+ *
+ * @param level
+ *        how much is logged (see serverlog.h)
+ * @param sample
+ *        one in how many lines of stdout are logged, 1 for every line
+ */
+void set_log_policy(loglevel_t level, unsigned long sample)
+{
+    loglevel = level;
+    logsample = sample > 0 ? sample : 1;
+}
+
+#ifdef DEBUG_LOG
+/*
+ * Log a debug message, at LEVEL_DEBUG. Only built with DEBUG_LOG, without it
+ * every log_debug() is compiled out along with its arguments.
+ *
+ * @param format
+ *        the format of the message, followed by its arguments
+ */
+void log_debugf(const char *format, ...)
+{
+    char buf[BUFSIZE + 1];
+    va_list args;
+
+    if (loglevel < LEVEL_DEBUG)
     {
         return;
     }
-    log_message(msg);
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    log_message(buf);
+}
+#endif
+
+/*
+ * Decide if a line of the jobs output is logged, as set by set_log_policy()
+ * and the flags the job was run with. The caller polls the job, so it is the
+ * only one to count its lines.
+ *
+ * @return
+ *        0:            the line is not logged
+ *        1:            the line is logged
+ */
+static int log_output(const jobmsg_t *msg, job_t *job)
+{
+    unsigned long line = job->lines++;
+    if (loglevel < LEVEL_OUTPUT || (job->flags & JOB_NOLOG))
+    {
+        return 0;
+    }
+    if (msg->stream != FRAME_STDERR && line % logsample != 0)
+    {
+        return 0;
+    }
+    job->logged++;
+    return 1;
 }
 
 /*
- * Open the server.log file (if it doesn't exist, make one) and log the servers
- * start up time to stdout and the server.log.
+ * Open the servers log, a new segment in the log directory (if it doesn't
+ * exist, make one), start the logger thread and log the servers start up time
+ * to stdout and the log.
+ *
+ * @param logdir
+ *        the directory of the log segments
  *
  * @exit
- *        1:            server.log could not be oppened (this is pre-mallocs)
+ *        1:            the log could not be oppened (this is pre-mallocs)
  */
-void log_startup()
+void log_startup(const char *logdir)
 {
-    serverlog = fopen("../server.log", "ab");
-    if (serverlog == NULL)
+    if (logger_start(logdir) < 0)
     {
-        fprintf(stderr, "[SERVER] server.log error\n");
+        perror("[SERVER] log");
         exit(1);
     }
 
@@ -149,39 +242,36 @@ void log_startup()
     strftime(time, sizeof(time), "%c", tm);
 
     char buf[BUFSIZE+1];
-    if (sprintf(buf, SERVER_ACT, time) < 0)
+    if (sprintf(buf, "%s\n" SERVER_ACT, separator, time) < 0)
     {
         return;
     }
-
-    fprintf(stdout, "%s\n", separator);
-    fprintf(stdout, "%s", buf);
-    fprintf(serverlog, "%s\n", separator);
-    fprintf(serverlog, "%s", buf);
+    log_message(buf);
 }
 
 /*
- * Log the time the server was de-actived to stdout and the server.log, closing
- * the server.log file before exiting.
+ * Stop the logger thread once it has written out every message, then log how
+ * it did and the time the server was de-actived to stdout and the log, sealing
+ * the segment before exiting.
  */
 void log_shutdown()
 {
+    logger_stop();
+
+    char buf[BUFSIZE+1];
+    logger_report_stats(buf, sizeof(buf));
+    log_message(buf);
+
     time_t t = time(NULL);
     struct tm *tm = localtime(&t);
     char time[64];
     strftime(time, sizeof(time), "%c", tm);
 
-    char buf[BUFSIZE+1];
-    if (sprintf(buf, SERVER_DEACT, time) < 0)
+    if (sprintf(buf, SERVER_DEACT "%s\n", time, separator) >= 0)
     {
-        return;
+        log_message(buf);
     }
-
-    fprintf(stdout, "%s", buf);
-    fprintf(stdout, "%s\n", separator);
-    fprintf(serverlog, "%s", buf);
-    fprintf(serverlog, "%s\n", separator);
-    fclose(serverlog);
+    logger_close();
 }
 
 /*******************************************************************************
@@ -189,166 +279,1706 @@ void log_shutdown()
  ******************************************************************************/
 
 /*
- * Write to the client a message "buf" in the specified format "format". Format
- * parameter is NULL if the server is senting one of the following messages:
- *
- * 1. The connection accepted message
- * 2. The initial "welcome" message
+ * Set the policy applied to watchers that fall behind and the amount of 
+ * output a client may have waiting before it is considered behind. This 
+ * should be called before any client connects.
  *
- * If the server has recieved an invalid command or requests the message to be
- * formatted, the format parameter will be set as such.
+ * @param policy
+ *        the policy to apply (see serverlog.h)
+ * @param hwm
+ *        the high-water mark in bytes
+ */
+void set_slow_policy(slowpolicy_t policy, size_t hwm)
+{
+    slowpolicy = policy;
+    highwater = hwm;
+}
+
+/*
+ * Determine if the client has more output waiting than the high-water mark,
+ * counting the output waiting in its feeds. The caller must hold the output
+ * lock of the client.
  *
- * All messages written will be logged.
+ * @return
+ *        0:            the client is keeping up
+ *        1:            the client has fallen behind
+ */
+int client_behind(client_t *client)
+{
+    return client->outbytes + client->rawbytes >= highwater;
+}
+
+/*
+ * Disconnect a client that fell behind, or whose socket failed while it was
+ * sent job output. Its socket is shut down, and the owning worker closes the
+ * client once the socket reports it, which removes it from the watchlists it
+ * is in. The caller must hold the output lock of the client.
+ */
+static void shut_client(client_t *client)
+{
+    if (!client->closing)
+    {
+        client->closing = 1;
+        shutdown(client->clientfd, SHUT_RDWR);
+    }
+}
+
+/*
+ * Append bytes to a chain of buffers, packing them into the tail buffer.
  *
- * @param format
- *        one of the message formats defined in serverlog.h
- * @param buf
- *        the message the server is sending to the client
- * @param clientfd
- *        the client's fd to write the message too
+ * @param head tail
+ *        the chain to append to
  *
  * @return
- *        -1:           the clients has closed its socket
- *        0:            the messages were written to the client successfully
- *        1:            an error occured and the message could not be sent
+ *        -1:           the bytes could not be appended
+ *        0:            the bytes were appended
  */
-int write_client(char *format, char *buf, int clientfd)
+static int append_chain(outbuf_t **head, outbuf_t **tail, const char *msg,
+                        size_t len)
 {
-    char msg[BUFSIZE + 1];
-    if (format != NULL && buf != NULL)
+    while (len > 0)
     {
-        if (sprintf(msg, format, buf) < 0)
+        outbuf_t *last = *tail;
+        if (last == NULL || last->end == OUTBUF_SIZE || last->fd >= 0)
         {
-            return 1;
+            outbuf_t *buf = malloc(sizeof(struct outbuf));
+            if (buf == NULL)
+            {
+                return -1;
+            }
+            buf->next = NULL;
+            buf->fd = -1;
+            buf->start = buf->end = 0;
+
+            if (last == NULL)
+            {
+                *head = buf;
+            }
+            else
+            {
+                last->next = buf;
+            }
+            *tail = last = buf;
         }
+
+        size_t room = OUTBUF_SIZE - last->end;
+        size_t n = len < room ? len : room;
+        memcpy(last->data + last->end, msg, n);
+        last->end += n;
+        msg += n;
+        len -= n;
     }
-    else if (buf == NULL)
+    return 0;
+}
+
+/*
+ * Append bytes to the clients outbound chain. When the chain goes from empty
+ * to non-empty the client is polled for EPOLLOUT so the event loop drains it
+ * (see flush_client()), unless the client is corked or has a write in flight,
+ * as it is polled once that is done (see uncork_client() and 
+ * write_to_watchers()).
+ *
+ * @return
+ *        -1:           the output could not be queued
+ *        0:            the output was queued
+ */
+static int queue_client(client_t *client, const char *msg, size_t len)
+{
+    int was_empty = client->outhead == NULL;
+
+    if (append_chain(&client->outhead, &client->outtail, msg, len) < 0)
+    {
+        return -1;
+    }
+    client->outbytes += len;
+
+    if (was_empty && !client->corked && !client->inflight)
+    {
+        modify_fd(client->clientfd, client, EPOLLIN | EPOLLOUT, client->fdset);
+    }
+    return 0;
+}
+
+/*
+ * Put the rest of a write the socket did not take back in front of the
+ * clients outbound chain, ahead of the output queued while the write was in
+ * flight.
+ *
+ * @return
+ *        -1:           the output could not be queued
+ *        0:            the output was queued
+ */
+static int requeue_client(client_t *client, const char *msg, size_t len)
+{
+    outbuf_t *head = NULL;
+    outbuf_t *tail = NULL;
+
+    if (append_chain(&head, &tail, msg, len) < 0)
     {
-        if (sprintf(msg, format, clientfd) < 0)
+        while (head)
         {
-            return 1;
+            outbuf_t *next = head->next;
+            free(head);
+            head = next;
         }
+        return -1;
     }
-    else
+    tail->next = client->outhead;
+    client->outhead = head;
+    client->outbytes += len;
+    return 0;
+}
+
+/*
+ * Queue whatever a direct write to the client did not take. A would-block 
+ * result (or a short write) is not an error, the rest waits in the chain, in
+ * front of anything queued while the write was in flight.
+ *
+ * @param result
+ *        the bytes written, or -errno
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the message was written or queued
+ */
+static int complete_write(client_t *client, const char *msg, size_t len,
+                            ssize_t result)
+{
+    if (result < 0)
     {
-        if (strcpy(msg, buf) < 0)
+        if (result != -EAGAIN && result != -EWOULDBLOCK)
         {
-            return 1;
+            return -1;
         }
+        result = 0;
     }
-
-    log_message(msg);
-    if (write(clientfd, msg, strlen(msg)) != strlen(msg))
+    if (result < len && client->outhead != NULL)
     {
-        return -1;
+        return requeue_client(client, msg + result, len - result);
+    }
+    if (result < len)
+    {
+        return queue_client(client, msg + result, len - result);
     }
     return 0;
 }
 
 /*
- * Write to the server the output of the job it ahs created. The exit_status
- * parameter should be -1 if the job is sending one of the following messages:
+ * Format the marker of a gap in the output sent to the client: the text
+ * format, or a FRAME_GAP frame for a client that uses binary framing. The
+ * caller must hold the output lock of the client.
  *
- * 1. The jobs stdout
- * 2. The jobs stderr
- * 3. The validation message of a successful job creation
- * 4. The jobs "killed by signal" message (command "kill [pid]")
- * 5. The client requested to watch the job (command "watch [pid]")
- * 6. The client requested to no longer watch the job (command "watch [pid]")
+ * @param buf
+ *        where the marker is formatted to, at least BUFSIZE + 1 bytes
+ * @param client
+ *        the client the marker is for
+ * @param format
+ *        OUTPUT_GAP or RAW_GAP
+ * @param pid
+ *        the job whose raw output was dropped, 0 for lines
+ * @param count
+ *        the amount of lines or bytes dropped
  *
- * If exit_status > 0, then the JOB_EXIT message should be the provied format.
+ * @return
+ *        the length of the marker
+ */
+static size_t format_gap(char *buf, client_t *client, const char *format,
+                         pid_t pid, unsigned long count)
+{
+    if (!client->binary)
+    {
+        return sprintf(buf, format, count);
+    }
+
+    uint64_t amount = htobe64(count);
+    size_t len = frame_pack(buf, FRAME_GAP, FRAME_NOSTREAM, pid,
+                            sizeof(amount));
+    memcpy(buf + len, &amount, sizeof(amount));
+    return len + sizeof(amount);
+}
+
+/*
+ * Send bytes to the client, as send_client(), with its output lock held.
+ */
+static int send_locked(client_t *client, const char *msg, size_t len)
+{
+    if (client->closing)
+    {
+        return -1;
+    }
+    if (client->outhead != NULL || client->sending != NULL || client->corked
+        || client->inflight)
+    {
+        return queue_client(client, msg, len);
+    }
+
+    ssize_t nbytes = write(client->clientfd, msg, len);
+    return complete_write(client, msg, len, nbytes < 0 ? -errno : nbytes);
+}
+
+/*
+ * Send bytes to the client without blocking. If nothing is waiting for the
+ * client the bytes are written straight away, otherwise (or if the socket
+ * can not take all of them) they are appended to the clients chain to keep
+ * the output in order. The bytes are only queued while the client is corked.
  *
- * All messages written will be logged.
+ * @param client
+ *        the client to send to
+ * @param msg
+ *        the bytes to send
+ * @param len
+ *        the amount of bytes to send
  *
- * @param format
- *        one of the job message formats defined in serverlog.h
- * @param jobpid
- *        the pid of the job requesting the message transfer
- * @param exit_status
- *         the jobs exit status (= -1 if void)
- * @param buf
- *        the message the job is sending to the client
- * @param writefd
- *        the pipe to write the jobs message too
+ * @return
+ *        -1:           the clients socket has closed
+ *        0:            the bytes were written or queued
+ */
+int send_client(client_t *client, const char *msg, size_t len)
+{
+    pthread_mutex_lock(&client->outlock);
+    int sent = send_locked(client, msg, len);
+    pthread_mutex_unlock(&client->outlock);
+    return sent;
+}
+
+/*
+ * Queue a range of a file for the client, behind the output already waiting,
+ * to be sent with sendfile() (see write_range()). Only the file is kept, so
+ * the range may be any size, and it is not counted in outbytes: a large range
+ * must not make the client look like a watcher falling behind its jobs.
  *
  * @return
- *        -1:           the write failed
- *        0:            the messages were written to the client successfully
- *        1:            an error occured and the message could not be sent
+ *        -1:           the range could not be queued, the file is closed
+ *        0:            the range was queued
  */
-int write_job(char *format, pid_t jobpid, int exit_status,
-                char *buf, int writefd)
+static int queue_range(client_t *client, int fd, off_t offset, size_t len)
 {
-    char msg[BUFSIZE + 1];
-    if (exit_status >= 0)
+    int was_empty = client->outhead == NULL;
+    outbuf_t *buf = malloc(sizeof(struct outbuf));
+
+    if (buf == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    buf->next = NULL;
+    buf->fd = fd;
+    buf->start = offset;
+    buf->end = offset + len;
+
+    if (client->outtail == NULL)
+    {
+        client->outhead = buf;
+    }
+    else
+    {
+        client->outtail->next = buf;
+    }
+    client->outtail = buf;
+
+    if (was_empty && !client->corked && !client->inflight)
+    {
+        modify_fd(client->clientfd, client, EPOLLIN | EPOLLOUT, client->fdset);
+    }
+    return 0;
+}
+
+/*
+ * Send a range of a file to the client, as send_file(), with its output lock
+ * held.
+ */
+static int send_range(client_t *client, int fd, off_t offset, size_t len,
+                      pid_t pid)
+{
+    if (client->closing)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while (client->binary)
     {
-        if (sprintf(msg, format, jobpid, exit_status) < 0)
-            return 1;
+        char header[FRAME_HEADER];
+        size_t piece = len < FILE_FRAME ? len : FILE_FRAME;
+        int piecefd = piece < len ? dup(fd) : fd;
 
-        if (write(writefd, msg, strlen(msg)) != strlen(msg))
+        frame_pack(header, FRAME_RAW, FRAME_STDOUT, pid, piece);
+        if (piecefd < 0 || send_locked(client, header, FRAME_HEADER) < 0)
+        {
+            if (piecefd >= 0 && piecefd != fd)
+            {
+                close(piecefd);
+            }
+            close(fd);
+            return -1;
+        }
+        if (queue_range(client, piecefd, offset, piece) < 0)
+        {
+            if (piecefd != fd)
+            {
+                close(fd);
+            }
             return -1;
+        }
+        if (piece == len)
+        {
+            return 0;
+        }
+        offset += piece;
+        len -= piece;
+    }
 
-        return 0;
+    if (client->outhead == NULL && client->sending == NULL && !client->corked
+        && !client->inflight)
+    {
+        while (len > 0)
+        {
+            ssize_t nbytes = sendfile(client->clientfd, fd, &offset, len);
+            if (nbytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                close(fd);
+                return -1;
+            }
+            if (nbytes <= 0)
+            {
+                break;
+            }
+            len -= nbytes;
+        }
+        if (len == 0)
+        {
+            close(fd);
+            return 0;
+        }
     }
-    if (buf == NULL)
-        buf = "";
+    return queue_range(client, fd, offset, len);
+}
 
-    if (sprintf(msg, format, jobpid, buf) < 0)
-        return 1;
+/*
+ * Send a range of a file to the client, such as the spooled output of a job,
+ * without copying it into the server. If nothing is waiting for the client the
+ * range is sent straight away, and whatever the socket does not take is
+ * queued. A client that uses binary framing is sent the range in FRAME_RAW
+ * frames of up to FILE_FRAME bytes. The file is closed once it is sent.
+ *
+ * @param client
+ *        the client to send to
+ * @param fd
+ *        the file, which the client takes over
+ * @param offset len
+ *        the range of the file to send
+ * @param pid
+ *        the job the file is the output of, for the frames
+ *
+ * @return
+ *        -1:           the clients socket has closed
+ *        0:            the range was sent or queued
+ */
+int send_file(client_t *client, int fd, off_t offset, size_t len, pid_t pid)
+{
+    pthread_mutex_lock(&client->outlock);
+    int sent = send_range(client, fd, offset, len, pid);
+    pthread_mutex_unlock(&client->outlock);
+    return sent;
+}
 
+/*
+ * Send a message of the server to the client, as send_message(), with its
+ * output lock held.
+ */
+static int send_framed(client_t *client, const char *msg, size_t len)
+{
+    if (!client->binary)
+    {
+        return send_locked(client, msg, len);
+    }
 
-    if (write(writefd, msg, strlen(msg)) != strlen(msg))
-        return -1;
+    char frame[FRAME_HEADER + BUFSIZE + 1];
+    while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+    {
+        len--;
+    }
+    if (len > BUFSIZE + 1)
+    {
+        len = BUFSIZE + 1;
+    }
 
-    return 0;
+    size_t header = frame_pack(frame, FRAME_SERVER, FRAME_NOSTREAM, 0, len);
+    memcpy(frame + header, msg, len);
+    return send_locked(client, frame, header + len);
 }
 
 /*
- * Distribute the output of the job to all the watchers. If the output could
- * not be written to a client, remove the client from the watchlist. This occurs
- * when the client closes their connection to the server.
- * 
- * @param buf
- *      the output of the job to distribute
- * @param watchlist
- *      the list of clients that are watching the job to sent output too
+ * Send a message of the server to the client. A client that uses binary 
+ * framing is sent it as a FRAME_SERVER frame, without its newline.
+ *
+ * @param client
+ *        the client to send to
+ * @param msg
+ *        the message, ending in a newline
+ * @param len
+ *        the length of the message, no more than BUFSIZE + 1
  *
  * @return
- *      -1:         error occured and the output can not be sent
- *      0:          the output was sent to the jobs (or was attempted)
+ *        -1:           the clients socket has closed
+ *        0:            the message was written or queued
  */
-int write_to_watchers(char *buf, watchlist_t *watchlist)
+int send_message(client_t *client, const char *msg, size_t len)
 {
-    char msg[BUFSIZE+1];
-    if (sprintf(msg, "%s\r\n", buf) < 0)
-        return -1;
+    pthread_mutex_lock(&client->outlock);
+    int sent = send_framed(client, msg, len);
+    pthread_mutex_unlock(&client->outlock);
+    return sent;
+}
 
-    log_message(msg);
+/*
+ * Send the client BINARY_ON, the last text it is sent, and switch it to
+ * binary framing. Both happen under the output lock of the client, so job 
+ * output that other workers queue for it is framed as the side of the switch
+ * it lands on expects.
+ *
+ * @param client
+ *        the client to switch
+ *
+ * @return
+ *        -1:           the clients socket has closed
+ *        0:            the client now uses binary framing
+ */
+int start_binary(client_t *client)
+{
+    char *msg = BINARY_ON "\r\n";
+    int sent = 0;
 
-    watcher_t *watcher = watchlist->head;
-    int skip = 0;
-    while (watcher)
+    pthread_mutex_lock(&client->outlock);
+    if (!client->binary)
+    {
+        log_message(msg);
+        sent = send_framed(client, msg, strlen(msg));
+        client->binary = sent == 0;
+    }
+    pthread_mutex_unlock(&client->outlock);
+    return sent;
+}
+
+/*
+ * Send the range of a file at the head of the clients outbound chain with
+ * sendfile(), so it is never copied into the server. The file is closed once
+ * the range is sent, or if it turns out shorter than the range. The caller
+ * must hold the output lock of the client.
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the socket is full
+ *        1:            the range was sent
+ */
+static int write_range(client_t *client)
+{
+    outbuf_t *buf = client->outhead;
+
+    while (buf->start < buf->end)
     {
-        /* Client closed its connection */
-        if ((skip = write(watcher->client->clientfd, msg, strlen(msg))) < 0)
-        {   
-            watcher_t *temp = watcher;
-            watcher = watcher->next;
-            remove_watcher(temp, watchlist);
+        off_t offset = buf->start;
+        ssize_t nbytes = sendfile(client->clientfd, buf->fd, &offset,
+                                  buf->end - buf->start);
+        if (nbytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        if (nbytes == 0) /* The file is shorter than the range */
+        {
+            nbytes = buf->end - buf->start;
         }
-        if (skip >= 0)
-            watcher = watcher->next;
+        buf->start += nbytes;
     }
-    return 0;
+
+    close(buf->fd);
+    client->outhead = buf->next;
+    if (client->outhead == NULL)
+    {
+        client->outtail = NULL;
+    }
+    free(buf);
+    return 1;
 }
 
 /*
- * Write to the client the list of valid commands or valid jobs that the server
- * can take. This should be called if the client sends the command "commands" or 
- * "joblist".
+ * Write as much of the clients outbound chain as the socket will take. The
+ * caller must hold the output lock of the client.
  *
- * @param clientfd
- *        the clients fd to write too
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the socket is full
+ *        1:            the chain is empty
+ */
+static int write_chain(client_t *client)
+{
+    while (client->outhead)
+    {
+        struct iovec iov[16];
+        int count = 0;
+
+        if (client->outhead->fd >= 0)
+        {
+            int result = write_range(client);
+            if (result <= 0)
+            {
+                return result;
+            }
+            continue;
+        }
+
+        for (outbuf_t *buf = client->outhead; buf && buf->fd < 0 && count < 16;
+             buf = buf->next)
+        {
+            iov[count].iov_base = buf->data + buf->start;
+            iov[count].iov_len = buf->end - buf->start;
+            count++;
+        }
+
+        ssize_t nbytes = writev(client->clientfd, iov, count);
+        if (nbytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        client->outbytes -= nbytes;
+
+        /* Release every buffer that was written completely */
+        while (client->outhead && nbytes > 0)
+        {
+            outbuf_t *buf = client->outhead;
+            size_t left = buf->end - buf->start;
+
+            if (nbytes < left)
+            {
+                buf->start += nbytes;
+                break;
+            }
+            nbytes -= left;
+            client->outhead = buf->next;
+            free(buf);
+        }
+        if (client->outhead == NULL)
+        {
+            client->outtail = NULL;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Append bytes to a feed behind the output already in it: into its pipe while
+ * nothing has spilled, the rest into the spill chain. The caller must hold
+ * the output lock of the client.
+ *
+ * @return
+ *        -1:           the bytes could not be appended
+ *        0:            the bytes were appended
+ */
+static int feed_bytes(rawfeed_t *feed, client_t *client, const char *msg,
+                        size_t len)
+{
+    if (feed->spillbytes == 0)
+    {
+        ssize_t nbytes = write(feed->pipe[1], msg, len);
+        if (nbytes > 0)
+        {
+            feed->queued += nbytes;
+            client->rawbytes += nbytes;
+            msg += nbytes;
+            len -= nbytes;
+        }
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    if (append_chain(&feed->spillhead, &feed->spilltail, msg, len) < 0)
+    {
+        return -1;
+    }
+    feed->spillbytes += len;
+    client->rawbytes += len;
+    return 0;
+}
+
+/*
+ * Write the rest of the feed the client is sending. Output in the feeds pipe
+ * is splice()d into the socket, output that spilled is written from the spill
+ * chain after it. The caller must hold the output lock of the client.
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the socket is full
+ *        1:            the feed was sent up to client->sendleft
+ */
+static int write_feed(client_t *client)
+{
+    rawfeed_t *feed = client->sending;
+
+    while (client->sendleft > 0)
+    {
+        ssize_t nbytes;
+        if (feed->queued > 0)
+        {
+            size_t len = feed->queued < client->sendleft 
+                            ? feed->queued : client->sendleft;
+            nbytes = splice(feed->pipe[0], NULL, client->clientfd, NULL, len,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nbytes > 0)
+            {
+                feed->queued -= nbytes;
+            }
+        }
+        else
+        {
+            outbuf_t *buf = feed->spillhead;
+            size_t len = buf->end - buf->start;
+            if (len > client->sendleft)
+            {
+                len = client->sendleft;
+            }
+
+            nbytes = write(client->clientfd, buf->data + buf->start, len);
+            if (nbytes > 0)
+            {
+                buf->start += nbytes;
+                feed->spillbytes -= nbytes;
+                if (buf->start == buf->end)
+                {
+                    feed->spillhead = buf->next;
+                    if (feed->spillhead == NULL)
+                    {
+                        feed->spilltail = NULL;
+                    }
+                    free(buf);
+                }
+            }
+        }
+
+        if (nbytes <= 0)
+        {
+            if (nbytes == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        client->sendleft -= nbytes;
+        client->rawbytes -= nbytes;
+    }
+    return 1;
+}
+
+/*
+ * Write the clients outbound chain and then its feeds for as long as the 
+ * socket takes them. A feed is sent up to what it held when its turn came, so
+ * chunks are never interrupted by other output, and feeds take turns so a busy
+ * job does not starve the others. A detached feed is freed once it is empty.
+ * The caller must hold the output lock of the client.
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the socket is full
+ *        1:            nothing is left to send
+ */
+static int drain_client(client_t *client)
+{
+    while (1)
+    {
+        if (client->sending == NULL)
+        {
+            int result = write_chain(client);
+            if (result <= 0)
+            {
+                return result;
+            }
+
+            rawfeed_t *feed = client->feeds;
+            while (feed && feed->queued == 0 && feed->spillbytes == 0)
+            {
+                feed = feed->next;
+            }
+            if (feed == NULL)
+            {
+                return 1;
+            }
+            client->sending = feed;
+            client->sendleft = feed->queued + feed->spillbytes;
+        }
+
+        int result = write_feed(client);
+        if (result <= 0)
+        {
+            return result;
+        }
+
+        rawfeed_t *feed = client->sending;
+        client->sending = NULL;
+        if (feed->dropped > 0 && feed->queued == 0 && feed->spillbytes == 0)
+        {
+            /* Caught up after dropping output, report the gap */
+            char gap[BUFSIZE + 1];
+            size_t len = format_gap(gap, client, RAW_GAP, feed->pid,
+                                    feed->dropped);
+            feed->dropped = 0;
+            if (feed_bytes(feed, client, gap, len) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (!feed->attached && feed->queued == 0 && feed->spillbytes == 0)
+        {
+            free_feed(feed, client);
+        }
+        else if (feed->next != NULL) /* Let the other feeds go first */
+        {
+            rawfeed_t **link = &client->feeds;
+            while (*link != feed)
+            {
+                link = &(*link)->next;
+            }
+            *link = feed->next;
+
+            rawfeed_t *last = feed->next;
+            while (last->next)
+            {
+                last = last->next;
+            }
+            last->next = feed;
+            feed->next = NULL;
+        }
+    }
+}
+
+/*
+ * Write the clients output, as flush_client(), with its output lock held. A
+ * client with a write in flight is not polled for EPOLLOUT until the write
+ * completes (see write_to_watchers()).
+ */
+static int flush_locked(client_t *client)
+{
+    if (client->inflight)
+    {
+        modify_fd(client->clientfd, client, EPOLLIN, client->fdset);
+        return 0;
+    }
+
+    int drained = drain_client(client);
+    if (drained < 0)
+    {
+        return -1;
+    }
+
+    if (drained && client->dropped > 0)
+    {
+        /* Caught up after dropping output, report the gap */
+        char gap[BUFSIZE + 1];
+        size_t len = format_gap(gap, client, OUTPUT_GAP, 0, client->dropped);
+        client->dropped = 0;
+        return send_locked(client, gap, len) < 0 ? -1 : 0;
+    }
+    if (drained)
+    {
+        modify_fd(client->clientfd, client, EPOLLIN, client->fdset);
+    }
+    if (client->stalling 
+        && client->outbytes + client->rawbytes < highwater / 2)
+    {
+        client->stalling = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Write as much of the clients output as the socket will take. This is called
+ * by the event loop when the client becomes writable. Once nothing is left the
+ * client is no longer polled for EPOLLOUT, and if output was dropped while the
+ * client was behind, the gap marker is sent.
+ *
+ * @param client
+ *        the client to drain
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the output was drained as far as possible
+ *        1:            the client stalled a job and has now caught up, so
+ *                      stalled jobs should be resumed (see resume_jobs())
+ */
+int flush_client(client_t *client)
+{
+    pthread_mutex_lock(&client->outlock);
+    int flushed = flush_locked(client);
+    pthread_mutex_unlock(&client->outlock);
+    return flushed;
+}
+
+/*
+ * Cork the client while its worker handles the commands it sent. The replies,
+ * and any job output the client is sent meanwhile, are only queued, to be 
+ * sent at once when the client is uncorked.
+ *
+ * @param client
+ *        the client whose commands are handled
+ */
+void cork_client(client_t *client)
+{
+    pthread_mutex_lock(&client->outlock);
+    client->corked = 1;
+    pthread_mutex_unlock(&client->outlock);
+}
+
+/*
+ * Uncork the client once its worker has handled the commands it sent and let
+ * go of the joblist lock, and write what was queued meanwhile in as few writes
+ * as the socket allows (see flush_client()).
+ *
+ * @param client
+ *        the client whose commands were handled
+ *
+ * @return
+ *        as flush_client()
+ */
+int uncork_client(client_t *client)
+{
+    int flushed = 0;
+
+    pthread_mutex_lock(&client->outlock);
+    client->corked = 0;
+    if (client->outhead != NULL || client->rawbytes > 0 || client->dropped > 0)
+    {
+        flushed = flush_locked(client);
+    }
+    pthread_mutex_unlock(&client->outlock);
+    return flushed;
+}
+
+/*
+ * Write to the client a message "buf" in the specified format "format". Format
+ * parameter is NULL if the server is senting one of the following messages:
+ *
+ * 1. The connection accepted message
+ * 2. The initial "welcome" message
+ *
+ * If the server has recieved an invalid command or requests the message to be
+ * formatted, the format parameter will be set as such.
+ *
+ * All messages written will be logged. A message longer than BUFSIZE is cut
+ * short, keeping its network newline.
+ *
+ * @param format
+ *        one of the message formats defined in serverlog.h
+ * @param buf
+ *        the message the server is sending to the client
+ * @param client
+ *        the client to write the message too
+ *
+ * @return
+ *        -1:           the clients has closed its socket
+ *        0:            the messages were written to the client successfully
+ *        1:            an error occured and the message could not be sent
+ */
+int write_client(char *format, char *buf, client_t *client)
+{
+    char msg[BUFSIZE + 1];
+    int len;
+    if (format != NULL && buf != NULL)
+    {
+        len = snprintf(msg, sizeof(msg), format, buf);
+    }
+    else if (buf == NULL)
+    {
+        len = snprintf(msg, sizeof(msg), format, client->clientfd);
+    }
+    else
+    {
+        len = snprintf(msg, sizeof(msg), "%s", buf);
+    }
+    if (len < 0)
+    {
+        return 1;
+    }
+    if (len >= (int) sizeof(msg)) /* Cut short, such as a long invalid command */
+    {
+        memcpy(msg + sizeof(msg) - 3, "\r\n", 2);
+    }
+
+    log_message(msg);
+    return send_message(client, msg, strlen(msg));
+}
+
+/*
+ * Queue a line of job output for a watcher that already has output waiting,
+ * applying the slow watcher policy if the watcher has fallen behind. The
+ * caller must hold the lock of the job and the output lock of the client.
+ *
+ * @param msg
+ *        the formatted line of output
+ * @param len
+ *        the length of the line
+ * @param watcher
+ *        the watcher of the job the output came from
+ *
+ * @return
+ *        -1:           the client is closing, or could not be queued to
+ *        0:            the line was queued or dropped
+ */
+static int queue_job_output(const char *msg, size_t len, watcher_t *watcher)
+{
+    client_t *client = watcher->client;
+
+    if (client->closing)
+    {
+        return -1;
+    }
+
+    if (client_behind(client))
+    {
+        switch (slowpolicy)
+        {
+            case SLOW_DROP:
+                client->dropped++;
+                return 0;
+            case SLOW_DISCONNECT: /* The owning worker sees the shutdown */
+                shut_client(client);
+                return -1;
+            case SLOW_BLOCK:
+                client->stalling = 1;
+                stall_job(watcher);
+                break;
+        }
+    }
+
+    if (client->dropped > 0) /* Mark the gap before the output resumes */
+    {
+        char gap[BUFSIZE + 1];
+        size_t len = format_gap(gap, client, OUTPUT_GAP, 0, client->dropped);
+        client->dropped = 0;
+        if (queue_client(client, gap, len) < 0)
+        {
+            return -1;
+        }
+    }
+    return queue_client(client, msg, len);
+}
+
+/*
+ * Format a message into buf, or into memory of its own (which the caller 
+ * frees) if it does not fit, such as a long line of job output.
+ *
+ * @param buf size
+ *        where the message is formatted to, and its size
+ * @param len
+ *        set to the length of the message
+ * @param format
+ *        the format of the message, followed by its arguments
+ *
+ * @return
+ *        NULL:         the message could not be formatted
+ *        msg:          the message, buf or memory to free
+ */
+static char *format_line(char *buf, size_t size, size_t *len,
+                         const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(buf, size, format, args);
+    va_end(args);
+
+    if (needed < 0)
+    {
+        return NULL;
+    }
+    *len = needed;
+    if (*len < size)
+    {
+        return buf;
+    }
+
+    char *msg = malloc(*len + 1);
+    if (msg != NULL)
+    {
+        va_start(args, format);
+        vsnprintf(msg, *len + 1, format, args);
+        va_end(args);
+    }
+    return msg;
+}
+
+/*
+ * Format what a job used as the end of the message of its exit (JOB_USAGE),
+ * or nothing if the job did not run in a cgroup. The peak memory is left out
+ * if it was not accounted.
+ */
+static void format_usage(const jobusage_t *usage, char *buf, size_t size)
+{
+    buf[0] = '\0';
+    if (usage != NULL && usage->peak > 0)
+    {
+        snprintf(buf, size, JOB_USAGE,
+                 (unsigned long long) usage->cpu_usec / 1000,
+                 (unsigned long long) usage->peak / 1024);
+    }
+    else if (usage != NULL)
+    {
+        snprintf(buf, size, JOB_USAGE_CPU,
+                 (unsigned long long) usage->cpu_usec / 1000);
+    }
+}
+
+/*
+ * Format a message for the watchers of a job as text (JOB_STDOUT, JOB_STDERR,
+ * JOB_EXIT or JOB_SIGNAL), which is also what the server logs.
+ *
+ * @return
+ *        NULL:         the message could not be formatted
+ *        text:         the message, buf or memory to free
+ */
+static char *format_text(const jobmsg_t *msg, pid_t pid, char *buf,
+                         size_t size, size_t *len)
+{
+    char usage[64];
+
+    switch (msg->type)
+    {
+        case FRAME_EXIT:
+            format_usage(msg->usage, usage, sizeof(usage));
+            return format_line(buf, size, len, JOB_EXIT, pid, msg->status,
+                               usage);
+        case FRAME_SIGNAL:
+            format_usage(msg->usage, usage, sizeof(usage));
+            return format_line(buf, size, len, JOB_SIGNAL, pid, usage);
+        default:
+            return format_line(buf, size, len, msg->stream == FRAME_STDERR
+                               ? JOB_STDERR : JOB_STDOUT, pid, msg->line);
+    }
+}
+
+/*
+ * Frame a message for the watchers of a job that use binary framing. A line
+ * of output is framed as is, without being formatted. The exit of a job that
+ * ran in a cgroup carries what the job used (see FRAME_USAGE).
+ *
+ * @return
+ *        NULL:         there was no memory for the frame
+ *        frame:        the frame, buf or memory to free
+ */
+static char *format_frame(const jobmsg_t *msg, pid_t pid, char *buf,
+                          size_t size, size_t *len)
+{
+    char exit[sizeof(uint32_t) + FRAME_USAGE];
+    const void *payload = msg->line;
+    size_t paylen = msg->len;
+
+    if (msg->type != FRAME_OUTPUT)
+    {
+        uint32_t status = htonl(msg->status);
+        paylen = 0;
+        if (msg->type == FRAME_EXIT)
+        {
+            memcpy(exit, &status, sizeof(status));
+            paylen += sizeof(status);
+        }
+        if (msg->usage != NULL)
+        {
+            uint64_t usage[] = { htobe64(msg->usage->cpu_usec),
+                                 htobe64(msg->usage->peak) };
+            memcpy(exit + paylen, usage, sizeof(usage));
+            paylen += sizeof(usage);
+        }
+        payload = exit;
+    }
+
+    char *frame = buf;
+    *len = FRAME_HEADER + paylen;
+    if (*len > size && (frame = malloc(*len)) == NULL)
+    {
+        return NULL;
+    }
+
+    size_t header = frame_pack(frame, msg->type, msg->stream, pid, paylen);
+    memcpy(frame + header, payload, paylen);
+    return frame;
+}
+
+/*
+ * Distribute a message about the job (a line of its output or its exit) to
+ * all the watchers. Each watcher is sent the message as text, or framed if it
+ * uses binary framing, and each form is only built if a watcher needs it. 
+ * Watchers with nothing waiting are written to directly, in batches of 
+ * IO_BATCH watchers through the servers I/O backend, so with io_uring a line
+ * costs one syscall per batch instead of one per watcher. Whatever a socket
+ * does not take is queued, as is the output for watchers that already have
+ * output waiting (see queue_job_output()). The exit of the job is also sent to
+ * the watchers that watch it raw or chunked, behind the output in their feeds.
+ * If the clients socket has failed, the client is shut down (see 
+ * shut_client()). A line of output is kept in the scrollback of the job as 
+ * well, and every message is written to the spool of the job as text. The 
+ * message is logged as it is, for the logger thread to format. Output is only
+ * logged as set by set_log_policy(), and how much of it was logged is noted
+ * before the exit of the job.
+ *
+ * The caller must hold the lock of the job. The output lock of each watcher is
+ * held while its message is formatted and queued, and let go of while a batch
+ * is written: each client in the batch is marked inflight meanwhile, so any
+ * output another worker sends it is queued behind the write.
+ * 
+ * @param msg
+ *      the message to distribute
+ * @param job
+ *      the job whose watchers the output is sent too
+ *
+ * @return
+ *      0:          the output was sent to the jobs (or was attempted)
+ */
+int write_to_watchers(const jobmsg_t *msg, job_t *job)
+{
+    char textbuf[BUFSIZE + 1];
+    char framebuf[FRAME_HEADER + BUFSIZE + 1];
+    size_t textlen = 0, framelen = 0;
+    char *text = NULL;
+    char *frame = NULL;
+
+    if (msg->type != FRAME_OUTPUT && job->logged < job->lines)
+    {
+        char logged[BUFSIZE + 1];
+        snprintf(logged, sizeof(logged), JOB_LOGGED, job->logged, job->lines,
+                 job->pid);
+        log_message(logged);
+    }
+
+    switch (msg->type)
+    {
+        case FRAME_EXIT:
+            logger_push(LOG_EXIT, -1, job->pid, &msg->status, sizeof(int));
+            break;
+        case FRAME_SIGNAL:
+            logger_push(LOG_SIGNAL, -1, job->pid, NULL, 0);
+            break;
+        default:
+            scrollback_append(&job->scrollback, msg->stream, job->pid,
+                              msg->line, msg->len);
+            if (log_output(msg, job))
+            {
+                logger_push(msg->stream == FRAME_STDERR ? LOG_STDERR
+                                                        : LOG_STDOUT,
+                            -1, job->pid, msg->line, msg->len);
+            }
+            break;
+    }
+
+    /* Spooled as the watchers are sent it as text */
+    if (job->spool.outfd >= 0
+        && (text = format_text(msg, job->pid, textbuf, sizeof(textbuf),
+                               &textlen)) != NULL)
+    {
+        spool_append(&job->spool, text, textlen);
+    }
+
+    iowrite_t writes[IO_BATCH];
+    client_t *batch[IO_BATCH];
+    watcher_t *watcher = job->watchlist->head;
+
+    while (watcher)
+    {
+        int count = 0;
+        for (; watcher && count < IO_BATCH; watcher = watcher->next)
+        {
+            client_t *client = watcher->client;
+            const char *out;
+            size_t len;
+
+            pthread_mutex_lock(&client->outlock);
+            if (client->closing) /* Its owning worker is closing it */
+            {
+                pthread_mutex_unlock(&client->outlock);
+                continue;
+            }
+            if (client->binary && frame == NULL)
+            {
+                frame = format_frame(msg, job->pid, framebuf, sizeof(framebuf),
+                                     &framelen);
+            }
+            else if (!client->binary && text == NULL)
+            {
+                text = format_text(msg, job->pid, textbuf, sizeof(textbuf),
+                                   &textlen);
+            }
+            out = client->binary ? frame : text;
+            len = client->binary ? framelen : textlen;
+
+            if (out == NULL) /* No memory for a long line */
+            {
+                pthread_mutex_unlock(&client->outlock);
+                continue;
+            }
+            if (watcher->feed != NULL) /* Only sent the exit of the job */
+            {
+                if (msg->type != FRAME_OUTPUT)
+                {
+                    feed_watcher(watcher, out, len, job, 1);
+                }
+            }
+            else if (client->outhead != NULL || client->sending != NULL
+                || client->dropped > 0 || client->corked || client->inflight)
+            {
+                queue_job_output(out, len, watcher);
+            }
+            else
+            {
+                client->inflight = 1;
+                writes[count].fd = client->clientfd;
+                writes[count].buf = out;
+                writes[count].len = len;
+                batch[count++] = client;
+            }
+            pthread_mutex_unlock(&client->outlock);
+        }
+
+        io_write_batch(writes, count);
+
+        for (int i = 0; i < count; i++)
+        {
+            client_t *client = batch[i];
+            pthread_mutex_lock(&client->outlock);
+            if (complete_write(client, writes[i].buf, writes[i].len,
+                               writes[i].result) < 0)
+            {
+                shut_client(client); /* Client closed its connection */
+            }
+            client->inflight = 0;
+
+            /* Output was queued behind the write, or is left of it */
+            if ((client->outhead != NULL || client->rawbytes > 0)
+                && !client->corked && !client->closing)
+            {
+                modify_fd(client->clientfd, client, EPOLLIN | EPOLLOUT,
+                          client->fdset);
+            }
+            pthread_mutex_unlock(&client->outlock);
+        }
+    }
+
+    if (text != NULL && text != textbuf)
+    {
+        free(text);
+    }
+    if (frame != NULL && frame != framebuf)
+    {
+        free(frame);
+    }
+    return 0;
+}
+
+/*
+ * Send a client that starts watching a job the last lines of output the job
+ * wrote, in a single write ahead of the output that follows. The lines are
+ * kept as frames, so a client that uses binary framing is sent them as they
+ * are, and any other client as text. The caller must hold the joblist lock
+ * and the lock of the job, so no line of output comes between the lines and
+ * the client starting to watch.
+ *
+ * @param job
+ *        the job the client started watching
+ * @param client
+ *        the watching client
+ * @param count
+ *        the amount of lines to send, or as many as the scrollback holds
+ *
+ * @return
+ *        -1:           the clients socket has closed
+ *        0:            the lines were sent or queued, or there were none
+ *        1:            there was no memory for the lines
+ */
+int replay_scrollback(job_t *job, client_t *client, size_t count)
+{
+    scrollback_t *sb = &job->scrollback;
+    size_t found;
+    size_t offset = scrollback_find(sb, count, &found);
+    size_t len = sb->end - offset;
+
+    if (found == 0)
+    {
+        return 0;
+    }
+
+    /* One more byte, to '\0' terminate the last line in place */
+    char *frames = malloc(len + 1);
+    char *text = client->binary ? NULL
+                 : malloc(len + found * (sizeof(JOB_STDERR) + 16));
+    if (frames == NULL || (!client->binary && text == NULL))
+    {
+        free(frames);
+        free(text);
+        return 1;
+    }
+    scrollback_read(sb, offset, frames, len);
+    scrollback_count_replay(found);
+
+    size_t textlen = 0;
+    for (size_t at = 0; text != NULL && at < len; )
+    {
+        frame_t frame;
+        ssize_t size = frame_unpack(frames + at, len - at, &frame);
+        char *line = frames + at + FRAME_HEADER;
+        char next = line[frame.len];
+
+        line[frame.len] = '\0';
+        textlen += sprintf(text + textlen, frame.stream == FRAME_STDERR
+                           ? JOB_STDERR : JOB_STDOUT, job->pid, line);
+        line[frame.len] = next;
+        at += size;
+    }
+
+    int sent = text != NULL ? send_client(client, text, textlen)
+                            : send_client(client, frames, len);
+    free(frames);
+    free(text);
+    return sent;
+}
+
+/*
+ * Write whatever the feeds of a client now hold. If the socket does not take
+ * all of it, the client is polled for EPOLLOUT and the event loop carries on
+ * (see flush_client()). A corked client, or one with a write in flight, is
+ * written once that is done. The caller must hold the output lock of the
+ * client.
+ *
+ * @return
+ *        -1:           the clients socket has failed
+ *        0:            the output was written or is waiting for the socket
+ */
+static int push_feeds(client_t *client)
+{
+    if (client->corked || client->inflight)
+    {
+        return 0;
+    }
+
+    int drained = drain_client(client);
+    if (drained == 0)
+    {
+        modify_fd(client->clientfd, client, EPOLLIN | EPOLLOUT, client->fdset);
+    }
+    return drained < 0 ? -1 : 0;
+}
+
+/*
+ * Apply the slow watcher policy to a raw or chunked watcher before a read of
+ * the jobs output is fed to it, and put the chunk header and any gap marker 
+ * in its feed. The caller must hold the lock of the job and the output lock
+ * of the client.
+ *
+ * @param watcher
+ *        the watcher to feed
+ * @param len
+ *        the amount of output about to be fed
+ * @param job
+ *        the job the output came from
+ * @param message
+ *        the output is the servers own message about the job, which is fed
+ *        whatever the policy, and as the frame it already is for a client 
+ *        that uses binary framing
+ *
+ * @return
+ *        -1:           the client is closing, or its feed could not be added to
+ *        0:            the output should be fed to the watcher
+ *        1:            the output is dropped for this watcher
+ */
+static int open_feed(watcher_t *watcher, size_t len, job_t *job,
+                     int message)
+{
+    client_t *client = watcher->client;
+    rawfeed_t *feed = watcher->feed;
+    char header[BUFSIZE + 1];
+
+    if (client->closing)
+    {
+        return -1;
+    }
+
+    if (!message && client_behind(client))
+    {
+        switch (slowpolicy)
+        {
+            case SLOW_DROP:
+                feed->dropped += len;
+                return 1;
+            case SLOW_DISCONNECT: /* The owning worker sees the shutdown */
+                shut_client(client);
+                return -1;
+            case SLOW_BLOCK:
+                client->stalling = 1;
+                stall_job(watcher);
+                break;
+        }
+    }
+
+    if (feed->dropped > 0) /* Mark the gap before the output resumes */
+    {
+        size_t hlen = format_gap(header, client, RAW_GAP, job->pid,
+                                 feed->dropped);
+        feed->dropped = 0;
+        if (feed_bytes(feed, client, header, hlen) < 0)
+        {
+            return -1;
+        }
+    }
+    if (feed->mode == WATCH_CHUNKED && !(message && client->binary))
+    {
+        size_t hlen = client->binary
+                    ? frame_pack(header, FRAME_RAW, FRAME_STDOUT, job->pid, len)
+                    : sprintf(header, RAW_CHUNK, job->pid, len);
+        if (feed_bytes(feed, client, header, hlen) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Hand the output waiting in a jobs pipe to the watchers that watch it raw or
+ * chunked. The output is tee()d into the pipe of every feed, and the last feed
+ * takes it with splice(), which also consumes it from the jobs pipe, so it 
+ * never passes through the server. It is only read into the server if the job
+ * has line watchers (which need it in buf) or a feed could not take all of it
+ * (the rest is then copied into that feeds spill chain). The caller must hold
+ * the lock of the job, and the output lock of each watcher is held while its
+ * feed is filled or written.
+ *
+ * @param job
+ *        the job whose output is fed
+ * @param fd
+ *        the jobs pipe
+ * @param buf
+ *        where the output is read to for the jobs line watchers
+ * @param room
+ *        the size of buf, which bounds the amount fed while the job has line
+ *        watchers
+ *
+ * @return
+ *        -1:           the pipe could not be read
+ *        0:            the pipe is empty (or closed)
+ *        n:            n bytes were consumed from the pipe, and read into buf
+ *                      if the job has line watchers
+ */
+ssize_t feed_watchers(job_t *job, int fd, char *buf, size_t room)
+{
+    watchlist_t *watchlist = job->watchlist;
+    int lines = watchlist->size > watchlist->nraw;
+    char *data = lines ? buf : rawbuf;
+    size_t len = lines ? room : RAWBUF_SIZE;
+
+    int avail;
+    if (ioctl(fd, FIONREAD, &avail) < 0)
+    {
+        return -1;
+    }
+    if (avail < len)
+    {
+        len = avail;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    /* Apply the policy first, every feed is given the same amount */
+    watcher_t *last = NULL;
+    watcher_t *watcher;
+    for (watcher = watchlist->head; watcher; watcher = watcher->next)
+    {
+        client_t *client = watcher->client;
+        if (watcher->feed == NULL)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&client->outlock);
+        int result = open_feed(watcher, len, job, 0);
+        watcher->feed->fed = result == 0 ? 0 : -1;
+        if (result < 0)
+        {
+            shut_client(client);
+        }
+        else if (result == 0)
+        {
+            last = watcher;
+        }
+        pthread_mutex_unlock(&client->outlock);
+    }
+
+    int copy = lines;
+    for (watcher = watchlist->head; watcher; watcher = watcher->next)
+    {
+        rawfeed_t *feed = watcher->feed;
+        if (feed == NULL || feed->fed < 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&watcher->client->outlock);
+        if (feed->spillbytes > 0) /* Keep the output in order */
+        {
+            copy = 1;
+        }
+        else if (watcher != last || copy) /* The last takes it with splice() */
+        {
+            ssize_t nbytes = tee(fd, feed->pipe[1], len, SPLICE_F_NONBLOCK);
+            if (nbytes > 0)
+            {
+                feed->fed = nbytes;
+                feed->queued += nbytes;
+                watcher->client->rawbytes += nbytes;
+            }
+            if (feed->fed < len)
+            {
+                copy = 1;
+            }
+        }
+        pthread_mutex_unlock(&watcher->client->outlock);
+    }
+
+    size_t consumed = 0;
+    if (!copy && last != NULL)
+    {
+        pthread_mutex_lock(&last->client->outlock);
+        ssize_t nbytes = splice(fd, NULL, last->feed->pipe[1], NULL, len,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (nbytes > 0)
+        {
+            last->feed->fed = nbytes;
+            last->feed->queued += nbytes;
+            last->client->rawbytes += nbytes;
+            consumed = nbytes;
+        }
+        pthread_mutex_unlock(&last->client->outlock);
+    }
+
+    /* Read what was not spliced, for the line watchers and the spill chains */
+    while (consumed < len)
+    {
+        ssize_t nbytes = read(fd, data + consumed, len - consumed);
+        if (nbytes <= 0)
+        {
+            if (nbytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        consumed += nbytes;
+    }
+
+    for (watcher = watchlist->head; watcher; watcher = watcher->next)
+    {
+        rawfeed_t *feed = watcher->feed;
+        client_t *client = watcher->client;
+        if (feed == NULL || feed->fed < 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&client->outlock);
+        if ((feed->fed < consumed 
+            && feed_bytes(feed, client, data + feed->fed,
+                            consumed - feed->fed) < 0)
+            || push_feeds(client) < 0)
+        {
+            shut_client(client);
+        }
+        pthread_mutex_unlock(&client->outlock);
+    }
+    return consumed;
+}
+
+/*
+ * Feed output (or a message of the server about the job) to a raw or chunked
+ * watcher, behind what is already in its feed, and send as much of the feed
+ * as the socket takes. If the client fails it is shut down. The caller must
+ * hold the lock of the job and the output lock of the client.
+ *
+ * @param watcher
+ *        the watcher to feed
+ * @param msg len
+ *        the bytes to feed, and their amount
+ * @param job
+ *        the job being watched
+ * @param message
+ *        the bytes are a message of the server (see open_feed())
+ *
+ * @return
+ *        -1:           the client is closing
+ *        0:            the bytes were fed, or dropped under the policy
+ */
+static int feed_watcher(watcher_t *watcher, const char *msg, size_t len,
+                        job_t *job, int message)
+{
+    client_t *client = watcher->client;
+    int result = open_feed(watcher, len, job, message);
+
+    if (result < 0 || (result == 0 
+                       && (feed_bytes(watcher->feed, client, msg, len) < 0
+                           || push_feeds(client) < 0)))
+    {
+        shut_client(client);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Feed lines of the jobs stdout to the watchers that watch the job raw or
+ * chunked. This is how the output of a job launched through a job manager 
+ * reaches them, as the manager passes it on line by line.
+ *
+ * @param msg
+ *      the lines, each ending in a network newline
+ * @param len
+ *      the length of the lines
+ * @param job
+ *      the job whose raw and chunked watchers the lines are fed to, whose lock
+ *      the caller must hold
+ */
+void write_to_feeds(const char *msg, size_t len, job_t *job)
+{
+    for (watcher_t *watcher = job->watchlist->head; watcher;
+         watcher = watcher->next)
+    {
+        if (watcher->feed != NULL)
+        {
+            pthread_mutex_lock(&watcher->client->outlock);
+            feed_watcher(watcher, msg, len, job, 0);
+            pthread_mutex_unlock(&watcher->client->outlock);
+        }
+    }
+}
+
+/*
+ * Write to the client the list of valid commands or valid jobs that the server
+ * can take. This should be called if the client sends the command "commands" or 
+ * "joblist".
+ *
+ * @param client
+ *        the client to write too
  * @param type
  *         0 for command list, else for job list
  *
@@ -358,7 +1988,7 @@ int write_to_watchers(char *buf, watchlist_t *watchlist)
  *        -1:           the clients has closed its socket
  *        0:            the messages were written to the client successfully
  */
-int write_setmsg(int clientfd, int type)
+int write_setmsg(client_t *client, int type)
 {
     char **head = cmdheads;
     int *indent = cmdindent;
@@ -381,7 +2011,7 @@ int write_setmsg(int clientfd, int type)
         
         log_message(cmd);
 
-        if (write(clientfd, cmd, strlen(cmd)) != strlen(cmd))
+        if (send_message(client, cmd, strlen(cmd)) < 0)
             return -1;
        
     }
@@ -390,13 +2020,15 @@ int write_setmsg(int clientfd, int type)
 
 /*
  * Notify the connected clients of the server's shutdown, prompting them to
- * terminate.
+ * terminate. Output still waiting for a client is flushed first, as far as
+ * its socket will take it.
  */
 void notify_clients_shutdown(clientlist_t *clientlist)
 {
     /* Errors are void since the program is terminating */
     for(client_t *client = clientlist->head; client; client = client->next)
     {
-        write(client->clientfd, SERVER_SHUTDOWN, strlen(SERVER_SHUTDOWN));
+        flush_client(client);
+        send_message(client, SERVER_SHUTDOWN, strlen(SERVER_SHUTDOWN));
     }
 }
@@ -36,9 +36,11 @@ struct sockaddr_in *init_server_addr(int port) {
 }
 
 /*
- * Create and setup a socket for a server to listen on.
+ * Create and setup a socket for a server to listen on. When reuseport is set,
+ * several sockets may be bound to the same port and the kernel will spread
+ * incoming connections across them (one listener per worker thread).
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuseport) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -55,6 +57,13 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    // Let each worker thread own a listener on the same port.
+    if (reuseport && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+        (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "headers/serverdata.h"
+#include "headers/serverlog.h"
+#include "headers/spool.h"
+
+/* The directory the jobs spool their output to */
+static const char *spooldir = SPOOL_DIR;
+
+/*******************************************************************************
+ *                              Spool Helpers                                  *
+ ******************************************************************************/
+
+/*
+ * Write all of buf to fd at an offset, or appended if the offset is -1.
+ *
+ * @return
+ *        -1:       the write failed, errno is set
+ *        0:        all of buf was written
+ */
+static int write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *at = buf;
+    while (len > 0)
+    {
+        ssize_t nbytes = offset < 0 ? write(fd, at, len)
+                                    : pwrite(fd, at, len, offset);
+        if (nbytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nbytes <= 0)
+        {
+            return -1;
+        }
+        at += nbytes;
+        len -= nbytes;
+        offset += offset < 0 ? 0 : nbytes;
+    }
+    return 0;
+}
+
+/*
+ * Stop spooling the output of a job that could not be written, and keep what
+ * was written so far.
+ */
+static void give_up(spool_t *spool)
+{
+    perror("[SERVER] spool");
+    close(spool->outfd);
+    close(spool->idxfd);
+    spool->outfd = spool->idxfd = -1;
+    free(spool->buf);
+    spool->buf = NULL;
+}
+
+/*
+ * Rewrite the header of the index, once the output and the entries it counts
+ * are written.
+ */
+static int write_header(spool_t *spool, int done)
+{
+    spoolheader_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPOOL_MAGIC, sizeof(header.magic));
+    header.stride = SPOOL_STRIDE;
+    header.lines = spool->lines;
+    header.bytes = spool->bytes;
+    header.done = done;
+    return write_all(spool->idxfd, &header, sizeof(header), 0);
+}
+
+/*******************************************************************************
+ *                                Spooling                                     *
+ ******************************************************************************/
+
+/*
+ * Set the directory the jobs spool their output to, and clear the spools a
+ * previous run of the server left in it, since they are named by pids that
+ * may be reused.
+ *
+ * @param dir
+ *        the spool directory, created if it does not exist
+ *
+ * @return
+ *        -1:       the directory could not be created or read
+ *        0:        the directory is ready
+ */
+int spool_start(const char *dir)
+{
+    spooldir = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    DIR *spools = opendir(dir);
+    struct dirent *entry;
+    if (spools == NULL)
+    {
+        return -1;
+    }
+    while ((entry = readdir(spools)) != NULL)
+    {
+        pid_t pid;
+        if (sscanf(entry->d_name, "job-%d.", &pid) == 1)
+        {
+            unlinkat(dirfd(spools), entry->d_name, 0);
+        }
+    }
+    closedir(spools);
+    return 0;
+}
+
+/*
+ * Create the spool of a new job, replacing the spool of an earlier job with
+ * the same pid. If it can not be created the job is not spooled.
+ *
+ * @param spool
+ *        the spool of the job
+ * @param pid
+ *        the pid of the job, which names its spool
+ */
+void spool_create(spool_t *spool, pid_t pid)
+{
+    char path[BUFSIZE + 1];
+
+    memset(spool, 0, offsetof(spool_t, entrybuf));
+    snprintf(path, sizeof(path), "%s/" SPOOL_OUT, spooldir, pid);
+    spool->outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND
+                              | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/" SPOOL_IDX, spooldir, pid);
+    spool->idxfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (spool->outfd < 0 || spool->idxfd < 0 || write_header(spool, 0) < 0)
+    {
+        give_up(spool);
+    }
+}
+
+/*
+ * Append a message about the job to its spool, as the watchers are sent it
+ * as text. Every SPOOL_STRIDE'th line is indexed. A message longer than the
+ * buffer is written on its own. The caller must hold the lock of the job.
+ *
+ * @param spool
+ *        the spool of the job
+ * @param text len
+ *        the message, ending in a network newline, and its length
+ */
+void spool_append(spool_t *spool, const char *text, size_t len)
+{
+    if (spool->outfd < 0)
+    {
+        return;
+    }
+    if (spool->buf == NULL && (spool->buf = malloc(SPOOL_BUFSIZE)) == NULL)
+    {
+        give_up(spool);
+        return;
+    }
+
+    if (spool->lines % SPOOL_STRIDE == 0)
+    {
+        if (spool->inentries == SPOOL_ENTRIES)
+        {
+            spool_flush(spool);
+        }
+        spool->entrybuf[spool->inentries++] = spool->bytes;
+        spool->entries++;
+    }
+    if (spool->inbuf + len > SPOOL_BUFSIZE)
+    {
+        spool_flush(spool);
+    }
+    if (spool->outfd < 0)
+    {
+        return;
+    }
+
+    spool->lines++;
+    spool->bytes += len;
+    if (len > SPOOL_BUFSIZE)
+    {
+        if (write_all(spool->outfd, text, len, -1) < 0)
+        {
+            give_up(spool);
+            return;
+        }
+        spool_flush(spool);
+        return;
+    }
+    memcpy(spool->buf + spool->inbuf, text, len);
+    spool->inbuf += len;
+}
+
+/*
+ * Write the output and the entries of the index that are buffered, then the
+ * header that counts them, so the spool can be read up to its last line.
+ *
+ * @param spool
+ *        the spool of the job
+ */
+void spool_flush(spool_t *spool)
+{
+    if (spool->outfd < 0)
+    {
+        return;
+    }
+
+    off_t at = sizeof(spoolheader_t)
+               + (spool->entries - spool->inentries) * sizeof(uint64_t);
+    if (write_all(spool->outfd, spool->buf, spool->inbuf, -1) < 0
+        || write_all(spool->idxfd, spool->entrybuf,
+                     spool->inentries * sizeof(uint64_t), at) < 0
+        || write_header(spool, 0) < 0)
+    {
+        give_up(spool);
+        return;
+    }
+    spool->inbuf = 0;
+    spool->inentries = 0;
+}
+
+/*
+ * Write what is left of the spool of a job that is removed and close it. The
+ * spool stays in the spool directory, to be read.
+ *
+ * @param spool
+ *        the spool of the job
+ */
+void spool_close(spool_t *spool)
+{
+    if (spool->outfd < 0)
+    {
+        return;
+    }
+
+    spool_flush(spool);
+    if (spool->outfd >= 0)
+    {
+        write_header(spool, 1);
+        close(spool->outfd);
+        close(spool->idxfd);
+        spool->outfd = spool->idxfd = -1;
+    }
+    free(spool->buf);
+    spool->buf = NULL;
+}
+
+/*******************************************************************************
+ *                             Spool Lookups                                   *
+ ******************************************************************************/
+
+/*
+ * Open the spool of a job to be read, mapping its index. The spool of a job
+ * that is running should be flushed first (see spool_flush()).
+ *
+ * @param view
+ *        the spool to open
+ * @param pid
+ *        the job the spool belongs to, running or not
+ *
+ * @return
+ *        -1:       the job has no spool
+ *        0:        the spool can be read
+ */
+int spool_open(spoolview_t *view, pid_t pid)
+{
+    char path[BUFSIZE + 1];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/" SPOOL_IDX, spooldir, pid);
+    int idxfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (idxfd < 0)
+    {
+        return -1;
+    }
+
+    view->header = MAP_FAILED;
+    if (fstat(idxfd, &st) == 0 && st.st_size >= (off_t) sizeof(spoolheader_t))
+    {
+        view->header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, idxfd, 0);
+    }
+    close(idxfd);
+    if (view->header == MAP_FAILED)
+    {
+        return -1;
+    }
+    view->size = st.st_size;
+
+    snprintf(path, sizeof(path), "%s/" SPOOL_OUT, spooldir, pid);
+    if (memcmp(view->header->magic, SPOOL_MAGIC, sizeof(view->header->magic))
+        || view->header->stride != SPOOL_STRIDE
+        || (view->outfd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        munmap((void *) view->header, view->size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find where a line starts in the output of a spool. The index gives the
+ * offset of the closest line before it, so at most SPOOL_STRIDE - 1 lines are
+ * read past, however much output there is.
+ *
+ * @param view
+ *        the opened spool
+ * @param line
+ *        the line, counted from 0
+ *
+ * @return
+ *        the offset of the line, or the end of the output past the last line
+ */
+uint64_t spool_offset(const spoolview_t *view, uint64_t line)
+{
+    const spoolheader_t *header = view->header;
+    const uint64_t *entries = (const uint64_t *) (header + 1);
+    size_t count = (view->size - sizeof(spoolheader_t)) / sizeof(uint64_t);
+
+    if (line >= header->lines || count == 0)
+    {
+        return header->bytes;
+    }
+
+    uint64_t entry = line / SPOOL_STRIDE;
+    if (entry >= count)
+    {
+        entry = count - 1;
+    }
+    uint64_t offset = entries[entry];
+    uint64_t skip = line - entry * SPOOL_STRIDE;
+
+    char buf[4096];
+    while (skip > 0)
+    {
+        ssize_t nread = pread(view->outfd, buf, sizeof(buf), offset);
+        if (nread <= 0)
+        {
+            return header->bytes;
+        }
+
+        char *at = buf;
+        char *newline;
+        while (skip > 0
+               && (newline = memchr(at, '\n', buf + nread - at)) != NULL)
+        {
+            at = newline + 1;
+            skip--;
+        }
+        offset += skip > 0 ? nread : at - buf;
+    }
+    return offset;
+}
+
+/*
+ * Release a spool that was read. Its output is closed unless the caller took
+ * it (and set outfd to -1).
+ */
+void spool_release(spoolview_t *view)
+{
+    munmap((void *) view->header, view->size);
+    if (view->outfd >= 0)
+    {
+        close(view->outfd);
+    }
+}